@@ -0,0 +1,106 @@
+#ifndef BENCHMARKERS_H
+#define BENCHMARKERS_H
+
+/**
+ * Builders of JPEG marker data with color profile information, shared by
+ * the corpus generator and the microbenchmarks.
+ */
+
+#include <vector>
+extern "C" {
+#include <jpeglib.h>
+}
+#include "../src/icc_adobergb.h"
+
+/**
+ * Appends a 16 bit little-endian value to a byte buffer
+ */
+static void putWord(std::vector<JOCTET>& data, unsigned int value) {
+	data.push_back(value & 0xFF);
+	data.push_back((value >> 8) & 0xFF);
+}
+
+/**
+ * Appends a 32 bit little-endian value to a byte buffer
+ */
+static void putLong(std::vector<JOCTET>& data, unsigned long value) {
+	putWord(data,value & 0xFFFF);
+	putWord(data,(value >> 16) & 0xFFFF);
+}
+
+/**
+ * Appends a TIFF IFD entry to a byte buffer
+ */
+static void putEntry(std::vector<JOCTET>& data, unsigned int tag, unsigned int type, unsigned long count, unsigned long value) {
+	putWord(data,tag);
+	putWord(data,type);
+	putLong(data,count);
+	putLong(data,value);
+}
+
+/**
+ * Builds an EXIF APP1 marker with color space information, as found in
+ * camera images: ColorSpace tag 1 for sRGB, or 0xFFFF (uncalibrated) plus
+ * AdobeRGB white point and primaries.
+ *
+ * @param[in] adobe true for AdobeRGB, false for sRGB
+ * @return Marker data, without the JPEG marker header
+ */
+static std::vector<JOCTET> buildExif(bool adobe) {
+	std::vector<JOCTET> data;
+	const char tag[] = {'E','x','i','f',0,0};
+	data.insert(data.end(),tag,tag+6);
+
+	// TIFF header, IFD0 at offset 8
+	data.push_back('I');
+	data.push_back('I');
+	putWord(data,42);
+	putLong(data,8);
+
+	// IFD0: Exif IFD pointer, and white point and primaries for AdobeRGB
+	unsigned int entries = adobe ? 3 : 1;
+	unsigned long ifd0End = 8 + 2 + 12*entries + 4;
+	unsigned long exifIfd = ifd0End;
+	unsigned long whitePoint = exifIfd + 2 + 12 + 4;
+	unsigned long primaries = whitePoint + 16;
+	putWord(data,entries);
+	if (adobe) {
+		putEntry(data,0x13e,5,2,whitePoint);
+		putEntry(data,0x13f,5,6,primaries);
+	}
+	putEntry(data,0x8769,4,1,exifIfd);
+	putLong(data,0);
+
+	// Exif IFD with ColorSpace tag
+	putWord(data,1);
+	putEntry(data,0xA001,3,1,adobe ? 0xFFFF : 1);
+	putLong(data,0);
+
+	// Rational values for AdobeRGB
+	if (adobe) {
+		const unsigned long rationals[] = {313,1000,329,1000,64,100,33,100,21,100,71,100,15,100,6,100};
+		for (int i=0; i<16; i++) {
+			putLong(data,rationals[i]);
+		}
+	}
+
+	return data;
+}
+
+/**
+ * Builds an ICC APP2 marker with the AdobeRGB profile
+ *
+ * @return Marker data, without the JPEG marker header
+ */
+static std::vector<JOCTET> buildIcc() {
+	std::vector<JOCTET> data;
+	const char tag[] = {'I','C','C','_','P','R','O','F','I','L','E',0};
+	data.insert(data.end(),tag,tag+12);
+	data.push_back(1);
+	data.push_back(1);
+	data.insert(data.end(),iccAdobeRGB,iccAdobeRGB+iccAdobeRGB_size);
+
+	return data;
+}
+
+#endif
@@ -0,0 +1,476 @@
+/**
+ * End-to-end benchmark runner for iccflow.
+ *
+ * Runs iccflow over every group folder of a corpus created by gencorpus,
+ * with several thread counts and optionally several presets and output
+ * durability policies, and reports
+ * for each scenario the best time of several runs as MP/s and files/s, plus
+ * the peak RSS of the process and the size of the converted images.
+ * Results can be compared against a saved baseline report: scenarios
+ * whose throughput drops more than a threshold are flagged as regressions.
+ * With several durability policies, the extra time of each policy over the
+ * first one is shown.
+ *
+ * Usage: benchrun -iccflow binary -corpus folder -output folder
+ *                 [-threads 1,2,4] [-presets fast,small] [-durability none,file,batch]
+ *                 [-repeat n] [-report file]
+ *                 [-baseline file] [-threshold percent] [-- iccflow options]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/**
+ * Measured results of a benchmark scenario
+ */
+struct Scenario {
+	std::string name;		/**< Group name, thread count, preset and durability, e.g. "rgb/j4", "rgb/j4/fast" or "rgb/j4/batch" */
+	unsigned long files;	/**< Images converted per run */
+	double megapixels;		/**< Megapixels converted per run */
+	double seconds;			/**< Best wall time of all runs */
+	long peakRssKb;			/**< Largest peak RSS of all runs, in KB */
+	double outputMb;		/**< Size of the converted images, in MB */
+};
+
+/**
+ * Reads the manifest of a corpus group
+ *
+ * @param[in] folder Path of the group folder
+ * @param[out] files Number of images in the group
+ * @param[out] megapixels Total megapixels of the images
+ * @param[out] names File names of the images
+ * @return true if the manifest was read, false otherwise
+ */
+static bool readManifest(const std::string& folder, unsigned long& files, double& megapixels, std::vector<std::string>& names) {
+	std::ifstream manifest((folder + "/manifest.txt").c_str());
+	if (!manifest.is_open()) {
+		return false;
+	}
+	files = 0;
+	megapixels = 0;
+	std::string name;
+	double width = 0;
+	double height = 0;
+	while (manifest >> name >> width >> height) {
+		files++;
+		megapixels += width*height/1e6;
+		names.push_back(name);
+	}
+
+	return true;
+}
+
+/**
+ * Gets the total size of converted images
+ *
+ * @param[in] folder Output folder
+ * @param[in] names File names of the images
+ * @return Total size in MB
+ */
+static double outputSize(const std::string& folder, const std::vector<std::string>& names) {
+	double bytes = 0;
+	for (size_t i=0; i<names.size(); i++) {
+		struct stat st;
+		if (stat((folder + "/" + names[i]).c_str(),&st) == 0) {
+			bytes += st.st_size;
+		}
+	}
+
+	return bytes/(1024*1024);
+}
+
+/**
+ * Runs iccflow once and measures it
+ *
+ * @param[in] arguments Command line, starting with the iccflow binary
+ * @param[out] seconds Wall time of the run
+ * @param[out] peakRssKb Peak resident set size of the process, in KB
+ * @return true if iccflow finished successfully, false otherwise
+ */
+static bool runOnce(const std::vector<std::string>& arguments, double& seconds, long& peakRssKb) {
+	std::vector<char*> argv;
+	for (size_t i=0; i<arguments.size(); i++) {
+		argv.push_back(const_cast<char*>(arguments[i].c_str()));
+	}
+	argv.push_back(NULL);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid < 0) {
+		return false;
+	}
+	if (pid == 0) {
+		// Child: discard console output and run iccflow
+		int devNull = open("/dev/null",O_WRONLY);
+		if (devNull >= 0) {
+			dup2(devNull,STDOUT_FILENO);
+			close(devNull);
+		}
+		execv(argv[0],&argv[0]);
+		_exit(127);
+	}
+
+	int status = 0;
+	struct rusage usage;
+	memset(&usage,0,sizeof(usage));
+	if (wait4(pid,&status,0,&usage) != pid) {
+		return false;
+	}
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	peakRssKb = usage.ru_maxrss;
+
+	return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+/**
+ * Writes scenario results as a report. Lines starting with # are comments,
+ * other lines hold: scenario files megapixels seconds mp/s files/s rss_mb output_mb
+ *
+ * @param[in] out Stream to write to
+ * @param[in] scenarios Scenario results
+ */
+static void writeReport(std::ostream& out, const std::vector<Scenario>& scenarios) {
+	out << "# " << std::left << std::setw(30) << "scenario" << std::right << std::setw(7) << "files"
+		<< std::setw(10) << "MP" << std::setw(10) << "seconds" << std::setw(10) << "MP/s"
+		<< std::setw(10) << "files/s" << std::setw(10) << "RSS MB" << std::setw(10) << "out MB" << std::endl;
+	out << std::fixed;
+	for (size_t i=0; i<scenarios.size(); i++) {
+		const Scenario& s = scenarios[i];
+		out << "  " << std::left << std::setw(30) << s.name << std::right << std::setw(7) << s.files
+			<< std::setprecision(2) << std::setw(10) << s.megapixels
+			<< std::setprecision(3) << std::setw(10) << s.seconds
+			<< std::setprecision(2) << std::setw(10) << s.megapixels/s.seconds
+			<< std::setw(10) << s.files/s.seconds
+			<< std::setw(10) << s.peakRssKb/1024.0
+			<< std::setw(10) << s.outputMb << std::endl;
+	}
+}
+
+/**
+ * Reads a report written by @ref writeReport
+ *
+ * @param[in] fileName Path of the report
+ * @param[out] scenarios Scenario results by name
+ * @return true if the report was read, false otherwise
+ */
+static bool readReport(const std::string& fileName, std::map<std::string,Scenario>& scenarios) {
+	std::ifstream in(fileName.c_str());
+	if (!in.is_open()) {
+		return false;
+	}
+	std::string line;
+	while (std::getline(in,line)) {
+		if (line.empty() || (line[0] == '#')) {
+			continue;
+		}
+		std::istringstream fields(line);
+		Scenario s;
+		double mps = 0;
+		double fps = 0;
+		double rssMb = 0;
+		if (fields >> s.name >> s.files >> s.megapixels >> s.seconds >> mps >> fps >> rssMb) {
+			s.peakRssKb = (long) (rssMb*1024);
+			if (!(fields >> s.outputMb)) {
+				s.outputMb = 0;
+			}
+			scenarios[s.name] = s;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Compares results against a baseline report
+ *
+ * @param[in] scenarios Current results
+ * @param[in] baseline Baseline results by scenario name
+ * @param[in] threshold Throughput drop, in percent, considered a regression
+ * @return Number of regressions found
+ */
+static int compareBaseline(const std::vector<Scenario>& scenarios, std::map<std::string,Scenario>& baseline, double threshold) {
+	int regressions = 0;
+	std::cout << std::endl << "Comparison with baseline (MP/s and peak RSS):" << std::endl;
+	std::cout << std::fixed << std::setprecision(2);
+	for (size_t i=0; i<scenarios.size(); i++) {
+		const Scenario& s = scenarios[i];
+		std::map<std::string,Scenario>::iterator base = baseline.find(s.name);
+		std::cout << "  " << std::left << std::setw(30) << s.name << std::right;
+		if (base == baseline.end()) {
+			std::cout << "  not in baseline" << std::endl;
+			continue;
+		}
+		double now = s.megapixels/s.seconds;
+		double before = base->second.megapixels/base->second.seconds;
+		double change = 100*(now - before)/before;
+		double rssChange = (base->second.peakRssKb > 0) ? 100.0*(s.peakRssKb - base->second.peakRssKb)/base->second.peakRssKb : 0;
+		std::cout << std::setw(10) << before << " -> " << std::setw(8) << now << " MP/s ("
+			<< std::showpos << change << "%)   RSS " << rssChange << "%" << std::noshowpos;
+		if (change < -threshold) {
+			std::cout << "   REGRESSION";
+			regressions++;
+		}
+		std::cout << std::endl;
+	}
+
+	return regressions;
+}
+
+/**
+ * Shows the cost of durability policies: for every scenario run with a
+ * policy other than the first one, the extra time over the same scenario
+ * run with the first policy, in total and per file
+ *
+ * @param[in] scenarios Scenario results, named with their policy last
+ * @param[in] policies Durability policies, the first one being the reference
+ */
+static void showDurabilityCost(const std::vector<Scenario>& scenarios, const std::vector<std::string>& policies) {
+	std::map<std::string,const Scenario*> byName;
+	for (size_t i=0; i<scenarios.size(); i++) {
+		byName[scenarios[i].name] = &scenarios[i];
+	}
+	std::string reference = "/" + policies[0];
+	std::cout << std::endl << "Durability cost (compared with " << policies[0] << "):" << std::endl;
+	std::cout << std::fixed;
+	for (size_t i=0; i<scenarios.size(); i++) {
+		const Scenario& s = scenarios[i];
+		for (size_t p=1; p<policies.size(); p++) {
+			std::string suffix = "/" + policies[p];
+			if ((s.name.size() <= suffix.size()) || (s.name.compare(s.name.size()-suffix.size(),suffix.size(),suffix) != 0)) {
+				continue;
+			}
+			std::map<std::string,const Scenario*>::iterator base = byName.find(s.name.substr(0,s.name.size()-suffix.size()) + reference);
+			std::cout << "  " << std::left << std::setw(30) << s.name << std::right;
+			if (base == byName.end()) {
+				std::cout << "  no reference run" << std::endl;
+				continue;
+			}
+			double extra = s.seconds - base->second->seconds;
+			std::cout << std::setprecision(3) << std::setw(10) << base->second->seconds << " -> " << std::setw(8) << s.seconds << " s ("
+				<< std::showpos << std::setprecision(1) << 100*extra/base->second->seconds << "%)   "
+				<< std::setprecision(3) << 1000*extra/std::max(s.files,1UL) << std::noshowpos << " ms per file" << std::endl;
+		}
+	}
+}
+
+/**
+ * Runner main function
+ */
+int main(int argc, char** argv) {
+	// Parse arguments
+	std::string iccflow;
+	std::string corpus;
+	std::string output;
+	std::string reportFile;
+	std::string baselineFile;
+	std::vector<int> threads;
+	std::vector<std::string> presets;
+	std::vector<std::string> policies;
+	std::vector<std::string> extraOptions;
+	int repeat = 3;
+	double threshold = 10;
+	for (int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--") {
+			for (i++; i<argc; i++) {
+				extraOptions.push_back(argv[i]);
+			}
+		} else if ((arg == "-iccflow") && (i+1 < argc)) {
+			iccflow = argv[++i];
+		} else if ((arg == "-corpus") && (i+1 < argc)) {
+			corpus = argv[++i];
+		} else if ((arg == "-output") && (i+1 < argc)) {
+			output = argv[++i];
+		} else if ((arg == "-report") && (i+1 < argc)) {
+			reportFile = argv[++i];
+		} else if ((arg == "-baseline") && (i+1 < argc)) {
+			baselineFile = argv[++i];
+		} else if ((arg == "-repeat") && (i+1 < argc)) {
+			repeat = std::max(1,atoi(argv[++i]));
+		} else if ((arg == "-threshold") && (i+1 < argc)) {
+			threshold = atof(argv[++i]);
+		} else if ((arg == "-presets") && (i+1 < argc)) {
+			std::istringstream list(argv[++i]);
+			std::string item;
+			while (std::getline(list,item,',')) {
+				if (!item.empty()) {
+					presets.push_back(item);
+				}
+			}
+		} else if ((arg == "-durability") && (i+1 < argc)) {
+			std::istringstream list(argv[++i]);
+			std::string item;
+			while (std::getline(list,item,',')) {
+				if (!item.empty()) {
+					policies.push_back(item);
+				}
+			}
+		} else if ((arg == "-threads") && (i+1 < argc)) {
+			std::istringstream list(argv[++i]);
+			std::string item;
+			while (std::getline(list,item,',')) {
+				if (atoi(item.c_str()) > 0) {
+					threads.push_back(atoi(item.c_str()));
+				}
+			}
+		} else {
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return 1;
+		}
+	}
+	if (iccflow.empty() || corpus.empty() || output.empty()) {
+		std::cerr << "Usage: benchrun -iccflow binary -corpus folder -output folder [-threads 1,2,4] [-presets fast,small]" << std::endl;
+		std::cerr << "                [-durability none,file,batch] [-repeat n] [-report file] [-baseline file] [-threshold percent]" << std::endl;
+		std::cerr << "                [-- iccflow options]" << std::endl;
+		return 1;
+	}
+	if (threads.empty()) {
+		threads.push_back(1);
+	}
+	if (presets.empty()) {
+		// Default settings, scenario names without preset
+		presets.push_back("");
+	}
+	if (policies.empty()) {
+		// Default policy, scenario names without policy
+		policies.push_back("");
+	}
+
+	// Find corpus groups
+	std::vector<std::string> groups;
+	DIR* dir = opendir(corpus.c_str());
+	if (dir == NULL) {
+		std::cerr << "Failed to open corpus folder: " << corpus << std::endl;
+		return 2;
+	}
+	dirent* ent = NULL;
+	while ((ent = readdir(dir))) {
+		struct stat st;
+		std::string name = ent->d_name;
+		if ((name != ".") && (name != "..") && (stat((corpus + "/" + name).c_str(),&st) == 0) && S_ISDIR(st.st_mode)) {
+			groups.push_back(name);
+		}
+	}
+	closedir(dir);
+	std::sort(groups.begin(),groups.end());
+
+	// Run scenarios
+	std::vector<Scenario> scenarios;
+	int failures = 0;
+	for (size_t g=0; g<groups.size(); g++) {
+		Scenario base;
+		std::vector<std::string> names;
+		if (!readManifest(corpus + "/" + groups[g],base.files,base.megapixels,names)) {
+			std::cerr << "Skipping " << groups[g] << ": no manifest" << std::endl;
+			continue;
+		}
+		for (size_t p=0; p<presets.size(); p++) {
+			for (size_t d=0; d<policies.size(); d++) {
+				for (size_t t=0; t<threads.size(); t++) {
+					Scenario s = base;
+					std::ostringstream name;
+					name << groups[g] << "/j" << threads[t];
+					if (!presets[p].empty()) {
+						name << "/" << presets[p];
+					}
+					if (!policies[d].empty()) {
+						name << "/" << policies[d];
+					}
+					s.name = name.str();
+					s.seconds = 0;
+					s.peakRssKb = 0;
+					s.outputMb = 0;
+
+					std::ostringstream threadCount;
+					threadCount << threads[t];
+					std::vector<std::string> arguments;
+					arguments.push_back(iccflow);
+					arguments.push_back("-i");
+					arguments.push_back(corpus + "/" + groups[g]);
+					arguments.push_back("-o");
+					arguments.push_back(output);
+					arguments.push_back("-j");
+					arguments.push_back(threadCount.str());
+					if (!presets[p].empty()) {
+						arguments.push_back("-preset");
+						arguments.push_back(presets[p]);
+					}
+					if (!policies[d].empty()) {
+						arguments.push_back("-durability");
+						arguments.push_back(policies[d]);
+					}
+					arguments.insert(arguments.end(),extraOptions.begin(),extraOptions.end());
+
+					bool success = true;
+					for (int r=0; r<repeat; r++) {
+						double seconds = 0;
+						long peakRssKb = 0;
+						if (!runOnce(arguments,seconds,peakRssKb)) {
+							success = false;
+							break;
+						}
+						if ((r == 0) || (seconds < s.seconds)) {
+							s.seconds = seconds;
+						}
+						s.peakRssKb = std::max(s.peakRssKb,peakRssKb);
+					}
+					if (!success) {
+						std::cerr << "iccflow failed in scenario " << s.name << std::endl;
+						failures++;
+						continue;
+					}
+					s.outputMb = outputSize(output,names);
+					std::cerr << "  " << s.name << ": " << std::fixed << std::setprecision(3) << s.seconds << " s" << std::endl;
+					scenarios.push_back(s);
+				}
+			}
+		}
+	}
+
+	// Report
+	writeReport(std::cout,scenarios);
+	if (!reportFile.empty()) {
+		std::ofstream report(reportFile.c_str());
+		writeReport(report,scenarios);
+		if (report.fail()) {
+			std::cerr << "Failed to write report: " << reportFile << std::endl;
+			return 2;
+		}
+	}
+
+	if (policies.size() > 1) {
+		showDurabilityCost(scenarios,policies);
+	}
+
+	// Compare with baseline
+	int regressions = 0;
+	std::map<std::string,Scenario> baseline;
+	if (!baselineFile.empty()) {
+		if (readReport(baselineFile,baseline)) {
+			regressions = compareBaseline(scenarios,baseline,threshold);
+		} else {
+			std::cout << std::endl << "No baseline found at " << baselineFile << std::endl;
+		}
+	}
+
+	if (failures > 0) {
+		return 3;
+	}
+	return (regressions > 0) ? 4 : 0;
+}
@@ -0,0 +1,217 @@
+/**
+ * Synthetic JPEG corpus generator for iccflow benchmarks.
+ *
+ * Creates one folder per image group (color space, profile information
+ * and encoding), each one with images of several sizes. Image contents are
+ * generated from a fixed seed, so the corpus is the same on every run.
+ * Every folder gets a manifest.txt file listing "file width height" lines.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sys/stat.h>
+extern "C" {
+#include <jpeglib.h>
+}
+#include "benchmarkers.h"
+
+/**
+ * Color profile information written to generated images
+ */
+enum CORPUS_PROFILES {
+	CORPUS_PROFILE_NONE,		/**< No profile information */
+	CORPUS_PROFILE_EMBEDDED,	/**< Embedded AdobeRGB ICC profile */
+	CORPUS_PROFILE_EXIF_SRGB,	/**< EXIF ColorSpace tag set to sRGB */
+	CORPUS_PROFILE_EXIF_ADOBE	/**< EXIF uncalibrated ColorSpace with AdobeRGB primaries */
+};
+
+/**
+ * Definition of a group of images sharing color space, profile and encoding
+ */
+struct CorpusGroup {
+	const char* name;		/**< Folder name */
+	J_COLOR_SPACE colorSpace;	/**< Color space of the images */
+	int components;			/**< Color components */
+	int profile;			/**< Profile information (see @ref CORPUS_PROFILES) */
+	bool progressive;		/**< Progressive encoding */
+};
+
+/**
+ * Image size, with the number of images generated of that size per group
+ */
+struct CorpusSize {
+	const char* name;		/**< Size name, used in file names */
+	int width;				/**< Width in pixels */
+	int height;				/**< Height in pixels */
+	int count;				/**< Images per group */
+};
+
+const CorpusGroup CORPUS_GROUPS[] = {
+	{"gray",		JCS_GRAYSCALE,	1,	CORPUS_PROFILE_NONE,		false},
+	{"rgb",			JCS_RGB,		3,	CORPUS_PROFILE_NONE,		false},
+	{"rgb-icc",		JCS_RGB,		3,	CORPUS_PROFILE_EMBEDDED,	false},
+	{"rgb-exif",	JCS_RGB,		3,	CORPUS_PROFILE_EXIF_SRGB,	false},
+	{"rgb-exifadobe",	JCS_RGB,	3,	CORPUS_PROFILE_EXIF_ADOBE,	false},
+	{"rgb-progressive",	JCS_RGB,	3,	CORPUS_PROFILE_NONE,		true},
+	{"cmyk",		JCS_CMYK,		4,	CORPUS_PROFILE_NONE,		false}
+};
+
+const CorpusSize CORPUS_SIZES[] = {
+	{"small",	640,	480,	8},
+	{"medium",	2048,	1536,	3},
+	{"large",	4096,	3072,	1}
+};
+
+/**
+ * Deterministic pseudo-random number generator (64 bit LCG)
+ */
+class Random {
+	public:
+		Random(unsigned long long seed) : m_state(seed) {}
+		unsigned int next() {
+			m_state = m_state*6364136223846793005ULL + 1442695040888963407ULL;
+			return (unsigned int) (m_state >> 33);
+		}
+	private:
+		unsigned long long m_state;		/**< Generator state */
+};
+
+/**
+ * Writes a synthetic image: smooth gradients with some noise, so that
+ * compression behaves as with photographic content.
+ *
+ * @param[in] fileName Path of the image to create
+ * @param[in] group Group defining color space, profile and encoding
+ * @param[in] width Width in pixels
+ * @param[in] height Height in pixels
+ * @param[in] seed Seed for image contents
+ * @return true if the image was written, false otherwise
+ */
+static bool writeImage(const std::string& fileName, const CorpusGroup& group, int width, int height, unsigned long long seed) {
+	FILE* f = fopen(fileName.c_str(),"wb");
+	if (f == NULL) {
+		return false;
+	}
+
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo,f);
+	cinfo.image_width = width;
+	cinfo.image_height = height;
+	cinfo.input_components = group.components;
+	cinfo.in_color_space = group.colorSpace;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo,90,TRUE);
+	if (group.progressive) {
+		jpeg_simple_progression(&cinfo);
+	}
+	jpeg_start_compress(&cinfo,TRUE);
+
+	// Profile information
+	std::vector<JOCTET> marker;
+	if (group.profile == CORPUS_PROFILE_EMBEDDED) {
+		marker = buildIcc();
+		jpeg_write_marker(&cinfo,JPEG_APP0+2,&marker[0],marker.size());
+	} else if ((group.profile == CORPUS_PROFILE_EXIF_SRGB) || (group.profile == CORPUS_PROFILE_EXIF_ADOBE)) {
+		marker = buildExif(group.profile == CORPUS_PROFILE_EXIF_ADOBE);
+		jpeg_write_marker(&cinfo,JPEG_APP0+1,&marker[0],marker.size());
+	}
+
+	// Image contents
+	Random random(seed);
+	int phase[4];
+	for (int c=0; c<4; c++) {
+		phase[c] = random.next() % 256;
+	}
+	std::vector<JSAMPLE> line(width*group.components);
+	JSAMPROW row = &line[0];
+	for (int y=0; y<height; y++) {
+		for (int x=0; x<width; x++) {
+			for (int c=0; c<group.components; c++) {
+				int value = phase[c] + (x*(c+1)*255)/width + (y*(4-c)*255)/height + (int) (random.next() % 24);
+				line[x*group.components+c] = (JSAMPLE) (value & 0xFF);
+			}
+		}
+		jpeg_write_scanlines(&cinfo,&row,1);
+	}
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	bool success = (fclose(f) == 0);
+
+	return success;
+}
+
+/**
+ * Creates a folder, if it does not already exist
+ *
+ * @param[in] dir Path of the folder
+ * @return true if the folder exists or was created, false otherwise
+ */
+static bool createDirectory(const std::string& dir) {
+	struct stat st;
+	if ((stat(dir.c_str(),&st) == 0) && S_ISDIR(st.st_mode)) {
+		return true;
+	}
+	return (mkdir(dir.c_str(),0777) == 0);
+}
+
+/**
+ * Generator main function
+ *
+ * Usage: gencorpus outputFolder [-quick]
+ * With -quick, only small images are generated.
+ */
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		std::cerr << "Usage: gencorpus outputFolder [-quick]" << std::endl;
+		return 1;
+	}
+	std::string output = argv[1];
+	bool quick = (argc > 2) && (std::string(argv[2]) == "-quick");
+	if (!createDirectory(output)) {
+		std::cerr << "Failed to create folder: " << output << std::endl;
+		return 2;
+	}
+
+	unsigned long long seed = 1;
+	for (size_t g=0; g<sizeof(CORPUS_GROUPS)/sizeof(CORPUS_GROUPS[0]); g++) {
+		const CorpusGroup& group = CORPUS_GROUPS[g];
+		std::string folder = output + "/" + group.name;
+		if (!createDirectory(folder)) {
+			std::cerr << "Failed to create folder: " << folder << std::endl;
+			return 2;
+		}
+		FILE* manifest = fopen((folder + "/manifest.txt").c_str(),"w");
+		if (manifest == NULL) {
+			std::cerr << "Failed to write manifest in " << folder << std::endl;
+			return 2;
+		}
+		for (size_t s=0; s<sizeof(CORPUS_SIZES)/sizeof(CORPUS_SIZES[0]); s++) {
+			const CorpusSize& size = CORPUS_SIZES[s];
+			if (quick && (s > 0)) {
+				break;
+			}
+			for (int i=0; i<size.count; i++) {
+				char name[64];
+				snprintf(name,sizeof(name),"%s-%02d.jpg",size.name,i);
+				if (!writeImage(folder + "/" + name,group,size.width,size.height,seed++)) {
+					std::cerr << "Failed to write " << folder << "/" << name << std::endl;
+					fclose(manifest);
+					return 2;
+				}
+				fprintf(manifest,"%s %d %d\n",name,size.width,size.height);
+			}
+		}
+		fclose(manifest);
+		std::cout << "Generated " << folder << std::endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+/**
+ * Microbenchmarks for the fixed costs of converting a file, independent of
+ * image size: embedded profile detection, profile loading, color transform
+ * creation and profile embedding. For small images these costs dominate
+ * over pixel throughput.
+ *
+ * Usage: microbench [-time seconds] [-filter text]
+ * Each case runs in 5 batches for about the given total time (default 0.5 s),
+ * and the median and best time per operation are reported.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+extern "C" {
+#include <jpeglib.h>
+}
+#include "../src/libiccflow.h"
+#include "../src/jpegio.h"
+#include "../src/libjpegcodec.h"
+#include "../src/icc_fogra27.h"
+#include "benchmarkers.h"
+
+/**
+ * Number of timed batches per case
+ */
+const int MICROBENCH_BATCHES = 5;
+
+/**
+ * Operation measured by a benchmark case
+ */
+typedef std::function<void()> BenchOperation;
+
+/**
+ * Runs a benchmark case and shows its results
+ *
+ * @param[in] name Name of the case
+ * @param[in] operation Operation to measure
+ * @param[in] seconds Approximate total time to spend in the case
+ */
+static void runCase(const std::string& name, BenchOperation operation, double seconds) {
+	// Warm up and estimate batch size
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	unsigned long calibration = 0;
+	double elapsed = 0;
+	do {
+		operation();
+		calibration++;
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	} while (elapsed < seconds/20);
+	unsigned long iterations = std::max(1UL,(unsigned long) (calibration*(seconds/MICROBENCH_BATCHES)/elapsed));
+
+	// Timed batches
+	std::vector<double> perOperation;
+	for (int b=0; b<MICROBENCH_BATCHES; b++) {
+		start = std::chrono::steady_clock::now();
+		for (unsigned long i=0; i<iterations; i++) {
+			operation();
+		}
+		elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		perOperation.push_back(elapsed/iterations);
+	}
+	std::sort(perOperation.begin(),perOperation.end());
+
+	std::cout << std::left << std::setw(52) << name << std::right << std::fixed << std::setprecision(2)
+		<< std::setw(12) << 1e6*perOperation[MICROBENCH_BATCHES/2]
+		<< std::setw(12) << 1e6*perOperation[0]
+		<< std::setw(12) << iterations << std::endl;
+}
+
+/**
+ * Creates a small JPEG image in memory
+ *
+ * @param[in] markers Marker data to write, with their marker codes
+ * @param[in] codes JPEG marker codes, one per marker
+ * @return The JPEG data
+ */
+static std::string createJpeg(const std::vector<std::vector<JOCTET> >& markers, const std::vector<int>& codes) {
+	std::string output;
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	iccflow_destination_mgr dest;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	iccflow_string_dest(&cinfo,&dest,&output);
+	cinfo.image_width = 160;
+	cinfo.image_height = 120;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_start_compress(&cinfo,TRUE);
+	for (size_t i=0; i<markers.size(); i++) {
+		jpeg_write_marker(&cinfo,codes[i],&markers[i][0],markers[i].size());
+	}
+	std::vector<JSAMPLE> line(160*3);
+	JSAMPROW row = &line[0];
+	for (int y=0; y<120; y++) {
+		for (int x=0; x<160*3; x++) {
+			line[x] = (JSAMPLE) ((x + y) & 0xFF);
+		}
+		jpeg_write_scanlines(&cinfo,&row,1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	return output;
+}
+
+/**
+ * Writes data to a file
+ *
+ * @param[in] fileName Path of the file
+ * @param[in] data Data to write
+ * @return true if the file was written, false otherwise
+ */
+static bool writeFile(const std::string& fileName, const std::string& data) {
+	FILE* f = fopen(fileName.c_str(),"wb");
+	if (f == NULL) {
+		return false;
+	}
+	bool success = (fwrite(data.data(),1,data.size(),f) == data.size());
+	return (fclose(f) == 0) && success;
+}
+
+/**
+ * Microbenchmark main function
+ */
+int main(int argc, char** argv) {
+	double seconds = 0.5;
+	std::string filter;
+	for (int i=1; i<argc; i++) {
+		if ((std::string(argv[i]) == "-time") && (i+1 < argc)) {
+			seconds = atof(argv[++i]);
+		} else if ((std::string(argv[i]) == "-filter") && (i+1 < argc)) {
+			filter = argv[++i];
+		}
+	}
+	if (seconds <= 0) {
+		seconds = 0.5;
+	}
+
+	// Test images: plain, many APPn markers (XMP, IPTC, vendor data) plus ICC, and EXIF
+	std::vector<std::vector<JOCTET> > markers;
+	std::vector<int> codes;
+	std::string plainJpeg = createJpeg(markers,codes);
+	for (int i=0; i<48; i++) {
+		markers.push_back(std::vector<JOCTET>(2048,(JOCTET) i));
+		codes.push_back(JPEG_APP0 + 3 + (i % 13));
+	}
+	markers.push_back(buildIcc());
+	codes.push_back(JPEG_APP0+2);
+	std::string markersJpeg = createJpeg(markers,codes);
+	markers.clear();
+	codes.clear();
+	markers.push_back(buildExif(true));
+	codes.push_back(JPEG_APP0+1);
+	std::string exifAdobeJpeg = createJpeg(markers,codes);
+	markers[0] = buildExif(false);
+	std::string exifSrgbJpeg = createJpeg(markers,codes);
+
+	char tempFolder[] = "/tmp/iccflow-microbench-XXXXXX";
+	if (mkdtemp(tempFolder) == NULL) {
+		std::cerr << "Failed to create temporary folder" << std::endl;
+		return 2;
+	}
+	std::string plainFile = std::string(tempFolder) + "/plain.jpg";
+	std::string markersFile = std::string(tempFolder) + "/markers.jpg";
+	if (!writeFile(plainFile,plainJpeg) || !writeFile(markersFile,markersJpeg)) {
+		std::cerr << "Failed to write test images" << std::endl;
+		return 2;
+	}
+
+	// Bundled profiles
+	IccProfile srgb;
+	srgb.loadSRGB();
+	IccProfile gray;
+	gray.loadGray(2.2);
+	IccProfile adobe;
+	adobe.loadFromMem((const char*) iccAdobeRGB,iccAdobeRGB_size);
+	IccProfile fogra;
+	fogra.loadFromMem((const char*) iccFOGRA27,iccFOGRA27_size);
+
+	// Benchmark cases
+	std::vector<std::pair<std::string,BenchOperation> > cases;
+	cases.push_back(std::make_pair(std::string("loadFromFile plain JPEG"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromFile(plainFile);
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromFile 48 APPn markers + ICC"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromFile(markersFile);
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromJpegMem 48 APPn markers + ICC"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromJpegMem(markersJpeg.data(),markersJpeg.size());
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromJpegMem EXIF AdobeRGB (primaries)"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromJpegMem(exifAdobeJpeg.data(),exifAdobeJpeg.size());
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromJpegMem EXIF sRGB"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromJpegMem(exifSrgbJpeg.data(),exifSrgbJpeg.size());
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromMem AdobeRGB"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromMem((const char*) iccAdobeRGB,iccAdobeRGB_size);
+	})));
+	cases.push_back(std::make_pair(std::string("loadFromMem FOGRA27"),BenchOperation([&]() {
+		IccProfile profile;
+		profile.loadFromMem((const char*) iccFOGRA27,iccFOGRA27_size);
+	})));
+
+	// Transform creation for every profile pair, intent, BPC and optimization setting
+	struct TransformPair {
+		const char* name;
+		IccProfile* input;
+		cmsUInt32Number inputFormat;
+		IccProfile* output;
+		cmsUInt32Number outputFormat;
+	};
+	TransformPair pairs[] = {
+		{"AdobeRGB>sRGB",	&adobe,	TYPE_RGB_8,			&srgb,	TYPE_RGB_8},
+		{"FOGRA27>sRGB",	&fogra,	TYPE_CMYK_8_REV,	&srgb,	TYPE_RGB_8},
+		{"sRGB>FOGRA27",	&srgb,	TYPE_RGB_8,			&fogra,	TYPE_CMYK_8_REV},
+		{"Gray>sRGB",		&gray,	TYPE_GRAY_8,		&srgb,	TYPE_RGB_8}
+	};
+	for (size_t p=0; p<sizeof(pairs)/sizeof(pairs[0]); p++) {
+		for (int intent=0; intent<4; intent++) {
+			for (int bpc=0; bpc<2; bpc++) {
+				for (int optimize=0; optimize<2; optimize++) {
+					std::ostringstream name;
+					name << "cmsCreateTransform " << pairs[p].name << " intent " << intent
+						<< (bpc ? " bpc" : "") << (optimize ? "" : " noopt");
+					int flags = (bpc ? cmsFLAGS_BLACKPOINTCOMPENSATION : 0) | (optimize ? 0 : cmsFLAGS_NOOPTIMIZE);
+					TransformPair pair = pairs[p];
+					cases.push_back(std::make_pair(name.str(),BenchOperation([pair,intent,flags]() {
+						cmsHTRANSFORM transform = cmsCreateTransform(pair.input->getHandle(),pair.inputFormat,pair.output->getHandle(),pair.outputFormat,intent,flags);
+						if (transform != NULL) {
+							cmsDeleteTransform(transform);
+						}
+					})));
+				}
+			}
+		}
+	}
+
+	// Profile embedding, with compression start as reference
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	iccflow_destination_mgr dest;
+	std::string output;
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	cinfo.image_width = 16;
+	cinfo.image_height = 16;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	cases.push_back(std::make_pair(std::string("jpeg_start_compress (reference)"),BenchOperation([&]() {
+		output.clear();
+		iccflow_string_dest(&cinfo,&dest,&output);
+		jpeg_start_compress(&cinfo,TRUE);
+		jpeg_abort_compress(&cinfo);
+	})));
+	cases.push_back(std::make_pair(std::string("jpeg_start_compress + embed profile sRGB"),BenchOperation([&]() {
+		output.clear();
+		iccflow_string_dest(&cinfo,&dest,&output);
+		jpeg_start_compress(&cinfo,TRUE);
+		std::string iccData;
+		srgb.saveToMem(iccData);
+		LibjpegEncoder::writeIccProfile(&cinfo,iccData);
+		jpeg_abort_compress(&cinfo);
+	})));
+	cases.push_back(std::make_pair(std::string("jpeg_start_compress + embed profile FOGRA27"),BenchOperation([&]() {
+		output.clear();
+		iccflow_string_dest(&cinfo,&dest,&output);
+		jpeg_start_compress(&cinfo,TRUE);
+		std::string iccData;
+		fogra.saveToMem(iccData);
+		LibjpegEncoder::writeIccProfile(&cinfo,iccData);
+		jpeg_abort_compress(&cinfo);
+	})));
+
+	// Run cases
+	std::cout << std::left << std::setw(52) << "case" << std::right << std::setw(12) << "median us"
+		<< std::setw(12) << "best us" << std::setw(12) << "iterations" << std::endl;
+	for (size_t i=0; i<cases.size(); i++) {
+		if (filter.empty() || (cases[i].first.find(filter) != std::string::npos)) {
+			runCase(cases[i].first,cases[i].second,seconds);
+		}
+	}
+
+	// Clean up
+	jpeg_destroy_compress(&cinfo);
+	remove(plainFile.c_str());
+	remove(markersFile.c_str());
+	rmdir(tempFolder);
+
+	return 0;
+}
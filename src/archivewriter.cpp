@@ -0,0 +1,341 @@
+#include <cstring>
+#include <algorithm>
+#include "globals.h"
+#include "archivewriter.h"
+
+/**
+ * Size of tar headers and of the blocks member contents are padded to
+ */
+const size_t TAR_BLOCK_SIZE = 512;
+
+/**
+ * Largest member size that fits in the size field of a ustar header
+ */
+const unsigned long long TAR_MAX_USTAR_SIZE = 077777777777ULL;
+
+/**
+ * Queued bytes above which workers wait for the writer thread
+ */
+const unsigned long long ARCHIVE_MAX_QUEUED = 64*1024*1024;
+
+/**
+ * Buffer size of the archive file
+ */
+const size_t ARCHIVE_BUFFER_SIZE = 1024*1024;
+
+/**
+ * Creates a closed archive writer
+ */
+ArchiveWriter::ArchiveWriter()
+:m_file(NULL),
+ m_time(0),
+ m_sync(false),
+ m_queuedBytes(0),
+ m_peakBytes(0),
+ m_members(0),
+ m_closing(false) {
+}
+
+/**
+ * Destructor closes the archive if still open
+ */
+ArchiveWriter::~ArchiveWriter() {
+	if (m_file != NULL) {
+		std::string error;
+		close(error);
+	}
+}
+
+/**
+ * Creates the archive and starts the writer thread
+ *
+ * @param[in] path Path of the archive
+ * @param[in] sync true for flushing the archive to storage before moving it to its final name
+ * @return true on success, false if the archive can't be created
+ */
+bool ArchiveWriter::open(const std::string& path, bool sync) {
+	m_path = path;
+	m_sync = sync;
+	m_tempPath = path + ".tmp";
+	m_file = fopen(m_tempPath.c_str(),"wb");
+	if (m_file == NULL) {
+		return false;
+	}
+	setvbuf(m_file,NULL,_IOFBF,ARCHIVE_BUFFER_SIZE);
+	m_time = time(NULL);
+	m_queue.clear();
+	m_queuedBytes = 0;
+	m_peakBytes = 0;
+	m_members = 0;
+	m_closing = false;
+	m_error.clear();
+	m_writer = std::thread(&ArchiveWriter::writerLoop,this);
+
+	return true;
+}
+
+/**
+ * Queues a regular file to be appended to the archive. Waits while too
+ * many bytes are queued.
+ *
+ * @param[in] name Name of the member
+ * @param[in] data Contents of the member, taken by the writer (empty on return)
+ * @param[in] done Called from the writer thread when the member has been written, with the error message (empty on success)
+ */
+void ArchiveWriter::write(const std::string& name, std::string& data, IoWriteCallback done) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_written.wait(lock,[this]() {
+		return (m_queuedBytes < ARCHIVE_MAX_QUEUED) || m_queue.empty();
+	});
+	m_queue.push_back(Member());
+	Member& member = m_queue.back();
+	member.name = name;
+	member.data.swap(data);
+	member.done = done;
+	m_queuedBytes += member.data.size();
+	if (m_queuedBytes > m_peakBytes) {
+		m_peakBytes = m_queuedBytes;
+	}
+	m_queued.notify_one();
+}
+
+/**
+ * Queues a hard link to a member written earlier. Errors are reported
+ * when the archive is closed.
+ *
+ * @param[in] name Name of the link
+ * @param[in] target Name of the member linked to
+ */
+void ArchiveWriter::link(const std::string& name, const std::string& target) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_queue.push_back(Member());
+	Member& member = m_queue.back();
+	member.name = name;
+	member.target = target;
+	m_queued.notify_one();
+}
+
+/**
+ * Writes the members still queued and the end of the archive, and moves
+ * the archive to its final name. The archive is deleted if some member
+ * could not be written.
+ *
+ * @param[out] error Error message on failure
+ * @return true on success, false otherwise
+ */
+bool ArchiveWriter::close(std::string& error) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closing = true;
+	}
+	m_queued.notify_all();
+	if (m_writer.joinable()) {
+		m_writer.join();
+	}
+	if (m_file == NULL) {
+		error = "Archive not open: " + m_path;
+		return false;
+	}
+
+	// The end of an archive is two zero blocks
+	char end[2*TAR_BLOCK_SIZE];
+	memset(end,0,sizeof(end));
+	bool success = m_error.empty() && (fwrite(end,1,sizeof(end),m_file) == sizeof(end));
+	if (success && m_sync && !syncFile(m_file)) {
+		m_error = "Failed to flush " + m_path + " to storage";
+		success = false;
+	}
+	success = (fclose(m_file) == 0) && success;
+	m_file = NULL;
+	if (!success) {
+		error = m_error.empty() ? "Failed to write " + m_path : m_error;
+		remove(m_tempPath.c_str());
+		return false;
+	}
+	if (rename(m_tempPath.c_str(),m_path.c_str()) != 0) {
+		error = "Can't rename " + m_tempPath + " to " + m_path;
+		return false;
+	}
+	if (m_sync && !syncFolder(getParentFolder(m_path))) {
+		error = "Failed to flush the folder of " + m_path + " to storage";
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Gets the number of members written, links included
+ *
+ * @return Members written
+ */
+unsigned long ArchiveWriter::getMembers() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_members;
+}
+
+/**
+ * Gets the largest number of bytes waiting to be written
+ *
+ * @return Peak queued bytes
+ */
+unsigned long long ArchiveWriter::getPeakBytes() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peakBytes;
+}
+
+/**
+ * Writer thread main loop: appends queued members in order until the
+ * archive is closed. After an error, members are not written and fail
+ * with the same error.
+ */
+void ArchiveWriter::writerLoop() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_queued.wait(lock,[this]() {
+			return !m_queue.empty() || m_closing;
+		});
+		if (m_queue.empty()) {
+			break;
+		}
+		Member member;
+		std::swap(member,m_queue.front());
+		m_queue.pop_front();
+		std::string error = m_error;
+		lock.unlock();
+
+		if (error.empty() && !writeMember(member)) {
+			error = "Failed to write " + member.name + " to " + m_path;
+		}
+
+		lock.lock();
+		if (m_error.empty()) {
+			m_error = error;
+		}
+		if (error.empty()) {
+			m_members++;
+		}
+		m_queuedBytes -= member.data.size();
+		m_written.notify_all();
+		if (member.done) {
+			lock.unlock();
+			member.done(error);
+			lock.lock();
+		}
+	}
+}
+
+/**
+ * Appends a member to the archive
+ *
+ * @param[in] member The member
+ * @return true on success, false on write error
+ */
+bool ArchiveWriter::writeMember(const Member& member) {
+	if (!member.target.empty()) {
+		return writeHeader(member.name,0,'1',member.target);
+	}
+
+	return writeHeader(member.name,member.data.size(),'0',"")
+		&& writePadded(member.data.data(),member.data.size());
+}
+
+/**
+ * Appends the header of a member, preceded by a pax extended header if
+ * its name, link name or size don't fit in a ustar header
+ *
+ * @param[in] name Name of the member
+ * @param[in] size Size of the member contents
+ * @param[in] type Member type: '0' regular file, '1' hard link, 'x' pax extended header
+ * @param[in] linkName Name of the member linked to, for hard links
+ * @return true on success, false on write error
+ */
+bool ArchiveWriter::writeHeader(const std::string& name, unsigned long long size, char type, const std::string& linkName) {
+	std::string pax;
+	if (name.size() > 100) {
+		addPaxRecord(pax,"path",name);
+	}
+	if (linkName.size() > 100) {
+		addPaxRecord(pax,"linkpath",linkName);
+	}
+	if (size > TAR_MAX_USTAR_SIZE) {
+		addPaxRecord(pax,"size",std::to_string(size));
+	}
+	if (!pax.empty() && (!writeHeader("PaxHeader",pax.size(),'x',"") || !writePadded(pax.data(),pax.size()))) {
+		return false;
+	}
+
+	char header[TAR_BLOCK_SIZE];
+	memset(header,0,sizeof(header));
+	memcpy(header,name.data(),std::min(name.size(),(size_t) 100));
+	setOctal(header+100,8,0644);
+	setOctal(header+108,8,0);
+	setOctal(header+116,8,0);
+	setOctal(header+124,12,(size > TAR_MAX_USTAR_SIZE) ? 0 : size);
+	setOctal(header+136,12,(unsigned long long) m_time);
+	header[156] = type;
+	memcpy(header+157,linkName.data(),std::min(linkName.size(),(size_t) 100));
+	memcpy(header+257,"ustar",6);
+	memcpy(header+263,"00",2);
+
+	// Checksum of the header, with the checksum field taken as spaces
+	memset(header+148,' ',8);
+	unsigned int checksum = 0;
+	for (size_t i=0; i<sizeof(header); i++) {
+		checksum += (unsigned char) header[i];
+	}
+	setOctal(header+148,7,checksum);
+
+	return (fwrite(header,1,sizeof(header),m_file) == sizeof(header));
+}
+
+/**
+ * Appends data padded with zeros to a whole number of blocks
+ *
+ * @param[in] data The data
+ * @param[in] size Size of the data
+ * @return true on success, false on write error
+ */
+bool ArchiveWriter::writePadded(const char* data, size_t size) {
+	if ((size > 0) && (fwrite(data,1,size,m_file) != size)) {
+		return false;
+	}
+	size_t padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+	char zeros[TAR_BLOCK_SIZE];
+	memset(zeros,0,padding);
+
+	return (padding == 0) || (fwrite(zeros,1,padding,m_file) == padding);
+}
+
+/**
+ * Sets a numeric header field: octal digits padded with zeros, followed
+ * by a NUL
+ *
+ * @param[out] field The field
+ * @param[in] length Length of the field, NUL included
+ * @param[in] value The value
+ */
+void ArchiveWriter::setOctal(char* field, size_t length, unsigned long long value) {
+	for (size_t i=length-1; i>0; i--) {
+		field[i-1] = (char) ('0' + (value & 7));
+		value >>= 3;
+	}
+	field[length-1] = 0;
+}
+
+/**
+ * Adds a record to the data of a pax extended header. Records are
+ * "length keyword=value\n", where length counts the whole record.
+ *
+ * @param[in,out] records Records of the header
+ * @param[in] keyword Keyword of the record
+ * @param[in] value Value of the record
+ */
+void ArchiveWriter::addPaxRecord(std::string& records, const std::string& keyword, const std::string& value) {
+	std::string record = " " + keyword + "=" + value + "\n";
+	size_t length = record.size() + 1;
+	while (std::to_string(length).size() + record.size() != length) {
+		length++;
+	}
+	records += std::to_string(length) + record;
+}
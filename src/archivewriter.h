@@ -0,0 +1,74 @@
+#ifndef ARCHIVEWRITER_H
+#define ARCHIVEWRITER_H
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include "ioengine.h"
+
+/**
+ * ArchiveWriter objects write the outputs of a batch run into a single
+ * tar archive (POSIX ustar, with pax headers for long names), instead of
+ * one file per output. Members are queued by workers and appended by a
+ * single writer thread, so the archive is written sequentially and the
+ * output filesystem only sees one file create and one rename, however
+ * many files are converted.
+ *
+ * The archive is written to a temp name and moved to its final name when
+ * it is closed, optionally after flushing it to storage.
+ */
+class ArchiveWriter {
+
+	public:
+		ArchiveWriter();
+		~ArchiveWriter();
+		bool open(const std::string&, bool);
+		void write(const std::string&, std::string&, IoWriteCallback);
+		void link(const std::string&, const std::string&);
+		bool close(std::string&);
+		unsigned long getMembers();
+		unsigned long long getPeakBytes();
+
+	private:
+		/**
+		 * Member waiting to be written
+		 */
+		struct Member {
+			std::string name;		/**< Name of the member in the archive */
+			std::string target;		/**< Member linked to, empty for a regular file */
+			std::string data;		/**< Contents of a regular file */
+			IoWriteCallback done;	/**< Called when the member has been written, NULL for none */
+		};
+
+		std::string m_path;					/**< Final path of the archive */
+		std::string m_tempPath;				/**< Path of the archive while it is written */
+		FILE* m_file;						/**< Archive file, NULL if closed */
+		time_t m_time;						/**< Modification time of members */
+		bool m_sync;						/**< Flush the archive to storage before moving it to its final name */
+		std::mutex m_mutex;					/**< Protects the queue and counters */
+		std::condition_variable m_queued;	/**< Signals the writer thread that members were queued or the archive is closing */
+		std::condition_variable m_written;	/**< Signals workers waiting for queued bytes to be written */
+		std::deque<Member> m_queue;			/**< Members waiting to be written */
+		unsigned long long m_queuedBytes;	/**< Bytes of members in the queue */
+		unsigned long long m_peakBytes;		/**< Largest number of queued bytes */
+		unsigned long m_members;			/**< Members written */
+		bool m_closing;						/**< Writer thread has to exit once the queue is empty */
+		std::string m_error;				/**< First write error, empty if none */
+		std::thread m_writer;				/**< Writer thread */
+
+		void writerLoop();
+		bool writeMember(const Member&);
+		bool writeHeader(const std::string&, unsigned long long, char, const std::string&);
+		bool writePadded(const char*, size_t);
+		static void setOctal(char*, size_t, unsigned long long);
+		static void addPaxRecord(std::string&, const std::string&, const std::string&);
+
+		ArchiveWriter(const ArchiveWriter&);
+		ArchiveWriter& operator=(const ArchiveWriter&);
+};
+
+#endif
@@ -0,0 +1,108 @@
+#include <fstream>
+#include <cstring>
+#include "dedupindex.h"
+
+/**
+ * Size of the chunks read to compare files with data in memory
+ */
+const size_t DEDUP_CHUNK_SIZE = 64*1024;
+
+/**
+ * Creates an empty index
+ */
+DedupIndex::DedupIndex() {
+}
+
+/**
+ * Looks up the content of a file, making the file the leader of its
+ * content if it is the first one
+ *
+ * @param[in] hash Hash of the file content
+ * @param[in] file The file
+ * @param[out] leader Leader of the content, if already seen
+ * @return true if the file is the leader of its content, false if the
+ * content was already seen
+ */
+bool DedupIndex::claim(unsigned long long hash, const DedupFile& file, DedupFile& leader) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::pair<unsigned long long,unsigned long long> key(hash,file.size);
+	std::map<std::pair<unsigned long long,unsigned long long>,size_t>::iterator it = m_contents.find(key);
+	if (it != m_contents.end()) {
+		leader = m_leaders[it->second].file;
+		return false;
+	}
+	m_contents[key] = file.index;
+	Leader& entry = m_leaders[file.index];
+	entry.file = file;
+	entry.finished = false;
+	entry.converted = false;
+
+	return true;
+}
+
+/**
+ * Makes a file follow the leader of its content
+ *
+ * @param[in] leader Index of the leader
+ * @param[in] file The file, with the same content as the leader
+ * @param[out] converted Whether the leader was converted, if already finished
+ * @return true if the leader is finished and the file can be linked to its
+ * outputs, false if the file is returned by @ref DedupIndex#finish later
+ */
+bool DedupIndex::follow(size_t leader, const DedupFile& file, bool& converted) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Leader& entry = m_leaders[leader];
+	if (entry.finished) {
+		converted = entry.converted;
+		return true;
+	}
+	entry.followers.push_back(file);
+
+	return false;
+}
+
+/**
+ * Marks a file as finished. Does nothing if the file is not a leader.
+ *
+ * @param[in] index Index of the file
+ * @param[in] converted Whether the file was converted (copied unchanged otherwise)
+ * @param[out] followers Files waiting for the file to finish, to be linked to its outputs
+ */
+void DedupIndex::finish(size_t index, bool converted, std::vector<DedupFile>& followers) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	followers.clear();
+	std::map<size_t,Leader>::iterator it = m_leaders.find(index);
+	if (it == m_leaders.end()) {
+		return;
+	}
+	it->second.finished = true;
+	it->second.converted = converted;
+	followers.swap(it->second.followers);
+}
+
+/**
+ * Compares data in memory with the content of a file
+ *
+ * @param[in] data The data
+ * @param[in] size Size of the data
+ * @param[in] path Path of the file
+ * @return true if the file could be read and has the same bytes
+ */
+bool DedupIndex::sameContent(const char* data, size_t size, const std::string& path) {
+	std::ifstream in(path.c_str(),std::ios::binary);
+	if (!in.is_open()) {
+		return false;
+	}
+	std::vector<char> buffer(DEDUP_CHUNK_SIZE);
+	size_t offset = 0;
+	while (in) {
+		in.read(&buffer[0],buffer.size());
+		size_t count = (size_t) in.gcount();
+		if ((count > size - offset) || (memcmp(&buffer[0],data + offset,count) != 0)) {
+			return false;
+		}
+		offset += count;
+	}
+
+	return in.eof() && (offset == size);
+}
@@ -0,0 +1,56 @@
+#ifndef DEDUPINDEX_H
+#define DEDUPINDEX_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+
+/**
+ * File of a batch run taking part in deduplication
+ */
+struct DedupFile {
+	size_t index;				/**< Index of the file in the work queue */
+	std::string file;			/**< Name of the file in the input folder */
+	unsigned long long size;	/**< Size of the file */
+};
+
+/**
+ * DedupIndex objects find the files of a batch run with the same content.
+ * The first file seen with some content (the leader) is converted, and
+ * the files found later with the same content (followers) get links to
+ * its outputs once it is finished. As all files of a run are converted
+ * with the same settings, the same content gives the same outputs.
+ *
+ * Files are indexed by a 64-bit FNV-1a hash of their content and their
+ * size. Callers confirm a match by comparing the bytes of both files
+ * before following a leader.
+ *
+ * Files can be added concurrently from several threads.
+ */
+class DedupIndex {
+
+	public:
+		DedupIndex();
+		bool claim(unsigned long long, const DedupFile&, DedupFile&);
+		bool follow(size_t, const DedupFile&, bool&);
+		void finish(size_t, bool, std::vector<DedupFile>&);
+		static bool sameContent(const char*, size_t, const std::string&);
+
+	private:
+		/**
+		 * Content seen in the run
+		 */
+		struct Leader {
+			DedupFile file;					/**< First file with the content */
+			bool finished;					/**< Whether the outputs of the file have been written */
+			bool converted;					/**< Whether the file was converted (copied unchanged otherwise) */
+			std::vector<DedupFile> followers;	/**< Files with the same content waiting for the leader to finish */
+		};
+
+		std::mutex m_mutex;		/**< Serializes access from workers */
+		std::map<std::pair<unsigned long long,unsigned long long>,size_t> m_contents;	/**< Leader index by content hash and size */
+		std::map<size_t,Leader> m_leaders;	/**< Leaders by index */
+};
+
+#endif
@@ -1,8 +1,16 @@
 /**
- * Definition of global constants
+ * Definition of global constants and helpers
  */
 
 #include <string>
+#include "globals.h"
+#if defined _WIN32 || defined _WIN64
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
 
 extern const std::string g_version = "1.3";
 
@@ -11,3 +19,125 @@ extern const std::string g_slash = "\\";
 #else
 extern const std::string g_slash = "/";
 #endif
+
+/**
+ * Gets the peak resident memory of the process
+ *
+ * @return Peak resident set size in bytes, 0 if not available
+ */
+unsigned long long getPeakRss() {
+#if defined _WIN32 || defined _WIN64
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF,&usage) != 0) {
+		return 0;
+	}
+#if defined __APPLE__
+	return (unsigned long long) usage.ru_maxrss;
+#else
+	return (unsigned long long) usage.ru_maxrss*1024;
+#endif
+#endif
+}
+
+/**
+ * Hashes a string with 64-bit FNV-1a. The value only depends on the bytes
+ * of the string, so it is the same on every host and in every run.
+ *
+ * @param[in] text The string
+ * @return Hash of the string
+ */
+unsigned long long hashString(const std::string& text) {
+	return hashBytes(text.data(),text.size(),FNV_OFFSET_BASIS);
+}
+
+/**
+ * Continues a 64-bit FNV-1a hash with a block of bytes, so that data read
+ * in chunks gets the same hash as the whole data
+ *
+ * @param[in] data The bytes
+ * @param[in] size Number of bytes
+ * @param[in] hash Hash of the preceding bytes, FNV_OFFSET_BASIS for the first block
+ * @return Hash of the preceding bytes and the block
+ */
+unsigned long long hashBytes(const void* data, size_t size, unsigned long long hash) {
+	const unsigned char* bytes = (const unsigned char*) data;
+	for (size_t i=0; i<size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * Flushes an open file to storage, so that its contents survive a power
+ * loss once the call returns
+ *
+ * @param[in] file The file, open for writing
+ * @return true on success, false if the data could not be written
+ */
+bool syncFile(FILE* file) {
+	if (fflush(file) != 0) {
+		return false;
+	}
+#if defined _WIN32 || defined _WIN64
+	return (_commit(_fileno(file)) == 0);
+#else
+	return (fsync(fileno(file)) == 0);
+#endif
+}
+
+/**
+ * Flushes a closed file to storage
+ *
+ * @param[in] path Path of the file
+ * @return true on success, false if the file can't be opened or flushed
+ */
+bool syncFile(const std::string& path) {
+	FILE* file = fopen(path.c_str(),"r+b");
+	if (file == NULL) {
+		return false;
+	}
+	bool success = syncFile(file);
+
+	return (fclose(file) == 0) && success;
+}
+
+/**
+ * Flushes the entries of a folder to storage, so that files created or
+ * renamed in it survive a power loss once the call returns
+ *
+ * @param[in] path Path of the folder
+ * @return true on success, false if the folder can't be opened or flushed
+ */
+bool syncFolder(const std::string& path) {
+#if defined _WIN32 || defined _WIN64
+	// Folders can't be opened as files, NTFS journals their entries
+	return true;
+#else
+	int fd = open(path.c_str(),O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		return false;
+	}
+	bool success = (fsync(fd) == 0);
+
+	return (close(fd) == 0) && success;
+#endif
+}
+
+/**
+ * Gets the folder containing a file
+ *
+ * @param[in] path Path of the file
+ * @return Path of the folder, "." for a bare file name
+ */
+std::string getParentFolder(const std::string& path) {
+	size_t separator = path.find_last_of(g_slash);
+	if (separator == std::string::npos) {
+		return ".";
+	}
+
+	return (separator > 0) ? path.substr(0,separator) : g_slash;
+}
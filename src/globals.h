@@ -2,8 +2,33 @@
 #define GLOBALS_H
 
 #include <string>
+#include <cstddef>
+#include <cstdio>
+
+/**
+ * Initial value of 64-bit FNV-1a hashes
+ */
+const unsigned long long FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+/**
+ * Durability policies of output files, from fastest to safest against
+ * power loss
+ */
+enum DURABILITY_POLICIES {
+	DURABILITY_NONE = 0,	/**< Files are published without waiting for storage */
+	DURABILITY_FILE,		/**< Every file is flushed to storage before being published */
+	DURABILITY_BATCH		/**< Files are published in groups sharing one flush of the filesystem */
+};
 
 extern const std::string g_version;
 extern const std::string g_slash;
 
+unsigned long long getPeakRss();
+unsigned long long hashString(const std::string&);
+unsigned long long hashBytes(const void*, size_t, unsigned long long);
+bool syncFile(FILE*);
+bool syncFile(const std::string&);
+bool syncFolder(const std::string&);
+std::string getParentFolder(const std::string&);
+
 #endif
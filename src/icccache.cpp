@@ -0,0 +1,315 @@
+#include <sstream>
+#include <lcms2.h>
+#include "icccache.h"
+#include "icc_fogra27.h"
+
+/**
+ * Deleter for shared LittleCMS transforms
+ */
+static void deleteTransform(void* hTransform) {
+	if (hTransform != NULL) {
+		cmsDeleteTransform((cmsHTRANSFORM) hTransform);
+	}
+}
+
+/**
+ * Deleter for shared profiles
+ */
+static void deleteProfile(const IccProfile* profile) {
+	delete profile;
+}
+
+/**
+ * Default constructor, creates an empty cache.
+ */
+IccCache::IccCache()
+:m_context(new LcmsContext()),
+ m_maxProfiles(64),
+ m_maxTransforms(64),
+ m_useCounter(0),
+ m_profileHits(0),
+ m_profileMisses(0),
+ m_transformHits(0),
+ m_transformMisses(0)
+{
+}
+
+/**
+ * Destructor releases all cached profiles and transforms. They are
+ * deleted as soon as no one else is using them.
+ */
+IccCache::~IccCache() {
+	m_transforms.clear();
+	m_profiles.clear();
+	m_builtinProfiles.clear();
+}
+
+/**
+ * Gets a profile loaded from file, loading it on first request.
+ *
+ * Profile file can be a standard ICC Profile file or a JPEG file (extracts
+ * embedded profile). If the file name is empty or the profile can't be
+ * loaded, the requested built-in profile is returned instead.
+ *
+ * @param[in] fileName Path to file containing the ICC profile
+ * @param[in] fallback Built-in profile to use when loading fails (see @ref BUILTIN_PROFILES)
+ * @return Shared handle to the cached profile
+ */
+SharedProfile IccCache::getProfile(const std::string& fileName, int fallback) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Look for a previously loaded profile
+	m_useCounter++;
+	std::map<std::string,ProfileEntry>::iterator it = m_profiles.find(fileName);
+	if (it != m_profiles.end()) {
+		m_profileHits++;
+		it->second.lastUse = m_useCounter;
+		return it->second.profile ? it->second.profile : getBuiltinProfile(fallback);
+	}
+	m_profileMisses++;
+
+	// Load profile, remembering failures so that they are not retried
+	IccProfile* profile = new IccProfile(m_context->getHandle());
+	ProfileEntry entry;
+	if (!profile->loadFromFile(fileName)) {
+		delete profile;
+	} else {
+		entry.profile = shareProfile(profile);
+	}
+	entry.lastUse = m_useCounter;
+	if (m_profiles.size() >= m_maxProfiles) {
+		evictProfile();
+	}
+	m_profiles[fileName] = entry;
+
+	return entry.profile ? entry.profile : getBuiltinProfile(fallback);
+}
+
+/**
+ * Gets one of the built-in profiles, creating it on first request.
+ * Must be called with the cache mutex locked.
+ *
+ * @param[in] builtin Built-in profile identifier (see @ref BUILTIN_PROFILES)
+ * @return Shared handle to the cached profile
+ */
+SharedProfile IccCache::getBuiltinProfile(int builtin) {
+	std::map<int,SharedProfile>::iterator it = m_builtinProfiles.find(builtin);
+	if (it != m_builtinProfiles.end()) {
+		return it->second;
+	}
+
+	IccProfile* profile = new IccProfile(m_context->getHandle());
+	switch (builtin) {
+		case BUILTIN_PROFILE_FOGRA27:
+			profile->loadFromMem((char*)iccFOGRA27,iccFOGRA27_size);
+			break;
+		case BUILTIN_PROFILE_GRAY:
+			profile->loadGray(2.2);
+			break;
+		default:
+			profile->loadSRGB();
+			break;
+	}
+	SharedProfile shared = shareProfile(profile);
+	m_builtinProfiles[builtin] = shared;
+
+	return shared;
+}
+
+/**
+ * Takes ownership of a loaded profile, computing its identifier. The
+ * profile keeps the cache context alive until it is deleted.
+ * Must be called with the cache mutex locked.
+ *
+ * @param[in] profile The profile, created in the cache context
+ * @return Shared handle to the profile
+ */
+SharedProfile IccCache::shareProfile(IccProfile* profile) {
+	m_profileIds[profile] = computeProfileId(profile->getHandle());
+	std::shared_ptr<LcmsContext> context = m_context;
+	return SharedProfile(profile,[context](const IccProfile* profile) {
+		deleteProfile(profile);
+	});
+}
+
+/**
+ * Gets a color transform between two profiles, creating it on first request.
+ *
+ * Profiles are identified by their MD5 profile ID, so transforms are also
+ * reused for profiles embedded in different images, as long as they are
+ * identical.
+ *
+ * @param[in] input Input profile (cached or owned by the caller)
+ * @param[in] inputFormat LittleCMS pixel format of input data
+ * @param[in] output Output profile (cached or owned by the caller)
+ * @param[in] outputFormat LittleCMS pixel format of output data
+ * @param[in] intent Rendering intent
+ * @param[in] flags LittleCMS transform flags
+ * @return Shared handle to the transform, empty if it could not be created
+ */
+SharedTransform IccCache::getTransform(const IccProfile* input, cmsUInt32Number inputFormat, const IccProfile* output, cmsUInt32Number outputFormat, int intent, int flags) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Build cache key from profile identifiers and transform parameters
+	std::map<const IccProfile*,std::string>::iterator inputId = m_profileIds.find(input);
+	std::map<const IccProfile*,std::string>::iterator outputId = m_profileIds.find(output);
+	std::ostringstream key;
+	key << ((inputId != m_profileIds.end()) ? inputId->second : computeProfileId(input->getHandle()));
+	key << ((outputId != m_profileIds.end()) ? outputId->second : computeProfileId(output->getHandle()));
+	key << ":" << inputFormat << ":" << outputFormat << ":" << intent << ":" << flags;
+
+	// Look for a previously created transform
+	m_useCounter++;
+	std::map<std::string,TransformEntry>::iterator it = m_transforms.find(key.str());
+	if (it != m_transforms.end()) {
+		m_transformHits++;
+		it->second.lastUse = m_useCounter;
+		return it->second.transform;
+	}
+	m_transformMisses++;
+
+	// Create new transform
+	cmsHTRANSFORM hTransform = cmsCreateTransformTHR(m_context->getHandle(),
+													 input->getHandle(),
+													 inputFormat,
+													 output->getHandle(),
+													 outputFormat,
+													 intent,
+													 flags);
+	if (hTransform == NULL) {
+		return SharedTransform();
+	}
+
+	// Store in cache
+	if (m_transforms.size() >= m_maxTransforms) {
+		evictTransform();
+	}
+	TransformEntry entry;
+	std::shared_ptr<LcmsContext> context = m_context;
+	entry.transform = SharedTransform(hTransform,[context](void* hTransform) {
+		deleteTransform(hTransform);
+	});
+	entry.lastUse = m_useCounter;
+	m_transforms[key.str()] = entry;
+
+	return entry.transform;
+}
+
+/**
+ * Removes the least recently used profile file from the cache. Converters
+ * still using the profile keep it until they release it.
+ * Must be called with the cache mutex locked.
+ */
+void IccCache::evictProfile() {
+	std::map<std::string,ProfileEntry>::iterator oldest = m_profiles.begin();
+	for (std::map<std::string,ProfileEntry>::iterator it = m_profiles.begin(); it != m_profiles.end(); ++it) {
+		if (it->second.lastUse < oldest->second.lastUse) {
+			oldest = it;
+		}
+	}
+	if (oldest != m_profiles.end()) {
+		m_profileIds.erase(oldest->second.profile.get());
+		m_profiles.erase(oldest);
+	}
+}
+
+/**
+ * Removes the least recently used transform from the cache.
+ * Must be called with the cache mutex locked.
+ */
+void IccCache::evictTransform() {
+	std::map<std::string,TransformEntry>::iterator oldest = m_transforms.begin();
+	for (std::map<std::string,TransformEntry>::iterator it = m_transforms.begin(); it != m_transforms.end(); ++it) {
+		if (it->second.lastUse < oldest->second.lastUse) {
+			oldest = it;
+		}
+	}
+	if (oldest != m_transforms.end()) {
+		m_transforms.erase(oldest);
+	}
+}
+
+/**
+ * Computes the MD5 profile ID of a LittleCMS profile
+ *
+ * @param[in] hProfile Handle to the profile
+ * @return The 16 byte profile ID
+ */
+std::string IccCache::computeProfileId(cmsHPROFILE hProfile) {
+	cmsUInt8Number id[16];
+	cmsMD5computeID(hProfile);
+	cmsGetHeaderProfileID(hProfile,id);
+	return std::string((const char*) id,16);
+}
+
+/**
+ * Sets the maximum number of profile files kept in the cache, so that
+ * requests naming many different files don't grow it without limit.
+ * Defaults to 64.
+ *
+ * @param[in] maxProfiles Maximum number of cached profile files (at least 1)
+ */
+void IccCache::setMaxProfiles(unsigned int maxProfiles) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxProfiles = (maxProfiles > 0) ? maxProfiles : 1;
+	while (m_profiles.size() > m_maxProfiles) {
+		evictProfile();
+	}
+}
+
+/**
+ * Sets the maximum number of transforms kept in the cache. Profiles
+ * embedded in images can be very diverse, so the transform cache is
+ * bounded. Defaults to 64.
+ *
+ * @param[in] maxTransforms Maximum number of cached transforms (at least 1)
+ */
+void IccCache::setMaxTransforms(unsigned int maxTransforms) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_maxTransforms = (maxTransforms > 0) ? maxTransforms : 1;
+	while (m_transforms.size() > m_maxTransforms) {
+		evictTransform();
+	}
+}
+
+/**
+ * @return Number of profile requests served from the cache
+ */
+unsigned long IccCache::getProfileHits() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_profileHits;
+}
+
+/**
+ * @return Number of profile requests that needed loading the profile
+ */
+unsigned long IccCache::getProfileMisses() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_profileMisses;
+}
+
+/**
+ * @return Number of transform requests served from the cache
+ */
+unsigned long IccCache::getTransformHits() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_transformHits;
+}
+
+/**
+ * @return Number of transform requests that needed creating the transform
+ */
+unsigned long IccCache::getTransformMisses() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_transformMisses;
+}
+
+/**
+ * Gets the memory counters of the LittleCMS context of cached profiles
+ * and transforms
+ *
+ * @param[out] stats The counters
+ */
+void IccCache::getLcmsStats(LcmsMemoryStats& stats) {
+	m_context->getStats(stats);
+}
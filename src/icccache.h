@@ -0,0 +1,103 @@
+#ifndef ICCCACHE_H
+#define ICCCACHE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <lcms2.h>
+#include "iccprofile.h"
+#include "lcmscontext.h"
+
+/**
+ * Shared handle to a LittleCMS color transform. The transform is deleted
+ * when the last user releases it, even if it was evicted from the cache.
+ */
+typedef std::shared_ptr<void> SharedTransform;
+
+/**
+ * Shared handle to a cached ICC profile. The profile is deleted when the
+ * last user releases it, even if it was evicted from the cache.
+ */
+typedef std::shared_ptr<const IccProfile> SharedProfile;
+
+/**
+ * Built-in profiles used as fallback when a configured profile can't be loaded
+ */
+enum BUILTIN_PROFILES {
+	BUILTIN_PROFILE_SRGB,		/**< LittleCMS sRGB */
+	BUILTIN_PROFILE_FOGRA27,	/**< Coated FOGRA27 */
+	BUILTIN_PROFILE_GRAY		/**< D50 Gamma-2.2 Grayscale */
+};
+
+/**
+ * IccCache objects keep ICC profiles and color transforms loaded, so that
+ * they are created only once and can be shared between several IccConverter
+ * objects, possibly running in different threads.
+ *
+ * Cached profiles are read-only. All LittleCMS calls that read shared
+ * profiles are serialized by the cache. Profiles loaded from files are
+ * bounded like transforms, built-in profiles are kept until the cache is
+ * deleted.
+ *
+ * Cached profiles and transforms are created in a LittleCMS context owned
+ * by the cache. Transforms are not modified once created, so any thread
+ * can run them, and they keep the context alive until they are deleted.
+ */
+class IccCache {
+
+	public:
+		IccCache();
+		~IccCache();
+		SharedProfile getProfile(const std::string&, int);
+		SharedTransform getTransform(const IccProfile*, cmsUInt32Number, const IccProfile*, cmsUInt32Number, int, int);
+		void setMaxProfiles(unsigned int);
+		void setMaxTransforms(unsigned int);
+		unsigned long getProfileHits();
+		unsigned long getProfileMisses();
+		unsigned long getTransformHits();
+		unsigned long getTransformMisses();
+		void getLcmsStats(LcmsMemoryStats&);
+
+	private:
+		/**
+		 * Cached profile data
+		 */
+		struct ProfileEntry {
+			SharedProfile profile;		/**< The profile, empty if it could not be loaded */
+			unsigned long lastUse;		/**< Use counter value when last requested */
+		};
+
+		/**
+		 * Cached transform data
+		 */
+		struct TransformEntry {
+			SharedTransform transform;	/**< The color transform */
+			unsigned long lastUse;		/**< Use counter value when last requested */
+		};
+
+		std::shared_ptr<LcmsContext> m_context;				/**< LittleCMS context of cached profiles and transforms */
+		std::mutex m_mutex;									/**< Serializes access to cache and shared profiles */
+		std::map<std::string,ProfileEntry> m_profiles;		/**< Profiles loaded from files, by file name */
+		std::map<int,SharedProfile> m_builtinProfiles;		/**< Built-in profiles, by identifier (see @ref BUILTIN_PROFILES) */
+		std::map<const IccProfile*,std::string> m_profileIds;	/**< MD5 identifiers of cached profiles */
+		std::map<std::string,TransformEntry> m_transforms;	/**< Created transforms, by profiles and parameters */
+		unsigned int m_maxProfiles;							/**< Maximum number of cached profile files */
+		unsigned int m_maxTransforms;						/**< Maximum number of cached transforms */
+		unsigned long m_useCounter;							/**< Counter for least recently used eviction */
+		unsigned long m_profileHits;						/**< Profile requests served from cache */
+		unsigned long m_profileMisses;						/**< Profile requests that needed loading */
+		unsigned long m_transformHits;						/**< Transform requests served from cache */
+		unsigned long m_transformMisses;					/**< Transform requests that needed creation */
+
+		SharedProfile getBuiltinProfile(int);
+		SharedProfile shareProfile(IccProfile*);
+		std::string computeProfileId(cmsHPROFILE);
+		void evictProfile();
+		void evictTransform();
+
+		IccCache(const IccCache&);
+		IccCache& operator=(const IccCache&);
+};
+
+#endif
@@ -1,16 +1,95 @@
-#include <iostream>
-#include <iomanip>
-extern "C" {
-#include <jpeglib.h>
-}
-#include <fstream>
-#include <cstring>
+#include <chrono>
 #include <cstdio>
-#include <setjmp.h>
+#include <algorithm>
+#include <cstring>
 #include "globals.h"
 #include "iccprofile.h"
 #include "iccconverter.h"
-#include "icc_fogra27.h"
+
+/**
+ * Creates an empty conversion result
+ */
+ConversionResult::ConversionResult() {
+	clear();
+}
+
+/**
+ * Resets all fields of the conversion result
+ */
+void ConversionResult::clear() {
+	errorCode = CONVERSION_OK;
+	errorMessage.clear();
+	profileSource.clear();
+	profileName.clear();
+	width = 0;
+	height = 0;
+	sourceWidth = 0;
+	sourceHeight = 0;
+	inputComponents = 0;
+	outputComponents = 0;
+	inputBytes = 0;
+	outputBytes = 0;
+	setupSeconds = 0;
+	processSeconds = 0;
+	totalSeconds = 0;
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		stageSeconds[i] = 0;
+		stageMemory[i] = 0;
+	}
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		memoryPeak[i] = 0;
+	}
+	peakRss = 0;
+}
+
+/**
+ * Creates a rendition with sRGB output, relative colorimetric intent,
+ * quality 85 and full size
+ */
+RenditionSpec::RenditionSpec()
+:intent(INTENT_RELATIVE_COLORIMETRIC),
+ jpegQuality(85),
+ scale(1)
+{
+	outputFolder.clear();
+	outputProfile.clear();
+}
+
+/**
+ * Working data of a rendition: its own compressor, color transform and
+ * output file, and a resampler when its size differs from the decompressed
+ * image.
+ */
+struct IccConverter::Rendition {
+	RenditionSpec spec;						/**< Rendition settings */
+	std::unique_ptr<JpegEncoder> encoder;	/**< JPEG compressor */
+	SharedTransform transform;				/**< Color transform of the current image */
+	Resampler resampler;					/**< Reduces decompressed lines to the rendition size */
+	bool resampling;						/**< Whether lines go through the resampler */
+	unsigned int width;						/**< Rendition width of the current image */
+	unsigned int height;					/**< Rendition height of the current image */
+	unsigned int linesWritten;				/**< Lines compressed of the current image */
+	std::vector<JSAMPLE> buffer;			/**< Color transformed line */
+	FILE* file;								/**< Temp output file, NULL when closed */
+	std::string tempFile;					/**< Path of temp output file */
+
+	Rendition(const RenditionSpec& theSpec, int backend)
+	:spec(theSpec),
+	 encoder(createJpegEncoder(backend)),
+	 resampling(false),
+	 width(0),
+	 height(0),
+	 linesWritten(0),
+	 file(NULL)
+	{
+	}
+
+	~Rendition() {
+		if (file != NULL) {
+			fclose(file);
+		}
+	}
+};
 
 /**
  * IccConverter objects manage the ICC profile color conversion
@@ -22,7 +101,18 @@ IccConverter::IccConverter()
  m_jpegQuality(85),
  m_blackPointCompensation(true),
  m_enableOptimization(true),
- m_verbose(false)
+ m_scaleDenominator(1),
+ m_maxSize(0),
+ m_resample(false),
+ m_sourceMemory(0),
+ m_backend(JPEG_BACKEND_LIBJPEG),
+ m_decoder(createJpegDecoder(JPEG_BACKEND_LIBJPEG)),
+ m_encoder(createJpegEncoder(JPEG_BACKEND_LIBJPEG)),
+ m_preserveMetadata(true),
+ m_syncOutput(false),
+ m_profileMemory(0),
+ m_progressCallback(NULL),
+ m_progressData(NULL)
 {
 	// Initialize variables
 	m_inputFolder.clear();
@@ -31,26 +121,14 @@ IccConverter::IccConverter()
 	m_defaultRGBProfileName.clear();
 	m_defaultCMYKProfileName.clear();
 	m_defaultGrayProfileName.clear();
-
-	// Initialize JPEG decompress objects
-	m_dinfo.err = jpeg_std_error(&m_derr.jerr);
-  	m_derr.jerr.error_exit = my_error_exit;
-	jpeg_create_decompress(&m_dinfo);
-
-	// Initialize JPEG compress objects
-	m_cinfo.err = jpeg_std_error(&m_cerr.jerr);
-  	m_cerr.jerr.error_exit = my_error_exit;
-	jpeg_create_compress(&m_cinfo);
+	m_cache = &m_ownCache;
 }
 
 /**
  * Destructor frees resources associated with JPEG
- * compression and decompression structs
+ * compression and decompression
  */
 IccConverter::~IccConverter() {
-	// Destroy JPEG compress/decompress objects
-	jpeg_destroy_decompress(&m_dinfo);
-	jpeg_destroy_compress(&m_cinfo);
 }
 
 /**
@@ -84,6 +162,7 @@ void IccConverter::setOutputFolder(const std::string& outputFolder) {
  */
 void IccConverter::setOutputProfile(const std::string& profileName){
 	m_outputProfileName = profileName;
+	m_profileMemory = 0;
 }
 
 /**
@@ -123,74 +202,6 @@ void IccConverter::setDefaultGrayProfile(const std::string& profileName){
 }
 
 
-/**
- * Loads the configured output profile to be used in color transforms.
- * If loading fails, defaults to sRGB. 
- *
- * @return true if the configured ICC profile was loaded correctly, false if
- * default had to be loaded instead
- */
-bool IccConverter::loadOutputProfile(){
-	m_outputProfile.loadFromFile(m_outputProfileName);
-	if (!m_outputProfile.isValid()) {
-		m_outputProfile.loadSRGB();	
-		return false;
-	}
-
-	return true;
-}
-
-/**
- * Loads the configured default input profile for source files in the
- * RGB color space. If loading fails, defaults to sRGB. 
- *
- * @return true if the configured ICC profile was loaded correctly, false if
- * default had to be loaded instead
- */
-bool IccConverter::loadDefaultRGBProfile(){
-	m_defaultRGBProfile.loadFromFile(m_defaultRGBProfileName);
-	if (!m_defaultRGBProfile.isValid()) {
-		m_defaultRGBProfile.loadSRGB();	
-		return false;
-	}
-
-	return true;
-}
-
-/**
- * Loads the configured default input profile for source files in the
- * CMYK color space. If loading fails, defaults to FOGRA27. 
- *
- * @return true if the configured ICC profile was loaded correctly, false if
- * default had to be loaded instead
- */
-bool IccConverter::loadDefaultCMYKProfile(){
-	m_defaultCMYKProfile.loadFromFile(m_defaultCMYKProfileName);
-	if (!m_defaultCMYKProfile.isValid()) {
-		m_defaultCMYKProfile.loadFromMem((char*)iccFOGRA27,iccFOGRA27_size);
-		return false;
-	}
-
-	return true;
-}
-
-/**
- * Loads the configured default input profile for source files in the
- * Grayscale color space. If loading fails, defaults to D50 Gamma 2.2 Grayscale. 
- *
- * @return true if the configured ICC profile was loaded correctly, false if
- * default had to be loaded instead
- */
-bool IccConverter::loadDefaultGrayProfile() {
-	m_defaultGrayProfile.loadFromFile(m_defaultGrayProfileName);
-	if (!m_defaultGrayProfile.isValid()) {
-		m_defaultGrayProfile.loadGray(2.2);
-		return false;
-	}
-
-	return true;
-}
-
 /**
  * Sets the rendering intent for the color conversion.
  * Possible values:
@@ -253,15 +264,191 @@ void IccConverter::setOptimization(bool enableOptimization) {
 
 
 /**
- * Enable or disable verbose output during processing.
+ * Sets a fixed downscaling factor for converted images. Images are reduced
+ * by libjpeg while decompressing (in the IDCT), so only the reduced image is
+ * color transformed and compressed. Ignored when a maximum size is set.
+ * 
+ * @param[in] denominator Scaling denominator: 1 (no scaling), 2, 4 or 8 for 1/2, 1/4 or 1/8 size
+ * @return true if a valid factor has been set, false otherwise
+ */
+bool IccConverter::setScale(int denominator) {
+	bool success = false;
+	if ((denominator == 1) || (denominator == 2) || (denominator == 4) || (denominator == 8)) {
+		m_scaleDenominator = denominator;
+		success = true;
+	}
+
+	return success;
+}
+
+
+/**
+ * Sets the maximum width and height of converted images. Larger images are
+ * reduced while decompressing with the smallest factor (1/2, 1/4 or 1/8)
+ * that makes them fit, or as much as possible if none does. Smaller images
+ * are never enlarged.
+ * 
+ * @param[in] maxSize Maximum width and height in pixels, 0 for no limit
+ * @see IccConverter#setResample
+ */
+void IccConverter::setMaxSize(unsigned int maxSize) {
+	m_maxSize = maxSize;
+}
+
+
+/**
+ * Enable or disable final resampling to the maximum size. When enabled,
+ * images are reduced while decompressing with the largest factor that keeps
+ * them at least as big as the maximum size, and then resampled with an area
+ * averaging filter so that the longest side is exactly the maximum size.
+ * 
+ * @param[in] resample true for resampling to the exact maximum size, false for libjpeg scaling only
+ * @see IccConverter#setMaxSize
+ */
+void IccConverter::setResample(bool resample) {
+	m_resample = resample;
+}
+
+
+/**
+ * Sets libjpeg parameters for decompression and compression, see
+ * @ref CodecSettings. Optimized Huffman tables and progressive output make
+ * libjpeg keep the whole compressed image in memory before writing it.
+ * 
+ * @param[in] codec libjpeg parameters
+ */
+void IccConverter::setCodecSettings(const CodecSettings& codec) {
+	m_codec = codec;
+}
+
+
+/**
+ * Sets the JPEG codec implementation used for decompression and compression
+ * of all outputs. The libjpeg backend streams images line by line, while the
+ * TurboJPEG backend keeps whole source and converted images in memory, and
+ * is only available when built with TURBOJPEG=1.
+ * 
+ * @param[in] backend The codec implementation (see @ref JPEG_BACKENDS)
+ * @return true if the backend has been set, false if it is not available in this build
+ */
+bool IccConverter::setBackend(int backend) {
+	if (!isJpegBackendAvailable(backend)) {
+		return false;
+	}
+	m_backend = backend;
+	m_decoder.reset(createJpegDecoder(backend));
+	m_encoder.reset(createJpegEncoder(backend));
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		m_renditions[i]->encoder.reset(createJpegEncoder(backend));
+	}
+
+	return true;
+}
+
+
+/**
+ * Enable or disable copying metadata to converted images. When enabled
+ * (the default), EXIF, XMP, IPTC, comments and other APPn markers of the
+ * source image are written to every output, after updating the EXIF color
+ * space and image size to match the output. JFIF, Adobe and ICC profile
+ * markers are never copied.
  * 
- * @param[in] verbose true for enabling verbose output, false for disabling
+ * @param[in] preserveMetadata true for copying metadata, false for dropping it
  */
-void IccConverter::setVerboseOutput(bool verbose) {
-	m_verbose = verbose;
+void IccConverter::setPreserveMetadata(bool preserveMetadata) {
+	m_preserveMetadata = preserveMetadata;
 }
 
 
+/**
+ * Enable or disable flushing converted files to storage before moving them
+ * to their final names in @ref IccConverter#convert. When enabled, a file
+ * found under its final name after a power loss is always complete, at the
+ * cost of waiting for the storage device once per file. Disabled by default.
+ *
+ * @param[in] syncOutput true for flushing every converted file, false for leaving it to the system
+ */
+void IccConverter::setSyncOutput(bool syncOutput) {
+	m_syncOutput = syncOutput;
+}
+
+
+/**
+ * Adds an output to file conversions. Each rendition is color transformed
+ * and compressed from the same decompressed image, so the source is only
+ * read and decompressed once for all of them. The image is decompressed at
+ * the largest size needed by any output, and reduced with an area averaging
+ * filter for the others.
+ *
+ * Renditions are only written by @ref IccConverter#convert. Black point
+ * compensation and optimization settings are shared with the main output.
+ * 
+ * @param[in] spec Rendition settings
+ * @return true if the rendition has been added, false if its settings are not valid
+ */
+bool IccConverter::addRendition(const RenditionSpec& spec) {
+	if ((spec.intent < 0) || (spec.intent > 3) || (spec.jpegQuality < 0) || (spec.jpegQuality > 100)) {
+		return false;
+	}
+	if ((spec.scale != 1) && (spec.scale != 2) && (spec.scale != 4) && (spec.scale != 8)) {
+		return false;
+	}
+	if (spec.outputFolder.empty()) {
+		return false;
+	}
+	m_renditions.push_back(std::unique_ptr<Rendition>(new Rendition(spec,m_backend)));
+	m_profileMemory = 0;
+	m_renditions.back()->spec.outputFolder = removeTrailingSlash(spec.outputFolder);
+
+	return true;
+}
+
+
+/**
+ * Removes all renditions, so that conversions only write the main output
+ */
+void IccConverter::clearRenditions() {
+	m_renditions.clear();
+	m_profileMemory = 0;
+}
+
+
+/**
+ * Sets a function to be called with the progress of each conversion, once
+ * for every scanline processed. The function is called from the thread
+ * running the conversion.
+ * 
+ * @param[in] callback The progress function, NULL for none
+ * @param[in] userData Pointer passed back to the progress function
+ */
+void IccConverter::setProgressCallback(ProgressCallback callback, void* userData) {
+	m_progressCallback = callback;
+	m_progressData = userData;
+}
+
+
+/**
+ * Sets a profile and transform cache shared with other IccConverter objects.
+ * The cache must outlive this object. By default each IccConverter uses
+ * its own private cache.
+ * 
+ * @param[in] cache The shared cache, or NULL for using the private cache
+ */
+void IccConverter::setCache(IccCache* cache) {
+	m_cache = (cache != NULL) ? cache : &m_ownCache;
+}
+
+/**
+ * Gets the memory counters of the LittleCMS context used for the profiles
+ * embedded in converted images. Cached profiles and transforms are counted
+ * by the cache.
+ *
+ * @param[out] stats The counters
+ */
+void IccConverter::getLcmsStats(LcmsMemoryStats& stats) {
+	m_lcms.getStats(stats);
+}
+
 
 /**
  * Performs ICC color conversion in a JPEG file 
@@ -271,95 +458,392 @@ void IccConverter::setVerboseOutput(bool verbose) {
  * with the same name in the output folder previously set by calling
  * (@ref IccConverter#setOutputFolder) method.
  *
+ * Nothing is written to the console: the outcome of the conversion is
+ * reported in the result structure.
+ *
  * @param[in] file Name of the file to process 
+ * @param[out] result Details and outcome of the conversion
  * @return true if conversion is successful, false otherwise
  * @see IccConverter#setInputFolder
  * @see IccConverter#setOutputFolder
  */
-bool IccConverter::convert(const std::string& file) {
-	// Generate input file name
-	std::string theFile = m_inputFolder + g_slash + file;
-	std::cout << file << ": ";
+bool IccConverter::convert(const std::string& file, ConversionResult& result) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	result.clear();
 
-	// Check valid output profile 
-	if (!m_outputProfile.isValid()) {
-		loadOutputProfile();		
+	// Open source file
+	std::string theFile = m_inputFolder + g_slash + file;
+	FILE* f = NULL;
+	if ((f = fopen(theFile.c_str(), "rb")) == NULL) {
+		result.errorCode = CONVERSION_ERROR_OPEN_INPUT;
+		result.errorMessage = "Failed to open " + theFile;
+		return false;
 	}
+	m_decoder->setFileSource(f);
+	m_sourceMemory = 0;
+	m_outputMemory.clear();
 
-	FILE* f = NULL;
+	// Open temp output file
+	std::string outputFile = m_outputFolder + g_slash + file;
+	std::string outputFileTemp = outputFile + ".tmp";
 	FILE* fOut = NULL;
-	std::string outputFileTemp("");
-	JSAMPLE* buffer_in[1];
-	buffer_in[0] = NULL;
-	JSAMPLE* buffer_out[1];
-	buffer_out[0] = NULL;
-	cmsHTRANSFORM hTransform = NULL; 
-	try {
+	if ((fOut = fopen(outputFileTemp.c_str(), "wb")) == NULL) {
+		result.errorCode = CONVERSION_ERROR_OPEN_OUTPUT;
+		result.errorMessage = "Failed to write " + outputFile;
+		fclose(f);
+		return false;
+	}
+	m_encoder->setFileDestination(fOut);
 
-		// Handle errors in the JPEG decompression library
-		if (setjmp(m_derr.setjmp_buffer)) {
-			throw 1;
+	// Open temp output files of renditions
+	if (!openRenditions(file,result)) {
+		fclose(f);
+		fclose(fOut);
+		remove(outputFileTemp.c_str());
+		return false;
+	}
+	std::chrono::steady_clock::time_point mark = start;
+	lapStage(result,CONVERSION_STAGE_OPEN,mark);
+	sampleMemory(result,CONVERSION_STAGE_OPEN,CONVERSION_STAGE_OPEN);
+
+	// Convert
+	bool success = transformImage(result,true);
+	mark = std::chrono::steady_clock::now();
+	fclose(f);
+	if (success && m_syncOutput && !syncFile(fOut)) {
+		result.errorCode = CONVERSION_ERROR_SYNC;
+		result.errorMessage = "Failed to flush " + outputFileTemp + " to storage";
+		success = false;
+	}
+	fclose(fOut);
+	if (!success) {
+		remove(outputFileTemp.c_str());
+		closeRenditions(file,false,result);
+		return false;
+	}
+
+	// Delete original file when processing in same folder, silently fail otherwise 
+	remove(outputFile.c_str());
+
+	// Move temp file to final destination
+	int renameStatus = rename(outputFileTemp.c_str(),outputFile.c_str());
+	if (renameStatus != 0) {
+		result.errorCode = CONVERSION_ERROR_RENAME;
+		result.errorMessage = "Can't rename " + outputFileTemp + " to " + outputFile;
+		closeRenditions(file,false,result);
+		return false;
+	}		
+	if (m_syncOutput && !syncFolder(getParentFolder(outputFile))) {
+		result.errorCode = CONVERSION_ERROR_SYNC;
+		result.errorMessage = "Failed to flush the folder of " + outputFile + " to storage";
+		closeRenditions(file,false,result);
+		return false;
+	}
+	if (!closeRenditions(file,true,result)) {
+		return false;
+	}
+	lapStage(result,CONVERSION_STAGE_PUBLISH,mark);
+	sampleMemory(result,CONVERSION_STAGE_PUBLISH,CONVERSION_STAGE_PUBLISH);
+
+	result.totalSeconds = secondsSince(start);
+
+	return true;
+}
+
+
+/**
+ * Performs ICC color conversion on JPEG data held in memory.
+ *
+ * Nothing is written to the console: the outcome of the conversion is
+ * reported in the result structure.
+ *
+ * @param[in] data Pointer to the source JPEG data
+ * @param[in] size Size in bytes of the source JPEG data
+ * @param[out] output String receiving the converted JPEG data
+ * @param[out] result Details and outcome of the conversion
+ * @return true if conversion is successful, false otherwise
+ */
+bool IccConverter::convertBuffer(const char* data, unsigned long size, std::string& output, ConversionResult& result) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	result.clear();
+	output.clear();
+	m_decoder->setMemorySource((const unsigned char*) data,size);
+	m_encoder->setStringDestination(&output);
+	m_sourceMemory = size;
+	m_outputMemory.assign(1,&output);
+
+	// Convert
+	bool success = transformImage(result,false);
+	if (!success) {
+		output.clear();
+		return false;
+	}
+
+	result.totalSeconds = secondsSince(start);
+
+	return true;
+}
+
+
+/**
+ * Performs ICC color conversion on JPEG data held in memory, producing the
+ * main output and all renditions in memory.
+ *
+ * Nothing is written to the console: the outcome of the conversion is
+ * reported in the result structure.
+ *
+ * @param[in] data Pointer to the source JPEG data
+ * @param[in] size Size in bytes of the source JPEG data
+ * @param[out] outputs Converted JPEG data: main output first, then renditions in the order they were added
+ * @param[out] result Details and outcome of the conversion
+ * @return true if conversion is successful, false otherwise
+ */
+bool IccConverter::convertBuffer(const char* data, unsigned long size, std::vector<std::string>& outputs, ConversionResult& result) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	result.clear();
+	outputs.assign(m_renditions.size()+1,std::string());
+	m_decoder->setMemorySource((const unsigned char*) data,size);
+	m_encoder->setStringDestination(&outputs[0]);
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		m_renditions[i]->encoder->setStringDestination(&outputs[i+1]);
+	}
+	m_sourceMemory = size;
+	m_outputMemory.clear();
+	for (size_t i=0; i<outputs.size(); i++) {
+		m_outputMemory.push_back(&outputs[i]);
+	}
+
+	// Convert
+	bool success = transformImage(result,true);
+	if (!success) {
+		outputs.clear();
+		return false;
+	}
+
+	result.totalSeconds = secondsSince(start);
+
+	return true;
+}
+
+
+/**
+ * Estimates the peak memory used to convert an image with the current
+ * settings, from its header, before decoding starts. The estimate is an
+ * upper bound for the large buffers:
+ *
+ * - Progressive sources are decoded from whole coefficient arrays (2 bytes
+ *   per sample at full size, whatever the scale).
+ * - Outputs with optimized Huffman tables or progressive coding keep their
+ *   whole coefficient arrays (up to 4 components).
+ * - The TurboJPEG backend keeps the compressed source, the decoded image and
+ *   every converted image in memory.
+ * - Every output holds a copy of its output profile.
+ *
+ * Line buffers, libjpeg pools and color transform tables are covered by a
+ * fixed amount per image.
+ *
+ * @param[in] source Size and components of the source image
+ * @param[in] progressive Whether the source image is progressive
+ * @param[in] fileSize Size of the source JPEG data
+ * @param[in] inMemory Whether source and converted data are held in memory (see @ref IccConverter#convertBuffer)
+ * @return Estimated memory in bytes
+ */
+unsigned long long IccConverter::estimateMemory(const JpegImageInfo& source, bool progressive, unsigned long long fileSize, bool inMemory) {
+	const unsigned long long fixedMemory = 4*1024*1024;
+	const unsigned long long maxComponents = 4;
+	unsigned long long pixels = (unsigned long long) source.width*source.height;
+	unsigned long long memory = fixedMemory;
+	if (progressive) {
+		memory += pixels*source.components*2;
+	}
+	if (m_backend == JPEG_BACKEND_TURBOJPEG) {
+		memory += (inMemory ? 0 : fileSize) + pixels*source.components;
+	}
+	if (inMemory) {
+		memory += fileSize;
+	}
+
+	// Pixels of every output
+	std::vector<unsigned long long> outputs;
+	double ratio = 1.0/m_scaleDenominator;
+	unsigned int longest = std::max(source.width,source.height);
+	if ((m_maxSize > 0) && (longest > m_maxSize)) {
+		ratio = (double) m_maxSize/longest;
+	}
+	outputs.push_back((unsigned long long) (pixels*ratio*ratio) + 1);
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		outputs.push_back(pixels/(m_renditions[i]->spec.scale*m_renditions[i]->spec.scale) + 1);
+	}
+	for (size_t i=0; i<outputs.size(); i++) {
+		if (m_codec.optimizeCoding || m_codec.progressive) {
+			memory += outputs[i]*maxComponents*2;
 		}
-		// Handle errors in the JPEG compression library
-		if (setjmp(m_cerr.setjmp_buffer)) {
-			throw 2;
+		if (m_backend == JPEG_BACKEND_TURBOJPEG) {
+			memory += outputs[i]*maxComponents*2;
+		} else if (inMemory) {
+			memory += outputs[i]*maxComponents/2;
 		}
+	}
 
-		// Open source file
-		if ((f = fopen(theFile.c_str(), "rb")) == NULL) {
-			std::cerr << "Failed to open " << theFile << std::endl;
-			return false;
+	// Output profiles, measured once
+	if (m_profileMemory == 0) {
+		std::string data;
+		m_cache->getProfile(m_outputProfileName,BUILTIN_PROFILE_SRGB)->saveToMem(data);
+		m_profileMemory = data.size();
+		for (size_t i=0; i<m_renditions.size(); i++) {
+			m_cache->getProfile(m_renditions[i]->spec.outputProfile,BUILTIN_PROFILE_SRGB)->saveToMem(data);
+			m_profileMemory += data.size();
 		}
-		jpeg_stdio_src(&m_dinfo,f);
+		m_profileMemory = std::max(m_profileMemory,1ULL);
+	}
+	memory += m_profileMemory;
 
-		// Open temp output file
-		std::string outputFile = m_outputFolder + g_slash + file;
-		outputFileTemp = outputFile + ".tmp";
-		if ((fOut = fopen(outputFileTemp.c_str(), "wb")) == NULL) {
-			std::cerr << "Failed to write  " << outputFile << std::endl;
-			fclose(f);
-			return false;
+	return memory;
+}
+
+
+/**
+ * Performs ICC color conversion on a JPEG stream.
+ *
+ * Input is read sequentially and output is written as soon as it is
+ * compressed, so both files can be pipes (e.g. stdin and stdout). Only the
+ * JPEG header is kept in memory to look for an embedded profile.
+ *
+ * If conversion fails midway, part of the converted image may have already
+ * been written to the output stream.
+ *
+ * @param[in] input Open stream with the source JPEG data
+ * @param[in] output Open stream receiving the converted JPEG data
+ * @param[out] result Details and outcome of the conversion
+ * @return true if conversion is successful, false otherwise
+ */
+bool IccConverter::convertStream(FILE* input, FILE* output, ConversionResult& result) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	result.clear();
+	m_decoder->setFileSource(input);
+	m_encoder->setFileDestination(output);
+	m_sourceMemory = 0;
+	m_outputMemory.clear();
+
+	// Convert
+	bool success = transformImage(result,false);
+	if (!success) {
+		return false;
+	}
+
+	result.totalSeconds = secondsSince(start);
+
+	return true;
+}
+
+
+/**
+ * Decompresses the JPEG image from the current data source, applies the
+ * color transform and compresses the result to the current data destination.
+ *
+ * The input profile is the one embedded in the image if valid, otherwise
+ * the default profile for the color space of the image is used. Embedded
+ * profiles are looked for in the header data kept by the decoder.
+ *
+ * @param[out] result Details and outcome of the conversion
+ * @param[in] withRenditions Whether to also write renditions (their destinations must be set up)
+ * @return true if conversion is successful, false otherwise
+ */
+bool IccConverter::transformImage(ConversionResult& result, bool withRenditions) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point mark = start;
+	m_lcms.resetPeak();
+	IccProfile embeddedProfile(m_lcms.getHandle());
+	const IccProfile* inputProfile = &embeddedProfile;
+	SharedProfile defaultProfile;
+	SharedProfile outputProfile = m_cache->getProfile(m_outputProfileName,BUILTIN_PROFILE_SRGB);
+	lapStage(result,CONVERSION_STAGE_PROFILE,mark);
+	SharedTransform transform;
+	size_t renditions = withRenditions ? m_renditions.size() : 0;
+	try {
+
+		// Read input header, keeping metadata markers
+		JpegImageInfo source;
+		m_decoder->setSaveMarkers(m_preserveMetadata);
+		if (!m_decoder->readHeader(source)) {
+			throw CONVERSION_ERROR_DECOMPRESS;
+		}
+		std::vector<JpegMarker> markers;
+		if (m_preserveMetadata) {
+			m_decoder->getMarkers(markers);
+			m_metadata.load(markers);
+		} else {
+			m_metadata.clear();
+		}
+
+		// Look for embedded profile in the header data
+		const char* headerData = NULL;
+		size_t headerSize = 0;
+		m_decoder->getHeaderData(headerData,headerSize);
+		embeddedProfile.loadFromJpegMem(headerData,headerSize);
+		lapStage(result,CONVERSION_STAGE_HEADER,mark);
+
+		// Choose size of converted image
+		result.sourceWidth = source.width;
+		result.sourceHeight = source.height;
+		unsigned int width = 0;
+		unsigned int height = 0;
+		int denominator = setupScaling(width,height);
+
+		// Decompress at the largest size needed by any output
+		for (size_t i=0; i<renditions; i++) {
+			Rendition& rendition = *m_renditions[i];
+			if (!m_decoder->getScaledSize(rendition.spec.scale,rendition.width,rendition.height)) {
+				throw CONVERSION_ERROR_DECOMPRESS;
+			}
+			denominator = std::min(denominator,rendition.spec.scale);
 		}
-		jpeg_stdio_dest(&m_cinfo,fOut);
 
 		// Start input decompression
-		jpeg_read_header(&m_dinfo, TRUE);
-		jpeg_start_decompress(&m_dinfo);
+		JpegImageInfo decoded;
+		if (!m_decoder->start(denominator,m_codec,decoded)) {
+			throw CONVERSION_ERROR_DECOMPRESS;
+		}
+		lapStage(result,CONVERSION_STAGE_DECODE,mark);
+		result.width = width;
+		result.height = height;
+		result.inputComponents = decoded.components;
+
+		// Outputs smaller than the decompressed image are resampled
+		bool resampling = (width != decoded.width) || (height != decoded.height);
+		if (resampling) {
+			m_resampler.setup(decoded.width,decoded.height,width,height,decoded.components);
+		}
+		for (size_t i=0; i<renditions; i++) {
+			Rendition& rendition = *m_renditions[i];
+			rendition.resampling = (rendition.width != decoded.width) || (rendition.height != decoded.height);
+			if (rendition.resampling) {
+				rendition.resampler.setup(decoded.width,decoded.height,rendition.width,rendition.height,decoded.components);
+			}
+		}
 
 		// Determine input profile
-		IccProfile inputProfile;
-		if (!inputProfile.loadFromFile(theFile)) {
-			switch (m_dinfo.out_color_space) {
+		if (!embeddedProfile.isValid()) {
+			switch (decoded.colorSpace) {
 				case JCS_GRAYSCALE:
-					if (!m_defaultGrayProfile.isValid()) {
-						loadDefaultGrayProfile();	
-					}
-					inputProfile = m_defaultGrayProfile;
+					defaultProfile = m_cache->getProfile(m_defaultGrayProfileName,BUILTIN_PROFILE_GRAY);
 					break;
 				case JCS_CMYK:
-					if (!m_defaultCMYKProfile.isValid()) {
-						loadDefaultCMYKProfile();	
-					}
-					inputProfile = m_defaultCMYKProfile;
+					defaultProfile = m_cache->getProfile(m_defaultCMYKProfileName,BUILTIN_PROFILE_FOGRA27);
 					break;
 				case JCS_RGB:
-					if (!m_defaultRGBProfile.isValid()) {
-						loadDefaultRGBProfile();	
-					}
-					inputProfile = m_defaultRGBProfile;
+					defaultProfile = m_cache->getProfile(m_defaultRGBProfileName,BUILTIN_PROFILE_SRGB);
 					break;
 				default:
-					std::cerr << "Unsupported color space" << std::endl;
-					fclose(f);
-					fclose(fOut);
-					jpeg_finish_decompress(&m_dinfo);
-					return false;	
+					throw CONVERSION_ERROR_COLOR_SPACE;
 			}
+			inputProfile = defaultProfile.get();
 		}
-		std::cout << "(" << inputProfile.getSource() << ": " << inputProfile.getName() << ") ";
-		std::cout.flush();
+		lapStage(result,CONVERSION_STAGE_PROFILE,mark);
+		result.profileSource = inputProfile->getSource();
+		result.profileName = inputProfile->getName();
 		cmsUInt32Number inputFormat = 0;
-		switch (inputProfile.getNumChannels()) {
+		switch (inputProfile->getNumChannels()) {
 			case 1:
 				inputFormat = TYPE_GRAY_8;
 				break;
@@ -370,56 +854,21 @@ bool IccConverter::convert(const std::string& file) {
 				inputFormat = TYPE_CMYK_8_REV;
 				break;
 			default:
-				std::cerr << "Unsupported number of channels in input profile" << std::endl;
-				fclose(f);
-				fclose(fOut);
-				jpeg_finish_decompress(&m_dinfo);
-				return false;	
+				throw CONVERSION_ERROR_INPUT_CHANNELS;
 		}
 
 		// Define output compression parameters
-		m_cinfo.image_width = m_dinfo.output_width;
-		m_cinfo.image_height = m_dinfo.output_height;
-		m_cinfo.input_components = m_outputProfile.getNumChannels();
+		JpegImageInfo output;
+		output.width = width;
+		output.height = height;
+		output.components = outputProfile->getNumChannels();
+		result.outputComponents = outputProfile->getNumChannels();
 		cmsUInt32Number outputFormat = 0;
-		switch (m_outputProfile.getNumChannels()) {
-			case 1:
-				m_cinfo.in_color_space = JCS_GRAYSCALE;
-				outputFormat = TYPE_GRAY_8;
-				break;
-			case 3:
-				m_cinfo.in_color_space = JCS_RGB;
-				outputFormat = TYPE_RGB_8;
-				break;
-			case 4:
-				m_cinfo.in_color_space = JCS_CMYK;
-				outputFormat = TYPE_CMYK_8_REV;
-				break;
-			default:
-				std::cerr << "Unsupported number of channels in output profile" << std::endl;
-				fclose(f);
-				fclose(fOut);
-				jpeg_finish_decompress(&m_dinfo);
-				return false;	
+		if (!getOutputFormat(outputProfile->getNumChannels(),output.colorSpace,outputFormat)) {
+			throw CONVERSION_ERROR_OUTPUT_CHANNELS;
 		}
-		jpeg_set_defaults(&m_cinfo);
-		jpeg_set_quality(&m_cinfo,m_jpegQuality,true);
-
-		// Start output compression
-		jpeg_start_compress(&m_cinfo,TRUE);
 
-		// Embed output profile
-		embedIccProfile(m_outputProfile,&m_cinfo);
-
-		// Create buffer for input 
-		long line_width = m_dinfo.output_width*m_dinfo.output_components;
-		buffer_in[0] = new JSAMPLE[line_width];
-
-		// Create buffer for output 
-		long line_width_out = m_cinfo.image_width*m_cinfo.input_components;
-		buffer_out[0] = new JSAMPLE[line_width_out];
-
-		// Create profile transform
+		// Get profile transform
 		int flags = 0;
 		if (m_blackPointCompensation) {
 			flags |= cmsFLAGS_BLACKPOINTCOMPENSATION;
@@ -427,129 +876,441 @@ bool IccConverter::convert(const std::string& file) {
 		if (!m_enableOptimization) {
 			flags |= cmsFLAGS_NOOPTIMIZE;
 		}
-		hTransform = cmsCreateTransform(inputProfile.getHandle(),
-										inputFormat,
-										m_outputProfile.getHandle(),
-										outputFormat,
-										m_intent,
-										flags);
+		transform = m_cache->getTransform(inputProfile,inputFormat,outputProfile.get(),outputFormat,m_intent,flags);
+		if (!transform) {
+			throw CONVERSION_ERROR_TRANSFORM;
+		}
 
-		// Read and process image lines
-		while (m_dinfo.output_scanline < m_dinfo.output_height) {
-			if (m_verbose) {
-				std::cout << std::setw(3) << (100*m_dinfo.output_scanline/m_dinfo.output_height) << "%\b\b\b\b";
+		// Get rendition transforms and start their compression, embedding their profiles
+		for (size_t i=0; i<renditions; i++) {
+			Rendition& rendition = *m_renditions[i];
+			SharedProfile profile = m_cache->getProfile(rendition.spec.outputProfile,BUILTIN_PROFILE_SRGB);
+			JpegImageInfo image;
+			image.width = rendition.width;
+			image.height = rendition.height;
+			image.components = profile->getNumChannels();
+			cmsUInt32Number format = 0;
+			if (!getOutputFormat(profile->getNumChannels(),image.colorSpace,format)) {
+				throw CONVERSION_ERROR_OUTPUT_CHANNELS;
+			}
+			rendition.transform = m_cache->getTransform(inputProfile,inputFormat,profile.get(),format,rendition.spec.intent,flags);
+			if (!rendition.transform) {
+				throw CONVERSION_ERROR_TRANSFORM;
 			}
-			jpeg_read_scanlines(&m_dinfo,&buffer_in[0],1);
-			cmsDoTransform(hTransform,(const void *) buffer_in[0],(void *) buffer_out[0],(cmsUInt32Number) m_dinfo.output_width);
-			jpeg_write_scanlines(&m_cinfo,&buffer_out[0],1);
+			std::string iccData;
+			profile->saveToMem(iccData);
+			m_metadata.getMarkers(getExifColorSpace(*profile),image.width,image.height,markers);
+			if (!rendition.encoder->start(image,rendition.spec.jpegQuality,m_codec,iccData,markers)) {
+				throw CONVERSION_ERROR_COMPRESS;
+			}
+			rendition.linesWritten = 0;
+			rendition.buffer.resize(rendition.width*profile->getNumChannels());
 		}
+		lapStage(result,CONVERSION_STAGE_TRANSFORM,mark);
 
-		// Delete profile transform
-		cmsDeleteTransform(hTransform);
-		hTransform = NULL;
+		// Start output compression, copying metadata and embedding output profile
+		std::string iccData;
+		outputProfile->saveToMem(iccData);
+		m_metadata.getMarkers(getExifColorSpace(*outputProfile),output.width,output.height,markers);
+		if (!m_encoder->start(output,m_jpegQuality,m_codec,iccData,markers)) {
+			throw CONVERSION_ERROR_COMPRESS;
+		}
 
-		// Finish decompression/compression and close files
-		jpeg_finish_decompress(&m_dinfo);
-		jpeg_finish_compress(&m_cinfo);
-		fclose(f);
-		fclose(fOut);
+		// Output line buffer, kept between images
+		m_lineBuffer.resize(output.width*output.components);
+		lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+		result.setupSeconds = secondsSince(start);
+		sampleMemory(result,CONVERSION_STAGE_HEADER,CONVERSION_STAGE_TRANSFORM);
 
-		// Free resources
-		delete buffer_in[0];
-		delete buffer_out[0];
+		// Read and process image lines
+		unsigned int linesWritten = 0;
+		for (unsigned int scanline=0; scanline<decoded.height; scanline++) {
+			if (m_progressCallback != NULL) {
+				m_progressCallback(scanline,decoded.height,m_progressData);
+			}
+			const JSAMPLE* buffer_in = m_decoder->readLine();
+			if (buffer_in == NULL) {
+				throw CONVERSION_ERROR_DECOMPRESS;
+			}
+			lapStage(result,CONVERSION_STAGE_DECODE,mark);
+			const JSAMPLE* line = buffer_in;
+			if (resampling) {
+				line = m_resampler.addLine(buffer_in);
+				lapStage(result,CONVERSION_STAGE_RESAMPLE,mark);
+			}
+			if (line != NULL) {
+				cmsDoTransform(transform.get(),(const void *) line,(void *) &m_lineBuffer[0],(cmsUInt32Number) width);
+				lapStage(result,CONVERSION_STAGE_COLOR,mark);
+				if (!m_encoder->writeLine(&m_lineBuffer[0])) {
+					throw CONVERSION_ERROR_COMPRESS;
+				}
+				linesWritten++;
+				lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+			}
 
-		// Delete original file when processing in same folder, silently fail otherwise 
-		remove(outputFile.c_str());
+			// Same decompressed line goes to every rendition
+			for (size_t i=0; i<renditions; i++) {
+				Rendition& rendition = *m_renditions[i];
+				const JSAMPLE* renditionLine = buffer_in;
+				if (rendition.resampling) {
+					renditionLine = rendition.resampler.addLine(buffer_in);
+					lapStage(result,CONVERSION_STAGE_RESAMPLE,mark);
+				}
+				if (renditionLine != NULL) {
+					cmsDoTransform(rendition.transform.get(),(const void *) renditionLine,(void *) &rendition.buffer[0],(cmsUInt32Number) rendition.width);
+					lapStage(result,CONVERSION_STAGE_COLOR,mark);
+					if (!rendition.encoder->writeLine(&rendition.buffer[0])) {
+						throw CONVERSION_ERROR_COMPRESS;
+					}
+					rendition.linesWritten++;
+					lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+				}
+			}
+		}
+		sampleMemory(result,CONVERSION_STAGE_DECODE,CONVERSION_STAGE_ENCODE);
 
-		// Move temp file to final destination
-		int renameStatus = rename(outputFileTemp.c_str(),outputFile.c_str());
-		if (renameStatus != 0) {
-			std::cerr << "Can't rename " << outputFileTemp << " to " << outputFile << std::endl;
-			return false;
-		}		
+		// Last resampled line may be left over because of rounding
+		if (resampling && (linesWritten < height)) {
+			const JSAMPLE* line = m_resampler.finish();
+			if (line != NULL) {
+				cmsDoTransform(transform.get(),(const void *) line,(void *) &m_lineBuffer[0],(cmsUInt32Number) width);
+				if (!m_encoder->writeLine(&m_lineBuffer[0])) {
+					throw CONVERSION_ERROR_COMPRESS;
+				}
+			}
+			lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+		}
+		for (size_t i=0; i<renditions; i++) {
+			Rendition& rendition = *m_renditions[i];
+			if (rendition.resampling && (rendition.linesWritten < rendition.height)) {
+				const JSAMPLE* line = rendition.resampler.finish();
+				if (line != NULL) {
+					cmsDoTransform(rendition.transform.get(),(const void *) line,(void *) &rendition.buffer[0],(cmsUInt32Number) rendition.width);
+					if (!rendition.encoder->writeLine(&rendition.buffer[0])) {
+						throw CONVERSION_ERROR_COMPRESS;
+					}
+				}
+				lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+			}
+		}
 
-	} catch(int e) {
-		// Error during JPEG (de)compression, show message
+		// Finish decompression/compression
+		if (!m_decoder->finish()) {
+			throw CONVERSION_ERROR_DECOMPRESS;
+		}
+		lapStage(result,CONVERSION_STAGE_DECODE,mark);
+		if (!m_encoder->finish()) {
+			throw CONVERSION_ERROR_COMPRESS;
+		}
+		result.inputBytes = m_decoder->getBytesRead();
+		result.outputBytes = m_encoder->getBytesWritten();
+		for (size_t i=0; i<renditions; i++) {
+			Rendition& rendition = *m_renditions[i];
+			if (!rendition.encoder->finish()) {
+				throw CONVERSION_ERROR_COMPRESS;
+			}
+			rendition.transform.reset();
+			result.outputBytes += rendition.encoder->getBytesWritten();
+		}
+		lapStage(result,CONVERSION_STAGE_ENCODE,mark);
+
+	} catch(CONVERSION_ERRORS e) {
+		// Error during conversion, store error code and message
+		result.errorCode = e;
 		switch (e) {
-			case 1:
-				std::cerr << "Error decompressing source JPEG image." << std::endl;
+			case CONVERSION_ERROR_DECOMPRESS:
+				result.errorMessage = "Error decompressing source JPEG image.";
 				break;
-			case 2:
-				std::cerr << "Error compressing converted JPEG image." << std::endl;
+			case CONVERSION_ERROR_COMPRESS:
+				result.errorMessage = "Error compressing converted JPEG image.";
+				break;
+			case CONVERSION_ERROR_COLOR_SPACE:
+				result.errorMessage = "Unsupported color space";
+				break;
+			case CONVERSION_ERROR_INPUT_CHANNELS:
+				result.errorMessage = "Unsupported number of channels in input profile";
+				break;
+			case CONVERSION_ERROR_OUTPUT_CHANNELS:
+				result.errorMessage = "Unsupported number of channels in output profile";
+				break;
+			case CONVERSION_ERROR_TRANSFORM:
+				result.errorMessage = "Failed to create color transform";
 				break;
 			default:
-				std::cerr << "Unknown exception during conversion." << std::endl;
+				result.errorMessage = "Unknown exception during conversion.";
 				break;
 		}
 
 		// Clean up
-		jpeg_abort_decompress(&m_dinfo);
-		jpeg_abort_compress(&m_cinfo);
-		if (f != NULL) fclose(f);
-		if (fOut != NULL) {
-			fclose(fOut);
-			remove(outputFileTemp.c_str());
+		m_decoder->abort();
+		m_encoder->abort();
+		for (size_t i=0; i<m_renditions.size(); i++) {
+			m_renditions[i]->encoder->abort();
+			m_renditions[i]->transform.reset();
 		}
-		if (hTransform != NULL) cmsDeleteTransform(hTransform);
-		if (buffer_in[0] != NULL) delete buffer_in[0];
-		if (buffer_out[0] != NULL) delete buffer_out[0];
 
 		// Finish with error
+		finishMemory(result);
 		return false;
 	}	
 
-	std::cout << "Done." << std::endl;
+	result.processSeconds = secondsSince(start) - result.setupSeconds;
+	finishMemory(result);
 
 	return true;
 }
 
 
 /**
- * Embeds an ICC profile in a JPEG file.
+ * Chooses the scaling of the image whose header has just been read, and
+ * gets the size of the converted image.
  *
- * Designed to work on a jpeglib JPEG compression process, requires as parameter
- * the jpeg_compress_struct object used by jpeglib for managing compression data.
- * Has to be called after jpeg_start_compress and before any jpeg_write_scanlines.
+ * With a maximum size, the scaling factor is chosen among 1/1, 1/2, 1/4 and
+ * 1/8: the smallest one fitting the image in the maximum size, or when
+ * resampling, the largest one keeping the image at least that big.
  *
- * @param[in] profile The ICC profile to embed
- * @param[in] p_cinfo Pointer to the jpeg_compress_struct used by jpeglib for JPEG compression
+ * @param[out] width Width of the converted image
+ * @param[out] height Height of the converted image
+ * @return Scaling denominator for decompression
  */
-void IccConverter::embedIccProfile(const IccProfile& profile, jpeg_compress_struct* p_cinfo) {
-	// Save profile to memory 
-	cmsUInt32Number outIccLength = 0;
-	cmsSaveProfileToMem(profile.getHandle(),NULL,&outIccLength);
-	char* outIccBuffer = new char[outIccLength];
-	cmsSaveProfileToMem(profile.getHandle(),(void*)outIccBuffer,&outIccLength);
+int IccConverter::setupScaling(unsigned int& width, unsigned int& height) {
+	int chosen = m_scaleDenominator;
+	if (m_maxSize > 0) {
+		chosen = 1;
+		for (int denominator=1; denominator<=8; denominator*=2) {
+			if (!m_decoder->getScaledSize(denominator,width,height)) {
+				throw CONVERSION_ERROR_DECOMPRESS;
+			}
+			unsigned int longest = std::max(width,height);
+			if (m_resample) {
+				if (longest < m_maxSize) {
+					break;
+				}
+				chosen = denominator;
+			} else {
+				chosen = denominator;
+				if (longest <= m_maxSize) {
+					break;
+				}
+			}
+		}
+	}
+	if (!m_decoder->getScaledSize(chosen,width,height)) {
+		throw CONVERSION_ERROR_DECOMPRESS;
+	}
 
-	// Generate profile data and embed into JPEG marker
-	char markerBuffer[65533];
-	markerBuffer[0] = (unsigned char) 'I';
-	markerBuffer[1] = (unsigned char) 'C';
-	markerBuffer[2] = (unsigned char) 'C';
-	markerBuffer[3] = (unsigned char) '_';
-	markerBuffer[4] = (unsigned char) 'P';
-	markerBuffer[5] = (unsigned char) 'R';
-	markerBuffer[6] = (unsigned char) 'O';
-	markerBuffer[7] = (unsigned char) 'F';
-	markerBuffer[8] = (unsigned char) 'I';
-	markerBuffer[9] = (unsigned char) 'L';
-	markerBuffer[10] = (unsigned char) 'E';
-	markerBuffer[11] = (unsigned char) 0;
-	int iccChunks = (outIccLength / 65517) + 1;
-	unsigned long savedBytes = 0;
-	for (int i=1; i<=iccChunks; i++) {
-		markerBuffer[12] = (unsigned char) i;
-		markerBuffer[13] = (unsigned char) iccChunks;
-		unsigned long bytesToSave = std::min((unsigned long)(outIccLength - savedBytes),(unsigned long)65517);
-		memcpy(&markerBuffer[14],&outIccBuffer[savedBytes],bytesToSave);
-		jpeg_write_marker(p_cinfo,JPEG_APP0+2,(unsigned char*)markerBuffer,bytesToSave+14);
-		savedBytes += bytesToSave;
+	// Final resampling to the exact maximum size
+	if (!m_resample || (m_maxSize == 0) || (std::max(width,height) <= m_maxSize)) {
+		return chosen;
+	}
+	if (width >= height) {
+		height = std::max(1U,(unsigned int) ((double) height*m_maxSize/width + 0.5));
+		width = m_maxSize;
+	} else {
+		width = std::max(1U,(unsigned int) ((double) width*m_maxSize/height + 0.5));
+		height = m_maxSize;
 	}
 
-	// Free resources
-	delete[] outIccBuffer;
+	return chosen;
 }
 
+
+/**
+ * Opens the temp output files of all renditions of a file
+ *
+ * @param[in] file Name of the file being converted
+ * @param[out] result Conversion result, receiving the error if a file can't be created
+ * @return true if all files were created, false otherwise (none is left open)
+ */
+bool IccConverter::openRenditions(const std::string& file, ConversionResult& result) {
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		Rendition& rendition = *m_renditions[i];
+		rendition.tempFile = rendition.spec.outputFolder + g_slash + file + ".tmp";
+		if ((rendition.file = fopen(rendition.tempFile.c_str(),"wb")) == NULL) {
+			result.errorCode = CONVERSION_ERROR_OPEN_OUTPUT;
+			result.errorMessage = "Failed to write " + rendition.spec.outputFolder + g_slash + file;
+			closeRenditions(file,false,result);
+			return false;
+		}
+		rendition.encoder->setFileDestination(rendition.file);
+	}
+
+	return true;
+}
+
+
+/**
+ * Closes the temp output files of all renditions of a file, and either
+ * moves them to their final names or deletes them
+ *
+ * @param[in] file Name of the file being converted
+ * @param[in] publish true for moving files to their final names, false for deleting them
+ * @param[out] result Conversion result, receiving the error if a file can't be moved
+ * @return true if all files were published or deleted, false otherwise
+ */
+bool IccConverter::closeRenditions(const std::string& file, bool publish, ConversionResult& result) {
+	bool success = true;
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		Rendition& rendition = *m_renditions[i];
+		if (rendition.file == NULL) {
+			continue;
+		}
+		if (publish && success && m_syncOutput && !syncFile(rendition.file)) {
+			result.errorCode = CONVERSION_ERROR_SYNC;
+			result.errorMessage = "Failed to flush " + rendition.tempFile + " to storage";
+			success = false;
+		}
+		fclose(rendition.file);
+		rendition.file = NULL;
+		if (!publish || !success) {
+			remove(rendition.tempFile.c_str());
+			continue;
+		}
+		std::string outputFile = rendition.spec.outputFolder + g_slash + file;
+		remove(outputFile.c_str());
+		if (rename(rendition.tempFile.c_str(),outputFile.c_str()) != 0) {
+			result.errorCode = CONVERSION_ERROR_RENAME;
+			result.errorMessage = "Can't rename " + rendition.tempFile + " to " + outputFile;
+			remove(rendition.tempFile.c_str());
+			success = false;
+		} else if (m_syncOutput && !syncFolder(getParentFolder(outputFile))) {
+			result.errorCode = CONVERSION_ERROR_SYNC;
+			result.errorMessage = "Failed to flush the folder of " + outputFile + " to storage";
+			success = false;
+		}
+	}
+
+	return success;
+}
+
+
+/**
+ * Gets the JPEG color space and LittleCMS pixel format of output images
+ *
+ * @param[in] channels Number of channels of the output profile
+ * @param[out] colorSpace JPEG color space for compression
+ * @param[out] format LittleCMS pixel format
+ * @return true if the number of channels is supported, false otherwise
+ */
+bool IccConverter::getOutputFormat(int channels, J_COLOR_SPACE& colorSpace, cmsUInt32Number& format) {
+	switch (channels) {
+		case 1:
+			colorSpace = JCS_GRAYSCALE;
+			format = TYPE_GRAY_8;
+			break;
+		case 3:
+			colorSpace = JCS_RGB;
+			format = TYPE_RGB_8;
+			break;
+		case 4:
+			colorSpace = JCS_CMYK;
+			format = TYPE_CMYK_8_REV;
+			break;
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Gets the EXIF color space of images with an output profile: sRGB for
+ * RGB profiles whose name starts with "sRGB" (such as the built-in one),
+ * uncalibrated for any other profile
+ *
+ * @param[in] profile The output profile
+ * @return EXIF ColorSpace tag value (see @ref EXIF_COLOR_SPACES)
+ */
+unsigned int IccConverter::getExifColorSpace(const IccProfile& profile) {
+	if ((profile.getNumChannels() == 3) && (profile.getName().compare(0,4,"sRGB") == 0)) {
+		return EXIF_COLOR_SPACE_SRGB;
+	}
+
+	return EXIF_COLOR_SPACE_UNCALIBRATED;
+}
+
+
+/**
+ * Gets the time elapsed since a given moment
+ *
+ * @param[in] start The starting moment
+ * @return Elapsed time in seconds
+ */
+double IccConverter::secondsSince(const std::chrono::steady_clock::time_point& start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/**
+ * Adds the time elapsed since the last mark to a conversion stage, and
+ * moves the mark to the current moment.
+ *
+ * @param[in] result Conversion result receiving the stage time
+ * @param[in] stage The stage (see @ref CONVERSION_STAGES)
+ * @param[in] mark End of the previous stage, updated to the current moment
+ */
+void IccConverter::lapStage(ConversionResult& result, int stage, std::chrono::steady_clock::time_point& mark) {
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	result.stageSeconds[stage] += std::chrono::duration<double>(now - mark).count();
+	mark = now;
+}
+
+/**
+ * Updates the peak memory of each subsystem, and of the stages in a range
+ * that have run, with the memory in use now. Called at stage boundaries
+ * only, never per scanline, as it locks the LittleCMS context.
+ *
+ * @param[in,out] result The conversion result
+ * @param[in] first First stage just finished (see @ref CONVERSION_STAGES)
+ * @param[in] last Last stage just finished
+ */
+void IccConverter::sampleMemory(ConversionResult& result, int first, int last) {
+	unsigned long long memory[MEMORY_SUBSYSTEM_COUNT] = {0};
+	memory[MEMORY_CODEC] = m_decoder->getMemoryUsed() + m_encoder->getMemoryUsed();
+	memory[MEMORY_PIXELS] = m_lineBuffer.capacity() + m_resampler.getMemoryUsed();
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		memory[MEMORY_CODEC] += m_renditions[i]->encoder->getMemoryUsed();
+		memory[MEMORY_PIXELS] += m_renditions[i]->buffer.capacity() + m_renditions[i]->resampler.getMemoryUsed();
+	}
+	LcmsMemoryStats lcms;
+	m_lcms.getStats(lcms);
+	memory[MEMORY_LCMS] = lcms.bytesInUse;
+	memory[MEMORY_IO] = m_sourceMemory;
+	for (size_t i=0; i<m_outputMemory.size(); i++) {
+		memory[MEMORY_IO] += m_outputMemory[i]->capacity();
+	}
+
+	unsigned long long total = 0;
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		result.memoryPeak[i] = std::max(result.memoryPeak[i],memory[i]);
+		total += memory[i];
+	}
+	for (int stage=first; stage<=last; stage++) {
+		if (result.stageSeconds[stage] > 0) {
+			result.stageMemory[stage] = std::max(result.stageMemory[stage],total);
+		}
+	}
+}
+
+/**
+ * Completes the memory accounting of a conversion: last sample of the
+ * decoder and encoders, LittleCMS peak of the image profiles, size of the
+ * shared cache and peak resident memory
+ *
+ * @param[in,out] result The conversion result
+ */
+void IccConverter::finishMemory(ConversionResult& result) {
+	sampleMemory(result,CONVERSION_STAGE_DECODE,CONVERSION_STAGE_ENCODE);
+	LcmsMemoryStats lcms;
+	m_lcms.getStats(lcms);
+	result.memoryPeak[MEMORY_LCMS] = std::max(result.memoryPeak[MEMORY_LCMS],lcms.peakBytes);
+	m_cache->getLcmsStats(lcms);
+	result.memoryPeak[MEMORY_CACHE] = lcms.bytesInUse;
+	result.peakRss = getPeakRss();
+}
+
+
 /**
  * Removes last slash character from a string, only if the string
  * actually ends in a slash. If the original string does not have
@@ -560,17 +1321,8 @@ void IccConverter::embedIccProfile(const IccProfile& profile, jpeg_compress_stru
  */
 std::string IccConverter::removeTrailingSlash(const std::string str) {
 	std::string newStr(str);
-	if (str.compare(str.length()-1,1,g_slash) == 0) {
+	if (!str.empty() && (str.compare(str.length()-1,1,g_slash) == 0)) {
 		newStr = newStr.substr(0,str.length()-1);
 	}
 	return newStr;
 }
-
-/**
- * Custom handling of errors in the libjpeg library
- */
-METHODDEF(void) my_error_exit(j_common_ptr cinfo) {
-  /* Return control to the setjmp point */
-  my_error_mgr* myerr = (my_error_mgr*) cinfo->err;
-  longjmp(myerr->setjmp_buffer, 1);
-}
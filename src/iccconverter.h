@@ -1,22 +1,117 @@
 #ifndef ICCCONVERTER_H
 #define ICCCONVERTER_H
 
-#include <setjmp.h>
-#include <jpeglib.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
 #include "iccprofile.h"
+#include "icccache.h"
+#include "jpegcodec.h"
+#include "jpegmetadata.h"
+#include "resampler.h"
 
 /**
- * Custor error manager struct for handling
- * libjpeg errors
+ * Error codes reported in conversion results
  */
-struct my_error_mgr {
-  struct jpeg_error_mgr jerr;	/**< Standard libjpeg error manager */
-  jmp_buf setjmp_buffer;		/**< Additional field for controlling return point on error */
+enum CONVERSION_ERRORS {
+	CONVERSION_OK = 0,					/**< Conversion successful */
+	CONVERSION_ERROR_OPEN_INPUT,		/**< Source file can't be opened */
+	CONVERSION_ERROR_OPEN_OUTPUT,		/**< Destination file can't be created */
+	CONVERSION_ERROR_DECOMPRESS,		/**< Error decompressing source JPEG image */
+	CONVERSION_ERROR_COMPRESS,			/**< Error compressing converted JPEG image */
+	CONVERSION_ERROR_COLOR_SPACE,		/**< Unsupported color space in source image */
+	CONVERSION_ERROR_INPUT_CHANNELS,	/**< Unsupported number of channels in input profile */
+	CONVERSION_ERROR_OUTPUT_CHANNELS,	/**< Unsupported number of channels in output profile */
+	CONVERSION_ERROR_TRANSFORM,			/**< Color transform can't be created */
+	CONVERSION_ERROR_RENAME,			/**< Converted file can't be moved to its final name */
+	CONVERSION_ERROR_SYNC				/**< Converted file can't be flushed to storage */
 };
-METHODDEF(void) my_error_exit(j_common_ptr cinfo);
 
 /**
- * IccConverter objects manage ICC color transforms on JPEG files
+ * Stages of an image conversion, timed separately in conversion results
+ */
+enum CONVERSION_STAGES {
+	CONVERSION_STAGE_OPEN = 0,			/**< Opening source and destination files */
+	CONVERSION_STAGE_HEADER,			/**< Reading JPEG header and looking for embedded profile */
+	CONVERSION_STAGE_PROFILE,			/**< Getting input and output profiles */
+	CONVERSION_STAGE_TRANSFORM,			/**< Getting color transform */
+	CONVERSION_STAGE_DECODE,			/**< Decompressing source image */
+	CONVERSION_STAGE_RESAMPLE,			/**< Reducing decompressed image to its final size */
+	CONVERSION_STAGE_COLOR,				/**< Applying color transform */
+	CONVERSION_STAGE_ENCODE,			/**< Compressing converted image */
+	CONVERSION_STAGE_PUBLISH,			/**< Closing files and moving result to its final name */
+	CONVERSION_STAGE_COUNT				/**< Number of stages */
+};
+
+/**
+ * Subsystems whose memory is accounted separately in conversion results
+ */
+enum MEMORY_SUBSYSTEMS {
+	MEMORY_CODEC = 0,			/**< libjpeg image pools (or TurboJPEG images), decoded line and captured header */
+	MEMORY_LCMS,				/**< LittleCMS allocations for the profiles of the image */
+	MEMORY_PIXELS,				/**< Color transformed lines and resampler buffers */
+	MEMORY_CACHE,				/**< Profiles and transforms of the shared cache */
+	MEMORY_IO,					/**< Source and converted JPEG data held in memory */
+	MEMORY_SUBSYSTEM_COUNT		/**< Number of subsystems */
+};
+
+/**
+ * Details and outcome of a single image conversion
+ */
+struct ConversionResult {
+	int errorCode;					/**< Error code (see @ref CONVERSION_ERRORS) */
+	std::string errorMessage;		/**< Description of the error, empty on success */
+	std::string profileSource;		/**< How the input profile was found (Embedded, EXIF, File, Library,...) */
+	std::string profileName;		/**< Name of the input profile */
+	unsigned int width;				/**< Converted image width in pixels */
+	unsigned int height;			/**< Converted image height in pixels */
+	unsigned int sourceWidth;		/**< Source image width in pixels */
+	unsigned int sourceHeight;		/**< Source image height in pixels */
+	unsigned int inputComponents;	/**< Color components of the source image */
+	unsigned int outputComponents;	/**< Color components of the converted image */
+	unsigned long inputBytes;		/**< Size of the source JPEG data */
+	unsigned long outputBytes;		/**< Size of the converted JPEG data */
+	double setupSeconds;			/**< Time spent reading headers and preparing the transform */
+	double processSeconds;			/**< Time spent decompressing, transforming and compressing */
+	double totalSeconds;			/**< Total conversion time */
+	double stageSeconds[CONVERSION_STAGE_COUNT];	/**< Time spent in each stage (see @ref CONVERSION_STAGES) */
+	unsigned long long memoryPeak[MEMORY_SUBSYSTEM_COUNT];	/**< Peak bytes of each subsystem (see @ref MEMORY_SUBSYSTEMS), the cache after the conversion */
+	unsigned long long stageMemory[CONVERSION_STAGE_COUNT];	/**< Peak bytes of the image's subsystems (all but the cache) in each stage */
+	unsigned long long peakRss;		/**< Peak resident memory of the process after the conversion, in bytes (0 if unknown) */
+
+	ConversionResult();
+	void clear();
+};
+
+/**
+ * Settings of an additional output (rendition) of file conversions. Every
+ * rendition is color transformed and compressed from the same decompressed
+ * image as the main output, and saved with the same file name in its folder.
+ */
+struct RenditionSpec {
+	std::string outputFolder;		/**< Folder where the rendition is saved */
+	std::string outputProfile;		/**< Path to output ICC profile, empty for sRGB */
+	int intent;						/**< Rendering intent for color transform (0-3) */
+	int jpegQuality;				/**< Quality parameter used for JPEG compression (0-100) */
+	int scale;						/**< Scaling denominator: 1, 2, 4 or 8 for full, 1/2, 1/4 or 1/8 size */
+
+	RenditionSpec();
+};
+
+/**
+ * Function called with the progress of a conversion: scanlines already
+ * processed, total scanlines and user data pointer
+ */
+typedef void (*ProgressCallback)(unsigned int, unsigned int, void*);
+
+/**
+ * IccConverter objects manage ICC color transforms on JPEG files.
+ *
+ * Converters never write to the console. Each converter must be used by
+ * only one thread at a time, but several converters can run concurrently,
+ * optionally sharing an @ref IccCache.
  */
 class IccConverter {
 
@@ -33,16 +128,32 @@ class IccConverter {
 		bool setJpegQuality(int);
 		void setBlackPointCompensation(bool);
 		void setOptimization(bool);
-		bool convert(const std::string&);
-		void setVerboseOutput(bool);
+		bool setScale(int);
+		void setMaxSize(unsigned int);
+		void setResample(bool);
+		void setCodecSettings(const CodecSettings&);
+		bool setBackend(int);
+		void setPreserveMetadata(bool);
+		void setSyncOutput(bool);
+		bool addRendition(const RenditionSpec&);
+		void clearRenditions();
+		bool convert(const std::string&,ConversionResult&);
+		bool convertBuffer(const char*, unsigned long, std::string&, ConversionResult&);
+		bool convertBuffer(const char*, unsigned long, std::vector<std::string>&, ConversionResult&);
+		bool convertStream(FILE*, FILE*, ConversionResult&);
+		unsigned long long estimateMemory(const JpegImageInfo&, bool, unsigned long long, bool);
+		void setProgressCallback(ProgressCallback,void*);
+		void setCache(IccCache*);
+		void getLcmsStats(LcmsMemoryStats&);
 
 	private:
+		struct Rendition;
+
 		std::string m_inputFolder;				/**< Path to input folder of source images */
 		std::string m_outputFolder;				/**< Path to output folder for processed images */
-		IccProfile m_outputProfile;				/**< Output ICC profile for color transform */
-		IccProfile m_defaultRGBProfile;			/**< Default input RGB ICC profile */
-		IccProfile m_defaultCMYKProfile;		/**< Default input CMYK ICC profile */
-		IccProfile m_defaultGrayProfile;		/**< Default input Grayscale ICC profile */
+		LcmsContext m_lcms;						/**< LittleCMS context of the profiles embedded in images */
+		IccCache m_ownCache;					/**< Profile and transform cache used when no shared cache is set */
+		IccCache* m_cache;						/**< Profile and transform cache in use */
 		std::string m_outputProfileName;		/**< Name of output ICC profile */
 		std::string m_defaultRGBProfileName;	/**< Name of default input RGB ICC profile */
 		std::string m_defaultCMYKProfileName;	/**< Name of default input CMYK ICC profile */
@@ -51,18 +162,39 @@ class IccConverter {
 		int m_jpegQuality;						/**< Quality parameter used for output JPEG compression */
 		bool m_blackPointCompensation;			/**< Wether to apply Black Point Compensation or not */
 		bool m_enableOptimization;			/**< Wether optimitzation is enabled for color transform calculations */
-		bool m_verbose;							/**< Verbose output enabled */
-		jpeg_decompress_struct m_dinfo;			/**< Info struct for JPEG decompression */
-		my_error_mgr m_derr;					/**< Data for JPEG decompression error management */
-		jpeg_compress_struct m_cinfo;			/**< Info struct for JPEG compression */
-		my_error_mgr m_cerr;					/**< Data for JPEG compression error management */
-
-		bool loadOutputProfile();
-		bool loadDefaultRGBProfile();
-		bool loadDefaultCMYKProfile();
-		bool loadDefaultGrayProfile();
-		void embedIccProfile(const IccProfile&,jpeg_compress_struct*);
+		int m_scaleDenominator;					/**< Fixed downscaling factor applied while decompressing (1/n) */
+		unsigned int m_maxSize;					/**< Maximum width and height of converted images, 0 for no limit */
+		bool m_resample;						/**< Wether to resample images to exactly fit m_maxSize */
+		Resampler m_resampler;					/**< Area averaging filter for final resampling */
+		std::vector<JSAMPLE> m_lineBuffer;		/**< Transformed line of the main output, kept between images */
+		unsigned long long m_sourceMemory;		/**< Size of the source held in memory, 0 for file sources */
+		std::vector<const std::string*> m_outputMemory;	/**< Strings receiving converted data, empty for file destinations */
+		CodecSettings m_codec;					/**< JPEG codec speed and size parameters */
+		int m_backend;							/**< JPEG codec implementation (see @ref JPEG_BACKENDS) */
+		std::unique_ptr<JpegDecoder> m_decoder;	/**< JPEG decompressor */
+		std::unique_ptr<JpegEncoder> m_encoder;	/**< JPEG compressor of the main output */
+		bool m_preserveMetadata;				/**< Wether to copy EXIF, XMP, IPTC and other metadata markers */
+		JpegMetadata m_metadata;				/**< Metadata markers of the current image */
+		bool m_syncOutput;						/**< Wether to flush converted files to storage before moving them to their final names */
+		unsigned long long m_profileMemory;		/**< Size of all output profiles, 0 until measured */
+		std::vector<std::unique_ptr<Rendition> > m_renditions;	/**< Additional outputs of file conversions */
+		ProgressCallback m_progressCallback;	/**< Function receiving conversion progress, NULL for none */
+		void* m_progressData;					/**< User data for progress function */
+
+		bool transformImage(ConversionResult&, bool);
+		int setupScaling(unsigned int&, unsigned int&);
+		bool openRenditions(const std::string&, ConversionResult&);
+		bool closeRenditions(const std::string&, bool, ConversionResult&);
+		static bool getOutputFormat(int, J_COLOR_SPACE&, cmsUInt32Number&);
+		static unsigned int getExifColorSpace(const IccProfile&);
+		double secondsSince(const std::chrono::steady_clock::time_point&);
+		void lapStage(ConversionResult&, int, std::chrono::steady_clock::time_point&);
+		void sampleMemory(ConversionResult&, int, int);
+		void finishMemory(ConversionResult&);
 		std::string removeTrailingSlash(const std::string);
+
+		IccConverter(const IccConverter&);
+		IccConverter& operator=(const IccConverter&);
 };
 
 #endif
@@ -1,12 +1,28 @@
 #include "globals.h"
 #include "iccflowapp.h"
 #include "iccconverter.h"
+#include "iccserver.h"
+#include "iccprofile.h"
+#include "lcmscontext.h"
 #include <iostream>
+#include <iomanip>
 #include <fstream>
+#include <iterator>
+#include <vector>
+#include <set>
+#include <thread>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <lcms2.h>
+#if defined _WIN32 || defined _WIN64
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 
 /**
  * Main constructor. Gets the command line arguments for running
@@ -22,7 +38,24 @@ IccFlowApp::IccFlowApp(int argc, char** argv)
  m_jpegQuality(85),
  m_blackPointCompensation(true),
  m_enableOptimization(true),
- m_verbose(false)
+ m_preserveMetadata(true),
+ m_scale(1),
+ m_maxSize(0),
+ m_resample(false),
+ m_verbose(false),
+ m_threads(1),
+ m_ioEngine(IO_ENGINE_SYNC),
+ m_prefetch(2),
+ m_maxMemory(0),
+ m_progressFd(-1),
+ m_progressInterval(1),
+ m_scan(false),
+ m_shardIndex(0),
+ m_shardCount(1),
+ m_leaseSeconds(60),
+ m_deduplicate(false),
+ m_durability(DURABILITY_NONE),
+ m_syncBatch(64)
 {
 	if (m_argc < 0) {
 		m_argc = 0;
@@ -33,6 +66,9 @@ IccFlowApp::IccFlowApp(int argc, char** argv)
 	m_defaultRGBProfile.clear();
 	m_defaultCMYKProfile.clear();
 	m_defaultGrayProfile.clear();
+	m_serverSocket.clear();
+	m_serverProfiles.clear();
+	m_statsFile.clear();
 }
 
 
@@ -47,8 +83,1362 @@ int IccFlowApp::run() {
 		return 1;
 	}
 
-	// Prepare the ICC profile converter
+	// Serve conversion requests instead of processing a folder
+	if (!m_serverSocket.empty()) {
+		IccServer server(m_serverSocket,m_threads,m_serverProfiles,[this](IccConverter& converter) { configureConverter(converter); });
+		return server.run();
+	}
+
+	// Convert a single image from standard input to standard output
+	if (isStreamMode()) {
+		return runStream();
+	}
+
+	// Only take an inventory of the input folder
+	if (m_scan) {
+		return runScan();
+	}
+
+	// Create output folders if needed
+	if (m_archiveFile.empty() && !createDirectory(m_outputFolder)) {
+		std::cerr << "Failed to create output folder: " << m_outputFolder << std::endl;
+		return 4;
+	}
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		if (!createDirectory(m_renditions[i].outputFolder)) {
+			std::cerr << "Failed to create output folder: " << m_renditions[i].outputFolder << std::endl;
+			return 4;
+		}
+	}
+
+	// Open input folder
+	m_stats.start();
+	m_stats.setKeepFiles(!m_statsFile.empty());
+	std::chrono::steady_clock::time_point listStart = std::chrono::steady_clock::now();
+	std::vector<std::string> files;
+	std::vector<unsigned long long> sizes;
+	unsigned long long totalBytes = 0;
+	unsigned long folderFiles = 0;
+	if (!listInputFolder(files,sizes,totalBytes,folderFiles)) {
+		return 2;
+	}
+	m_stats.setShard(m_shardIndex,m_shardCount,folderFiles);
+	if (m_tar && m_archiveFile.empty() && !createSubfolders(files)) {
+		m_tar.reset();
+		return 4;
+	}
+
+	// Join the processes sharing the spool folder
+	if (!m_spoolFolder.empty()) {
+		m_spool.reset(new SpoolQueue());
+		if (!m_spool->open(m_spoolFolder,m_leaseSeconds,files)) {
+			std::cerr << "Failed to open spool folder: " << m_spoolFolder << std::endl;
+			m_spool.reset();
+			return 7;
+		}
+	}
+
+	// Schedule largest files first, so that big images don't finish last. JPEG
+	// files cost their pixel samples, as decoding, color transform and encoding
+	// are proportional to them, and their memory is estimated for the budget.
+	// Headers are read by all worker threads, as the folder may be slow to read.
+	IccCache cache;
+	std::vector<unsigned long long> costs(sizes);
+	std::vector<unsigned long long> memory(files.size(),0);
+	if ((m_threads > 1) || (m_maxMemory > 0)) {
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> scanners;
+		for (int i=1; i<m_threads; i++) {
+			scanners.push_back(std::thread(&IccFlowApp::estimateWorker,this,&next,std::cref(files),std::cref(sizes),std::ref(costs),std::ref(memory),&cache));
+		}
+		estimateWorker(&next,files,sizes,costs,memory,&cache);
+		for (size_t i=0; i<scanners.size(); i++) {
+			scanners[i].join();
+		}
+	}
+	m_workQueue.setup(costs,m_threads);
+	m_budget.setLimit(m_maxMemory);
+	m_stats.addRunStage(RUN_STAGE_LIST,secondsSince(listStart));
+	if (m_ioEngine != IO_ENGINE_SYNC) {
+		startIoEngine(files.size());
+	}
+	if (m_deduplicate) {
+		m_dedup.reset(new DedupIndex());
+	}
+	if (!m_archiveFile.empty()) {
+		m_archive.reset(new ArchiveWriter());
+		if (!m_archive->open(m_archiveFile,m_durability != DURABILITY_NONE)) {
+			std::cerr << "Failed to create archive: " << m_archiveFile << std::endl;
+			m_archive.reset();
+			m_io.reset();
+			return 4;
+		}
+	}
+	if (m_io) {
+		if ((m_durability == DURABILITY_BATCH) && !m_archive) {
+			std::vector<std::string> folders(1,m_outputFolder);
+			for (size_t i=0; i<m_renditions.size(); i++) {
+				folders.push_back(m_renditions[i].outputFolder);
+			}
+			m_publisher.reset(new PublishBatch(folders,m_syncBatch));
+		}
+		m_io->setDurability(m_durability,m_publisher.get());
+	}
+
+	// Process files with worker threads sharing profiles and transforms
+	m_success = true;
+	m_progress.setOutput(m_progressFd,m_progressInterval);
+	m_progress.start(files.size(),totalBytes);
+	std::vector<std::thread> threads;
+	for (int i=1; i<m_threads; i++) {
+		threads.push_back(std::thread(&IccFlowApp::batchWorker,this,i,std::cref(files),std::cref(sizes),std::cref(memory),&cache));
+	}
+	batchWorker(0,files,sizes,memory,&cache);
+	for (size_t i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+	if (m_io) {
+		m_io->wait();
+		if (m_publisher) {
+			m_publisher->flush();
+		}
+		m_stats.addMemory(MEMORY_IO,m_io->getPeakBytes());
+		m_io.reset();
+	}
+	unsigned long members = 0;
+	if (m_archive) {
+		std::string error;
+		if (!m_archive->close(error)) {
+			std::cerr << error << std::endl;
+			m_success = false;
+		}
+		members = m_archive->getMembers();
+		m_stats.addMemory(MEMORY_IO,m_archive->getPeakBytes());
+		m_archive.reset();
+	}
+	m_dedup.reset();
+	m_tar.reset();
+	m_progress.stop();
+
+	// Show run summary and write report
+	m_stats.finish(cache);
+	m_stats.writeSummary(std::cout,m_verbose);
+	if (m_maxMemory > 0) {
+		std::cout << "Memory budget " << std::fixed << std::setprecision(2) << m_maxMemory/1048576.0 << " MB: peak estimate "
+			<< m_budget.getPeak()/1048576.0 << " MB, " << m_budget.getWaits() << " files waited for memory" << std::endl;
+	}
+	if (m_spool) {
+		std::cout << "Spool: " << m_spool->getClaimed() << " files claimed (" << m_spool->getTakenOver() << " taken over from expired leases), "
+			<< m_spool->getAlreadyDone() << " already done" << std::endl;
+		m_spool->close();
+		m_spool.reset();
+	}
+	if (!m_archiveFile.empty()) {
+		std::cout << "Archive: " << members << " members written to " << m_archiveFile << std::endl;
+	}
+	if (m_publisher) {
+		std::cout << "Durability: " << m_publisher->getPublished() << " files published after " << m_publisher->getBarriers()
+			<< " flushes of the output filesystems (" << std::fixed << std::setprecision(3) << m_publisher->getBarrierSeconds()
+			<< " s waiting for storage)" << std::endl;
+		m_publisher.reset();
+	}
+	if (!writeReport()) {
+		return 6;
+	}
+
+	// Return exit code
+	return (m_success ? 0 : 3);
+}
+
+
+/**
+ * Lists the files of the input folder that belong to the shard of this
+ * run. Files are assigned to shards by a hash of their name, so every
+ * file lands in the same shard in every run and on every host, whatever
+ * other files are added or removed. If the input folder is a tar archive,
+ * its files are listed instead.
+ *
+ * @param[out] files Names of the files of the shard, without subfolders
+ * @param[out] sizes Size of every file
+ * @param[out] totalBytes Size of all files of the shard
+ * @param[out] folderFiles Files in the whole folder, in all shards
+ * @return true on success, false if the folder can't be opened
+ */
+bool IccFlowApp::listInputFolder(std::vector<std::string>& files, std::vector<unsigned long long>& sizes, unsigned long long& totalBytes, unsigned long& folderFiles) {
+	if (isInputArchive(m_inputFolder)) {
+		return listInputArchive(files,sizes,totalBytes,folderFiles);
+	}
+	DIR* dir = NULL;
+	dir = opendir(m_inputFolder.c_str());
+	if (dir == NULL) {
+		std::cerr << "Failed to open input folder: " << m_inputFolder << std::endl;
+		return false;
+	}
+
+	// Traverse directory and collect files
+	dirent* ent = NULL;
+	struct stat st;
+	files.clear();
+	sizes.clear();
+	totalBytes = 0;
+	folderFiles = 0;
+	while ((ent = readdir(dir))) {
+		stat((m_inputFolder+g_slash+ent->d_name).c_str(),&st);
+		if (!S_ISDIR(st.st_mode)) {
+			folderFiles++;
+			if (hashString(ent->d_name) % m_shardCount != m_shardIndex) {
+				continue;
+			}
+			files.push_back(ent->d_name);
+			sizes.push_back(st.st_size);
+			totalBytes += st.st_size;
+		}
+	}
+	closedir(dir);
+
+	return true;
+}
+
+
+/**
+ * Opens the tar archive given as input folder and lists its files that
+ * belong to the shard of this run. The archive stays open, and files
+ * are converted from its contents in memory.
+ *
+ * @param[out] files Names of the files of the shard, with their subfolders in the archive
+ * @param[out] sizes Size of every file
+ * @param[out] totalBytes Size of all files of the shard
+ * @param[out] folderFiles Files in the whole archive, in all shards
+ * @return true on success, false if the archive can't be read
+ */
+bool IccFlowApp::listInputArchive(std::vector<std::string>& files, std::vector<unsigned long long>& sizes, unsigned long long& totalBytes, unsigned long& folderFiles) {
+	m_tar.reset(new TarReader());
+	std::string error;
+	if (!m_tar->open(m_inputFolder,error)) {
+		std::cerr << "Failed to read input archive: " << error << std::endl;
+		m_tar.reset();
+		return false;
+	}
+	if (m_tar->getSkipped() > 0) {
+		std::cerr << "Skipped " << m_tar->getSkipped() << " files of the input archive with absolute or parent (..) paths" << std::endl;
+	}
+
+	std::vector<std::string> allFiles;
+	std::vector<unsigned long long> allSizes;
+	m_tar->getFiles(allFiles,allSizes);
+	files.clear();
+	sizes.clear();
+	totalBytes = 0;
+	folderFiles = allFiles.size();
+	for (size_t i=0; i<allFiles.size(); i++) {
+		if (hashString(allFiles[i]) % m_shardCount != m_shardIndex) {
+			continue;
+		}
+		files.push_back(allFiles[i]);
+		sizes.push_back(allSizes[i]);
+		totalBytes += allSizes[i];
+	}
+
+	return true;
+}
+
+
+/**
+ * Creates the subfolders of files read from an input archive in the
+ * output folder and rendition folders
+ *
+ * @param[in] files Names of the files, with their subfolders
+ * @return true on success, false if a subfolder can't be created
+ */
+bool IccFlowApp::createSubfolders(const std::vector<std::string>& files) {
+	std::set<std::string> subfolders;
+	for (size_t i=0; i<files.size(); i++) {
+		size_t slash = files[i].find('/');
+		while (slash != std::string::npos) {
+			subfolders.insert(files[i].substr(0,slash));
+			slash = files[i].find('/',slash+1);
+		}
+	}
+
+	// Parents sort before their subfolders
+	for (std::set<std::string>::iterator it=subfolders.begin(); it!=subfolders.end(); ++it) {
+		if (!createDirectory(m_outputFolder+g_slash+*it)) {
+			std::cerr << "Failed to create output folder: " << m_outputFolder+g_slash+*it << std::endl;
+			return false;
+		}
+		for (size_t i=0; i<m_renditions.size(); i++) {
+			if (!createDirectory(m_renditions[i].outputFolder+g_slash+*it)) {
+				std::cerr << "Failed to create output folder: " << m_renditions[i].outputFolder+g_slash+*it << std::endl;
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Checks if the input folder given in the command line is a tar archive,
+ * that is a regular file
+ *
+ * @param[in] path The input folder
+ * @return true if the path is a regular file, false otherwise
+ */
+bool IccFlowApp::isInputArchive(const std::string& path) {
+	struct stat st;
+	return (stat(path.c_str(),&st) == 0) && S_ISREG(st.st_mode);
+}
+
+
+/**
+ * Parses a shard given as index/count, such as 0/4 for the first of four
+ * shards
+ *
+ * @param[in] text The shard
+ * @param[out] index Index of the shard, from 0 to count-1
+ * @param[out] count Number of shards
+ * @return true if the shard is valid, false otherwise
+ */
+bool IccFlowApp::parseShard(const std::string& text, unsigned int& index, unsigned int& count) {
+	char* end = NULL;
+	long parsedIndex = strtol(text.c_str(),&end,10);
+	if ((end == text.c_str()) || (*end != '/')) {
+		return false;
+	}
+	const char* countStart = end+1;
+	long parsedCount = strtol(countStart,&end,10);
+	if ((end == countStart) || (*end != 0) || (parsedCount < 1) || (parsedIndex < 0) || (parsedIndex >= parsedCount)) {
+		return false;
+	}
+	index = (unsigned int) parsedIndex;
+	count = (unsigned int) parsedCount;
+
+	return true;
+}
+
+
+/**
+ * Takes an inventory of the input folder reading only the headers of its
+ * files: markers up to the frame header, without decoding any pixels.
+ * Headers are read by one worker per thread, and the cost of converting
+ * the batch is estimated by converting one image of median size in memory.
+ *
+ * @return 0 on success, 2 if the input folder can't be read, 6 if the report can't be written
+ */
+int IccFlowApp::runScan() {
+	m_inventory.start();
+	m_inventory.setKeepFiles(!m_statsFile.empty());
+	std::vector<std::string> files;
+	std::vector<unsigned long long> sizes;
+	unsigned long long totalBytes = 0;
+	unsigned long folderFiles = 0;
+	if (!listInputFolder(files,sizes,totalBytes,folderFiles)) {
+		return 2;
+	}
+	m_inventory.setShard(m_shardIndex,m_shardCount,folderFiles);
+
+	// Read headers with worker threads sharing the next file index
+	IccCache cache;
+	std::atomic<size_t> next(0);
+	std::vector<unsigned long long> samples(files.size(),0);
+	m_progress.setOutput(m_progressFd,m_progressInterval);
+	m_progress.start(files.size(),totalBytes);
+	std::vector<std::thread> threads;
+	for (int i=1; i<m_threads; i++) {
+		threads.push_back(std::thread(&IccFlowApp::scanWorker,this,std::cref(files),std::cref(sizes),&next,&samples,&cache));
+	}
+	scanWorker(files,sizes,&next,&samples,&cache);
+	for (size_t i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+	m_progress.stop();
+	m_inventory.finish();
+	estimateBatch(files,samples,cache);
+	m_tar.reset();
+
+	// Show inventory and write report
+	m_inventory.writeSummary(std::cout,m_verbose);
+	if (!m_statsFile.empty() && !m_inventory.writeReport(m_statsFile)) {
+		std::cerr << "Failed to write report: " << m_statsFile << std::endl;
+		return 6;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Reads the headers of the files of a scan until all files are taken.
+ * The memory needed to convert every image is estimated with the
+ * conversion settings of the command line.
+ *
+ * @param[in] files Names of the files in the input folder
+ * @param[in] sizes Size of every file
+ * @param[in,out] next Index of the next file to scan, shared by all workers
+ * @param[out] samples Pixel samples of every JPEG file, 0 if its header is not valid
+ * @param[in] cache Profile and transform cache used for estimates
+ */
+void IccFlowApp::scanWorker(const std::vector<std::string>& files, const std::vector<unsigned long long>& sizes, std::atomic<size_t>* next, std::vector<unsigned long long>* samples, IccCache* cache) {
+	IccConverter estimator;
+	configureConverter(estimator);
+	estimator.setCache(cache);
+	LcmsContext lcms;
+	IccProfile profile(lcms.getHandle());
+	std::vector<char> header;
+	bool inMemory = (m_ioEngine != IO_ENGINE_SYNC);
+	size_t index = 0;
+	while ((index = (*next)++) < files.size()) {
+		ScanRecord record;
+		record.file = files[index];
+		record.fileSize = sizes[index];
+		record.jpeg = isJpegFile(files[index]);
+		if (record.jpeg) {
+			JpegImageInfo info;
+			size_t length = 0;
+			record.valid = readJpegHeader(files[index],header,length,info,record.progressive);
+			if (record.valid) {
+				record.width = info.width;
+				record.height = info.height;
+				record.components = info.components;
+				if (profile.loadFromJpegMem(&header[0],length)) {
+					record.profileSource = profile.getSource();
+					record.profileName = profile.getName();
+				}
+				record.exifColorSpace = profile.getExifColorSpace();
+				record.memory = estimator.estimateMemory(info,record.progressive,record.fileSize,inMemory);
+				(*samples)[index] = (unsigned long long) info.width*info.height*info.components;
+			}
+			if (m_verbose) {
+				std::lock_guard<std::mutex> lock(m_outputMutex);
+				std::cout << record.file << ": ";
+				if (!record.valid) {
+					std::cout << "no JPEG frame header found" << std::endl;
+				} else {
+					std::cout << record.width << "x" << record.height << " " << RunStats::getColorSpaceName(record.components)
+						<< (record.progressive ? " progressive" : " baseline") << ", profile "
+						<< (record.profileSource.empty() ? "none" : record.profileSource+": "+record.profileName)
+						<< ", EXIF " << ScanInventory::getExifColorSpaceName(record.exifColorSpace) << std::endl;
+				}
+			}
+		}
+		m_inventory.add(record);
+		m_progress.addFile(record.fileSize,!record.jpeg || record.valid);
+	}
+}
+
+
+/**
+ * Measures the cost of conversions with the settings of the command line,
+ * converting in memory the JPEG file with the median number of samples.
+ * It is converted twice, and the second conversion is measured, as the
+ * profiles and transform it needs are cached by then, as in a batch run.
+ *
+ * @param[in] files Names of the files in the input folder
+ * @param[in] samples Pixel samples of every JPEG file, 0 if its header is not valid
+ * @param[in] cache Profile and transform cache
+ */
+void IccFlowApp::estimateBatch(const std::vector<std::string>& files, const std::vector<unsigned long long>& samples, IccCache& cache) {
+	std::vector<size_t> jpegFiles;
+	for (size_t i=0; i<files.size(); i++) {
+		if (samples[i] > 0) {
+			jpegFiles.push_back(i);
+		}
+	}
+	if (jpegFiles.empty()) {
+		return;
+	}
+	std::nth_element(jpegFiles.begin(),jpegFiles.begin()+jpegFiles.size()/2,jpegFiles.end(),[&samples](size_t a, size_t b) {
+		return samples[a] < samples[b];
+	});
+	size_t median = jpegFiles[jpegFiles.size()/2];
+
+	std::string data;
+	const char* member = NULL;
+	size_t memberSize = 0;
+	if (m_tar && m_tar->find(files[median],member,memberSize)) {
+		data.assign(member,memberSize);
+	} else {
+		std::ifstream in((m_inputFolder+g_slash+files[median]).c_str(),std::ios::in | std::ios::binary);
+		data.assign((std::istreambuf_iterator<char>(in)),std::istreambuf_iterator<char>());
+	}
+	IccConverter converter;
+	configureConverter(converter);
+	converter.setCache(&cache);
+	std::vector<std::string> outputs;
+	ConversionResult result;
+	for (int i=0; i<2; i++) {
+		if (!converter.convertBuffer(data.data(),data.size(),outputs,result)) {
+			return;
+		}
+	}
+	m_inventory.setEstimate(files[median],result.totalSeconds/samples[median],m_threads);
+}
+
+
+/**
+ * Converts a single JPEG image read from standard input, writing the
+ * result to standard output as it is compressed. Messages go to standard
+ * error, so that they don't mix with image data.
+ *
+ * @return 0 on success, 3 if conversion failed
+ */
+int IccFlowApp::runStream() {
+	#if defined _WIN32 || defined _WIN64
+	_setmode(_fileno(stdin),_O_BINARY);
+	_setmode(_fileno(stdout),_O_BINARY);
+	#endif
+	setvbuf(stdout,NULL,_IONBF,0);
+
+	IccCache cache;
+	IccConverter converter;
+	configureConverter(converter);
+	converter.setCache(&cache);
+	ConversionResult result;
+	m_stats.start();
+	m_stats.setKeepFiles(!m_statsFile.empty());
+	bool converted = converter.convertStream(stdin,stdout,result);
+	m_stats.addConversion("-",result);
+	LcmsMemoryStats lcms;
+	converter.getLcmsStats(lcms);
+	m_stats.addLcmsStats(lcms);
+	m_stats.finish(cache);
+	if (!converted) {
+		std::cerr << result.errorMessage << std::endl;
+	} else if (m_verbose) {
+		std::cerr << "(" << result.profileSource << ": " << result.profileName << ") Done." << std::endl;
+	}
+	if (!writeReport()) {
+		return 6;
+	}
+
+	return (converted ? 0 : 3);
+}
+
+
+/**
+ * Batch worker: takes files from the work queue until all of them have
+ * been processed, using its own converter.
+ *
+ * @param[in] worker Index of the worker in the work queue
+ * @param[in] files Names of the files in the input folder
+ * @param[in] sizes Sizes of the files in the input folder
+ * @param[in] memory Estimated memory needed to convert each file (reserved from the memory budget)
+ * @param[in] cache Profile and transform cache shared by all workers
+ */
+void IccFlowApp::batchWorker(int worker, const std::vector<std::string>& files, const std::vector<unsigned long long>& sizes, const std::vector<unsigned long long>& memory, IccCache* cache) {
 	IccConverter converter;
+	configureConverter(converter);
+	converter.setCache(cache);
+	int lastPercent = -1;
+	if (m_verbose && (m_threads == 1) && !m_io) {
+		converter.setProgressCallback(showProgress,&lastPercent);
+	}
+
+	size_t index = 0;
+	std::vector<size_t> upcoming;
+	while (nextFile(worker,sizes,index)) {
+		if (m_io) {
+			// Read the next files of this worker while converting this one
+			m_workQueue.peek(worker,m_prefetch,upcoming);
+			for (size_t i=0; i<upcoming.size(); i++) {
+				if (m_spool && (m_spool->claim(upcoming[i]) != SPOOL_CLAIMED)) {
+					continue;
+				}
+				if (m_tar) {
+					m_tar->prefetch(files[upcoming[i]]);
+				} else {
+					m_io->prefetch(upcoming[i],m_inputFolder+g_slash+files[upcoming[i]]);
+				}
+			}
+			m_budget.reserve(memory[index]);
+			processFileAsync(converter,index,sizes[index],memory[index],files[index]);
+			continue;
+		}
+		m_budget.reserve(memory[index]);
+		bool success = processFile(converter,files[index]);
+		m_budget.release(memory[index]);
+		if (m_spool) {
+			m_spool->complete(index);
+		}
+		if (!success) {
+			m_success = false;
+		}
+		m_progress.addFile(sizes[index],success);
+	}
+	LcmsMemoryStats lcms;
+	converter.getLcmsStats(lcms);
+	m_stats.addLcmsStats(lcms);
+}
+
+
+/**
+ * Takes the next file of a batch worker. With a spool, files done by
+ * other processes are skipped and files leased to them are left for
+ * the end, when they are taken over if their lease expires.
+ *
+ * @param[in] worker Index of the worker in the work queue
+ * @param[in] sizes Sizes of the files in the input folder
+ * @param[out] index Index of the file to process
+ * @return true if a file was taken, false when all files have been processed
+ */
+bool IccFlowApp::nextFile(int worker, const std::vector<unsigned long long>& sizes, size_t& index) {
+	if (!m_spool) {
+		return m_workQueue.next(worker,index);
+	}
+	while (m_workQueue.next(worker,index)) {
+		int claim = m_spool->claim(index);
+		if (claim == SPOOL_CLAIMED) {
+			return true;
+		} else if (claim == SPOOL_DONE) {
+			m_progress.addFile(sizes[index],true);
+		}
+	}
+
+	return m_spool->nextDeferred(index,[this,&sizes](size_t done) {
+		m_progress.addFile(sizes[done],true);
+	});
+}
+
+
+/**
+ * Worker thread estimating the cost and memory of the files of a batch run
+ * from their frame headers, taking files one by one until all are done
+ *
+ * @param[in,out] next Index of the next file to estimate, shared by all workers
+ * @param[in] files Names of the files in the input folder
+ * @param[in] sizes Sizes of the files
+ * @param[in,out] costs Cost of every file, initialized to its size and set to its pixel samples for JPEG files
+ * @param[out] memory Estimated memory of every file, set only with a memory budget
+ * @param[in] cache Cache of profiles for the estimates
+ */
+void IccFlowApp::estimateWorker(std::atomic<size_t>* next, const std::vector<std::string>& files, const std::vector<unsigned long long>& sizes,
+								std::vector<unsigned long long>& costs, std::vector<unsigned long long>& memory, IccCache* cache) {
+	bool inMemory = (m_ioEngine != IO_ENGINE_SYNC);
+	IccConverter estimator;
+	configureConverter(estimator);
+	estimator.setCache(cache);
+	std::vector<char> header;
+	size_t index = 0;
+	while ((index = (*next)++) < files.size()) {
+		if (!isJpegFile(files[index])) {
+			memory[index] = inMemory ? sizes[index]*2 : 0;
+			continue;
+		}
+		JpegImageInfo info;
+		bool progressive = false;
+		size_t length = 0;
+		if (readJpegHeader(files[index],header,length,info,progressive)) {
+			costs[index] = (unsigned long long) info.width*info.height*info.components;
+		}
+		if (m_maxMemory > 0) {
+			memory[index] = estimator.estimateMemory(info,progressive,sizes[index],inMemory);
+		}
+	}
+}
+
+
+/**
+ * Reads the start of a JPEG file from the input folder (or input archive),
+ * up to its frame header. The first 64 KB are read, and more if APPn markers (such as
+ * large embedded profiles) push the frame header further.
+ *
+ * @param[in] file Name of the file
+ * @param[in,out] header Buffer receiving the data, reused between calls
+ * @param[out] length Bytes read into the buffer
+ * @param[out] info Width, height and number of components of the image
+ * @param[out] progressive Whether the image is progressive
+ * @return true if the frame header was found, false otherwise
+ */
+bool IccFlowApp::readJpegHeader(const std::string& file, std::vector<char>& header, size_t& length, JpegImageInfo& info, bool& progressive) {
+	length = 0;
+	FILE* fp = NULL;
+	const char* member = NULL;
+	size_t memberSize = 0;
+	if (m_tar) {
+		if (!m_tar->find(file,member,memberSize)) {
+			return false;
+		}
+	} else if ((fp = fopen((m_inputFolder+g_slash+file).c_str(),"rb")) == NULL) {
+		return false;
+	}
+	if (header.size() < 65536) {
+		header.resize(65536);
+	}
+	bool found = false;
+	while (true) {
+		if (fp != NULL) {
+			length += fread(&header[length],1,header.size()-length,fp);
+		} else {
+			size_t count = std::min(header.size()-length,memberSize-length);
+			memcpy(&header[length],member+length,count);
+			length += count;
+		}
+		found = scanJpegFrame(&header[0],length,info,progressive);
+		if (found || (length < header.size()) || ((unsigned char) header[0] != 0xFF) || ((unsigned char) header[1] != 0xD8)) {
+			break;
+		}
+		header.resize(header.size()*4);
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+
+	return found;
+}
+
+
+/**
+ * Checks the extension of a file name for JPEG files
+ *
+ * @param[in] file The file name
+ * @return true if the file has .jpg or .jpeg extension (in any case), false otherwise
+ */
+bool IccFlowApp::isJpegFile(const std::string& file) {
+	std::string fileLow = file;
+	transform(fileLow.begin(),fileLow.end(),fileLow.begin(),::tolower);
+	return (fileLow.rfind(".jpg") == fileLow.size()-4) || (fileLow.rfind(".jpeg") == fileLow.size()-5);
+}
+
+
+/**
+ * Processes a file from the input folder: JPEG files are converted,
+ * other files are just copied to the output folder.
+ *
+ * @param[in] converter The converter to use
+ * @param[in] file Name of the file to process
+ * @return true if the file was successfully processed, false otherwise
+ */
+bool IccFlowApp::processFile(IccConverter& converter, const std::string& file) {
+	if (isJpegFile(file)) {
+		// Verbose single worker shows the file name before converting, as progress follows it
+		bool showProgress = m_verbose && (m_threads == 1);
+		if (showProgress) {
+			std::cout << file << ": ";
+			std::cout.flush();
+		}
+		ConversionResult result;
+		bool converted = converter.convert(file,result);
+		m_stats.addConversion(file,result);
+		if (converted) {
+			m_progress.addOutput((unsigned long long) result.width*result.height,result.outputBytes);
+		}
+		reportResult(file,result,!showProgress);
+		if (!converted) {
+			copyToOutputs(file);
+			return false;
+		}
+	} else {
+		// Just copy all non-JPEG files
+		std::chrono::steady_clock::time_point copyStart = std::chrono::steady_clock::now();
+		if (!copyToOutputs(file)) {
+			return false;
+		}
+		if (!outputToSameDirectory() || !m_renditions.empty()) {
+			struct stat st;
+			unsigned long bytes = (stat((m_inputFolder+g_slash+file).c_str(),&st) == 0) ? st.st_size : 0;
+			m_stats.addCopy(bytes,secondsSince(copyStart));
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Copies a source file unchanged to the output folder and to rendition
+ * folders, skipping the input folder itself
+ *
+ * @param[in] file Name of the file in the input folder
+ * @return true if all copies were successful, false otherwise
+ */
+bool IccFlowApp::copyToOutputs(const std::string& file) {
+	bool success = true;
+	std::vector<std::string> paths;
+	getCopyPaths(file,paths);
+	for (size_t i=0; i<paths.size(); i++) {
+		success = copyFile(m_inputFolder+g_slash+file,paths[i]) && success;
+	}
+
+	return success;
+}
+
+
+/**
+ * Gets the paths where a source file is copied unchanged: the output
+ * folder and rendition folders, skipping the input folder itself. When
+ * writing an archive, the name of the member.
+ *
+ * @param[in] file Name of the file in the input folder
+ * @param[out] paths Paths of the copies
+ */
+void IccFlowApp::getCopyPaths(const std::string& file, std::vector<std::string>& paths) {
+	paths.clear();
+	if (!m_archiveFile.empty()) {
+		paths.push_back(file);
+		return;
+	}
+	if (!outputToSameDirectory()) {
+		paths.push_back(m_outputFolder+g_slash+file);
+	}
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		if (m_renditions[i].outputFolder != m_inputFolder) {
+			paths.push_back(m_renditions[i].outputFolder+g_slash+file);
+		}
+	}
+}
+
+
+/**
+ * Gets the paths where the converted image of a JPEG file is written: the
+ * output folder and rendition folders. When writing an archive, the name
+ * of the member.
+ *
+ * @param[in] file Name of the file in the input folder
+ * @param[out] paths Paths of the converted images
+ */
+void IccFlowApp::getOutputPaths(const std::string& file, std::vector<std::string>& paths) {
+	paths.clear();
+	if (!m_archiveFile.empty()) {
+		paths.push_back(file);
+		return;
+	}
+	paths.push_back(m_outputFolder+g_slash+file);
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		paths.push_back(m_renditions[i].outputFolder+g_slash+file);
+	}
+}
+
+
+/**
+ * Checks if a JPEG file has the same content as a file processed earlier
+ * in the run, when deduplicating. The content already read for conversion
+ * is hashed, and a match is confirmed by comparing the bytes with the
+ * earlier file. Duplicates are not converted: their outputs are linked to
+ * the outputs of the earlier file once it is finished.
+ *
+ * @param[in] index Index of the file in the work queue
+ * @param[in] file Name of the file in the input folder
+ * @param[in] data Content of the file
+ * @param[in] length Size of the content
+ * @return true if the file is a duplicate and has been (or will be) linked,
+ * false if it has to be processed
+ */
+bool IccFlowApp::deduplicate(size_t index, const std::string& file, const char* data, size_t length) {
+	if (!m_dedup || !isJpegFile(file)) {
+		return false;
+	}
+	unsigned long long hash = hashBytes(data,length,FNV_OFFSET_BASIS);
+	DedupFile duplicate;
+	duplicate.index = index;
+	duplicate.file = file;
+	duplicate.size = length;
+	DedupFile leader;
+	if (m_dedup->claim(hash,duplicate,leader)) {
+		return false;
+	}
+	const char* leaderData = NULL;
+	size_t leaderSize = 0;
+	bool same = false;
+	if (m_tar) {
+		same = m_tar->find(leader.file,leaderData,leaderSize) && (leaderSize == length) && (memcmp(data,leaderData,length) == 0);
+	} else {
+		same = DedupIndex::sameContent(data,length,m_inputFolder+g_slash+leader.file);
+	}
+	if (!same) {
+		return false;
+	}
+	bool converted = false;
+	if (m_dedup->follow(leader.index,duplicate,converted)) {
+		linkDuplicate(leader.file,duplicate,converted);
+	}
+
+	return true;
+}
+
+
+/**
+ * Links the files waiting for a file with the same content to finish,
+ * when deduplicating
+ *
+ * @param[in] index Index of the finished file in the work queue
+ * @param[in] file Name of the finished file in the input folder
+ * @param[in] converted Whether the file was converted (copied unchanged otherwise)
+ */
+void IccFlowApp::finishDuplicates(size_t index, const std::string& file, bool converted) {
+	if (!m_dedup) {
+		return;
+	}
+	std::vector<DedupFile> followers;
+	m_dedup->finish(index,converted,followers);
+	for (size_t i=0; i<followers.size(); i++) {
+		linkDuplicate(file,followers[i],converted);
+	}
+}
+
+
+/**
+ * Gives a duplicate file the outputs of the file with the same content
+ * processed earlier. If that file failed to convert, the duplicate fails
+ * too, and gets links to its unchanged copies.
+ *
+ * @param[in] leader Name of the earlier file in the input folder
+ * @param[in] duplicate The duplicate file
+ * @param[in] converted Whether the earlier file was converted
+ */
+void IccFlowApp::linkDuplicate(const std::string& leader, const DedupFile& duplicate, bool converted) {
+	std::chrono::steady_clock::time_point linkStart = std::chrono::steady_clock::now();
+	std::vector<std::string> sources;
+	std::vector<std::string> targets;
+	if (converted) {
+		getOutputPaths(leader,sources);
+		getOutputPaths(duplicate.file,targets);
+	} else {
+		getCopyPaths(leader,sources);
+		getCopyPaths(duplicate.file,targets);
+	}
+	bool linked = true;
+	for (size_t i=0; i<sources.size(); i++) {
+		if (m_archive) {
+			m_archive->link(targets[i],sources[i]);
+		} else {
+			linked = linkFile(sources[i],targets[i]) && linked;
+		}
+	}
+	bool success = converted && linked;
+	m_stats.addDuplicate(duplicate.size,success,secondsSince(linkStart));
+	{
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		if (success) {
+			std::cout << duplicate.file << ": Same content as " << leader << ", outputs linked.\n";
+		} else if (!converted) {
+			std::cerr << duplicate.file << ": Same content as " << leader << ", which failed to convert" << std::endl;
+		} else {
+			std::cerr << duplicate.file << ": Failed to link the outputs of " << leader << std::endl;
+		}
+	}
+	if (!success) {
+		m_success = false;
+	}
+	if (m_spool) {
+		m_spool->complete(duplicate.index);
+	}
+	m_progress.addFile(duplicate.size,success);
+}
+
+
+/**
+ * Replaces a file by a hard link to another file, so that both share
+ * their data. The link is created under a temporary name and renamed, so
+ * the target is replaced atomically (with -durability batch, the
+ * publisher renames it). Falls back to copying the file if it can't be
+ * linked (for example across filesystems).
+ *
+ * @param[in] srcFile Path of the file to link to
+ * @param[in] dstFile Path of the link
+ * @return true if the file was linked or copied, false otherwise
+ */
+bool IccFlowApp::linkFile(const std::string& srcFile, const std::string& dstFile) {
+	#if !defined _WIN32 && !defined _WIN64
+	std::string tempFile = dstFile + ".tmp";
+	unlink(tempFile.c_str());
+	if (link(srcFile.c_str(),tempFile.c_str()) == 0) {
+		if (m_publisher) {
+			stageFile(tempFile,dstFile);
+			return true;
+		}
+		if (rename(tempFile.c_str(),dstFile.c_str()) == 0) {
+			return (m_durability == DURABILITY_NONE) || syncFolder(getParentFolder(dstFile));
+		}
+		unlink(tempFile.c_str());
+	}
+	#endif
+
+	return copyFile(srcFile,dstFile);
+}
+
+
+/**
+ * Creates the I/O engine of a batch run. Falls back to the thread pool
+ * engine if io_uring is not available.
+ *
+ * @param[in] files Number of files in the run
+ */
+void IccFlowApp::startIoEngine(size_t files) {
+	// Enough concurrent operations for every worker reading ahead and writing
+	int concurrency = m_threads*(m_prefetch+2);
+	m_io.reset(createIoEngine(m_ioEngine,concurrency));
+	if (!m_io) {
+		std::cerr << "io_uring not available, using threads I/O engine" << std::endl;
+		m_io.reset(createIoEngine(IO_ENGINE_THREADS,concurrency));
+	}
+	m_io->reset(files);
+}
+
+
+/**
+ * Processes a file from the input folder through the I/O engine. The file
+ * is converted (or copied) from memory once it has been read (or in place
+ * from an input archive), and outputs
+ * are written in the background. The result is reported when all outputs
+ * have been written.
+ *
+ * @param[in] converter The converter to use
+ * @param[in] index Index of the file in the work queue
+ * @param[in] size Size of the file
+ * @param[in] memory Memory reserved for the file, released when its outputs have been written
+ * @param[in] file Name of the file
+ */
+void IccFlowApp::processFileAsync(IccConverter& converter, size_t index, unsigned long long size, unsigned long long memory, const std::string& file) {
+	std::shared_ptr<AsyncFile> pending(new AsyncFile());
+	pending->file = file;
+	pending->index = index;
+	pending->size = size;
+	pending->memory = memory;
+	pending->jpeg = isJpegFile(file);
+	pending->success = false;
+	pending->start = std::chrono::steady_clock::now();
+	pending->pending = 1;
+	pending->storing = 1;
+
+	// Wait for the file to be read, or find it in the input archive
+	std::string data;
+	std::string error;
+	const char* input = NULL;
+	size_t inputSize = 0;
+	bool read = false;
+	if (m_tar) {
+		read = m_tar->find(file,input,inputSize);
+		if (!read) {
+			error = "File not found in input archive: " + file;
+		}
+	} else {
+		read = m_io->take(index,m_inputFolder+g_slash+file,data,error);
+		input = data.data();
+		inputSize = data.size();
+	}
+	double readSeconds = secondsSince(pending->start);
+	if (read && deduplicate(index,file,input,inputSize)) {
+		m_budget.release(memory);
+		return;
+	}
+
+	// Convert, or copy unchanged if not a JPEG file or conversion failed
+	std::vector<std::string> outputs;
+	std::vector<std::string> paths;
+	if (!read) {
+		pending->result.errorCode = CONVERSION_ERROR_OPEN_INPUT;
+		pending->result.errorMessage = error;
+	} else if (pending->jpeg && converter.convertBuffer(input,inputSize,outputs,pending->result)) {
+		pending->success = true;
+		getOutputPaths(file,paths);
+	} else {
+		pending->success = !pending->jpeg;
+		getCopyPaths(file,paths);
+		outputs.assign(paths.size(),std::string(input,inputSize));
+	}
+	if (pending->jpeg) {
+		pending->result.stageSeconds[CONVERSION_STAGE_OPEN] += readSeconds;
+		pending->result.totalSeconds += readSeconds;
+	}
+
+	// Write outputs in the background
+	for (size_t i=0; i<paths.size(); i++) {
+		pending->pending++;
+		IoWriteCallback written = [this,pending](const std::string& error) {
+			if (!error.empty()) {
+				std::lock_guard<std::mutex> lock(pending->mutex);
+				if (pending->writeError.empty()) {
+					pending->writeError = error;
+				}
+			}
+			if (--pending->pending == 0) {
+				finishAsyncFile(pending);
+			}
+		};
+		if (m_archive) {
+			m_archive->write(paths[i],outputs[i],written);
+		} else {
+			// Memory is released once outputs are stored, as publishing them may wait for a barrier
+			pending->storing++;
+			IoWriteCallback stored = [this,pending](const std::string&) {
+				if (--pending->storing == 0) {
+					m_budget.release(pending->memory.exchange(0));
+				}
+			};
+			m_io->write(paths[i],outputs[i],written,stored);
+		}
+	}
+	if (!m_archive && (--pending->storing == 0)) {
+		m_budget.release(pending->memory.exchange(0));
+	}
+	if (--pending->pending == 0) {
+		finishAsyncFile(pending);
+	}
+}
+
+
+/**
+ * Reports a file processed through the I/O engine, once all its outputs
+ * have been written
+ *
+ * @param[in] pending The file
+ */
+void IccFlowApp::finishAsyncFile(std::shared_ptr<AsyncFile> pending) {
+	bool success = pending->success;
+	if (pending->jpeg) {
+		ConversionResult& result = pending->result;
+		if (success && !pending->writeError.empty()) {
+			result.errorCode = CONVERSION_ERROR_OPEN_OUTPUT;
+			result.errorMessage = pending->writeError;
+			success = false;
+		}
+		m_stats.addConversion(pending->file,result);
+		if (success) {
+			m_progress.addOutput((unsigned long long) result.width*result.height,result.outputBytes);
+		}
+		reportResult(pending->file,result,true);
+	} else if (!success) {
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		std::cerr << pending->result.errorMessage << std::endl;
+	} else if (!pending->writeError.empty()) {
+		success = false;
+	} else if (!outputToSameDirectory() || !m_renditions.empty()) {
+		m_stats.addCopy(pending->size,secondsSince(pending->start));
+	}
+	if (!pending->writeError.empty() && (!pending->jpeg || !pending->success)) {
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		std::cerr << "Error while copying " << m_inputFolder+g_slash+pending->file << ": " << pending->writeError << std::endl;
+	}
+
+	if (!success) {
+		m_success = false;
+	}
+	m_budget.release(pending->memory.exchange(0));
+	finishDuplicates(pending->index,pending->file,success);
+	if (m_spool) {
+		m_spool->complete(pending->index);
+	}
+	m_progress.addFile(pending->size,success);
+}
+
+
+/**
+ * Overrides a libjpeg parameter of the selected preset
+ *
+ * @param[in] option Command line option (-dct, -fancy, -optimize-coding, -progressive or -restart)
+ * @param[in] value Option value
+ * @return true if the value is valid, false otherwise
+ */
+bool IccFlowApp::applyCodecOption(const std::string& option, const std::string& value) {
+	if (option == "-dct") {
+		J_DCT_METHOD method = JDCT_ISLOW;
+		if (value == "islow") {
+			method = JDCT_ISLOW;
+		} else if (value == "ifast") {
+			method = JDCT_IFAST;
+		} else if (value == "float") {
+			method = JDCT_FLOAT;
+		} else {
+			return false;
+		}
+		m_codec.decodeDctMethod = method;
+		m_codec.encodeDctMethod = method;
+		return true;
+	}
+	if (option == "-restart") {
+		int rows = atoi(value.c_str());
+		if ((rows < 0) || (rows > 65535) || (value.find_first_not_of("0123456789") != std::string::npos)) {
+			return false;
+		}
+		m_codec.restartRows = rows;
+		return true;
+	}
+
+	// On/off options
+	if ((value != "on") && (value != "off")) {
+		return false;
+	}
+	bool enabled = (value == "on");
+	if (option == "-fancy") {
+		m_codec.fancyUpsampling = enabled;
+	} else if (option == "-optimize-coding") {
+		m_codec.optimizeCoding = enabled;
+	} else if (option == "-progressive") {
+		m_codec.progressive = enabled;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Parses a memory size from the command line: a number of bytes, with an
+ * optional K, M or G suffix (powers of 1024)
+ *
+ * @param[in] text Memory size
+ * @param[out] bytes Parsed size in bytes
+ * @return true if the size is valid, false otherwise
+ */
+bool IccFlowApp::parseMemorySize(const std::string& text, unsigned long long& bytes) {
+	char* end = NULL;
+	double value = strtod(text.c_str(),&end);
+	if ((end == text.c_str()) || (value < 0)) {
+		return false;
+	}
+	std::string suffix(end);
+	if ((suffix == "K") || (suffix == "k")) {
+		value *= 1024;
+	} else if ((suffix == "M") || (suffix == "m")) {
+		value *= 1024*1024;
+	} else if ((suffix == "G") || (suffix == "g")) {
+		value *= 1024*1024*1024;
+	} else if (!suffix.empty()) {
+		return false;
+	}
+	bytes = (unsigned long long) value;
+
+	return true;
+}
+
+
+/**
+ * Parses a rendition spec from the command line: the output folder,
+ * optionally followed by comma separated settings p=profile, c=intent,
+ * q=quality and scale=n. Intent and quality default to the main output ones.
+ *
+ * @param[in] text Rendition spec
+ * @param[out] spec Parsed rendition settings
+ * @return true if the spec is valid, false otherwise
+ */
+bool IccFlowApp::parseRendition(const std::string& text, RenditionSpec& spec) {
+	spec = RenditionSpec();
+	spec.intent = m_intent;
+	spec.jpegQuality = m_jpegQuality;
+	size_t start = 0;
+	bool first = true;
+	while (start <= text.size()) {
+		size_t end = text.find(',',start);
+		if (end == std::string::npos) {
+			end = text.size();
+		}
+		std::string item = text.substr(start,end-start);
+		start = end + 1;
+		if (first) {
+			spec.outputFolder = item;
+			first = false;
+			continue;
+		}
+		size_t equals = item.find('=');
+		if (equals == std::string::npos) {
+			return false;
+		}
+		std::string key = item.substr(0,equals);
+		std::string value = item.substr(equals+1);
+		if (key == "p") {
+			spec.outputProfile = value;
+		} else if (key == "c") {
+			spec.intent = atoi(value.c_str());
+		} else if (key == "q") {
+			spec.jpegQuality = atoi(value.c_str());
+		} else if (key == "scale") {
+			spec.scale = atoi(value.c_str());
+		} else {
+			return false;
+		}
+	}
+	if (spec.outputFolder.empty() || (spec.outputFolder == "-")) {
+		return false;
+	}
+	if ((spec.intent < 0) || (spec.intent > 3) || (spec.jpegQuality < 0) || (spec.jpegQuality > 100)) {
+		return false;
+	}
+
+	return (spec.scale == 1) || (spec.scale == 2) || (spec.scale == 4) || (spec.scale == 8);
+}
+
+
+/**
+ * Shows the outcome of a file conversion. Output is only flushed when
+ * needed to keep it in order with error messages.
+ *
+ * @param[in] file Name of the converted file
+ * @param[in] result Conversion result
+ * @param[in] showName Whether to show the file name (not shown yet)
+ */
+void IccFlowApp::reportResult(const std::string& file, const ConversionResult& result, bool showName) {
+	std::lock_guard<std::mutex> lock(m_outputMutex);
+	if (showName) {
+		std::cout << file << ": ";
+	}
+	if (!result.profileSource.empty()) {
+		std::cout << "(" << result.profileSource << ": " << result.profileName << ") ";
+	}
+	if (result.errorCode == CONVERSION_OK) {
+		std::cout << "Done.\n";
+	} else {
+		std::cout.flush();
+		std::cerr << result.errorMessage << std::endl;
+	}
+}
+
+
+/**
+ * Writes the run report, if requested in the command line
+ *
+ * @return true if no report was requested or it was written, false otherwise
+ */
+bool IccFlowApp::writeReport() {
+	if (m_statsFile.empty()) {
+		return true;
+	}
+	if (!m_stats.writeReport(m_statsFile)) {
+		std::cerr << "Failed to write report: " << m_statsFile << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Gets the time elapsed since a given moment
+ *
+ * @param[in] start The starting moment
+ * @return Elapsed time in seconds
+ */
+double IccFlowApp::secondsSince(const std::chrono::steady_clock::time_point& start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/**
+ * Progress function for verbose output: shows percentage of
+ * scanlines processed, only when it changes
+ *
+ * @param[in] line Scanlines already processed
+ * @param[in] height Total scanlines in the image
+ * @param[in] userData Pointer to int with the last percentage shown
+ */
+void IccFlowApp::showProgress(unsigned int line, unsigned int height, void* userData) {
+	int* lastPercent = (int*) userData;
+	int percent = (int) (100ULL*line/height);
+	if ((line == 0) || (percent != *lastPercent)) {
+		*lastPercent = percent;
+		std::cout << std::setw(3) << percent << "%\b\b\b\b";
+		std::cout.flush();
+	}
+}
+
+
+/**
+ * Sets up a converter with the parameters given in the command line
+ *
+ * @param[in] converter The converter to set up
+ */
+void IccFlowApp::configureConverter(IccConverter& converter) {
 	converter.setInputFolder(m_inputFolder);
 	converter.setOutputFolder(m_outputFolder);
 	converter.setOutputProfile(m_outputProfile);
@@ -59,54 +1449,17 @@ int IccFlowApp::run() {
 	converter.setJpegQuality(m_jpegQuality);
 	converter.setBlackPointCompensation(m_blackPointCompensation);
 	converter.setOptimization(m_enableOptimization);
-	converter.setVerboseOutput(m_verbose);
-
-	// Create output folder if needed
-	if (!createDirectory(m_outputFolder)) {
-		std::cerr << "Failed to create output folder: " << m_outputFolder << std::endl;
-		return 4;
-	}
-
-	// Open input folder
-	DIR* dir = NULL;
-	dir = opendir(m_inputFolder.c_str());
-	if (dir == NULL) {
-		std::cerr << "Failed to open input folder: " << m_inputFolder << std::endl;
-		return 2;
-	}
-
-	// Traverse directory and process JPEG files
-	dirent* ent = NULL;
-	struct stat st;
-	std::string file,fileLow;
-	bool success = true;
-	while ((ent = readdir(dir))) {
-		stat((m_inputFolder+g_slash+ent->d_name).c_str(),&st);
-		if (!S_ISDIR(st.st_mode)) {
-			file = ent->d_name;
-			fileLow = file;
-			transform(fileLow.begin(),fileLow.end(),fileLow.begin(),::tolower);
-			if ((fileLow.rfind(".jpg") == fileLow.size()-4) || (fileLow.rfind(".jpeg") == fileLow.size()-5)) {
-				if (!converter.convert(file)) {
-					success = false;
-					if (!outputToSameDirectory()) {
-						copyFile(m_inputFolder+g_slash+file,m_outputFolder+g_slash+file);
-					}
-				}
-			} else {
-				if (!outputToSameDirectory()) {
-					// Just copy all non-JPEG files
-					if (!copyFile(m_inputFolder+g_slash+file,m_outputFolder+g_slash+file)) {
-						success = false;
-					}
-				}
-			}
-		}
+	converter.setPreserveMetadata(m_preserveMetadata);
+	converter.setSyncOutput(m_durability != DURABILITY_NONE);
+	converter.setScale(m_scale);
+	converter.setMaxSize(m_maxSize);
+	converter.setResample(m_resample);
+	converter.setCodecSettings(m_codec);
+	converter.setBackend(m_backend);
+	converter.clearRenditions();
+	for (size_t i=0; i<m_renditions.size(); i++) {
+		converter.addRendition(m_renditions[i]);
 	}
-	closedir(dir);
-
-	// Return exit code
-	return (success ? 0 : 3);
 }
 
 
@@ -127,9 +1480,40 @@ bool IccFlowApp::parseArguments() {
 	m_defaultGrayProfile.clear();
 	m_intent = INTENT_RELATIVE_COLORIMETRIC;
 	m_jpegQuality = 85;
+	m_scale = 1;
+	m_maxSize = 0;
+	m_preset = "balanced";
+	m_codecArgs.clear();
+	m_backendName = "libjpeg";
+	m_backend = JPEG_BACKEND_LIBJPEG;
+	m_renditionArgs.clear();
+	m_renditions.clear();
+	m_serverSocket.clear();
+	m_serverProfiles.clear();
+	m_statsFile.clear();
+	m_threads = 1;
+	m_ioEngineName = "sync";
+	m_ioEngine = IO_ENGINE_SYNC;
+	m_prefetch = 2;
+	m_maxMemoryArg.clear();
+	m_maxMemory = 0;
+	m_progressFd = -1;
+	m_progressInterval = 1;
+	m_scan = false;
+	m_shardArg.clear();
+	m_spoolFolder.clear();
+	m_leaseSeconds = 60;
+	m_deduplicate = false;
+	m_archiveFile.clear();
+	m_durabilityName = "none";
+	m_durability = DURABILITY_NONE;
+	m_syncBatch = 64;
+	m_shardIndex = 0;
+	m_shardCount = 1;
 
 	// Traverse and analyze arguments
 	bool helpShown = false;
+	bool threadsGiven = false;
 	for (int i=1; i<m_argc; i++) {
 		if (std::string(m_argv[i]) == "-h") {
 			showHelp();
@@ -170,8 +1554,103 @@ bool IccFlowApp::parseArguments() {
 			m_blackPointCompensation = false; 
 		} else if (std::string(m_argv[i]) == "-no") {
 			m_enableOptimization = false; 
+		} else if (std::string(m_argv[i]) == "-strip") {
+			m_preserveMetadata = false; 
+		} else if (std::string(m_argv[i]) == "-scale") {
+			if (++i < m_argc) {
+				m_scale = atoi(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-max-size") {
+			if (++i < m_argc) {
+				m_maxSize = atoi(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-resample") {
+			m_resample = true; 
+		} else if (std::string(m_argv[i]) == "-preset") {
+			if (++i < m_argc) {
+				m_preset = std::string(m_argv[i]);
+			}
+		} else if ((std::string(m_argv[i]) == "-dct") || (std::string(m_argv[i]) == "-fancy") || (std::string(m_argv[i]) == "-optimize-coding")
+			|| (std::string(m_argv[i]) == "-progressive") || (std::string(m_argv[i]) == "-restart")) {
+			if (i+1 < m_argc) {
+				m_codecArgs.push_back(std::make_pair(std::string(m_argv[i]),std::string(m_argv[i+1])));
+				i++;
+			}
+		} else if (std::string(m_argv[i]) == "-codec") {
+			if (++i < m_argc) {
+				m_backendName = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-rendition") {
+			if (++i < m_argc) {
+				m_renditionArgs.push_back(m_argv[i]);
+			}
 		} else if (std::string(m_argv[i]) == "-v") {
 			m_verbose = true; 
+		} else if (std::string(m_argv[i]) == "-server") {
+			if (++i < m_argc) {
+				m_serverSocket = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-server-profiles") {
+			if (++i < m_argc) {
+				m_serverProfiles = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-j") {
+			if (++i < m_argc) {
+				m_threads = atoi(m_argv[i]);
+				threadsGiven = true;
+			}
+		} else if (std::string(m_argv[i]) == "-io") {
+			if (++i < m_argc) {
+				m_ioEngineName = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-prefetch") {
+			if (++i < m_argc) {
+				m_prefetch = atoi(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-max-memory") {
+			if (++i < m_argc) {
+				m_maxMemoryArg = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-progress") {
+			if (++i < m_argc) {
+				m_progressFd = atoi(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-progress-interval") {
+			if (++i < m_argc) {
+				m_progressInterval = atof(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-stats") {
+			if (++i < m_argc) {
+				m_statsFile = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-scan") {
+			m_scan = true;
+		} else if (std::string(m_argv[i]) == "-shard") {
+			if (++i < m_argc) {
+				m_shardArg = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-spool") {
+			if (++i < m_argc) {
+				m_spoolFolder = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-lease") {
+			if (++i < m_argc) {
+				m_leaseSeconds = atof(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-dedup") {
+			m_deduplicate = true;
+		} else if (std::string(m_argv[i]) == "-durability") {
+			if (++i < m_argc) {
+				m_durabilityName = std::string(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-sync-batch") {
+			if (++i < m_argc) {
+				m_syncBatch = atoi(m_argv[i]);
+			}
+		} else if (std::string(m_argv[i]) == "-archive") {
+			if (++i < m_argc) {
+				m_archiveFile = std::string(m_argv[i]);
+			}
 		}	
 	}
 
@@ -184,14 +1663,93 @@ bool IccFlowApp::parseArguments() {
 	bool success = false;
 	if (!helpShown) {
 		success = true;
-		if (m_inputFolder == "") {
+		if ((m_inputFolder == "") && m_serverSocket.empty()) {
 			std::cerr << "Input folder required, please specify with -i option" << std::endl;
 			success = false;
 		}
-		if (m_outputFolder == "") {
+		if ((m_outputFolder == "") && m_archiveFile.empty() && m_serverSocket.empty() && !m_scan) {
 			std::cerr << "Output folder required, please specify with -o option" << std::endl;
 			success = false;
 		}
+		if (m_scan && (!m_serverSocket.empty() || (m_inputFolder == "-"))) {
+			std::cerr << "Scan mode needs an input folder" << std::endl;
+			success = false;
+		}
+		if (m_scan && !threadsGiven) {
+			m_threads = std::max((int) std::thread::hardware_concurrency(),1);
+		}
+		if (((m_inputFolder == "-") || (m_outputFolder == "-")) && !isStreamMode() && !m_scan) {
+			std::cerr << "Streaming mode needs both input and output set to - (-i - -o -)" << std::endl;
+			success = false;
+		}
+		if ((m_progressFd == 1) || (m_progressFd == 0)) {
+			std::cerr << "Invalid progress file descriptor (standard input and output are not allowed)" << std::endl;
+			success = false;
+		}
+		if (m_progressInterval <= 0) {
+			std::cerr << "Invalid progress interval (should be greater than 0)" << std::endl;
+			success = false;
+		}
+		if (m_threads < 1) {
+			std::cerr << "Invalid number of threads (should be 1 or more)" << std::endl;
+			success = false;
+		}
+		if (m_ioEngineName == "sync") {
+			m_ioEngine = IO_ENGINE_SYNC;
+		} else if (m_ioEngineName == "threads") {
+			m_ioEngine = IO_ENGINE_THREADS;
+		} else if (m_ioEngineName == "uring") {
+			m_ioEngine = IO_ENGINE_URING;
+		} else {
+			std::cerr << "Invalid I/O engine (should be sync, threads or uring)" << std::endl;
+			success = false;
+		}
+		if (m_durabilityName == "none") {
+			m_durability = DURABILITY_NONE;
+		} else if (m_durabilityName == "file") {
+			m_durability = DURABILITY_FILE;
+		} else if (m_durabilityName == "batch") {
+			m_durability = DURABILITY_BATCH;
+		} else {
+			std::cerr << "Invalid durability policy (should be none, file or batch)" << std::endl;
+			success = false;
+		}
+		if (m_syncBatch < 1) {
+			std::cerr << "Invalid number of files per flush (should be 1 or more)" << std::endl;
+			success = false;
+		}
+		if ((m_durability != DURABILITY_NONE) && (isStreamMode() || !m_serverSocket.empty() || m_scan)) {
+			std::cerr << "Durability policies only apply when converting folders" << std::endl;
+			success = false;
+		}
+		if (!m_maxMemoryArg.empty() && !parseMemorySize(m_maxMemoryArg,m_maxMemory)) {
+			std::cerr << "Invalid memory budget (should be a size in bytes, with optional K, M or G suffix)" << std::endl;
+			success = false;
+		}
+		if (!m_shardArg.empty() && !parseShard(m_shardArg,m_shardIndex,m_shardCount)) {
+			std::cerr << "Invalid shard (should be index/count, with index from 0 to count-1)" << std::endl;
+			success = false;
+		}
+		if ((m_shardCount > 1) && (isStreamMode() || !m_serverSocket.empty())) {
+			std::cerr << "Sharding is only supported when converting or scanning folders" << std::endl;
+			success = false;
+		}
+		if (!m_serverProfiles.empty() && m_serverSocket.empty()) {
+			std::cerr << "Server profile folders are only supported in server mode" << std::endl;
+			success = false;
+		}
+		if (!m_spoolFolder.empty() && (isStreamMode() || !m_serverSocket.empty() || m_scan)) {
+			std::cerr << "Spool folders are only supported when converting folders" << std::endl;
+			success = false;
+		}
+		if (m_leaseSeconds <= 0) {
+			std::cerr << "Invalid lease time (should be greater than 0)" << std::endl;
+			success = false;
+		}
+		if (m_prefetch < 0) {
+			std::cerr << "Invalid number of files to prefetch (should be 0 or more)" << std::endl;
+			success = false;
+		}
 		if ((m_intent < 0) || (m_intent > 3)) {
 			std::cerr << "Invalid rendering intent code (should be 0 to 3)" << std::endl;
 			success = false;
@@ -200,6 +1758,94 @@ bool IccFlowApp::parseArguments() {
 			std::cerr << "Invalid JPEG quality value (should be 0 to 100)" << std::endl;
 			success = false;
 		}
+		if ((m_scale != 1) && (m_scale != 2) && (m_scale != 4) && (m_scale != 8)) {
+			std::cerr << "Invalid scale (should be 1, 2, 4 or 8)" << std::endl;
+			success = false;
+		}
+		if (m_maxSize < 0) {
+			std::cerr << "Invalid maximum size (should be 0 or more)" << std::endl;
+			success = false;
+		}
+		if ((m_scale != 1) && (m_maxSize > 0)) {
+			std::cerr << "Scale and maximum size can't be used together" << std::endl;
+			success = false;
+		}
+		if (m_resample && (m_maxSize == 0)) {
+			std::cerr << "Resampling needs a maximum size (-max-size option)" << std::endl;
+			success = false;
+		}
+		m_codec = CodecSettings();
+		if (!m_codec.setPreset(m_preset)) {
+			std::cerr << "Invalid preset (should be fast, balanced or small)" << std::endl;
+			success = false;
+		}
+		for (size_t i=0; i<m_codecArgs.size(); i++) {
+			if (!applyCodecOption(m_codecArgs[i].first,m_codecArgs[i].second)) {
+				std::cerr << "Invalid value for " << m_codecArgs[i].first << ": " << m_codecArgs[i].second << std::endl;
+				success = false;
+			}
+		}
+		if (m_backendName == "libjpeg") {
+			m_backend = JPEG_BACKEND_LIBJPEG;
+		} else if (m_backendName == "turbojpeg") {
+			m_backend = JPEG_BACKEND_TURBOJPEG;
+			if (!isJpegBackendAvailable(m_backend)) {
+				std::cerr << "TurboJPEG codec not available in this build (rebuild with TURBOJPEG=1)" << std::endl;
+				success = false;
+			}
+		} else {
+			std::cerr << "Invalid codec (should be libjpeg or turbojpeg)" << std::endl;
+			success = false;
+		}
+		for (size_t i=0; i<m_renditionArgs.size(); i++) {
+			RenditionSpec spec;
+			if (!parseRendition(m_renditionArgs[i],spec)) {
+				std::cerr << "Invalid rendition: " << m_renditionArgs[i] << std::endl;
+				success = false;
+			} else {
+				m_renditions.push_back(spec);
+			}
+		}
+		if (!m_renditions.empty() && (isStreamMode() || !m_serverSocket.empty())) {
+			std::cerr << "Renditions are only supported when converting folders" << std::endl;
+			success = false;
+		}
+		if (!m_archiveFile.empty()) {
+			if (!m_outputFolder.empty() || !m_serverSocket.empty() || m_scan || (m_inputFolder == "-")) {
+				std::cerr << "Archives replace the output folder of folder conversions (use either -o or -archive)" << std::endl;
+				success = false;
+			}
+			if (!m_renditions.empty() || !m_spoolFolder.empty()) {
+				std::cerr << "Archives can't be used with renditions or spool folders" << std::endl;
+				success = false;
+			}
+			// Outputs are written from memory, so inputs are read by an I/O engine too
+			if (m_ioEngine == IO_ENGINE_SYNC) {
+				m_ioEngine = IO_ENGINE_THREADS;
+			}
+		}
+		if (isInputArchive(m_inputFolder) && m_serverSocket.empty()) {
+			// Files of input archives are converted from memory, and outputs written by an I/O engine
+			if (m_ioEngine == IO_ENGINE_SYNC) {
+				m_ioEngine = IO_ENGINE_THREADS;
+			}
+			if (outputToSameDirectory()) {
+				std::cerr << "The output folder can't be the input archive" << std::endl;
+				success = false;
+			}
+		}
+		if ((m_durability == DURABILITY_BATCH) && m_archiveFile.empty()) {
+			// Outputs are written to temp files by an I/O engine and published in groups
+			if (m_ioEngine == IO_ENGINE_SYNC) {
+				m_ioEngine = IO_ENGINE_THREADS;
+			}
+		}
+		if (m_deduplicate && m_serverSocket.empty()) {
+			// Files are hashed from memory, once read by an I/O engine for conversion
+			if (m_ioEngine == IO_ENGINE_SYNC) {
+				m_ioEngine = IO_ENGINE_THREADS;
+			}
+		}
 	}
 
 	return success;
@@ -211,11 +1857,16 @@ bool IccFlowApp::parseArguments() {
 void IccFlowApp::showHelp() {
 	std::cout << "IccFlow " << g_version << std::endl;
 	std::cout << "iccflow -i inputFolder -o outputFolder [options]" << std::endl;
+	std::cout << "iccflow -server socketPath [options]" << std::endl;
+	std::cout << "iccflow -i - -o - [options] < input.jpg > output.jpg" << std::endl;
+	std::cout << "iccflow -i inputFolder -scan [options]" << std::endl;
 	std::cout << "Performs ICC color transformation on JPEG files." << std::endl;
 	std::cout << std::endl;
 	std::cout << "Mandatory parameters:" << std::endl;
-	std::cout << "  -i inputFolder:   Source folder containing the original JPEG images." << std::endl;
+	std::cout << "  -i inputFolder:   Source folder containing the original JPEG images, or a tar archive of them." << std::endl;
 	std::cout << "  -o outputFolder:  Destination folder where converted images will be saved." << std::endl;
+	std::cout << "                    Use - for both folders to convert a single image from standard input" << std::endl;
+	std::cout << "                    to standard output." << std::endl;
 	std::cout << std::endl;
 	std::cout << "Optional parameters:" << std::endl;
 	std::cout << "  -p outputProfile:   Output profile for the color transformation (path to .icc/.icm file)." << std::endl;
@@ -242,12 +1893,104 @@ void IccFlowApp::showHelp() {
 	std::cout << std::endl;
 	std::cout << "  -no:               Disable optimization (enabled by default)" << std::endl; 
 	std::cout << std::endl;
+	std::cout << "  -strip:            Don't copy EXIF, XMP, IPTC and other metadata to converted images" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -scale n:          Reduce converted images to 1/n size while decompressing (n: 1, 2, 4 or 8)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -max-size pixels:  Reduce converted images to fit in pixels x pixels, using the smallest" << std::endl; 
+	std::cout << "                     decompression scale (1/2, 1/4 or 1/8) that fits. Images are never enlarged." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -resample:         With -max-size, resample images after decompression so that the longest" << std::endl; 
+	std::cout << "                     side is exactly the maximum size (area averaging filter)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -preset name:      libjpeg speed/size trade-off: fast (fast DCT, plain upsampling), balanced" << std::endl; 
+	std::cout << "                     (libjpeg defaults, default preset) or small (optimized Huffman tables," << std::endl; 
+	std::cout << "                     progressive output)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -dct method:       Override DCT method for decompression and compression: islow, ifast or float" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -fancy on|off:     Override smooth chroma upsampling when decompressing" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -optimize-coding on|off: Override Huffman table optimization" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -progressive on|off: Override progressive output" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -restart rows:     Write restart markers every rows MCU rows (0 for none, the default)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -codec name:       JPEG codec: libjpeg (default, streams images line by line) or turbojpeg" << std::endl; 
+	std::cout << "                     (TurboJPEG 3 API, keeps whole images in memory, needs a TURBOJPEG=1 build)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -rendition folder[,p=profile][,c=intent][,q=quality][,scale=n]:" << std::endl; 
+	std::cout << "                     Also save every converted image to folder, with its own output profile," << std::endl; 
+	std::cout << "                     rendering intent, JPEG quality and 1/n scale. Images are decompressed only" << std::endl; 
+	std::cout << "                     once for all outputs. Can be repeated." << std::endl; 
+	std::cout << std::endl;
 	std::cout << "  -v:                Enable verbose output. Shows percentage progress during processing." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -server socketPath: Run as a conversion server listening on a Unix domain socket, instead" << std::endl; 
+	std::cout << "                      of processing a folder. Input and output folders are not needed." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -server-profiles folder: Folder with the output profiles that server requests can choose" << std::endl; 
+	std::cout << "                      by file name. Without it, requests can only use the default profile." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -j threads:        Number of worker threads (defaults to 1). Verbose output needs a single thread." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -io engine:        File I/O of folder conversions: sync (default, files are read and written" << std::endl; 
+	std::cout << "                     line by line by the workers), threads (whole files are read ahead and" << std::endl; 
+	std::cout << "                     written in the background by I/O threads) or uring (as threads, with Linux" << std::endl; 
+	std::cout << "                     io_uring, falling back to threads when not available)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -prefetch files:   Files read ahead per worker by threads and uring I/O engines (defaults to 2)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -max-memory size:  Memory budget for images converted at the same time (e.g. 512M or 4G)." << std::endl; 
+	std::cout << "                     Workers wait before starting images that don't fit, estimated from their" << std::endl; 
+	std::cout << "                     headers. Defaults to no limit." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -progress fd:      Write progress events as JSON lines to file descriptor fd (e.g. 2 for standard" << std::endl; 
+	std::cout << "                     error), with files and bytes done, MP/s and estimated time left." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -progress-interval seconds: Minimum time between progress events (defaults to 1)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -stats reportFile: Write timing and counters of the run to a report file: per-file results in" << std::endl; 
+	std::cout << "                     CSV format for .csv files, summary and per-file results in JSON otherwise." << std::endl; 
+	std::cout << "                     A short summary is always shown after batch runs, with per-stage times if" << std::endl; 
+	std::cout << "                     verbose output is enabled." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -scan:             Only read the headers of the input folder files (no output folder needed) and" << std::endl; 
+	std::cout << "                     show an inventory: color spaces, profiles, EXIF color spaces, sizes, progressive" << std::endl; 
+	std::cout << "                     vs baseline and the estimated cost of converting them with the given options." << std::endl; 
+	std::cout << "                     Uses all cores unless -j is given. -stats writes per-file records." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -shard index/count: Only process the files of the input folder in shard index (0 to count-1)," << std::endl; 
+	std::cout << "                      chosen by a hash of their names, to split a folder across processes or hosts." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -spool folder:     Share the input folder with the processes using the same spool folder: files are" << std::endl; 
+	std::cout << "                     claimed through lease files, so processes can join a running job, and a file" << std::endl; 
+	std::cout << "                     whose lease expires is taken over. Rerunning the job skips finished files." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -lease seconds:    Time after which a spool lease not touched expires (defaults to 60)" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -dedup:            Convert JPEG files with the same content once: the outputs of the others are" << std::endl; 
+	std::cout << "                     hard links to the outputs of the first one. Uses the threads I/O engine unless" << std::endl; 
+	std::cout << "                     -io uring is given." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -archive file:     Write all outputs, copied files included, to a tar archive instead of an output" << std::endl; 
+	std::cout << "                     folder (no -o). Members are appended by a single writer thread." << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -durability policy: How outputs are made durable before being moved to their final names:" << std::endl; 
+	std::cout << "                      none: left to the system (DEFAULT, fastest)" << std::endl; 
+	std::cout << "                      file: every output is flushed to storage (fsync) before being moved" << std::endl; 
+	std::cout << "                      batch: outputs are moved in groups after one flush of the output filesystems" << std::endl; 
+	std::cout << std::endl;
+	std::cout << "  -sync-batch files:  Outputs published after every flush with -durability batch (defaults to 64)" << std::endl; 
 }
 
 
  /**
- * Copies a file
+ * Copies a file. Unless durability is left to the system, the copy is
+ * written to a temp name and published like the other outputs: moved after
+ * being flushed to storage, or handed to the publisher with -durability
+ * batch.
  *
  * @param[in] srcFile Path to source file
  * @param[out] dstFile Path to destination file
@@ -261,12 +2004,14 @@ bool IccFlowApp::copyFile(const std::string& srcFile, const std::string& dstFile
 	dst.exceptions(std::ifstream::failbit);
 	
 	// Copy file
+	std::string targetFile = (m_durability != DURABILITY_NONE) ? dstFile + ".tmp" : dstFile;
 	bool success = true;
 	try {
 		src.open(srcFile.c_str(),std::ios::binary);
-		dst.open(dstFile.c_str(),std::ios::binary);
+		dst.open(targetFile.c_str(),std::ios::binary);
 		dst << src.rdbuf();
 	} catch (std::ios::failure e) {
+		std::lock_guard<std::mutex> lock(m_outputMutex);
 		std::cerr << "Error while copying " << srcFile << " to " << dstFile << std::endl;
 		success = false;
 	}
@@ -279,7 +2024,57 @@ bool IccFlowApp::copyFile(const std::string& srcFile, const std::string& dstFile
 		dst.close();
 	}
 
-	return success;
+	if ((m_durability == DURABILITY_NONE) || !success) {
+		if (!success && (targetFile != dstFile)) {
+			remove(targetFile.c_str());
+		}
+		return success;
+	}
+	if (m_publisher) {
+		stageFile(targetFile,dstFile);
+		return true;
+	}
+
+	// Move copy to its final name only once it is on storage, so that a power loss can't leave it truncated
+	if (!syncFile(targetFile)) {
+		remove(targetFile.c_str());
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		std::cerr << "Error while flushing " << dstFile << " to storage" << std::endl;
+		return false;
+	}
+	// Delete original file when processing in same folder, silently fail otherwise
+	remove(dstFile.c_str());
+	if (rename(targetFile.c_str(),dstFile.c_str()) != 0) {
+		remove(targetFile.c_str());
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		std::cerr << "Can't rename " << targetFile << " to " << dstFile << std::endl;
+		return false;
+	}
+	if (!syncFolder(getParentFolder(dstFile))) {
+		std::lock_guard<std::mutex> lock(m_outputMutex);
+		std::cerr << "Failed to flush the folder of " << dstFile << " to storage" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Hands a written temp file to the publisher of the batch run, which moves
+ * it to its final name after the next flush of the output filesystems.
+ * Errors are reported when the file is published.
+ *
+ * @param[in] tempFile Temp name of the file, already written and closed
+ * @param[in] dstFile Final name of the file
+ */
+void IccFlowApp::stageFile(const std::string& tempFile, const std::string& dstFile) {
+	m_publisher->add(tempFile,dstFile,[this](const std::string& error) {
+		if (!error.empty()) {
+			std::lock_guard<std::mutex> lock(m_outputMutex);
+			std::cerr << error << std::endl;
+			m_success = false;
+		}
+	});
 }
 
 /**
@@ -292,8 +2087,7 @@ bool IccFlowApp::createDirectory(const std::string& dir) {
 
 	// Check if directory already exists
 	struct stat st;
-	stat(dir.c_str(),&st);
-	if (S_ISDIR(st.st_mode)) {
+	if ((stat(dir.c_str(),&st) == 0) && S_ISDIR(st.st_mode)) {
 		return true;
 	}
 
@@ -303,7 +2097,19 @@ bool IccFlowApp::createDirectory(const std::string& dir) {
 	#else
 	int result = mkdir(dir.c_str(),0777);
 	#endif
-	return (result == 0);
+
+	// Another process sharing the output folder may have created it meanwhile
+	return ((result == 0) || ((stat(dir.c_str(),&st) == 0) && S_ISDIR(st.st_mode)));
+}
+
+/**
+ * Checks if a single image has to be converted from standard input
+ * to standard output
+ *
+ * @return true if both input and output folders are "-", false otherwise
+ */
+bool IccFlowApp::isStreamMode() {
+	return ((m_inputFolder == "-") && (m_outputFolder == "-"));
 }
 
 /**
@@ -2,6 +2,25 @@
 #define ICCFLOWAPP_H
 
 #include <string>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include "iccconverter.h"
+#include "icccache.h"
+#include "runstats.h"
+#include "progressreporter.h"
+#include "workqueue.h"
+#include "ioengine.h"
+#include "memorybudget.h"
+#include "scaninventory.h"
+#include "spoolqueue.h"
+#include "dedupindex.h"
+#include "archivewriter.h"
+#include "tarreader.h"
+#include "publishbatch.h"
 
 /**
  * IccFlowApp class implements the iccflow application
@@ -9,6 +28,24 @@
 class IccFlowApp {
 
 	private:
+		/**
+		 * File of a batch run whose outputs are being written by the I/O engine
+		 */
+		struct AsyncFile {
+			std::string file;				/**< Name of the file in the input folder */
+			size_t index;					/**< Index of the file in the work queue */
+			unsigned long long size;		/**< Size of the source file */
+			bool jpeg;						/**< Whether the file is converted or just copied */
+			bool success;					/**< Conversion or read successful */
+			ConversionResult result;		/**< Conversion result of JPEG files */
+			std::chrono::steady_clock::time_point start;	/**< Start of processing */
+			std::mutex mutex;				/**< Protects the write error */
+			std::string writeError;			/**< First write error, empty if none */
+			std::atomic<int> pending;		/**< Writes not finished, plus one while submitting them */
+			std::atomic<int> storing;		/**< Writes not stored yet, plus one while submitting them */
+			std::atomic<unsigned long long> memory;	/**< Memory reserved from the budget, 0 once released */
+		};
+
 		int m_argc;			/**< Command line argument count */
 		char** m_argv;		/**< Command line arguments */
 		std::string m_inputFolder;		/**< Folder where original images are located */
@@ -21,12 +58,93 @@ class IccFlowApp {
 		int m_jpegQuality;	/**< Quality parameter for output JPEG compression (0-100) */
 		bool m_blackPointCompensation;	/**< Wether to apply Black Point Compensation or not */
 		bool m_enableOptimization;	/**< Wether optimitzation is enabled for color transform calculations */
+		bool m_preserveMetadata;	/**< Wether to copy metadata markers to converted images */
+		int m_scale;		/**< Scaling denominator for converted images (1/n size) */
+		int m_maxSize;		/**< Maximum width and height of converted images, 0 for no limit */
+		bool m_resample;	/**< Wether to resample converted images to exactly fit m_maxSize */
+		std::string m_preset;	/**< Name of libjpeg parameters preset */
+		std::vector<std::pair<std::string,std::string> > m_codecArgs;	/**< libjpeg parameter overrides given in the command line */
+		CodecSettings m_codec;	/**< libjpeg parameters from preset and overrides */
+		std::string m_backendName;	/**< Name of JPEG codec backend */
+		int m_backend;		/**< JPEG codec backend (see @ref JPEG_BACKENDS) */
+		std::vector<std::string> m_renditionArgs;	/**< Rendition specs given in the command line */
+		std::vector<RenditionSpec> m_renditions;	/**< Additional outputs of every conversion */
 		bool m_verbose;		/**< Verbose output enabled */
+		std::string m_serverSocket;	/**< Path of Unix domain socket for server mode, empty for batch mode */
+		std::string m_serverProfiles;	/**< Folder with the profiles server requests can choose, empty for built-in profiles only */
+		int m_threads;		/**< Number of worker threads */
+		WorkQueue m_workQueue;	/**< Files of the batch run, handed out to workers largest first */
+		std::string m_ioEngineName;	/**< Name of file I/O engine for batch runs */
+		int m_ioEngine;		/**< File I/O engine for batch runs (see @ref IO_ENGINES) */
+		int m_prefetch;		/**< Files read ahead per worker by the I/O engine */
+		std::unique_ptr<IoEngine> m_io;	/**< File I/O engine of the current batch run, NULL for synchronous I/O */
+		std::string m_maxMemoryArg;	/**< Memory budget given in the command line */
+		unsigned long long m_maxMemory;	/**< Memory budget for images converted at the same time, 0 for no limit */
+		MemoryBudget m_budget;	/**< Memory reserved by images being converted */
+		std::atomic<bool> m_success;	/**< All files processed so far were successful */
+		std::mutex m_outputMutex;	/**< Serializes console output of workers */
+		std::string m_statsFile;	/**< Path of run report file (JSON or CSV), empty for none */
+		RunStats m_stats;		/**< Timing and counters of the current run */
+		int m_progressFd;		/**< File descriptor receiving progress events, -1 for none */
+		double m_progressInterval;	/**< Minimum seconds between progress events */
+		ProgressReporter m_progress;	/**< Progress events writer */
+		bool m_scan;		/**< Only read the headers of the input folder files and show an inventory */
+		std::string m_shardArg;	/**< Shard given in the command line (index/count) */
+		unsigned int m_shardIndex;	/**< Shard of the input folder processed by this run, from 0 */
+		unsigned int m_shardCount;	/**< Number of shards the input folder is split in, 1 for no sharding */
+		std::string m_spoolFolder;	/**< Spool folder shared with other processes converting the same folder, empty for none */
+		double m_leaseSeconds;	/**< Seconds after which the spool lease of a file not touched expires */
+		std::unique_ptr<SpoolQueue> m_spool;	/**< Spool of the current batch run, NULL if not coordinating with other processes */
+		bool m_deduplicate;	/**< Convert JPEG files with the same content once, linking the outputs of the others */
+		std::unique_ptr<DedupIndex> m_dedup;	/**< Contents seen in the current batch run, NULL if not deduplicating */
+		std::string m_archiveFile;	/**< Tar archive receiving all outputs instead of the output folder, empty for none */
+		std::unique_ptr<ArchiveWriter> m_archive;	/**< Archive of the current batch run, NULL if writing to the output folder */
+		std::unique_ptr<TarReader> m_tar;	/**< Tar archive given as input folder, NULL if reading a folder */
+		std::string m_durabilityName;	/**< Name of durability policy of output files */
+		int m_durability;	/**< Durability policy of output files (see @ref DURABILITY_POLICIES) */
+		int m_syncBatch;	/**< Files published after every flush of the output filesystems with DURABILITY_BATCH */
+		std::unique_ptr<PublishBatch> m_publisher;	/**< Publisher of output files of the current batch run, NULL unless DURABILITY_BATCH */
+		ScanInventory m_inventory;	/**< Headers found by the current scan */
 
 		bool parseArguments();
+		void configureConverter(IccConverter&);
+		int runStream();
+		int runScan();
+		bool listInputFolder(std::vector<std::string>&, std::vector<unsigned long long>&, unsigned long long&, unsigned long&);
+		bool listInputArchive(std::vector<std::string>&, std::vector<unsigned long long>&, unsigned long long&, unsigned long&);
+		bool createSubfolders(const std::vector<std::string>&);
+		static bool isInputArchive(const std::string&);
+		static bool parseShard(const std::string&, unsigned int&, unsigned int&);
+		void scanWorker(const std::vector<std::string>&, const std::vector<unsigned long long>&, std::atomic<size_t>*, std::vector<unsigned long long>*, IccCache*);
+		void estimateBatch(const std::vector<std::string>&, const std::vector<unsigned long long>&, IccCache&);
+		void batchWorker(int, const std::vector<std::string>&, const std::vector<unsigned long long>&, const std::vector<unsigned long long>&, IccCache*);
+		void estimateWorker(std::atomic<size_t>*, const std::vector<std::string>&, const std::vector<unsigned long long>&, std::vector<unsigned long long>&, std::vector<unsigned long long>&, IccCache*);
+		bool nextFile(int, const std::vector<unsigned long long>&, size_t&);
+		bool readJpegHeader(const std::string&, std::vector<char>&, size_t&, JpegImageInfo&, bool&);
+		static bool isJpegFile(const std::string&);
+		bool processFile(IccConverter&, const std::string&);
+		void processFileAsync(IccConverter&, size_t, unsigned long long, unsigned long long, const std::string&);
+		void finishAsyncFile(std::shared_ptr<AsyncFile>);
+		void getCopyPaths(const std::string&, std::vector<std::string>&);
+		void getOutputPaths(const std::string&, std::vector<std::string>&);
+		bool deduplicate(size_t, const std::string&, const char*, size_t);
+		void finishDuplicates(size_t, const std::string&, bool);
+		void linkDuplicate(const std::string&, const DedupFile&, bool);
+		bool linkFile(const std::string&, const std::string&);
+		void startIoEngine(size_t);
+		bool copyToOutputs(const std::string&);
+		static bool parseMemorySize(const std::string&, unsigned long long&);
+		bool parseRendition(const std::string&, RenditionSpec&);
+		bool applyCodecOption(const std::string&, const std::string&);
+		void reportResult(const std::string&, const ConversionResult&, bool);
+		bool writeReport();
+		double secondsSince(const std::chrono::steady_clock::time_point&);
+		static void showProgress(unsigned int, unsigned int, void*);
 		void showHelp();
 		bool copyFile(const std::string&,const std::string&);
+		void stageFile(const std::string&, const std::string&);
 		bool createDirectory(const std::string&);
+		bool isStreamMode();
 		bool outputToSameDirectory();
 
 	public:
@@ -7,19 +7,59 @@
 #include "icc_adobergb.h"
 #include "iccprofile.h"
 
+/**
+ * Read-only stream buffer over a block of memory, so that JPEG markers
+ * can be scanned from memory without copying the data.
+ */
+class MemoryStreamBuffer : public std::streambuf {
+	public:
+		MemoryStreamBuffer(const char* data, unsigned long size) {
+			char* begin = const_cast<char*>(data);
+			setg(begin,begin,begin+size);
+		}
+
+	protected:
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) {
+			char* target = egptr()+off;
+			if (dir == std::ios_base::beg) {
+				target = eback()+off;
+			} else if (dir == std::ios_base::cur) {
+				target = gptr()+off;
+			}
+			if ((target < eback()) || (target > egptr())) {
+				return pos_type(off_type(-1));
+			}
+			setg(eback(),target,egptr());
+			return pos_type(target-eback());
+		}
+
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which) {
+			return seekoff(off_type(pos),std::ios_base::beg,which);
+		}
+};
+
 /**
  * Default constructor with empty initializations.
  */
-IccProfile::IccProfile():m_hprofile(NULL)
+IccProfile::IccProfile():m_context(NULL),m_hprofile(NULL),m_exifColorSpace(0)
 {
 	m_profileSource.clear();
 	m_profileName.clear();
 }
 
+/**
+ * Constructor creating the profile in a LittleCMS context
+ *
+ * @param[in] context The context, NULL for the global context
+ */
+IccProfile::IccProfile(cmsContext context):m_context(context),m_hprofile(NULL),m_exifColorSpace(0)
+{
+}
+
 /**
  * Copy constructor.
  */
-IccProfile::IccProfile(const IccProfile& iccprofile):m_hprofile(NULL) {
+IccProfile::IccProfile(const IccProfile& iccprofile):m_context(iccprofile.m_context),m_hprofile(NULL),m_exifColorSpace(iccprofile.m_exifColorSpace) {
 	if (iccprofile.isValid()) {
 		// Save original profile to memory
 		cmsUInt32Number bytesNeeded = 0;
@@ -28,7 +68,7 @@ IccProfile::IccProfile(const IccProfile& iccprofile):m_hprofile(NULL) {
 		cmsSaveProfileToMem(iccprofile.getHandle(),(void *)buffer,&bytesNeeded);
 
 		// Load from memory into new profile
-		m_hprofile = cmsOpenProfileFromMem((const void*) buffer, bytesNeeded);
+		m_hprofile = cmsOpenProfileFromMemTHR(m_context,(const void*) buffer, bytesNeeded);
 		delete[] buffer;
 	}
 
@@ -53,13 +93,14 @@ IccProfile& IccProfile::operator=(const IccProfile& iccprofile) {
 		cmsSaveProfileToMem(iccprofile.getHandle(),(void *)buffer,&bytesNeeded);
 
 		// Load from memory into new profile
-		m_hprofile = cmsOpenProfileFromMem((const void*) buffer, bytesNeeded);
+		m_hprofile = cmsOpenProfileFromMemTHR(m_context,(const void*) buffer, bytesNeeded);
 		delete[] buffer;
 	}
 
 	// Store text descriptions
 	m_profileSource = iccprofile.getSource();
 	m_profileName = iccprofile.getName();
+	m_exifColorSpace = iccprofile.m_exifColorSpace;
 
 	return *this;
 }
@@ -88,28 +129,12 @@ bool IccProfile::loadFromFile(const std::string& filename) {
 	transform(lower.begin(),lower.end(),lower.begin(),::tolower);
 	if ((lower.rfind(".jpg") == lower.size()-4) || (lower.rfind(".jpeg") == lower.size()-5)) {
 		// Load ICC Profile from JPEG
-		unsigned long profileSize = 0;
-		char *profileBuffer = NULL;
-		unsigned int exifProfile = 0;
-		if (extractIccProfile(filename,&profileBuffer,profileSize,exifProfile)) {
-			if (profileSize > 0) {
-				// Embedded ICC Profile 
-				m_hprofile = cmsOpenProfileFromMem((const void*) profileBuffer, (cmsUInt32Number) profileSize);
-				delete[] profileBuffer;
-				m_profileSource = "Embedded";
-			} else if (exifProfile == 2) { 
-				// EXIF AdobeRGB
-				m_hprofile = cmsOpenProfileFromMem((const void*) iccAdobeRGB, (cmsUInt32Number) iccAdobeRGB_size);
-				m_profileSource = "EXIF";
-			} else if (exifProfile == 1) { 
-				// EXIF sRGB
-				m_hprofile = cmsCreate_sRGBProfile();
-				m_profileSource = "EXIF";
-			}
-		}
+		std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
+		loadFromJpegStream(f);
+		f.close();
 	} else {
 		// Load standard ICC Profile file
-		m_hprofile = cmsOpenProfileFromFile(filename.c_str(),"r");
+		m_hprofile = cmsOpenProfileFromFileTHR(m_context,filename.c_str(),"r");
 		if  (m_hprofile != NULL) {
 			m_profileSource = "File";
 		}
@@ -123,6 +148,67 @@ bool IccProfile::loadFromFile(const std::string& filename) {
 	return (m_hprofile != NULL);
 }
 
+/**
+ * Loads ICC profile from JPEG data held in a memory buffer.
+ *
+ * The buffer is scanned for embedded ICC Profile data and for Exif
+ * metadata, exactly as @ref IccProfile#loadFromFile does with JPEG files.
+ * Only the JPEG header is needed, so the buffer may hold just the bytes
+ * up to the first non-APPn marker.
+ *
+ * @param[in] buffer Pointer to the memory buffer holding JPEG data
+ * @param[in] bufferSize Size of the memory buffer
+ * @return true if profile was sucessfully loaded, false otherwise
+ */
+bool IccProfile::loadFromJpegMem(const char* buffer, const unsigned long bufferSize) {
+	// Clear current profile data
+	clear();
+
+	// Scan JPEG markers straight from memory
+	MemoryStreamBuffer streamBuffer(buffer,bufferSize);
+	std::istream stream(&streamBuffer);
+	loadFromJpegStream(stream);
+
+	// Store the name of the profile
+	if (m_hprofile != NULL) {
+		m_profileName = extractProfileName();
+	}
+
+	return (m_hprofile != NULL);
+}
+
+/**
+ * Loads the ICC profile found in a JPEG stream (embedded profile or
+ * Exif color space information).
+ *
+ * @param[in] f The stream positioned at the start of the JPEG data
+ * @return true if a profile was found and loaded, false otherwise
+ */
+bool IccProfile::loadFromJpegStream(std::istream& f) {
+	unsigned long profileSize = 0;
+	char *profileBuffer = NULL;
+	unsigned int exifProfile = 0;
+	if (extractIccProfile(f,&profileBuffer,profileSize,exifProfile)) {
+		m_exifColorSpace = exifProfile;
+		if (profileSize > 0) {
+			// Embedded ICC Profile 
+			m_hprofile = cmsOpenProfileFromMemTHR(m_context,(const void*) profileBuffer, (cmsUInt32Number) profileSize);
+			delete[] profileBuffer;
+			m_profileSource = "Embedded";
+		} else if (exifProfile == 2) { 
+			// EXIF AdobeRGB
+			m_hprofile = cmsOpenProfileFromMemTHR(m_context,(const void*) iccAdobeRGB, (cmsUInt32Number) iccAdobeRGB_size);
+			m_profileSource = "EXIF";
+		} else if (exifProfile == 1) { 
+			// EXIF sRGB
+			m_hprofile = cmsCreate_sRGBProfileTHR(m_context);
+			m_profileSource = "EXIF";
+		}
+	}
+
+	return (m_hprofile != NULL);
+}
+
 /**
  * Loads ICC profile from a memory buffer
  *
@@ -135,7 +221,7 @@ bool IccProfile::loadFromMem(const char* buffer, const long bufferSize) {
 	clear();
 
 	// Load profile from memory
-	m_hprofile = cmsOpenProfileFromMem((const void*) buffer, (cmsUInt32Number) bufferSize);
+	m_hprofile = cmsOpenProfileFromMemTHR(m_context,(const void*) buffer, (cmsUInt32Number) bufferSize);
 	if  (m_hprofile != NULL) {
 		m_profileSource = "Memory";
 		m_profileName = extractProfileName();
@@ -152,7 +238,7 @@ void IccProfile::loadSRGB() {
 	clear();
 
 	// Load sRGB profile
-	m_hprofile = cmsCreate_sRGBProfile();
+	m_hprofile = cmsCreate_sRGBProfileTHR(m_context);
 	m_profileSource = "Library";
 	m_profileName = extractProfileName();
 }
@@ -167,8 +253,8 @@ void IccProfile::loadGray(double gamma) {
 	clear();
 	
 	// Load grayscale profile
-	cmsToneCurve* GammaCurve = cmsBuildGamma(0, gamma);
-	m_hprofile = cmsCreateGrayProfile(cmsD50_xyY(), GammaCurve);
+	cmsToneCurve* GammaCurve = cmsBuildGamma(m_context, gamma);
+	m_hprofile = cmsCreateGrayProfileTHR(m_context, cmsD50_xyY(), GammaCurve);
 	cmsFreeToneCurve(GammaCurve);
 	m_profileSource = "Library";
 	m_profileName = extractProfileName();
@@ -217,6 +303,17 @@ std::string IccProfile::getSource() const {
 	return m_profileSource;
 }
 
+/**
+ * Returns the EXIF color space found in the JPEG data the profile was
+ * loaded from, even if an embedded profile was used instead
+ *
+ * @return 0 if not found, 1 for sRGB, 2 for AdobeRGB (uncalibrated with
+ * AdobeRGB primaries), 0xFFFF for other uncalibrated color spaces
+ */
+unsigned int IccProfile::getExifColorSpace() const {
+	return m_exifColorSpace;
+}
+
 /**
  * Returns a text description of the name stored inside the ICC profile
  *
@@ -243,6 +340,7 @@ std::string IccProfile::getName() const {
 void IccProfile::clear() {
 	m_profileSource.clear();
 	m_profileName.clear();
+	m_exifColorSpace = 0;
 	if (m_hprofile != NULL) {
 		cmsCloseProfile(m_hprofile);
 		m_hprofile = NULL;
@@ -301,7 +399,42 @@ cmsUInt32Number IccProfile::getNumChannels() {
 }
 
 /**
- * Gets ICC profiles embedded in JPEG files.
+ * Gets the number of channels in the loaded ICC profile.
+ * This is a const version of @ref IccProfile#getNumChannels
+ *
+ * @return Number of channels of the ICC profile, or 0 if no profile has been loaded
+ */
+cmsUInt32Number IccProfile::getNumChannels() const {
+	cmsUInt32Number channels = 0;
+	if (m_hprofile != NULL) {
+		channels = cmsChannelsOf(cmsGetColorSpace(m_hprofile));
+	}
+	return channels;
+}
+
+/**
+ * Serializes the loaded ICC profile, e.g. for embedding it in JPEG files
+ *
+ * @param[out] data Receives the profile data, empty if no profile has been loaded
+ * @return true if the profile has been serialized, false otherwise
+ */
+bool IccProfile::saveToMem(std::string& data) const {
+	data.clear();
+	cmsUInt32Number length = 0;
+	if ((m_hprofile == NULL) || !cmsSaveProfileToMem(m_hprofile,NULL,&length)) {
+		return false;
+	}
+	data.resize(length);
+	if (!cmsSaveProfileToMem(m_hprofile,(void*) &data[0],&length)) {
+		data.clear();
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Gets ICC profiles embedded in JPEG files or JPEG data held in memory.
  *
  * If an ICC profile is embedded in the JPEG file, it is loaded into a memory buffer. Besides that,
  * EXIF data on color profiles of the image is also stored.
@@ -310,16 +443,16 @@ cmsUInt32Number IccProfile::getNumChannels() {
  * profileBuffer parameter. The calling code will be responsible for freeing this buffer
  * when it is no longer needed.
  *
- * @param[in] filename Path to the JPEG file
+ * @param[in] f Stream positioned at the start of the JPEG data
  * @param[out] profileBuffer Memory buffer where the embedded profile will be loaded
  * @param[out] profileSize Size in bytes of the embedded profile if detected, 0 if not found
  * @param[out] exifProfile EXIF color profile code: 0=Not found,  1=sRGB, 2=AdobeRGB, 0xFFFF=undefined
- * @return true if file could be scanned for ICC profiles, false if some error happened 
+ * @return true if data could be scanned for ICC profiles, false if some error happened 
  */
-bool IccProfile::extractIccProfile(std::string filename, char** profileBuffer, unsigned long &profileSize, unsigned int &exifProfile) {
+bool IccProfile::extractIccProfile(std::istream& f, char** profileBuffer, unsigned long &profileSize, unsigned int &exifProfile) {
 
 	// JPEG Markers 
-	char SOI[] = {0xFF,0xD8};
+	char SOI[] = {(char)0xFF,(char)0xD8};
 	char ICC_TAG[] = {'I','C','C','_','P','R','O','F','I','L','E',0};
 	char EXIF_TAG[] = {'E','x','i','f',0,0};
 
@@ -332,13 +465,9 @@ bool IccProfile::extractIccProfile(std::string filename, char** profileBuffer, u
 	unsigned long iccProfileSize = 0;
 	unsigned int exifColorSpace = 0;
 
-	// Open file 
-	std::ifstream f(filename.c_str(), std::ios::in | std::ios::binary);
-
 	try {
 		// Detect JPEG start 
 		if (!readBytesAndCompare(f,buffer,2,SOI)) {
-			f.close();
 			return false;
 		}
 
@@ -347,7 +476,6 @@ bool IccProfile::extractIccProfile(std::string filename, char** profileBuffer, u
 		while (!finished) {
 			readBytes(f,buffer,2);
 			if (buffer[0] != (char)0xFF) {		// Invalid marker 
-				f.close();
 				return false;
 			}
 			switch (buffer[1]) {
@@ -469,6 +597,7 @@ bool IccProfile::extractIccProfile(std::string filename, char** profileBuffer, u
 				case JPEG_MARKER_APP13:
 				case JPEG_MARKER_APP14:
 				case JPEG_MARKER_APP15:
+				case JPEG_MARKER_COM:
 					// Skip other JPEG markers
 					readBytes(f,buffer,2);
 					markerLength = (((unsigned char) buffer[0]) << 8) | ((unsigned char) buffer[1]);
@@ -498,25 +627,21 @@ bool IccProfile::extractIccProfile(std::string filename, char** profileBuffer, u
 		exifProfile = exifColorSpace;
 
 	} catch (int e) {
-		f.close();
 		return false;
 	}
 
-	// Close file 
-	f.close();
-
 	return true;
 }
 
 /**
  * Reads bytes from a file into a memory buffer
  *
- * @param[in] f The ifstream from where to read
+ * @param[in] f The stream from where to read
  * @param[out] buffer The memory buffer where data will be stored
  * @param[in] length The number of bytes to read
  * @throw Integer "1" if reading from the file fails
  */
-void IccProfile::readBytes(std::ifstream &f, char *buffer, long length) {
+void IccProfile::readBytes(std::istream &f, char *buffer, long length) {
 	f.read(buffer,length);
 	if (f.fail()) {
 		throw 1;
@@ -527,14 +652,14 @@ void IccProfile::readBytes(std::ifstream &f, char *buffer, long length) {
  * Reads bytes from a file into a memory buffer and compares them to another
  * memory buffer.
  *
- * @param[in] f The ifstream from where to read
+ * @param[in] f The stream from where to read
  * @param[out] buffer The memory buffer where data will be stored
  * @param[in] length The number of bytes to read
  * @param[in] compare The memory buffer with the data to compare to.
  * @throw Integer "1" if reading from the file fails
  * @return true if the bytes read match the bytes to compare, false if different
  */
-bool IccProfile::readBytesAndCompare(std::ifstream &f, char *buffer, long length, char *compare) {
+bool IccProfile::readBytesAndCompare(std::istream &f, char *buffer, long length, char *compare) {
 	readBytes(f,buffer,length);
 	return (memcmp(buffer,compare,length) == 0);
 }
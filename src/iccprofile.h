@@ -1,20 +1,27 @@
 #ifndef ICCPROFILE_H
 #define ICCPROFILE_H
 
+#include <string>
+#include <istream>
 #include <lcms2.h>
 
 /**
  * IccProfile objects represent an ICC color profile.
  *
+ * Profiles are created in the LittleCMS context given on construction
+ * (the global context by default), which must outlive them. Copies are
+ * created in the context of the copied profile.
  */
 class IccProfile {
 	public:
 		IccProfile();
+		explicit IccProfile(cmsContext);
 		~IccProfile();
 		IccProfile(const IccProfile&);
 		IccProfile& operator=(const IccProfile&);
 		bool loadFromFile(const std::string&);
 		bool loadFromMem(const char*,const long);
+		bool loadFromJpegMem(const char*,const unsigned long);
 		void loadSRGB();
 		void loadGray(double);
 		bool isValid() const;
@@ -22,23 +29,29 @@ class IccProfile {
 		cmsHPROFILE getHandle();
 		cmsHPROFILE getHandle() const;
 		cmsUInt32Number getNumChannels();
+		cmsUInt32Number getNumChannels() const;
 		std::string getSource();
 		std::string getSource() const;
 		std::string getName();
 		std::string getName() const;
+		unsigned int getExifColorSpace() const;
+		bool saveToMem(std::string&) const;
 
 	private:
-		void readBytes(std::ifstream&, char*, long);
-		bool readBytesAndCompare(std::ifstream&, char*, long, char*);
+		void readBytes(std::istream&, char*, long);
+		bool readBytesAndCompare(std::istream&, char*, long, char*);
 		unsigned int exifReadWord(const char*, const bool);
 		unsigned long exifReadLong(const char*, const bool);
-		bool extractIccProfile(const std::string, char**, unsigned long&, unsigned int&);
+		bool extractIccProfile(std::istream&, char**, unsigned long&, unsigned int&);
+		bool loadFromJpegStream(std::istream&);
 		void clear();
 		std::string extractProfileName();
 
+		cmsContext m_context;			/**< LittleCMS context of the profile, NULL for the global context */
 		cmsHPROFILE m_hprofile;			/**< Handle to corresponding LittleCMS library icc profile */
 		std::string m_profileSource; 	/**< Tells how the ICC profile was found (embedded, EXIF,...) */
 		std::string m_profileName;		/**< Name embedded in the ICC profile */
+		unsigned int m_exifColorSpace;	/**< EXIF color space of the JPEG data the profile was loaded from: 0=Not found, 1=sRGB, 2=AdobeRGB, 0xFFFF=undefined */
 
 };
 
@@ -61,7 +74,8 @@ enum JPEG_MARKERS {
 	JPEG_MARKER_APP12 = (char)0xEC,
 	JPEG_MARKER_APP13 = (char)0xED,
 	JPEG_MARKER_APP14 = (char)0xEE,
-	JPEG_MARKER_APP15 = (char)0xEF
+	JPEG_MARKER_APP15 = (char)0xEF,
+	JPEG_MARKER_COM   = (char)0xFE
 };
 
 #endif
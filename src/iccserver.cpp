@@ -0,0 +1,414 @@
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "iccserver.h"
+
+/**
+ * Maximum accepted size of request options
+ */
+const uint32_t SERVER_MAX_OPTIONS = 65536;
+
+/**
+ * Maximum accepted size of a JPEG image in a request
+ */
+const uint32_t SERVER_MAX_IMAGE = 1024*1024*1024;
+
+/**
+ * Seconds between shutdown checks while waiting for client data
+ */
+const int SERVER_POLL_SECONDS = 1;
+
+/**
+ * Seconds a connection can stay idle between requests before it is closed
+ */
+const int SERVER_IDLE_SECONDS = 30;
+
+/**
+ * Set by signal handlers when the server has to shut down
+ */
+static volatile sig_atomic_t s_stopRequested = 0;
+
+/**
+ * Handler for termination signals
+ */
+static void requestStop(int) {
+	s_stopRequested = 1;
+}
+
+/**
+ * Main constructor.
+ *
+ * @param[in] socketPath Path of the Unix domain socket to listen on
+ * @param[in] workers Number of worker threads (at least 1)
+ * @param[in] profileFolder Folder with the output profiles requests can choose, empty to only allow the default profile
+ * @param[in] setup Function preparing converters with the default settings
+ */
+IccServer::IccServer(const std::string& socketPath, int workers, const std::string& profileFolder, ConverterSetup setup)
+:m_socketPath(socketPath),
+ m_workers(workers > 0 ? workers : 1),
+ m_profileFolder(profileFolder),
+ m_setup(setup),
+ m_stopping(false)
+{
+}
+
+/**
+ * Runs the server until SIGINT or SIGTERM is received.
+ *
+ * @return 0 on clean shutdown, a non-zero error code otherwise
+ */
+int IccServer::run() {
+	// Check socket path
+	sockaddr_un address;
+	memset(&address,0,sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (m_socketPath.empty() || (m_socketPath.size() >= sizeof(address.sun_path))) {
+		std::cerr << "Invalid socket path: " << m_socketPath << std::endl;
+		return 5;
+	}
+	strncpy(address.sun_path,m_socketPath.c_str(),sizeof(address.sun_path)-1);
+
+	// Create listening socket, replacing any stale socket file
+	int listenFd = socket(AF_UNIX,SOCK_STREAM,0);
+	if (listenFd < 0) {
+		std::cerr << "Failed to create socket" << std::endl;
+		return 5;
+	}
+	unlink(m_socketPath.c_str());
+	if ((bind(listenFd,(sockaddr*) &address,sizeof(address)) != 0) || (listen(listenFd,64) != 0)) {
+		std::cerr << "Failed to listen on " << m_socketPath << std::endl;
+		close(listenFd);
+		return 5;
+	}
+
+	// Stop on termination signals, and don't die when clients go away
+	struct sigaction action;
+	memset(&action,0,sizeof(action));
+	action.sa_handler = requestStop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT,&action,NULL);
+	sigaction(SIGTERM,&action,NULL);
+	signal(SIGPIPE,SIG_IGN);
+
+	// Start workers, with termination signals blocked so that they interrupt accept()
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals,SIGINT);
+	sigaddset(&signals,SIGTERM);
+	pthread_sigmask(SIG_BLOCK,&signals,NULL);
+	std::vector<std::thread> threads;
+	for (int i=0; i<m_workers; i++) {
+		threads.push_back(std::thread(&IccServer::workerLoop,this));
+	}
+	pthread_sigmask(SIG_UNBLOCK,&signals,NULL);
+	std::cout << "Listening on " << m_socketPath << " with " << m_workers << " workers" << std::endl;
+
+	// Accept connections and queue them for workers
+	while (!s_stopRequested) {
+		int fd = accept(listenFd,NULL,NULL);
+		if (fd < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED)) {
+				continue;
+			}
+			std::cerr << "Failed to accept connection" << std::endl;
+			break;
+		}
+		timeval timeout;
+		timeout.tv_sec = SERVER_POLL_SECONDS;
+		timeout.tv_usec = 0;
+		setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_connections.push_back(fd);
+		m_ready.notify_one();
+	}
+
+	// Shut down: workers finish their current connection and exit
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+		m_ready.notify_all();
+	}
+	for (size_t i=0; i<threads.size(); i++) {
+		threads[i].join();
+	}
+	while (!m_connections.empty()) {
+		close(m_connections.front());
+		m_connections.pop_front();
+	}
+	close(listenFd);
+	unlink(m_socketPath.c_str());
+
+	return 0;
+}
+
+/**
+ * Worker thread main loop: takes queued connections and serves them
+ * with its own converter.
+ */
+void IccServer::workerLoop() {
+	IccConverter converter;
+	converter.setCache(&m_cache);
+	while (true) {
+		int fd = -1;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (!m_stopping && m_connections.empty()) {
+				m_ready.wait(lock);
+			}
+			if (m_stopping) {
+				return;
+			}
+			fd = m_connections.front();
+			m_connections.pop_front();
+		}
+		serveConnection(fd,converter);
+		close(fd);
+	}
+}
+
+/**
+ * Serves all requests sent through a client connection, until the client
+ * closes it, sends an invalid request or leaves it idle (see
+ * @ref IccServer#waitForRequest).
+ *
+ * @param[in] fd The connection socket
+ * @param[in] converter The converter of the worker serving the connection
+ */
+void IccServer::serveConnection(int fd, IccConverter& converter) {
+	std::string options;
+	std::vector<char> image;
+	std::string output;
+	std::string error;
+	ConversionResult result;
+	uint32_t length = 0;
+	while (!s_stopRequested && waitForRequest(fd) && readUint32(fd,length)) {
+		// Read options
+		if (length > SERVER_MAX_OPTIONS) {
+			sendResponse(fd,SERVER_STATUS_BAD_REQUEST,"Options too long");
+			return;
+		}
+		options.resize(length);
+		if ((length > 0) && !readFully(fd,&options[0],length)) {
+			return;
+		}
+
+		// Read JPEG data
+		if (!readUint32(fd,length)) {
+			return;
+		}
+		if (length > SERVER_MAX_IMAGE) {
+			sendResponse(fd,SERVER_STATUS_BAD_REQUEST,"Image too large");
+			return;
+		}
+		image.resize(length);
+		if ((length > 0) && !readFully(fd,&image[0],length)) {
+			return;
+		}
+
+		// Convert with the default settings plus the request options
+		m_setup(converter);
+		converter.setCache(&m_cache);
+		if (!applyOptions(options,converter,error)) {
+			if (!sendResponse(fd,SERVER_STATUS_BAD_REQUEST,error)) {
+				return;
+			}
+			continue;
+		}
+		bool success = converter.convertBuffer(image.empty() ? NULL : &image[0],image.size(),output,result);
+		if (!sendResponse(fd,success ? SERVER_STATUS_OK : SERVER_STATUS_FAILED,success ? output : result.errorMessage)) {
+			return;
+		}
+	}
+}
+
+/**
+ * Waits for the next request of a connection. Idle connections are closed
+ * after SERVER_IDLE_SECONDS, or as soon as other connections are waiting
+ * for a worker, so that idle keep-alive clients can't hold all workers.
+ *
+ * @param[in] fd The connection socket
+ * @return true if data (or the end of the stream) is ready, false if the connection has to be closed
+ */
+bool IccServer::waitForRequest(int fd) {
+	int idleSeconds = 0;
+	while (!s_stopRequested) {
+		pollfd request;
+		request.fd = fd;
+		request.events = POLLIN;
+		request.revents = 0;
+		int ready = poll(&request,1,SERVER_POLL_SECONDS*1000);
+		if (ready > 0) {
+			return true;
+		}
+		if (ready < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		idleSeconds += SERVER_POLL_SECONDS;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_connections.empty() || (idleSeconds >= SERVER_IDLE_SECONDS)) {
+			return false;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Applies the options of a request to a converter
+ *
+ * @param[in] options Options text, one "key=value" pair per line
+ * @param[in] converter The converter to set up
+ * @param[out] error Description of the first invalid option found
+ * @return true if all options are valid, false otherwise
+ */
+bool IccServer::applyOptions(const std::string& options, IccConverter& converter, std::string& error) {
+	std::istringstream lines(options);
+	std::string line;
+	while (std::getline(lines,line)) {
+		if (line.empty()) {
+			continue;
+		}
+		size_t separator = line.find('=');
+		std::string key = line.substr(0,separator);
+		std::string value = (separator != std::string::npos) ? line.substr(separator+1) : "";
+		bool valid = (separator != std::string::npos);
+		if (!valid) {
+			// Not a key=value pair
+		} else if (key == "profile") {
+			// Only plain file names inside the profile folder, so that clients can't read other files
+			valid = value.empty() || (!m_profileFolder.empty() && (value.find('/') == std::string::npos) && (value != ".") && (value != ".."));
+			if (valid && !value.empty()) {
+				converter.setOutputProfile(m_profileFolder + "/" + value);
+			}
+		} else if (key == "intent") {
+			valid = converter.setIntent(atoi(value.c_str()));
+		} else if (key == "quality") {
+			valid = converter.setJpegQuality(atoi(value.c_str()));
+		} else if (key == "bpc") {
+			converter.setBlackPointCompensation(value != "0");
+		} else if (key == "optimize") {
+			converter.setOptimization(value != "0");
+		} else if (key == "metadata") {
+			converter.setPreserveMetadata(value != "0");
+		} else if (key == "preset") {
+			CodecSettings codec;
+			valid = codec.setPreset(value);
+			if (valid) {
+				converter.setCodecSettings(codec);
+			}
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			error = "Invalid option: " + line;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Reads an exact number of bytes from a socket
+ *
+ * @param[in] fd The socket
+ * @param[out] buffer Where to store the data
+ * @param[in] length Number of bytes to read
+ * @return true if all bytes were read, false on error or end of stream
+ */
+bool IccServer::readFully(int fd, char* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t bytes = read(fd,buffer,length);
+		if (bytes < 0) {
+			if ((errno == EINTR) || (((errno == EAGAIN) || (errno == EWOULDBLOCK)) && !s_stopRequested)) {
+				continue;
+			}
+			return false;
+		}
+		if (bytes == 0) {
+			return false;
+		}
+		buffer += bytes;
+		length -= bytes;
+	}
+
+	return true;
+}
+
+/**
+ * Writes an exact number of bytes to a socket
+ *
+ * @param[in] fd The socket
+ * @param[in] buffer Data to write
+ * @param[in] length Number of bytes to write
+ * @return true if all bytes were written, false on error
+ */
+bool IccServer::writeFully(int fd, const char* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t bytes = write(fd,buffer,length);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buffer += bytes;
+		length -= bytes;
+	}
+
+	return true;
+}
+
+/**
+ * Reads a 32 bit big-endian unsigned integer from a socket
+ *
+ * @param[in] fd The socket
+ * @param[out] value The value read
+ * @return true if the value was read, false on error or end of stream
+ */
+bool IccServer::readUint32(int fd, uint32_t& value) {
+	unsigned char buffer[4];
+	if (!readFully(fd,(char*) buffer,4)) {
+		return false;
+	}
+	value = (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+
+	return true;
+}
+
+/**
+ * Sends a response to a client
+ *
+ * @param[in] fd The connection socket
+ * @param[in] status Status code (see @ref SERVER_STATUS)
+ * @param[in] payload Converted JPEG data or error message
+ * @return true if the response was sent, false on error
+ */
+bool IccServer::sendResponse(int fd, uint32_t status, const std::string& payload) {
+	unsigned char header[8];
+	uint32_t length = payload.size();
+	header[0] = (status >> 24) & 0xFF;
+	header[1] = (status >> 16) & 0xFF;
+	header[2] = (status >> 8) & 0xFF;
+	header[3] = status & 0xFF;
+	header[4] = (length >> 24) & 0xFF;
+	header[5] = (length >> 16) & 0xFF;
+	header[6] = (length >> 8) & 0xFF;
+	header[7] = length & 0xFF;
+
+	return writeFully(fd,(const char*) header,8) && writeFully(fd,payload.data(),payload.size());
+}
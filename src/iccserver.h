@@ -0,0 +1,75 @@
+#ifndef ICCSERVER_H
+#define ICCSERVER_H
+
+#include <string>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+#include "iccconverter.h"
+#include "icccache.h"
+
+/**
+ * Function preparing an IccConverter with the application settings
+ */
+typedef std::function<void(IccConverter&)> ConverterSetup;
+
+/**
+ * IccServer objects convert JPEG images sent by local clients through
+ * a Unix domain socket.
+ *
+ * All integers in the protocol are 32 bit unsigned, big-endian. Clients
+ * send any number of requests on a connection, each one made of:
+ *   - Options length, followed by the options text: "key=value" lines for
+ *     profile (file name in the server profile folder), intent (0-3), quality (0-100),
+ *     bpc (0/1) and optimize (0/1). Missing options take the server defaults.
+ *   - JPEG data length, followed by the JPEG data.
+ *
+ * Each request gets a response made of:
+ *   - Status code (see @ref SERVER_STATUS)
+ *   - Payload length, followed by the payload: the converted JPEG on
+ *     success, an error message otherwise.
+ *
+ * Connections are served by a pool of worker threads, each one with its own
+ * IccConverter. Profiles and transforms are shared by all workers. A
+ * connection idle between requests is closed after a while, or as soon as
+ * other connections are waiting for a worker.
+ */
+class IccServer {
+
+	public:
+		IccServer(const std::string&, int, const std::string&, ConverterSetup);
+		int run();
+
+	private:
+		std::string m_socketPath;			/**< Path of the Unix domain socket */
+		int m_workers;						/**< Number of worker threads */
+		std::string m_profileFolder;		/**< Folder with the profiles requests can choose, empty for none */
+		ConverterSetup m_setup;				/**< Prepares converters with the default settings */
+		IccCache m_cache;					/**< Profile and transform cache shared by workers */
+		std::mutex m_mutex;					/**< Protects the connection queue */
+		std::condition_variable m_ready;	/**< Signals new connections or shutdown to workers */
+		std::deque<int> m_connections;		/**< Accepted connections waiting for a worker */
+		bool m_stopping;					/**< Server is shutting down */
+
+		void workerLoop();
+		void serveConnection(int, IccConverter&);
+		bool waitForRequest(int);
+		bool applyOptions(const std::string&, IccConverter&, std::string&);
+		bool readFully(int, char*, size_t);
+		bool writeFully(int, const char*, size_t);
+		bool readUint32(int, uint32_t&);
+		bool sendResponse(int, uint32_t, const std::string&);
+};
+
+/**
+ * Status codes of server responses
+ */
+enum SERVER_STATUS {
+	SERVER_STATUS_OK = 0,				/**< Conversion successful, payload is the converted JPEG */
+	SERVER_STATUS_BAD_REQUEST = 1,		/**< Invalid options, payload is an error message */
+	SERVER_STATUS_FAILED = 2			/**< Conversion failed, payload is an error message */
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "globals.h"
+#include "ioengine.h"
+#include "publishbatch.h"
+#include "threadioengine.h"
+#include "uringioengine.h"
+
+/**
+ * Creates an empty slot
+ */
+IoEngine::ReadSlot::ReadSlot()
+:done(false) {
+}
+
+/**
+ * Creates an engine with no pending requests
+ */
+IoEngine::IoEngine()
+:m_pendingBytes(0),
+ m_pendingWrites(0),
+ m_maxPendingBytes(256ULL*1024*1024),
+ m_readBytes(0),
+ m_peakBytes(0),
+ m_durability(DURABILITY_NONE),
+ m_batch(NULL) {
+}
+
+/**
+ * Destructor. Implementations must have finished all requests.
+ */
+IoEngine::~IoEngine() {
+}
+
+/**
+ * Prepares the engine for a new list of input files, forgetting files
+ * read ahead and not taken
+ *
+ * @param[in] files Number of files in the list
+ */
+void IoEngine::reset(size_t files) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_slots.clear();
+	m_taken.assign(files,false);
+	m_readBytes = 0;
+}
+
+/**
+ * Sets how written files are made durable before they are moved to their
+ * final names. With DURABILITY_FILE, every file is flushed to storage
+ * before being moved, and its folder after it has been moved. With DURABILITY_BATCH, files are left under their
+ * temp names and handed to a publisher, which flushes and moves them in
+ * groups; write callbacks are called once files have been published.
+ * Must be called before writing files.
+ *
+ * @param[in] durability The durability policy (see @ref DURABILITY_POLICIES)
+ * @param[in] batch Publisher of written files for DURABILITY_BATCH, owned by the caller
+ */
+void IoEngine::setDurability(int durability, PublishBatch* batch) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_durability = durability;
+	m_batch = (durability == DURABILITY_BATCH) ? batch : NULL;
+}
+
+/**
+ * Starts reading an input file, unless it is already being read or it has
+ * been taken by a worker
+ *
+ * @param[in] index Index of the file in the list
+ * @param[in] path Path of the file
+ */
+void IoEngine::prefetch(size_t index, const std::string& path) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if ((index >= m_taken.size()) || m_taken[index] || (m_slots.find(index) != m_slots.end())) {
+		return;
+	}
+	std::shared_ptr<ReadSlot> slot(new ReadSlot());
+	m_slots[index] = slot;
+	lock.unlock();
+	startRead(slot,path);
+}
+
+/**
+ * Gets the contents of an input file, waiting for it to be read if needed.
+ * Files not read ahead are read now.
+ *
+ * @param[in] index Index of the file in the list
+ * @param[in] path Path of the file
+ * @param[out] data Contents of the file
+ * @param[out] error Error message if the file can't be read
+ * @return true if the file was read, false otherwise
+ */
+bool IoEngine::take(size_t index, const std::string& path, std::string& data, std::string& error) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (index < m_taken.size()) {
+		m_taken[index] = true;
+	}
+	std::shared_ptr<ReadSlot> slot;
+	std::map<size_t, std::shared_ptr<ReadSlot> >::iterator it = m_slots.find(index);
+	if (it != m_slots.end()) {
+		slot = it->second;
+	} else {
+		slot.reset(new ReadSlot());
+		m_slots[index] = slot;
+		lock.unlock();
+		startRead(slot,path);
+		lock.lock();
+	}
+	while (!slot->done) {
+		m_changed.wait(lock);
+	}
+	data.swap(slot->data);
+	error = slot->error;
+	m_slots.erase(index);
+	m_readBytes -= data.size();
+
+	return error.empty();
+}
+
+/**
+ * Writes a file in the background. Waits first if too much data is
+ * already being written, so that memory use stays bounded.
+ *
+ * @param[in] path Final path of the file
+ * @param[in,out] data Contents of the file (the string is left empty)
+ * @param[in] callback Function called when the write finishes, from any thread
+ * @param[in] stored Function called before callback, as soon as the contents have been written
+ * and are no longer held in memory (before being published with DURABILITY_BATCH), empty for none
+ */
+void IoEngine::write(const std::string& path, std::string& data, IoWriteCallback callback, IoWriteCallback stored) {
+	unsigned long long size = data.size();
+	bool sync = false;
+	bool publish = true;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while ((m_pendingWrites > 0) && (m_pendingBytes + size > m_maxPendingBytes)) {
+			m_changed.wait(lock);
+		}
+		m_pendingBytes += size;
+		m_pendingWrites++;
+		updatePeak();
+		sync = (m_durability == DURABILITY_FILE);
+		publish = (m_batch == NULL);
+	}
+
+	IoRequest* request = new IoRequest();
+	request->type = IO_REQUEST_WRITE;
+	request->path = path;
+	request->tempPath = path + ".tmp";
+	request->sync = sync;
+	request->publish = publish;
+	request->data.swap(data);
+	request->done = [this,size,callback,stored](IoRequest* request) {
+		if (request->sync && request->publish && request->error.empty() && !syncFolder(getParentFolder(request->path))) {
+			request->error = "Failed to flush the folder of " + request->path + " to storage";
+		}
+		if (stored) {
+			stored(request->error);
+		}
+		if (!request->publish && request->error.empty()) {
+			m_batch->add(request->tempPath,request->path,callback);
+		} else {
+			callback(request->error);
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_pendingBytes -= size;
+		m_pendingWrites--;
+		m_changed.notify_all();
+	};
+	submit(request);
+}
+
+/**
+ * Waits until all writes have finished and their callbacks have returned.
+ * With DURABILITY_BATCH, files may still be waiting in the publisher, whose
+ * callbacks are called when it is flushed.
+ */
+void IoEngine::wait() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (m_pendingWrites > 0) {
+		m_changed.wait(lock);
+	}
+}
+
+/**
+ * Gets the highest amount of file data held by the engine: files read
+ * ahead and not taken yet plus files being written
+ *
+ * @return Peak bytes
+ */
+unsigned long long IoEngine::getPeakBytes() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peakBytes;
+}
+
+/**
+ * Finishes a request: calls its completion handler and deletes it
+ *
+ * @param[in] request The request
+ */
+void IoEngine::complete(IoRequest* request) {
+	request->done(request);
+	delete request;
+}
+
+/**
+ * Submits the read request of an input file
+ *
+ * @param[in] slot Slot receiving the contents of the file
+ * @param[in] path Path of the file
+ */
+void IoEngine::startRead(std::shared_ptr<ReadSlot> slot, const std::string& path) {
+	IoRequest* request = new IoRequest();
+	request->type = IO_REQUEST_READ;
+	request->path = path;
+	request->done = [this,slot](IoRequest* request) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		slot->data.swap(request->data);
+		slot->error = request->error;
+		slot->done = true;
+		m_readBytes += slot->data.size();
+		updatePeak();
+		m_changed.notify_all();
+	};
+	submit(request);
+}
+
+/**
+ * Updates the peak amount of data held. Must be called with the mutex locked.
+ */
+void IoEngine::updatePeak() {
+	if (m_readBytes + m_pendingBytes > m_peakBytes) {
+		m_peakBytes = m_readBytes + m_pendingBytes;
+	}
+}
+
+/**
+ * Creates an I/O engine
+ *
+ * @param[in] engine The engine type (see @ref IO_ENGINES)
+ * @param[in] concurrency Number of file operations run at the same time
+ * @return The new engine, owned by the caller, or NULL if the engine is not available
+ * (not built, or not supported by the kernel)
+ */
+IoEngine* createIoEngine(int engine, int concurrency) {
+	switch (engine) {
+		case IO_ENGINE_THREADS:
+			return new ThreadIoEngine(concurrency);
+#ifdef ICCFLOW_IO_URING
+		case IO_ENGINE_URING: {
+			UringIoEngine* uring = new UringIoEngine(concurrency);
+			if (!uring->isReady()) {
+				delete uring;
+				return NULL;
+			}
+			return uring;
+		}
+#endif
+		default:
+			return NULL;
+	}
+}
@@ -0,0 +1,125 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * File I/O engines for batch runs
+ */
+enum IO_ENGINES {
+	IO_ENGINE_SYNC = 0,		/**< No engine: converters read and write files themselves, line by line */
+	IO_ENGINE_THREADS,		/**< Pool of I/O threads doing blocking calls */
+	IO_ENGINE_URING			/**< Linux io_uring, a single thread submitting batches of calls (built with IO_URING=1) */
+};
+
+/**
+ * Function called when a file write finishes, with the error message
+ * (empty on success)
+ */
+typedef std::function<void(const std::string&)> IoWriteCallback;
+
+class PublishBatch;
+
+/**
+ * Interface of asynchronous file I/O engines.
+ *
+ * Input files are read whole into memory, ahead of the workers that need
+ * them, and converted images are written from memory in the background, so
+ * that storage latency overlaps with decoding and encoding. Files are
+ * written to a temp name and then moved to their final name, optionally
+ * after flushing them to storage (see @ref IoEngine#setDurability).
+ *
+ * Engines implement @ref IoEngine#submit. Requests are completed by calling
+ * @ref IoEngine#complete from any thread.
+ */
+class IoEngine {
+
+	public:
+		IoEngine();
+		virtual ~IoEngine();
+		void reset(size_t);
+		void setDurability(int, PublishBatch*);
+		void prefetch(size_t, const std::string&);
+		bool take(size_t, const std::string&, std::string&, std::string&);
+		void write(const std::string&, std::string&, IoWriteCallback, IoWriteCallback);
+		void wait();
+		unsigned long long getPeakBytes();
+
+		/**
+		 * Gets the name of the engine
+		 *
+		 * @return The name, as given in the command line
+		 */
+		virtual const char* getName() = 0;
+
+	protected:
+		/**
+		 * Types of requests
+		 */
+		enum IO_REQUEST_TYPES {
+			IO_REQUEST_READ = 0,	/**< Read a whole file */
+			IO_REQUEST_WRITE		/**< Write a whole file to a temp name and move it to its final name */
+		};
+
+		/**
+		 * A file read or write
+		 */
+		struct IoRequest {
+			int type;					/**< Request type (see @ref IO_REQUEST_TYPES) */
+			std::string path;			/**< File to read, or final name of file to write */
+			std::string tempPath;		/**< Temp name of file to write */
+			bool sync;					/**< Flush written file to storage before closing it */
+			bool publish;				/**< Move written file to its final name (left under its temp name otherwise) */
+			std::string data;			/**< Contents read, or contents to write */
+			std::string error;			/**< Error message, empty on success */
+			std::function<void(IoRequest*)> done;	/**< Completion handler */
+		};
+
+		/**
+		 * Starts a request. The engine calls @ref IoEngine#complete when it is done.
+		 *
+		 * @param[in] request The request, owned by the caller until completed
+		 */
+		virtual void submit(IoRequest* request) = 0;
+		void complete(IoRequest*);
+
+	private:
+		/**
+		 * Input file being read or waiting to be taken by a worker
+		 */
+		struct ReadSlot {
+			bool done;				/**< Read finished */
+			std::string data;		/**< File contents */
+			std::string error;		/**< Error message, empty on success */
+
+			ReadSlot();
+		};
+
+		std::mutex m_mutex;								/**< Protects all members below */
+		std::condition_variable m_changed;				/**< Signals finished reads and writes */
+		std::map<size_t, std::shared_ptr<ReadSlot> > m_slots;	/**< Files read ahead, by file index */
+		std::vector<bool> m_taken;						/**< Files already taken by workers */
+		unsigned long long m_pendingBytes;				/**< Size of files being written */
+		size_t m_pendingWrites;							/**< Number of files being written */
+		unsigned long long m_maxPendingBytes;			/**< Writers wait above this amount of pending data */
+		unsigned long long m_readBytes;					/**< Size of files read and not taken yet */
+		unsigned long long m_peakBytes;					/**< Highest amount of data read ahead and pending writes */
+		int m_durability;								/**< Durability policy of written files (see @ref DURABILITY_POLICIES) */
+		PublishBatch* m_batch;							/**< Publisher of written files with DURABILITY_BATCH, NULL otherwise */
+
+		void startRead(std::shared_ptr<ReadSlot>, const std::string&);
+		void updatePeak();
+
+		IoEngine(const IoEngine&);
+		IoEngine& operator=(const IoEngine&);
+};
+
+IoEngine* createIoEngine(int, int);
+
+#endif
@@ -0,0 +1,227 @@
+#include <algorithm>
+#include "jpegcodec.h"
+#include "libjpegcodec.h"
+#include "turbojpegcodec.h"
+
+/**
+ * Creates codec settings with libjpeg defaults ("balanced" preset)
+ */
+CodecSettings::CodecSettings() {
+	setPreset("balanced");
+}
+
+/**
+ * Sets all parameters from a named preset:
+ *    fast:     fast integer DCT, plain upsampling, standard Huffman tables
+ *    balanced: accurate integer DCT, smooth upsampling, standard Huffman tables (libjpeg defaults)
+ *    small:    accurate integer DCT, smooth upsampling, optimized Huffman tables, progressive output
+ *
+ * @param[in] name Preset name
+ * @return true if the preset exists, false otherwise (settings are not changed)
+ */
+bool CodecSettings::setPreset(const std::string& name) {
+	if (name == "fast") {
+		decodeDctMethod = JDCT_IFAST;
+		fancyUpsampling = false;
+		encodeDctMethod = JDCT_IFAST;
+		optimizeCoding = false;
+		progressive = false;
+	} else if (name == "balanced") {
+		decodeDctMethod = JDCT_ISLOW;
+		fancyUpsampling = true;
+		encodeDctMethod = JDCT_ISLOW;
+		optimizeCoding = false;
+		progressive = false;
+	} else if (name == "small") {
+		decodeDctMethod = JDCT_ISLOW;
+		fancyUpsampling = true;
+		encodeDctMethod = JDCT_ISLOW;
+		optimizeCoding = true;
+		progressive = true;
+	} else {
+		return false;
+	}
+	restartRows = 0;
+
+	return true;
+}
+
+/**
+ * Creates an empty image description
+ */
+JpegImageInfo::JpegImageInfo()
+:width(0),
+ height(0),
+ components(0),
+ colorSpace(JCS_UNKNOWN)
+{
+}
+
+/**
+ * Tells whether a JPEG backend has been compiled in
+ *
+ * @param[in] backend The backend (see @ref JPEG_BACKENDS)
+ * @return true if the backend can be used, false otherwise
+ */
+bool isJpegBackendAvailable(int backend) {
+	switch (backend) {
+		case JPEG_BACKEND_LIBJPEG:
+			return true;
+#ifdef ICCFLOW_TURBOJPEG
+		case JPEG_BACKEND_TURBOJPEG:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+/**
+ * Creates a decoder of the given backend
+ *
+ * @param[in] backend The backend (see @ref JPEG_BACKENDS)
+ * @return The new decoder, owned by the caller, or NULL if the backend is not available
+ */
+JpegDecoder* createJpegDecoder(int backend) {
+	switch (backend) {
+		case JPEG_BACKEND_LIBJPEG:
+			return new LibjpegDecoder();
+#ifdef ICCFLOW_TURBOJPEG
+		case JPEG_BACKEND_TURBOJPEG:
+			return new TurbojpegDecoder();
+#endif
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Creates an encoder of the given backend
+ *
+ * @param[in] backend The backend (see @ref JPEG_BACKENDS)
+ * @return The new encoder, owned by the caller, or NULL if the backend is not available
+ */
+JpegEncoder* createJpegEncoder(int backend) {
+	switch (backend) {
+		case JPEG_BACKEND_LIBJPEG:
+			return new LibjpegEncoder();
+#ifdef ICCFLOW_TURBOJPEG
+		case JPEG_BACKEND_TURBOJPEG:
+			return new TurbojpegEncoder();
+#endif
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Splits ICC profile data in the payloads of APP2 markers, as specified by
+ * the ICC: null terminated "ICC_PROFILE" signature, sequence number,
+ * number of markers and up to 65517 bytes of profile data each.
+ *
+ * @param[in] iccProfile ICC profile data
+ * @param[out] markers Marker payloads, without marker code and length
+ */
+void getIccMarkers(const std::string& iccProfile, std::vector<std::string>& markers) {
+	const size_t chunkSize = 65517;
+	markers.clear();
+	int iccChunks = (iccProfile.size() / chunkSize) + 1;
+	size_t savedBytes = 0;
+	for (int i=1; i<=iccChunks; i++) {
+		size_t bytesToSave = std::min(iccProfile.size() - savedBytes,chunkSize);
+		std::string marker("ICC_PROFILE",12);	// Signature includes terminating null
+		marker += (char) i;
+		marker += (char) iccChunks;
+		marker.append(iccProfile,savedBytes,bytesToSave);
+		markers.push_back(marker);
+		savedBytes += bytesToSave;
+	}
+}
+
+/**
+ * Gets the APPn and COM markers of JPEG data, up to the first marker that
+ * is neither of them (normally a table or frame marker)
+ *
+ * @param[in] data JPEG data, starting with SOI
+ * @param[in] size Size of the data
+ * @param[out] markers Markers found, in file order
+ */
+void scanJpegMarkers(const char* data, size_t size, std::vector<JpegMarker>& markers) {
+	markers.clear();
+	const unsigned char* bytes = (const unsigned char*) data;
+	if ((size < 2) || (bytes[0] != 0xFF) || (bytes[1] != 0xD8)) {
+		return;
+	}
+	size_t position = 2;
+	while (position + 4 <= size) {
+		if (bytes[position] != 0xFF) {
+			return;
+		}
+		int code = bytes[position+1];
+		if (code == 0xFF) {		// Padding
+			position++;
+			continue;
+		}
+		if (((code < JPEG_APP0) || (code > JPEG_APP0+15)) && (code != JPEG_COM)) {
+			return;
+		}
+		size_t length = (bytes[position+2] << 8) | bytes[position+3];
+		if ((length < 2) || (position + 2 + length > size)) {
+			return;
+		}
+		JpegMarker marker;
+		marker.code = code;
+		marker.data.assign(data+position+4,length-2);
+		markers.push_back(marker);
+		position += 2 + length;
+	}
+}
+
+/**
+ * Gets the image size from the frame header (SOFn marker) of JPEG data,
+ * without decoding anything. Every marker before the frame header must be
+ * complete in the data.
+ *
+ * @param[in] data JPEG data, starting with SOI
+ * @param[in] size Size of the data
+ * @param[out] info Width, height and number of components of the image
+ * @param[out] progressive Whether the image is progressive (decoded from whole coefficient arrays)
+ * @return true if the frame header was found, false otherwise
+ */
+bool scanJpegFrame(const char* data, size_t size, JpegImageInfo& info, bool& progressive) {
+	const unsigned char* bytes = (const unsigned char*) data;
+	if ((size < 2) || (bytes[0] != 0xFF) || (bytes[1] != 0xD8)) {
+		return false;
+	}
+	size_t position = 2;
+	while (position + 4 <= size) {
+		if (bytes[position] != 0xFF) {
+			return false;
+		}
+		int code = bytes[position+1];
+		if (code == 0xFF) {		// Padding
+			position++;
+			continue;
+		}
+		size_t length = (bytes[position+2] << 8) | bytes[position+3];
+		if (length < 2) {
+			return false;
+		}
+		// SOF0-SOF15, except DHT, JPG and DAC which share the range
+		if ((code >= 0xC0) && (code <= 0xCF) && (code != 0xC4) && (code != 0xC8) && (code != 0xCC)) {
+			if ((length < 8) || (position + 10 > size)) {
+				return false;
+			}
+			info.height = (bytes[position+5] << 8) | bytes[position+6];
+			info.width = (bytes[position+7] << 8) | bytes[position+8];
+			info.components = bytes[position+9];
+			progressive = (code == 0xC2) || (code == 0xC6) || (code == 0xCA) || (code == 0xCE);
+			return true;
+		}
+		if (code == 0xDA) {		// Start of scan without a frame header
+			return false;
+		}
+		position += 2 + length;
+	}
+	return false;
+}
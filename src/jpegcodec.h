@@ -0,0 +1,256 @@
+#ifndef JPEGCODEC_H
+#define JPEGCODEC_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+extern "C" {
+#include <jpeglib.h>
+}
+
+/**
+ * JPEG codec implementations available to @ref IccConverter
+ */
+enum JPEG_BACKENDS {
+	JPEG_BACKEND_LIBJPEG = 0,		/**< libjpeg API, streaming scanline by scanline */
+	JPEG_BACKEND_TURBOJPEG			/**< TurboJPEG 3 API, whole images in memory (built with TURBOJPEG=1) */
+};
+
+/**
+ * libjpeg decompression and compression parameters trading speed against
+ * quality and output size. Defaults match the "balanced" preset, which is
+ * plain libjpeg defaults.
+ */
+struct CodecSettings {
+	J_DCT_METHOD decodeDctMethod;	/**< Inverse DCT method for decompression */
+	bool fancyUpsampling;			/**< Smooth chroma upsampling when decompressing */
+	J_DCT_METHOD encodeDctMethod;	/**< DCT method for compression */
+	bool optimizeCoding;			/**< Optimized Huffman tables (keeps the whole image in memory) */
+	bool progressive;				/**< Progressive output (keeps the whole image in memory) */
+	int restartRows;				/**< Restart interval in MCU rows, 0 for none */
+
+	CodecSettings();
+	bool setPreset(const std::string&);
+};
+
+/**
+ * Size and pixel layout of an image, as stored in a JPEG file or as
+ * handed to or from a codec
+ */
+struct JpegImageInfo {
+	unsigned int width;				/**< Width in pixels */
+	unsigned int height;			/**< Height in pixels */
+	int components;					/**< Color components per pixel */
+	J_COLOR_SPACE colorSpace;		/**< Color space of the pixels (JCS_GRAYSCALE, JCS_RGB or JCS_CMYK for decoded lines) */
+
+	JpegImageInfo();
+};
+
+/**
+ * APPn or COM marker of a JPEG file
+ */
+struct JpegMarker {
+	int code;				/**< Marker code (JPEG_APP0+n or JPEG_COM) */
+	std::string data;		/**< Marker payload, without marker code and length */
+};
+
+/**
+ * Interface of JPEG decompressors.
+ *
+ * Decoders read from a file or a memory block, and hand out the image
+ * line by line. Errors never throw: methods return false (or NULL), and
+ * the decoder is ready for a new source after @ref JpegDecoder#abort.
+ */
+class JpegDecoder {
+
+	public:
+		virtual ~JpegDecoder() {}
+
+		/**
+		 * Sets an open file as source. The file is read sequentially, so it
+		 * can be a pipe.
+		 *
+		 * @param[in] file Open file with the JPEG data
+		 */
+		virtual void setFileSource(FILE* file) = 0;
+
+		/**
+		 * Sets a memory block as source. The block must be kept until the
+		 * image is finished.
+		 *
+		 * @param[in] data JPEG data
+		 * @param[in] size Size of the JPEG data
+		 */
+		virtual void setMemorySource(const unsigned char* data, size_t size) = 0;
+
+		/**
+		 * Enables or disables keeping the APPn and COM markers of the next
+		 * images, see @ref JpegDecoder#getMarkers
+		 *
+		 * @param[in] save true for keeping markers, false for skipping them
+		 */
+		virtual void setSaveMarkers(bool save) = 0;
+
+		/**
+		 * Reads the JPEG header
+		 *
+		 * @param[out] info Size, components and color space of the stored image
+		 * @return true if the header was read, false on error
+		 */
+		virtual bool readHeader(JpegImageInfo& info) = 0;
+
+		/**
+		 * Gets the JPEG data read so far, containing at least all markers
+		 * before the image data. Valid after @ref JpegDecoder#readHeader until
+		 * the next source is set.
+		 *
+		 * @param[out] data Start of the data
+		 * @param[out] size Size of the data
+		 */
+		virtual void getHeaderData(const char*& data, size_t& size) = 0;
+
+		/**
+		 * Gets the APPn and COM markers of the image, in file order. Valid
+		 * after @ref JpegDecoder#readHeader when markers are being saved.
+		 *
+		 * @param[out] markers The markers found, at least APP1-APP13, APP15 and COM
+		 */
+		virtual void getMarkers(std::vector<JpegMarker>& markers) = 0;
+
+		/**
+		 * Gets the size of the decoded image when scaling it
+		 *
+		 * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+		 * @param[out] width Scaled width
+		 * @param[out] height Scaled height
+		 * @return true on success, false on error
+		 */
+		virtual bool getScaledSize(int denominator, unsigned int& width, unsigned int& height) = 0;
+
+		/**
+		 * Starts decoding the image
+		 *
+		 * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+		 * @param[in] codec Decompression parameters
+		 * @param[out] output Size, components and color space of decoded lines
+		 * @return true on success, false on error
+		 */
+		virtual bool start(int denominator, const CodecSettings& codec, JpegImageInfo& output) = 0;
+
+		/**
+		 * Decodes the next line
+		 *
+		 * @return The line, valid until the next call, or NULL on error
+		 */
+		virtual const JSAMPLE* readLine() = 0;
+
+		/**
+		 * Finishes decoding, after all lines have been read
+		 *
+		 * @return true on success, false on error
+		 */
+		virtual bool finish() = 0;
+
+		/**
+		 * Abandons the current image after an error
+		 */
+		virtual void abort() = 0;
+
+		/**
+		 * Gets the amount of JPEG data consumed
+		 *
+		 * @return Bytes read from the source
+		 */
+		virtual unsigned long getBytesRead() = 0;
+
+		/**
+		 * Gets the working memory of the current image: codec pools, the
+		 * decoded line and any copy of the JPEG data
+		 *
+		 * @return Bytes in use
+		 */
+		virtual unsigned long long getMemoryUsed() = 0;
+};
+
+/**
+ * Interface of JPEG compressors.
+ *
+ * Encoders write to a file or append to a string, and receive the image
+ * line by line. Errors never throw: methods return false, and the encoder
+ * is ready for a new destination after @ref JpegEncoder#abort.
+ */
+class JpegEncoder {
+
+	public:
+		virtual ~JpegEncoder() {}
+
+		/**
+		 * Sets an open file as destination
+		 *
+		 * @param[in] file Open file receiving the JPEG data
+		 */
+		virtual void setFileDestination(FILE* file) = 0;
+
+		/**
+		 * Sets a string as destination. JPEG data is appended to it.
+		 *
+		 * @param[in] output String receiving the JPEG data
+		 */
+		virtual void setStringDestination(std::string* output) = 0;
+
+		/**
+		 * Starts encoding an image
+		 *
+		 * @param[in] image Size, components and color space of the lines to encode
+		 * @param[in] quality JPEG quality (0-100)
+		 * @param[in] codec Compression parameters
+		 * @param[in] iccProfile ICC profile data to embed, empty for none
+		 * @param[in] markers APPn and COM markers to write before the ICC profile
+		 * @return true on success, false on error
+		 */
+		virtual bool start(const JpegImageInfo& image, int quality, const CodecSettings& codec, const std::string& iccProfile, const std::vector<JpegMarker>& markers) = 0;
+
+		/**
+		 * Encodes the next line
+		 *
+		 * @param[in] line Pixels of the line
+		 * @return true on success, false on error
+		 */
+		virtual bool writeLine(const JSAMPLE* line) = 0;
+
+		/**
+		 * Finishes encoding, after all lines have been written
+		 *
+		 * @return true on success, false on error
+		 */
+		virtual bool finish() = 0;
+
+		/**
+		 * Abandons the current image after an error
+		 */
+		virtual void abort() = 0;
+
+		/**
+		 * Gets the amount of JPEG data produced
+		 *
+		 * @return Bytes written to the destination
+		 */
+		virtual unsigned long getBytesWritten() = 0;
+
+		/**
+		 * Gets the working memory of the current image: codec pools and
+		 * any buffered lines
+		 *
+		 * @return Bytes in use
+		 */
+		virtual unsigned long long getMemoryUsed() = 0;
+};
+
+bool isJpegBackendAvailable(int);
+JpegDecoder* createJpegDecoder(int);
+JpegEncoder* createJpegEncoder(int);
+void getIccMarkers(const std::string&, std::vector<std::string>&);
+void scanJpegMarkers(const char*, size_t, std::vector<JpegMarker>&);
+bool scanJpegFrame(const char*, size_t, JpegImageInfo&, bool&);
+
+#endif
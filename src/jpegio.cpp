@@ -0,0 +1,489 @@
+/**
+ * Source and destination managers for libjpeg, reading from
+ * files or memory and writing to files or strings, and memory
+ * manager reusing the memory of previous images.
+ */
+
+#include <cstring>
+#include "jpegio.h"
+extern "C" {
+#include <jerror.h>
+}
+
+/**
+ * Nothing to do when decompression starts
+ */
+METHODDEF(void) iccflow_init_source(j_decompress_ptr cinfo) {
+	iccflow_source_mgr* src = (iccflow_source_mgr*) cinfo->src;
+	src->startOfFile = true;
+}
+
+/**
+ * Refills the input buffer. Memory sources have already handed over all
+ * of their data, so reaching this point means the JPEG is truncated: a
+ * fake EOI marker is inserted, as libjpeg's own managers do.
+ */
+METHODDEF(boolean) iccflow_fill_input_buffer(j_decompress_ptr cinfo) {
+	iccflow_source_mgr* src = (iccflow_source_mgr*) cinfo->src;
+	size_t bytes = 0;
+	if (src->file != NULL) {
+		bytes = fread(src->buffer,1,JPEGIO_BUFFER_SIZE,src->file);
+	}
+
+	if (bytes == 0) {
+		if (src->startOfFile && (src->file != NULL)) {
+			ERREXIT(cinfo, JERR_INPUT_EMPTY);
+		}
+		WARNMS(cinfo, JWRN_JPEG_EOF);
+		src->buffer[0] = (JOCTET) 0xFF;
+		src->buffer[1] = (JOCTET) JPEG_EOI;
+		bytes = 2;
+	}
+
+	if (src->header != NULL) {
+		src->header->append((const char*) src->buffer,bytes);
+	}
+	src->bytesRead += bytes;
+	src->pub.next_input_byte = src->buffer;
+	src->pub.bytes_in_buffer = bytes;
+	src->startOfFile = false;
+
+	return TRUE;
+}
+
+/**
+ * Skips over uninteresting data (APPn markers and the like)
+ */
+METHODDEF(void) iccflow_skip_input_data(j_decompress_ptr cinfo, long numBytes) {
+	iccflow_source_mgr* src = (iccflow_source_mgr*) cinfo->src;
+	if (numBytes <= 0) {
+		return;
+	}
+	while (numBytes > (long) src->pub.bytes_in_buffer) {
+		numBytes -= (long) src->pub.bytes_in_buffer;
+		iccflow_fill_input_buffer(cinfo);
+	}
+	src->pub.next_input_byte += (size_t) numBytes;
+	src->pub.bytes_in_buffer -= (size_t) numBytes;
+}
+
+/**
+ * Nothing to do when decompression finishes
+ */
+METHODDEF(void) iccflow_term_source(j_decompress_ptr) {
+}
+
+/**
+ * Common setup of source manager methods
+ */
+static void iccflow_setup_src(j_decompress_ptr cinfo, iccflow_source_mgr* src) {
+	src->pub.init_source = iccflow_init_source;
+	src->pub.fill_input_buffer = iccflow_fill_input_buffer;
+	src->pub.skip_input_data = iccflow_skip_input_data;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = iccflow_term_source;
+	src->startOfFile = true;
+	cinfo->src = &src->pub;
+}
+
+/**
+ * Sets an already open stdio file as data source for JPEG decompression.
+ * The file is read sequentially, so it can also be a pipe.
+ *
+ * @param[in] cinfo The decompression object
+ * @param[in] src Source manager struct owned by the caller
+ * @param[in] file The file to read from
+ * @param[out] header String receiving a copy of the data read, NULL for none
+ */
+void iccflow_file_src(j_decompress_ptr cinfo, iccflow_source_mgr* src, FILE* file, std::string* header) {
+	iccflow_setup_src(cinfo,src);
+	src->file = file;
+	src->header = header;
+	src->bytesRead = 0;
+	src->data = NULL;
+	src->size = 0;
+	src->pub.next_input_byte = NULL;
+	src->pub.bytes_in_buffer = 0;
+}
+
+/**
+ * Sets a memory block as data source for JPEG decompression.
+ * The memory block must remain valid until decompression finishes.
+ *
+ * @param[in] cinfo The decompression object
+ * @param[in] src Source manager struct owned by the caller
+ * @param[in] data Pointer to the JPEG data
+ * @param[in] size Size in bytes of the JPEG data
+ */
+void iccflow_mem_src(j_decompress_ptr cinfo, iccflow_source_mgr* src, const unsigned char* data, size_t size) {
+	iccflow_setup_src(cinfo,src);
+	src->file = NULL;
+	src->data = data;
+	src->size = size;
+	src->header = NULL;
+	src->bytesRead = size;
+	src->pub.next_input_byte = data;
+	src->pub.bytes_in_buffer = size;
+}
+
+/**
+ * Prepares the output buffer when compression starts
+ */
+METHODDEF(void) iccflow_init_destination(j_compress_ptr cinfo) {
+	iccflow_destination_mgr* dest = (iccflow_destination_mgr*) cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEGIO_BUFFER_SIZE;
+}
+
+/**
+ * Writes a block of bytes to the destination file or string
+ */
+static void iccflow_write_bytes(j_compress_ptr cinfo, iccflow_destination_mgr* dest, size_t bytes) {
+	if (dest->file != NULL) {
+		if (fwrite(dest->buffer,1,bytes,dest->file) != bytes) {
+			ERREXIT(cinfo, JERR_FILE_WRITE);
+		}
+	} else {
+		dest->output->append((const char*) dest->buffer,bytes);
+	}
+	dest->bytesWritten += bytes;
+}
+
+/**
+ * Flushes the full output buffer
+ */
+METHODDEF(boolean) iccflow_empty_output_buffer(j_compress_ptr cinfo) {
+	iccflow_destination_mgr* dest = (iccflow_destination_mgr*) cinfo->dest;
+	iccflow_write_bytes(cinfo,dest,JPEGIO_BUFFER_SIZE);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = JPEGIO_BUFFER_SIZE;
+
+	return TRUE;
+}
+
+/**
+ * Flushes any remaining data when compression finishes
+ */
+METHODDEF(void) iccflow_term_destination(j_compress_ptr cinfo) {
+	iccflow_destination_mgr* dest = (iccflow_destination_mgr*) cinfo->dest;
+	size_t bytes = JPEGIO_BUFFER_SIZE - dest->pub.free_in_buffer;
+	if (bytes > 0) {
+		iccflow_write_bytes(cinfo,dest,bytes);
+	}
+	if (dest->file != NULL) {
+		fflush(dest->file);
+		if (ferror(dest->file)) {
+			ERREXIT(cinfo, JERR_FILE_WRITE);
+		}
+	}
+}
+
+/**
+ * Common setup of destination manager methods
+ */
+static void iccflow_setup_dest(j_compress_ptr cinfo, iccflow_destination_mgr* dest) {
+	dest->pub.init_destination = iccflow_init_destination;
+	dest->pub.empty_output_buffer = iccflow_empty_output_buffer;
+	dest->pub.term_destination = iccflow_term_destination;
+	cinfo->dest = &dest->pub;
+}
+
+/**
+ * Sets an already open stdio file as destination for JPEG compression.
+ *
+ * @param[in] cinfo The compression object
+ * @param[in] dest Destination manager struct owned by the caller
+ * @param[in] file The file to write to
+ */
+void iccflow_file_dest(j_compress_ptr cinfo, iccflow_destination_mgr* dest, FILE* file) {
+	iccflow_setup_dest(cinfo,dest);
+	dest->file = file;
+	dest->output = NULL;
+	dest->bytesWritten = 0;
+}
+
+/**
+ * Sets a string as destination for JPEG compression. Compressed data
+ * is appended to the string.
+ *
+ * @param[in] cinfo The compression object
+ * @param[in] dest Destination manager struct owned by the caller
+ * @param[out] output The string receiving the compressed data
+ */
+void iccflow_string_dest(j_compress_ptr cinfo, iccflow_destination_mgr* dest, std::string* output) {
+	iccflow_setup_dest(cinfo,dest);
+	dest->file = NULL;
+	dest->output = output;
+	dest->bytesWritten = 0;
+}
+
+/**
+ * Virtual array of samples, always kept in memory
+ */
+struct jvirt_sarray_control {
+	JSAMPARRAY buffer;			/**< Rows of the whole array, NULL until realized */
+	JDIMENSION rows;			/**< Number of rows */
+	JDIMENSION samplesPerRow;	/**< Width of each row */
+	JDIMENSION maxAccess;		/**< Maximum rows accessed at once */
+	boolean preZero;			/**< Array must start zeroed */
+	jvirt_sarray_ptr next;		/**< Next array of the image */
+};
+
+/**
+ * Virtual array of coefficient blocks, always kept in memory
+ */
+struct jvirt_barray_control {
+	JBLOCKARRAY buffer;			/**< Rows of the whole array, NULL until realized */
+	JDIMENSION rows;			/**< Number of rows */
+	JDIMENSION blocksPerRow;	/**< Width of each row */
+	JDIMENSION maxAccess;		/**< Maximum rows accessed at once */
+	boolean preZero;			/**< Array must start zeroed */
+	jvirt_barray_ptr next;		/**< Next array of the image */
+};
+
+/**
+ * Row sizes are rounded up to this amount, as libjpeg-turbo does, because
+ * its SIMD routines may touch a few bytes past the end of a row
+ */
+const size_t ICCFLOW_ROW_ALIGNMENT = 2*SCRATCH_ALIGNMENT;
+
+/**
+ * Gets a block from the scratch arena, failing as libjpeg does when there
+ * is not enough memory
+ */
+static void* iccflow_arena_alloc(j_common_ptr cinfo, size_t size) {
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	void* block = mem->arena->allocate(size);
+	if (block == NULL) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+
+	return block;
+}
+
+/**
+ * Gets memory from the libjpeg manager for pools other than the image pool.
+ * The libjpeg manager is made current during the call, as it may use
+ * cinfo->mem itself.
+ */
+static void* iccflow_library_alloc(j_common_ptr cinfo, int poolId, size_t size, bool large) {
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	cinfo->mem = mem->library;
+	void* block = large ? (*mem->library->alloc_large)(cinfo,poolId,size) : (*mem->library->alloc_small)(cinfo,poolId,size);
+	cinfo->mem = &mem->pub;
+
+	return block;
+}
+
+/**
+ * Allocates a small object
+ */
+METHODDEF(void*) iccflow_alloc_small(j_common_ptr cinfo, int poolId, size_t size) {
+	if (poolId != JPOOL_IMAGE) {
+		return iccflow_library_alloc(cinfo,poolId,size,false);
+	}
+
+	return iccflow_arena_alloc(cinfo,size);
+}
+
+/**
+ * Allocates a large object
+ */
+METHODDEF(void*) iccflow_alloc_large(j_common_ptr cinfo, int poolId, size_t size) {
+	if (poolId != JPOOL_IMAGE) {
+		return iccflow_library_alloc(cinfo,poolId,size,true);
+	}
+
+	return iccflow_arena_alloc(cinfo,size);
+}
+
+/**
+ * Allocates the row pointers and the rows of a 2-D array in one go
+ *
+ * @param[in] cinfo The libjpeg object
+ * @param[in] poolId Pool of the array
+ * @param[in] rowSize Size of a row in bytes
+ * @param[in] rows Number of rows
+ * @return Array of row pointers
+ */
+static void** iccflow_alloc_rows(j_common_ptr cinfo, int poolId, size_t rowSize, JDIMENSION rows) {
+	size_t stride = (rowSize + ICCFLOW_ROW_ALIGNMENT - 1) & ~(ICCFLOW_ROW_ALIGNMENT - 1);
+	if ((rows > 0) && (stride > ((size_t) -1) / rows)) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+	}
+	void** pointers;
+	char* data;
+	if (poolId == JPOOL_IMAGE) {
+		pointers = (void**) iccflow_arena_alloc(cinfo,rows*sizeof(void*));
+		data = (char*) iccflow_arena_alloc(cinfo,stride*rows);
+	} else {
+		pointers = (void**) iccflow_library_alloc(cinfo,poolId,rows*sizeof(void*),false);
+		data = (char*) iccflow_library_alloc(cinfo,poolId,stride*rows,true);
+	}
+	for (JDIMENSION row=0; row<rows; row++) {
+		pointers[row] = data + row*stride;
+	}
+
+	return pointers;
+}
+
+/**
+ * Allocates a 2-D array of samples
+ */
+METHODDEF(JSAMPARRAY) iccflow_alloc_sarray(j_common_ptr cinfo, int poolId, JDIMENSION samplesPerRow, JDIMENSION rows) {
+	return (JSAMPARRAY) iccflow_alloc_rows(cinfo,poolId,(size_t) samplesPerRow*sizeof(JSAMPLE),rows);
+}
+
+/**
+ * Allocates a 2-D array of coefficient blocks
+ */
+METHODDEF(JBLOCKARRAY) iccflow_alloc_barray(j_common_ptr cinfo, int poolId, JDIMENSION blocksPerRow, JDIMENSION rows) {
+	return (JBLOCKARRAY) iccflow_alloc_rows(cinfo,poolId,(size_t) blocksPerRow*sizeof(JBLOCK),rows);
+}
+
+/**
+ * Registers a virtual array of samples, allocated by realize_virt_arrays
+ */
+METHODDEF(jvirt_sarray_ptr) iccflow_request_virt_sarray(j_common_ptr cinfo, int poolId, boolean preZero, JDIMENSION samplesPerRow, JDIMENSION rows, JDIMENSION maxAccess) {
+	if (poolId != JPOOL_IMAGE) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+	}
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	jvirt_sarray_ptr array = (jvirt_sarray_ptr) iccflow_arena_alloc(cinfo,sizeof(jvirt_sarray_control));
+	array->buffer = NULL;
+	array->rows = rows;
+	array->samplesPerRow = samplesPerRow;
+	array->maxAccess = maxAccess;
+	array->preZero = preZero;
+	array->next = mem->sarrays;
+	mem->sarrays = array;
+
+	return array;
+}
+
+/**
+ * Registers a virtual array of coefficient blocks, allocated by realize_virt_arrays
+ */
+METHODDEF(jvirt_barray_ptr) iccflow_request_virt_barray(j_common_ptr cinfo, int poolId, boolean preZero, JDIMENSION blocksPerRow, JDIMENSION rows, JDIMENSION maxAccess) {
+	if (poolId != JPOOL_IMAGE) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, poolId);
+	}
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	jvirt_barray_ptr array = (jvirt_barray_ptr) iccflow_arena_alloc(cinfo,sizeof(jvirt_barray_control));
+	array->buffer = NULL;
+	array->rows = rows;
+	array->blocksPerRow = blocksPerRow;
+	array->maxAccess = maxAccess;
+	array->preZero = preZero;
+	array->next = mem->barrays;
+	mem->barrays = array;
+
+	return array;
+}
+
+/**
+ * Allocates all virtual arrays requested so far, whole in memory
+ */
+METHODDEF(void) iccflow_realize_virt_arrays(j_common_ptr cinfo) {
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	for (jvirt_sarray_ptr array = mem->sarrays; array != NULL; array = array->next) {
+		if (array->buffer == NULL) {
+			array->buffer = iccflow_alloc_sarray(cinfo,JPOOL_IMAGE,array->samplesPerRow,array->rows);
+			if (array->preZero) {
+				for (JDIMENSION row=0; row<array->rows; row++) {
+					memset(array->buffer[row],0,(size_t) array->samplesPerRow*sizeof(JSAMPLE));
+				}
+			}
+		}
+	}
+	for (jvirt_barray_ptr array = mem->barrays; array != NULL; array = array->next) {
+		if (array->buffer == NULL) {
+			array->buffer = iccflow_alloc_barray(cinfo,JPOOL_IMAGE,array->blocksPerRow,array->rows);
+			if (array->preZero) {
+				for (JDIMENSION row=0; row<array->rows; row++) {
+					memset(array->buffer[row],0,(size_t) array->blocksPerRow*sizeof(JBLOCK));
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Gets rows of a virtual array of samples
+ */
+METHODDEF(JSAMPARRAY) iccflow_access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr array, JDIMENSION startRow, JDIMENSION rows, boolean) {
+	if ((array->buffer == NULL) || (rows > array->maxAccess) || (startRow > array->rows) || (rows > array->rows - startRow)) {
+		ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+	}
+
+	return array->buffer + startRow;
+}
+
+/**
+ * Gets rows of a virtual array of coefficient blocks
+ */
+METHODDEF(JBLOCKARRAY) iccflow_access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr array, JDIMENSION startRow, JDIMENSION rows, boolean) {
+	if ((array->buffer == NULL) || (rows > array->maxAccess) || (startRow > array->rows) || (rows > array->rows - startRow)) {
+		ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+	}
+
+	return array->buffer + startRow;
+}
+
+/**
+ * Frees a pool. Freeing the image pool takes back the whole arena.
+ */
+METHODDEF(void) iccflow_free_pool(j_common_ptr cinfo, int poolId) {
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	if (poolId == JPOOL_IMAGE) {
+		mem->sarrays = NULL;
+		mem->barrays = NULL;
+		mem->arena->reset();
+		return;
+	}
+	cinfo->mem = mem->library;
+	(*mem->library->free_pool)(cinfo,poolId);
+	cinfo->mem = &mem->pub;
+}
+
+/**
+ * Hands the object back to the libjpeg manager, which destroys it
+ */
+METHODDEF(void) iccflow_self_destruct(j_common_ptr cinfo) {
+	iccflow_memory_mgr* mem = (iccflow_memory_mgr*) cinfo->mem;
+	mem->sarrays = NULL;
+	mem->barrays = NULL;
+	mem->arena->reset();
+	cinfo->mem = mem->library;
+	(*mem->library->self_destruct)(cinfo);
+}
+
+/**
+ * Makes a libjpeg object take the memory of its images from a scratch
+ * arena. Must be called right after jpeg_create_compress or
+ * jpeg_create_decompress.
+ *
+ * @param[in] cinfo The compression or decompression object
+ * @param[in] mem Memory manager struct owned by the caller
+ * @param[in] arena Arena receiving the image pool, owned by the caller
+ */
+void iccflow_scratch_memory(j_common_ptr cinfo, iccflow_memory_mgr* mem, ScratchArena* arena) {
+	mem->library = cinfo->mem;
+	mem->arena = arena;
+	mem->sarrays = NULL;
+	mem->barrays = NULL;
+	mem->pub.alloc_small = iccflow_alloc_small;
+	mem->pub.alloc_large = iccflow_alloc_large;
+	mem->pub.alloc_sarray = iccflow_alloc_sarray;
+	mem->pub.alloc_barray = iccflow_alloc_barray;
+	mem->pub.request_virt_sarray = iccflow_request_virt_sarray;
+	mem->pub.request_virt_barray = iccflow_request_virt_barray;
+	mem->pub.realize_virt_arrays = iccflow_realize_virt_arrays;
+	mem->pub.access_virt_sarray = iccflow_access_virt_sarray;
+	mem->pub.access_virt_barray = iccflow_access_virt_barray;
+	mem->pub.free_pool = iccflow_free_pool;
+	mem->pub.self_destruct = iccflow_self_destruct;
+	mem->pub.max_memory_to_use = mem->library->max_memory_to_use;
+	mem->pub.max_alloc_chunk = mem->library->max_alloc_chunk;
+	cinfo->mem = &mem->pub;
+}
@@ -0,0 +1,79 @@
+#ifndef JPEGIO_H
+#define JPEGIO_H
+
+#include <cstdio>
+#include <string>
+#include "scratcharena.h"
+extern "C" {
+#include <jpeglib.h>
+}
+
+/**
+ * Size of the intermediate buffers used by file based source
+ * and destination managers
+ */
+const size_t JPEGIO_BUFFER_SIZE = 4096;
+
+/**
+ * Source manager for libjpeg decompression, reading either from a
+ * stdio FILE or from a block of memory.
+ *
+ * The struct is owned by the caller, so the same decompression object
+ * can be switched freely between file and memory sources.
+ *
+ * File sources can keep a copy of the data read, so that JPEG markers can
+ * be scanned after jpeg_read_header() without reading the file again. This
+ * also works for non-seekable files such as pipes. Set header to NULL to
+ * stop copying once the header has been read.
+ */
+struct iccflow_source_mgr {
+	struct jpeg_source_mgr pub;			/**< Standard libjpeg source manager */
+	FILE* file;							/**< Source file, NULL when reading from memory */
+	const JOCTET* data;					/**< Source memory block, NULL when reading from file */
+	size_t size;						/**< Size of source memory block */
+	std::string* header;				/**< Receives a copy of the data read from file, NULL for none */
+	unsigned long bytesRead;			/**< Bytes handed to the decompressor so far */
+	bool startOfFile;					/**< No data has been read from the file yet */
+	JOCTET buffer[JPEGIO_BUFFER_SIZE];	/**< Read buffer for file sources */
+};
+
+/**
+ * Destination manager for libjpeg compression, writing either to a
+ * stdio FILE or appending to a std::string.
+ */
+struct iccflow_destination_mgr {
+	struct jpeg_destination_mgr pub;	/**< Standard libjpeg destination manager */
+	FILE* file;							/**< Destination file, NULL when writing to memory */
+	std::string* output;				/**< Destination string, NULL when writing to file */
+	unsigned long bytesWritten;			/**< Bytes written to the destination so far */
+	JOCTET buffer[JPEGIO_BUFFER_SIZE];	/**< Write buffer */
+};
+
+/**
+ * Memory manager for libjpeg, taking the memory of each image from a
+ * @ref ScratchArena, so that it is reused for the next image instead of
+ * going back to the heap.
+ *
+ * Only the image pool is handled: permanent allocations (done once per
+ * libjpeg object) are passed to the manager created by libjpeg, which
+ * remains in charge of destroying the object. Virtual arrays are always
+ * kept in memory, as libjpeg-turbo does, and never go to temp files.
+ *
+ * The struct is owned by the caller, and must remain valid until the
+ * libjpeg object is destroyed.
+ */
+struct iccflow_memory_mgr {
+	struct jpeg_memory_mgr pub;			/**< Standard libjpeg memory manager */
+	struct jpeg_memory_mgr* library;	/**< Memory manager created by libjpeg */
+	ScratchArena* arena;				/**< Memory of the image pool */
+	jvirt_sarray_ptr sarrays;			/**< Sample virtual arrays requested for the image */
+	jvirt_barray_ptr barrays;			/**< Coefficient virtual arrays requested for the image */
+};
+
+void iccflow_file_src(j_decompress_ptr, iccflow_source_mgr*, FILE*, std::string*);
+void iccflow_mem_src(j_decompress_ptr, iccflow_source_mgr*, const unsigned char*, size_t);
+void iccflow_file_dest(j_compress_ptr, iccflow_destination_mgr*, FILE*);
+void iccflow_string_dest(j_compress_ptr, iccflow_destination_mgr*, std::string*);
+void iccflow_scratch_memory(j_common_ptr, iccflow_memory_mgr*, ScratchArena*);
+
+#endif
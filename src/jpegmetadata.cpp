@@ -0,0 +1,185 @@
+#include <cstring>
+#include "jpegmetadata.h"
+
+/**
+ * Creates an empty metadata set
+ */
+JpegMetadata::JpegMetadata() {
+	m_markers.clear();
+}
+
+/**
+ * Keeps the metadata markers of a source image, dropping JFIF (APP0),
+ * Adobe (APP14) and ICC profile (APP2) markers
+ *
+ * @param[in] markers APPn and COM markers of the source image, in file order
+ */
+void JpegMetadata::load(const std::vector<JpegMarker>& markers) {
+	m_markers.clear();
+	for (size_t i=0; i<markers.size(); i++) {
+		const JpegMarker& marker = markers[i];
+		if (marker.code == JPEG_APP0) {
+			continue;
+		}
+		if ((marker.code == JPEG_APP0+14) && startsWith(marker,"Adobe",5)) {
+			continue;
+		}
+		if ((marker.code == JPEG_APP0+2) && startsWith(marker,"ICC_PROFILE",12)) {
+			continue;
+		}
+		m_markers.push_back(marker);
+	}
+}
+
+/**
+ * Removes all markers
+ */
+void JpegMetadata::clear() {
+	m_markers.clear();
+}
+
+/**
+ * Gets the markers to write to a converted image. The EXIF ColorSpace,
+ * PixelXDimension and PixelYDimension tags are updated when present.
+ *
+ * @param[in] colorSpace EXIF color space of the converted image (see @ref EXIF_COLOR_SPACES)
+ * @param[in] width Width of the converted image
+ * @param[in] height Height of the converted image
+ * @param[out] markers The markers, in source file order
+ */
+void JpegMetadata::getMarkers(unsigned int colorSpace, unsigned int width, unsigned int height, std::vector<JpegMarker>& markers) const {
+	markers = m_markers;
+	for (size_t i=0; i<markers.size(); i++) {
+		if ((markers[i].code == JPEG_APP0+1) && startsWith(markers[i],"Exif\0\0",6)) {
+			updateExif(markers[i].data,colorSpace,width,height);
+		}
+	}
+}
+
+/**
+ * Checks the signature at the start of a marker
+ *
+ * @param[in] marker The marker
+ * @param[in] signature Expected bytes
+ * @param[in] length Number of bytes to compare
+ * @return true if the marker starts with the signature, false otherwise
+ */
+bool JpegMetadata::startsWith(const JpegMarker& marker, const char* signature, size_t length) {
+	return (marker.data.size() >= length) && (memcmp(marker.data.data(),signature,length) == 0);
+}
+
+/**
+ * Updates color space and image size tags of the Exif IFD in place. Tags
+ * not present are not added, and malformed data is left untouched.
+ *
+ * @param[in,out] data Payload of the EXIF APP1 marker
+ * @param[in] colorSpace New ColorSpace value
+ * @param[in] width New PixelXDimension value
+ * @param[in] height New PixelYDimension value
+ */
+void JpegMetadata::updateExif(std::string& data, unsigned int colorSpace, unsigned int width, unsigned int height) {
+	// TIFF header after the "Exif\0\0" signature
+	const size_t tiff = 6;
+	if (data.size() < tiff+8) {
+		return;
+	}
+	bool littleEndian = (data[tiff] == 'I');
+
+	// Look for the Exif IFD pointer in IFD0
+	size_t ifd0 = tiff + readLong(data,tiff+4,littleEndian);
+	if (ifd0+2 > data.size()) {
+		return;
+	}
+	unsigned int count = readWord(data,ifd0,littleEndian);
+	size_t exifIfd = 0;
+	for (unsigned int i=0; (i<count) && (ifd0+2+(i+1)*12 <= data.size()); i++) {
+		size_t entry = ifd0+2+i*12;
+		if (readWord(data,entry,littleEndian) == 0x8769) {
+			exifIfd = tiff + readLong(data,entry+8,littleEndian);
+			break;
+		}
+	}
+	if ((exifIfd == 0) || (exifIfd+2 > data.size())) {
+		return;
+	}
+
+	// Update tags of the Exif IFD (values of single SHORT or LONG fit in the entry)
+	count = readWord(data,exifIfd,littleEndian);
+	for (unsigned int i=0; (i<count) && (exifIfd+2+(i+1)*12 <= data.size()); i++) {
+		size_t entry = exifIfd+2+i*12;
+		unsigned int tag = readWord(data,entry,littleEndian);
+		unsigned int type = readWord(data,entry+2,littleEndian);
+		unsigned long value = 0;
+		if (tag == 0xA001) {
+			value = colorSpace;
+		} else if (tag == 0xA002) {
+			value = width;
+		} else if (tag == 0xA003) {
+			value = height;
+		} else {
+			continue;
+		}
+		if ((type == 3) && (value <= 0xFFFF)) {
+			writeWord(data,entry+8,value,littleEndian);
+		} else if (type == 4) {
+			writeLong(data,entry+8,value,littleEndian);
+		}
+	}
+}
+
+/**
+ * Reads a 16 bit EXIF value
+ *
+ * @param[in] data Marker payload
+ * @param[in] offset Position of the value
+ * @param[in] littleEndian true if data is little-endian, false if it is big-endian
+ * @return The value
+ */
+unsigned int JpegMetadata::readWord(const std::string& data, size_t offset, bool littleEndian) {
+	unsigned int b0 = (unsigned char) data[offset];
+	unsigned int b1 = (unsigned char) data[offset+1];
+	return littleEndian ? ((b1 << 8) | b0) : ((b0 << 8) | b1);
+}
+
+/**
+ * Reads a 32 bit EXIF value
+ *
+ * @param[in] data Marker payload
+ * @param[in] offset Position of the value
+ * @param[in] littleEndian true if data is little-endian, false if it is big-endian
+ * @return The value, or 0 if it is out of bounds
+ */
+unsigned long JpegMetadata::readLong(const std::string& data, size_t offset, bool littleEndian) {
+	if (offset+4 > data.size()) {
+		return 0;
+	}
+	unsigned long high = readWord(data,offset+(littleEndian ? 2 : 0),littleEndian);
+	unsigned long low = readWord(data,offset+(littleEndian ? 0 : 2),littleEndian);
+	return (high << 16) | low;
+}
+
+/**
+ * Writes a 16 bit EXIF value
+ *
+ * @param[out] data Marker payload
+ * @param[in] offset Position of the value
+ * @param[in] value The value
+ * @param[in] littleEndian true if data is little-endian, false if it is big-endian
+ */
+void JpegMetadata::writeWord(std::string& data, size_t offset, unsigned int value, bool littleEndian) {
+	data[offset+(littleEndian ? 0 : 1)] = (char) (value & 0xFF);
+	data[offset+(littleEndian ? 1 : 0)] = (char) ((value >> 8) & 0xFF);
+}
+
+/**
+ * Writes a 32 bit EXIF value
+ *
+ * @param[out] data Marker payload
+ * @param[in] offset Position of the value
+ * @param[in] value The value
+ * @param[in] littleEndian true if data is little-endian, false if it is big-endian
+ */
+void JpegMetadata::writeLong(std::string& data, size_t offset, unsigned long value, bool littleEndian) {
+	writeWord(data,offset+(littleEndian ? 0 : 2),value & 0xFFFF,littleEndian);
+	writeWord(data,offset+(littleEndian ? 2 : 0),(value >> 16) & 0xFFFF,littleEndian);
+}
@@ -0,0 +1,44 @@
+#ifndef JPEGMETADATA_H
+#define JPEGMETADATA_H
+
+#include <string>
+#include <vector>
+#include "jpegcodec.h"
+
+/**
+ * EXIF ColorSpace tag values
+ */
+enum EXIF_COLOR_SPACES {
+	EXIF_COLOR_SPACE_SRGB = 1,				/**< sRGB */
+	EXIF_COLOR_SPACE_UNCALIBRATED = 0xFFFF	/**< Any other color space */
+};
+
+/**
+ * JpegMetadata objects hold the metadata markers of a source image (EXIF,
+ * XMP, IPTC, comments and other APPn markers) so that they can be copied to
+ * converted images in the same pass.
+ *
+ * Markers describing the source encoding are dropped: JFIF and Adobe
+ * markers are written by the compressor, and ICC profile chunks are
+ * replaced by the output profile. EXIF is updated to match every output.
+ */
+class JpegMetadata {
+
+	public:
+		JpegMetadata();
+		void load(const std::vector<JpegMarker>&);
+		void clear();
+		void getMarkers(unsigned int, unsigned int, unsigned int, std::vector<JpegMarker>&) const;
+
+	private:
+		std::vector<JpegMarker> m_markers;	/**< Metadata markers of the source image */
+
+		static bool startsWith(const JpegMarker&, const char*, size_t);
+		static void updateExif(std::string&, unsigned int, unsigned int, unsigned int);
+		static unsigned int readWord(const std::string&, size_t, bool);
+		static unsigned long readLong(const std::string&, size_t, bool);
+		static void writeWord(std::string&, size_t, unsigned int, bool);
+		static void writeLong(std::string&, size_t, unsigned long, bool);
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include <cstdlib>
+#include <cstring>
+#include <lcms2_plugin.h>
+#include "lcmscontext.h"
+
+/**
+ * Size of the smallest pooled block, header included
+ */
+const size_t LCMS_MIN_BLOCK = 32;
+
+/**
+ * Largest request accepted, as in the default LittleCMS allocator
+ */
+const size_t LCMS_MAX_ALLOC = 512*1024*1024;
+
+/**
+ * Memory handler plugin routing the allocations of a context to the
+ * @ref LcmsContext given as context user data
+ */
+static cmsPluginMemHandler lcmsPoolPlugin;
+
+/**
+ * Creates empty counters
+ */
+LcmsMemoryStats::LcmsMemoryStats()
+:allocations(0),
+ frees(0),
+ poolHits(0),
+ bytesAllocated(0),
+ bytesInUse(0),
+ peakBytes(0),
+ bytesHeld(0) {
+}
+
+/**
+ * Creates a LittleCMS context allocating from the pool of this object.
+ * If the context can't be created, LittleCMS's global context is used.
+ */
+LcmsContext::LcmsContext()
+:m_context(NULL) {
+	for (int i=0; i<SIZE_CLASSES; i++) {
+		m_freeLists[i] = NULL;
+	}
+	static std::once_flag pluginReady;
+	std::call_once(pluginReady,[]() {
+		memset(&lcmsPoolPlugin,0,sizeof(lcmsPoolPlugin));
+		lcmsPoolPlugin.base.Magic = cmsPluginMagicNumber;
+		lcmsPoolPlugin.base.ExpectedVersion = LCMS_VERSION;
+		lcmsPoolPlugin.base.Type = cmsPluginMemHandlerSig;
+		lcmsPoolPlugin.base.Next = NULL;
+		lcmsPoolPlugin.MallocPtr = poolMalloc;
+		lcmsPoolPlugin.FreePtr = poolFree;
+		lcmsPoolPlugin.ReallocPtr = poolRealloc;
+	});
+	m_context = cmsCreateContext(&lcmsPoolPlugin,this);
+}
+
+/**
+ * Destructor deletes the context and frees the pool. All profiles and
+ * transforms of the context must have been deleted.
+ */
+LcmsContext::~LcmsContext() {
+	if (m_context != NULL) {
+		cmsDeleteContext(m_context);
+	}
+	for (int i=0; i<SIZE_CLASSES; i++) {
+		while (m_freeLists[i] != NULL) {
+			FreeBlock* block = m_freeLists[i];
+			m_freeLists[i] = block->next;
+			free(((BlockHeader*) block) - 1);
+		}
+	}
+}
+
+/**
+ * Gets the LittleCMS context, to be passed to the THR functions
+ *
+ * @return The context, NULL for the global context if it couldn't be created
+ */
+cmsContext LcmsContext::getHandle() {
+	return m_context;
+}
+
+/**
+ * Gets the memory counters of the context
+ *
+ * @param[out] stats The counters
+ */
+void LcmsContext::getStats(LcmsMemoryStats& stats) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	stats = m_stats;
+}
+
+/**
+ * Starts measuring a new peak from the bytes currently in use
+ */
+void LcmsContext::resetPeak() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.peakBytes = m_stats.bytesInUse;
+}
+
+/**
+ * Gets a block, from the free list of its size class if possible
+ *
+ * @param[in] size Bytes requested
+ * @return The block, or NULL if there is not enough memory
+ */
+void* LcmsContext::allocate(size_t size) {
+	if (size > LCMS_MAX_ALLOC) {
+		return NULL;
+	}
+	size_t blockSize = size + sizeof(BlockHeader);
+	unsigned int sizeClass = 0;
+	while ((sizeClass < SIZE_CLASSES) && ((LCMS_MIN_BLOCK << sizeClass) < blockSize)) {
+		sizeClass++;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	BlockHeader* header = NULL;
+	if ((sizeClass < SIZE_CLASSES) && (m_freeLists[sizeClass] != NULL)) {
+		FreeBlock* block = m_freeLists[sizeClass];
+		m_freeLists[sizeClass] = block->next;
+		header = ((BlockHeader*) block) - 1;
+		m_stats.poolHits++;
+	} else {
+		if (sizeClass < SIZE_CLASSES) {
+			blockSize = LCMS_MIN_BLOCK << sizeClass;
+		}
+		header = (BlockHeader*) malloc(blockSize);
+		if (header == NULL) {
+			return NULL;
+		}
+		m_stats.bytesHeld += blockSize;
+	}
+	header->owner = this;
+	header->sizeClass = sizeClass;
+	header->size = (unsigned int) size;
+	m_stats.allocations++;
+	m_stats.bytesAllocated += size;
+	m_stats.bytesInUse += size;
+	if (m_stats.bytesInUse > m_stats.peakBytes) {
+		m_stats.peakBytes = m_stats.bytesInUse;
+	}
+
+	return header + 1;
+}
+
+/**
+ * Gives back a block: pooled blocks go to the free list of their size
+ * class, large ones back to the heap
+ *
+ * @param[in] ptr The block, NULL does nothing
+ */
+void LcmsContext::release(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	BlockHeader* header = ((BlockHeader*) ptr) - 1;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stats.frees++;
+	m_stats.bytesInUse -= header->size;
+	if (header->sizeClass < SIZE_CLASSES) {
+		FreeBlock* block = (FreeBlock*) ptr;
+		block->next = m_freeLists[header->sizeClass];
+		m_freeLists[header->sizeClass] = block;
+	} else {
+		m_stats.bytesHeld -= header->size + sizeof(BlockHeader);
+		free(header);
+	}
+}
+
+/**
+ * Resizes a block, keeping it when it is still big enough
+ *
+ * @param[in] ptr The block, NULL for a new one
+ * @param[in] size New size in bytes
+ * @return The resized block, or NULL if there is not enough memory (the
+ * original block is kept then)
+ */
+void* LcmsContext::reallocate(void* ptr, size_t size) {
+	if (ptr == NULL) {
+		return allocate(size);
+	}
+	BlockHeader* header = ((BlockHeader*) ptr) - 1;
+	if ((header->sizeClass < SIZE_CLASSES) && (size + sizeof(BlockHeader) <= (LCMS_MIN_BLOCK << header->sizeClass))) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats.bytesInUse = m_stats.bytesInUse - header->size + size;
+		if (size > header->size) {
+			m_stats.bytesAllocated += size - header->size;
+		}
+		if (m_stats.bytesInUse > m_stats.peakBytes) {
+			m_stats.peakBytes = m_stats.bytesInUse;
+		}
+		header->size = (unsigned int) size;
+		return ptr;
+	}
+	void* resized = allocate(size);
+	if (resized != NULL) {
+		memcpy(resized,ptr,(header->size < size) ? header->size : size);
+		release(ptr);
+	}
+
+	return resized;
+}
+
+/**
+ * Gets the object owning a context. While LittleCMS creates or deletes a
+ * context, a temporary context with the same user data is passed.
+ */
+LcmsContext* LcmsContext::getOwner(cmsContext context) {
+	return (LcmsContext*) cmsGetContextUserData(context);
+}
+
+/**
+ * Memory plugin allocation function
+ */
+void* LcmsContext::poolMalloc(cmsContext context, cmsUInt32Number size) {
+	return getOwner(context)->allocate(size);
+}
+
+/**
+ * Memory plugin free function. Blocks go back to the context that
+ * allocated them.
+ */
+void LcmsContext::poolFree(cmsContext, void* ptr) {
+	if (ptr != NULL) {
+		(((BlockHeader*) ptr) - 1)->owner->release(ptr);
+	}
+}
+
+/**
+ * Memory plugin reallocation function
+ */
+void* LcmsContext::poolRealloc(cmsContext context, void* ptr, cmsUInt32Number size) {
+	if (ptr != NULL) {
+		return (((BlockHeader*) ptr) - 1)->owner->reallocate(ptr,size);
+	}
+
+	return getOwner(context)->allocate(size);
+}
@@ -0,0 +1,86 @@
+#ifndef LCMSCONTEXT_H
+#define LCMSCONTEXT_H
+
+#include <cstddef>
+#include <mutex>
+#include <lcms2.h>
+
+/**
+ * Memory use of a LittleCMS context
+ */
+struct LcmsMemoryStats {
+	unsigned long long allocations;		/**< Blocks requested by LittleCMS */
+	unsigned long long frees;			/**< Blocks given back by LittleCMS */
+	unsigned long long poolHits;		/**< Requests served from previously freed blocks */
+	unsigned long long bytesAllocated;	/**< Total bytes requested */
+	unsigned long long bytesInUse;		/**< Bytes requested and not given back yet */
+	unsigned long long peakBytes;		/**< Highest value of bytesInUse */
+	unsigned long long bytesHeld;		/**< Heap memory held by the context, in use or pooled */
+
+	LcmsMemoryStats();
+};
+
+/**
+ * LcmsContext objects own a LittleCMS context whose memory comes from a
+ * pool private to the context, with allocation counters.
+ *
+ * Small blocks are kept in free lists by size class when LittleCMS frees
+ * them, and reused for later requests of the same class, so that parsing
+ * the embedded profiles of a stream of images stops going to the heap
+ * once the pool is warm. Large blocks go straight to the heap.
+ *
+ * Each converter owns a context for the profiles of its images, so its
+ * pool is only used by the thread running the converter. Profiles and
+ * transforms shared through an @ref IccCache live in the context of the
+ * cache, whose memory may be released from any thread, so pools are
+ * protected by a mutex (never contended for converter contexts).
+ */
+class LcmsContext {
+
+	public:
+		LcmsContext();
+		~LcmsContext();
+		cmsContext getHandle();
+		void getStats(LcmsMemoryStats&);
+		void resetPeak();
+
+	private:
+		/**
+		 * Number of pooled size classes, from 32 bytes to 64 KB
+		 */
+		static const int SIZE_CLASSES = 12;
+
+		/**
+		 * Bookkeeping stored in front of every block
+		 */
+		struct BlockHeader {
+			LcmsContext* owner;		/**< Context the block belongs to */
+			unsigned int sizeClass;	/**< Size class, SIZE_CLASSES for blocks not pooled */
+			unsigned int size;		/**< Bytes requested */
+		};
+
+		/**
+		 * Pooled block waiting to be reused
+		 */
+		struct FreeBlock {
+			FreeBlock* next;		/**< Next block of the same size class */
+		};
+
+		cmsContext m_context;						/**< The LittleCMS context */
+		std::mutex m_mutex;							/**< Protects the pool and the counters */
+		FreeBlock* m_freeLists[SIZE_CLASSES];		/**< Freed blocks by size class */
+		LcmsMemoryStats m_stats;					/**< Memory counters */
+
+		void* allocate(size_t);
+		void release(void*);
+		void* reallocate(void*, size_t);
+		static LcmsContext* getOwner(cmsContext);
+		static void* poolMalloc(cmsContext, cmsUInt32Number);
+		static void poolFree(cmsContext, void*);
+		static void* poolRealloc(cmsContext, void*, cmsUInt32Number);
+
+		LcmsContext(const LcmsContext&);
+		LcmsContext& operator=(const LcmsContext&);
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef LIBICCFLOW_H
+#define LIBICCFLOW_H
+
+/**
+ * Public interface of the iccflow library (libiccflow).
+ *
+ * Typical use from an image service converting JPEG data in memory:
+ *
+ *     IccCache cache;                  // shared by all converters
+ *     IccConverter converter;          // one per thread
+ *     converter.setCache(&cache);
+ *     converter.setOutputProfile("/path/to/profile.icc");
+ *
+ *     std::string output;
+ *     ConversionResult result;
+ *     if (!converter.convertBuffer(data,size,output,result)) {
+ *         // result.errorCode and result.errorMessage tell what went wrong
+ *     }
+ *
+ * The library never writes to the console.
+ */
+
+#include "iccprofile.h"
+#include "icccache.h"
+#include "iccconverter.h"
+#include "runstats.h"
+
+#endif
@@ -0,0 +1,373 @@
+#include <cstdio>
+#include "libjpegcodec.h"
+
+METHODDEF(void) my_error_exit(j_common_ptr cinfo);
+
+/**
+ * Creates the libjpeg decompression object
+ */
+LibjpegDecoder::LibjpegDecoder()
+:m_saveMarkers(false)
+{
+	m_dinfo.err = jpeg_std_error(&m_derr.jerr);
+	m_derr.jerr.error_exit = my_error_exit;
+	jpeg_create_decompress(&m_dinfo);
+	iccflow_scratch_memory((j_common_ptr) &m_dinfo,&m_memory,&m_arena);
+	iccflow_mem_src(&m_dinfo,&m_source,NULL,0);
+}
+
+/**
+ * Destructor frees the libjpeg decompression object
+ */
+LibjpegDecoder::~LibjpegDecoder() {
+	jpeg_destroy_decompress(&m_dinfo);
+}
+
+/**
+ * Sets an open file as source. Data read is captured until the header
+ * has been read, so markers can be scanned without reading the file again.
+ *
+ * @param[in] file Open file with the JPEG data
+ */
+void LibjpegDecoder::setFileSource(FILE* file) {
+	m_header.clear();
+	iccflow_file_src(&m_dinfo,&m_source,file,&m_header);
+}
+
+/**
+ * Sets a memory block as source
+ *
+ * @param[in] data JPEG data
+ * @param[in] size Size of the JPEG data
+ */
+void LibjpegDecoder::setMemorySource(const unsigned char* data, size_t size) {
+	m_header.clear();
+	iccflow_mem_src(&m_dinfo,&m_source,data,size);
+}
+
+/**
+ * Enables or disables keeping APP1-APP13, APP15 and COM markers. APP0 and
+ * APP14 are always parsed by libjpeg itself, and not kept.
+ *
+ * @param[in] save true for keeping markers, false for skipping them
+ */
+void LibjpegDecoder::setSaveMarkers(bool save) {
+	m_saveMarkers = save;
+}
+
+/**
+ * Reads the JPEG header, and stops capturing file data
+ *
+ * @param[out] info Size, components and color space of the stored image
+ * @return true if the header was read, false on error
+ */
+bool LibjpegDecoder::readHeader(JpegImageInfo& info) {
+	if (setjmp(m_derr.setjmp_buffer)) {
+		m_source.header = NULL;
+		return false;
+	}
+	unsigned int lengthLimit = m_saveMarkers ? 0xFFFF : 0;
+	for (int app=1; app<=15; app++) {
+		if (app != 14) {
+			jpeg_save_markers(&m_dinfo,JPEG_APP0+app,lengthLimit);
+		}
+	}
+	jpeg_save_markers(&m_dinfo,JPEG_COM,lengthLimit);
+	jpeg_read_header(&m_dinfo,TRUE);
+	m_source.header = NULL;
+	info.width = m_dinfo.image_width;
+	info.height = m_dinfo.image_height;
+	info.components = m_dinfo.num_components;
+	info.colorSpace = m_dinfo.out_color_space;
+
+	return true;
+}
+
+/**
+ * Gets the JPEG data containing the header: the data captured from file
+ * sources, or the whole memory block
+ *
+ * @param[out] data Start of the data
+ * @param[out] size Size of the data
+ */
+void LibjpegDecoder::getHeaderData(const char*& data, size_t& size) {
+	if (m_source.file != NULL) {
+		data = m_header.data();
+		size = m_header.size();
+	} else {
+		data = (const char*) m_source.data;
+		size = m_source.size;
+	}
+}
+
+/**
+ * Gets the markers saved while reading the header
+ *
+ * @param[out] markers The saved markers, in file order
+ */
+void LibjpegDecoder::getMarkers(std::vector<JpegMarker>& markers) {
+	markers.clear();
+	for (jpeg_saved_marker_ptr saved = m_dinfo.marker_list; saved != NULL; saved = saved->next) {
+		JpegMarker marker;
+		marker.code = saved->marker;
+		marker.data.assign((const char*) saved->data,saved->data_length);
+		markers.push_back(marker);
+	}
+}
+
+/**
+ * Gets the size of the decoded image when scaling it in the IDCT
+ *
+ * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+ * @param[out] width Scaled width
+ * @param[out] height Scaled height
+ * @return true on success, false on error
+ */
+bool LibjpegDecoder::getScaledSize(int denominator, unsigned int& width, unsigned int& height) {
+	if (setjmp(m_derr.setjmp_buffer)) {
+		return false;
+	}
+	m_dinfo.scale_num = 1;
+	m_dinfo.scale_denom = denominator;
+	jpeg_calc_output_dimensions(&m_dinfo);
+	width = m_dinfo.output_width;
+	height = m_dinfo.output_height;
+
+	return true;
+}
+
+/**
+ * Starts decompression
+ *
+ * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+ * @param[in] codec Decompression parameters
+ * @param[out] output Size, components and color space of decoded lines
+ * @return true on success, false on error
+ */
+bool LibjpegDecoder::start(int denominator, const CodecSettings& codec, JpegImageInfo& output) {
+	if (setjmp(m_derr.setjmp_buffer)) {
+		return false;
+	}
+	m_dinfo.scale_num = 1;
+	m_dinfo.scale_denom = denominator;
+	m_dinfo.dct_method = codec.decodeDctMethod;
+	m_dinfo.do_fancy_upsampling = codec.fancyUpsampling ? TRUE : FALSE;
+	jpeg_start_decompress(&m_dinfo);
+	output.width = m_dinfo.output_width;
+	output.height = m_dinfo.output_height;
+	output.components = m_dinfo.output_components;
+	output.colorSpace = m_dinfo.out_color_space;
+	m_line.resize(m_dinfo.output_width*m_dinfo.output_components);
+
+	return true;
+}
+
+/**
+ * Decodes the next line
+ *
+ * @return The line, valid until the next call, or NULL on error
+ */
+const JSAMPLE* LibjpegDecoder::readLine() {
+	if (setjmp(m_derr.setjmp_buffer)) {
+		return NULL;
+	}
+	JSAMPROW row = &m_line[0];
+	jpeg_read_scanlines(&m_dinfo,&row,1);
+
+	return row;
+}
+
+/**
+ * Finishes decompression
+ *
+ * @return true on success, false on error
+ */
+bool LibjpegDecoder::finish() {
+	if (setjmp(m_derr.setjmp_buffer)) {
+		return false;
+	}
+	jpeg_finish_decompress(&m_dinfo);
+
+	return true;
+}
+
+/**
+ * Abandons the current image
+ */
+void LibjpegDecoder::abort() {
+	m_source.header = NULL;
+	m_header.clear();
+	jpeg_abort_decompress(&m_dinfo);
+}
+
+/**
+ * Gets the amount of JPEG data consumed
+ *
+ * @return Bytes read from the source
+ */
+unsigned long LibjpegDecoder::getBytesRead() {
+	return m_source.bytesRead;
+}
+
+/**
+ * Gets the working memory of the current image
+ *
+ * @return Size of the libjpeg image pool, the decoded line and the captured header
+ */
+unsigned long long LibjpegDecoder::getMemoryUsed() {
+	return m_arena.getUsed() + m_line.capacity() + m_header.capacity();
+}
+
+
+/**
+ * Creates the libjpeg compression object
+ */
+LibjpegEncoder::LibjpegEncoder() {
+	m_cinfo.err = jpeg_std_error(&m_cerr.jerr);
+	m_cerr.jerr.error_exit = my_error_exit;
+	jpeg_create_compress(&m_cinfo);
+	iccflow_scratch_memory((j_common_ptr) &m_cinfo,&m_memory,&m_arena);
+	iccflow_file_dest(&m_cinfo,&m_destination,NULL);
+}
+
+/**
+ * Destructor frees the libjpeg compression object
+ */
+LibjpegEncoder::~LibjpegEncoder() {
+	jpeg_destroy_compress(&m_cinfo);
+}
+
+/**
+ * Sets an open file as destination
+ *
+ * @param[in] file Open file receiving the JPEG data
+ */
+void LibjpegEncoder::setFileDestination(FILE* file) {
+	iccflow_file_dest(&m_cinfo,&m_destination,file);
+}
+
+/**
+ * Sets a string as destination
+ *
+ * @param[in] output String receiving the JPEG data
+ */
+void LibjpegEncoder::setStringDestination(std::string* output) {
+	iccflow_string_dest(&m_cinfo,&m_destination,output);
+}
+
+/**
+ * Sets compression parameters, starts compression and writes the given
+ * markers and the ICC profile markers
+ *
+ * @param[in] image Size, components and color space of the lines to encode
+ * @param[in] quality JPEG quality (0-100)
+ * @param[in] codec Compression parameters
+ * @param[in] iccProfile ICC profile data to embed, empty for none
+ * @param[in] markers APPn and COM markers to write before the ICC profile
+ * @return true on success, false on error
+ */
+bool LibjpegEncoder::start(const JpegImageInfo& image, int quality, const CodecSettings& codec, const std::string& iccProfile, const std::vector<JpegMarker>& markers) {
+	if (setjmp(m_cerr.setjmp_buffer)) {
+		return false;
+	}
+	m_cinfo.image_width = image.width;
+	m_cinfo.image_height = image.height;
+	m_cinfo.input_components = image.components;
+	m_cinfo.in_color_space = image.colorSpace;
+	jpeg_set_defaults(&m_cinfo);
+	jpeg_set_quality(&m_cinfo,quality,TRUE);
+	m_cinfo.dct_method = codec.encodeDctMethod;
+	m_cinfo.optimize_coding = codec.optimizeCoding ? TRUE : FALSE;
+	m_cinfo.restart_in_rows = codec.restartRows;
+	if (codec.progressive) {
+		jpeg_simple_progression(&m_cinfo);
+	}
+	jpeg_start_compress(&m_cinfo,TRUE);
+	for (size_t i=0; i<markers.size(); i++) {
+		jpeg_write_marker(&m_cinfo,markers[i].code,(const JOCTET*) markers[i].data.data(),markers[i].data.size());
+	}
+	if (!iccProfile.empty()) {
+		writeIccProfile(&m_cinfo,iccProfile);
+	}
+
+	return true;
+}
+
+/**
+ * Compresses the next line
+ *
+ * @param[in] line Pixels of the line
+ * @return true on success, false on error
+ */
+bool LibjpegEncoder::writeLine(const JSAMPLE* line) {
+	if (setjmp(m_cerr.setjmp_buffer)) {
+		return false;
+	}
+	JSAMPROW row = const_cast<JSAMPROW>(line);
+	jpeg_write_scanlines(&m_cinfo,&row,1);
+
+	return true;
+}
+
+/**
+ * Finishes compression, flushing all data to the destination
+ *
+ * @return true on success, false on error
+ */
+bool LibjpegEncoder::finish() {
+	if (setjmp(m_cerr.setjmp_buffer)) {
+		return false;
+	}
+	jpeg_finish_compress(&m_cinfo);
+
+	return true;
+}
+
+/**
+ * Abandons the current image
+ */
+void LibjpegEncoder::abort() {
+	jpeg_abort_compress(&m_cinfo);
+}
+
+/**
+ * Gets the amount of JPEG data produced
+ *
+ * @return Bytes written to the destination
+ */
+unsigned long LibjpegEncoder::getBytesWritten() {
+	return m_destination.bytesWritten;
+}
+
+/**
+ * Gets the working memory of the current image
+ *
+ * @return Size of the libjpeg image pool
+ */
+unsigned long long LibjpegEncoder::getMemoryUsed() {
+	return m_arena.getUsed();
+}
+
+/**
+ * Embeds an ICC profile in the JPEG being compressed, split in APP2
+ * markers. Must be called right after jpeg_start_compress.
+ *
+ * @param[in] p_cinfo Compression struct
+ * @param[in] iccProfile ICC profile data
+ */
+void LibjpegEncoder::writeIccProfile(jpeg_compress_struct* p_cinfo, const std::string& iccProfile) {
+	std::vector<std::string> markers;
+	getIccMarkers(iccProfile,markers);
+	for (size_t i=0; i<markers.size(); i++) {
+		jpeg_write_marker(p_cinfo,JPEG_APP0+2,(const JOCTET*) markers[i].data(),markers[i].size());
+	}
+}
+
+/**
+ * Custom handling of errors in the libjpeg library
+ */
+METHODDEF(void) my_error_exit(j_common_ptr cinfo) {
+  /* Return control to the setjmp point */
+  my_error_mgr* myerr = (my_error_mgr*) cinfo->err;
+  longjmp(myerr->setjmp_buffer, 1);
+}
@@ -0,0 +1,90 @@
+#ifndef LIBJPEGCODEC_H
+#define LIBJPEGCODEC_H
+
+#include <setjmp.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "jpegcodec.h"
+#include "jpegio.h"
+
+/**
+ * Custor error manager struct for handling
+ * libjpeg errors
+ */
+struct my_error_mgr {
+  struct jpeg_error_mgr jerr;	/**< Standard libjpeg error manager */
+  jmp_buf setjmp_buffer;		/**< Additional field for controlling return point on error */
+};
+
+/**
+ * JPEG decompressor using the libjpeg API. Lines are decoded on demand,
+ * so only the header and one line are kept in memory. The memory libjpeg
+ * needs for each image comes from a scratch arena kept between images.
+ */
+class LibjpegDecoder : public JpegDecoder {
+
+	public:
+		LibjpegDecoder();
+		~LibjpegDecoder();
+		void setFileSource(FILE*);
+		void setMemorySource(const unsigned char*, size_t);
+		void setSaveMarkers(bool);
+		bool readHeader(JpegImageInfo&);
+		void getHeaderData(const char*&, size_t&);
+		void getMarkers(std::vector<JpegMarker>&);
+		bool getScaledSize(int, unsigned int&, unsigned int&);
+		bool start(int, const CodecSettings&, JpegImageInfo&);
+		const JSAMPLE* readLine();
+		bool finish();
+		void abort();
+		unsigned long getBytesRead();
+		unsigned long long getMemoryUsed();
+
+	private:
+		jpeg_decompress_struct m_dinfo;		/**< Info struct for JPEG decompression */
+		my_error_mgr m_derr;				/**< Data for JPEG decompression error management */
+		iccflow_source_mgr m_source;		/**< JPEG decompression data source */
+		iccflow_memory_mgr m_memory;		/**< JPEG decompression memory manager */
+		ScratchArena m_arena;				/**< Memory of the image being decompressed, kept between images */
+		std::string m_header;				/**< Header data captured from file sources */
+		std::vector<JSAMPLE> m_line;		/**< Last decoded line */
+		bool m_saveMarkers;					/**< Wether APPn and COM markers are kept */
+
+		LibjpegDecoder(const LibjpegDecoder&);
+		LibjpegDecoder& operator=(const LibjpegDecoder&);
+};
+
+/**
+ * JPEG compressor using the libjpeg API. Lines are compressed as they
+ * are received, and output is written as soon as it is compressed. The
+ * memory libjpeg needs for each image comes from a scratch arena kept
+ * between images.
+ */
+class LibjpegEncoder : public JpegEncoder {
+
+	public:
+		LibjpegEncoder();
+		~LibjpegEncoder();
+		void setFileDestination(FILE*);
+		void setStringDestination(std::string*);
+		bool start(const JpegImageInfo&, int, const CodecSettings&, const std::string&, const std::vector<JpegMarker>&);
+		bool writeLine(const JSAMPLE*);
+		bool finish();
+		void abort();
+		unsigned long getBytesWritten();
+		unsigned long long getMemoryUsed();
+		static void writeIccProfile(jpeg_compress_struct*, const std::string&);
+
+	private:
+		jpeg_compress_struct m_cinfo;			/**< Info struct for JPEG compression */
+		my_error_mgr m_cerr;					/**< Data for JPEG compression error management */
+		iccflow_destination_mgr m_destination;	/**< JPEG compression data destination */
+		iccflow_memory_mgr m_memory;			/**< JPEG compression memory manager */
+		ScratchArena m_arena;					/**< Memory of the image being compressed, kept between images */
+
+		LibjpegEncoder(const LibjpegEncoder&);
+		LibjpegEncoder& operator=(const LibjpegEncoder&);
+};
+
+#endif
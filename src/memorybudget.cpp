@@ -0,0 +1,81 @@
+#include <algorithm>
+#include "memorybudget.h"
+
+/**
+ * Creates an unlimited budget
+ */
+MemoryBudget::MemoryBudget()
+:m_limit(0),
+ m_used(0),
+ m_peak(0),
+ m_nextTicket(0),
+ m_serving(0),
+ m_waits(0) {
+}
+
+/**
+ * Sets the budget
+ *
+ * @param[in] limit Budget in bytes, 0 for no limit
+ */
+void MemoryBudget::setLimit(unsigned long long limit) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_limit = limit;
+}
+
+/**
+ * Reserves memory for an image, waiting for earlier reservations and for
+ * enough memory to be released
+ *
+ * @param[in] bytes Estimated memory of the image
+ */
+void MemoryBudget::reserve(unsigned long long bytes) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	unsigned long ticket = m_nextTicket++;
+	while (ticket != m_serving) {
+		m_released.wait(lock);
+	}
+	bool waited = false;
+	while ((m_limit > 0) && (m_used > 0) && (m_used + bytes > m_limit)) {
+		waited = true;
+		m_released.wait(lock);
+	}
+	m_serving++;
+	m_used += bytes;
+	m_peak = std::max(m_peak,m_used);
+	if (waited) {
+		m_waits++;
+	}
+	m_released.notify_all();
+}
+
+/**
+ * Releases the memory of an image
+ *
+ * @param[in] bytes Memory reserved for the image
+ */
+void MemoryBudget::release(unsigned long long bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_used -= std::min(bytes,m_used);
+	m_released.notify_all();
+}
+
+/**
+ * Gets the highest memory reserved at the same time
+ *
+ * @return Memory in bytes
+ */
+unsigned long long MemoryBudget::getPeak() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peak;
+}
+
+/**
+ * Gets the number of reservations that had to wait for memory
+ *
+ * @return Number of reservations
+ */
+unsigned long MemoryBudget::getWaits() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_waits;
+}
@@ -0,0 +1,41 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * MemoryBudget objects limit the estimated memory of images converted at
+ * the same time. Workers reserve the estimate of an image before decoding
+ * it, waiting while the budget is exhausted, so that large images run with
+ * lower parallelism instead of exhausting memory.
+ *
+ * Reservations are granted in request order, so that a large image is not
+ * overtaken forever by smaller ones. An image larger than the whole budget
+ * runs alone.
+ */
+class MemoryBudget {
+
+	public:
+		MemoryBudget();
+		void setLimit(unsigned long long);
+		void reserve(unsigned long long);
+		void release(unsigned long long);
+		unsigned long long getPeak();
+		unsigned long getWaits();
+
+	private:
+		std::mutex m_mutex;					/**< Protects all members */
+		std::condition_variable m_released;	/**< Signals released memory and granted turns */
+		unsigned long long m_limit;			/**< Budget in bytes, 0 for no limit */
+		unsigned long long m_used;			/**< Memory reserved by images being converted */
+		unsigned long long m_peak;			/**< Highest reserved memory */
+		unsigned long m_nextTicket;			/**< Turn given to the next reservation */
+		unsigned long m_serving;			/**< Turn of the reservation being granted */
+		unsigned long m_waits;				/**< Reservations that had to wait */
+
+		MemoryBudget(const MemoryBudget&);
+		MemoryBudget& operator=(const MemoryBudget&);
+};
+
+#endif
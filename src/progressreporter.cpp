@@ -0,0 +1,172 @@
+#include <cstdio>
+#include <cerrno>
+#include <csignal>
+#if defined _WIN32 || defined _WIN64
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "progressreporter.h"
+
+/**
+ * Creates a disabled reporter: counters are updated, but no events
+ * are written until an output is set.
+ */
+ProgressReporter::ProgressReporter()
+:m_fd(-1),
+ m_interval(1),
+ m_filesTotal(0),
+ m_bytesTotal(0),
+ m_filesDone(0),
+ m_filesFailed(0),
+ m_bytesDone(0),
+ m_bytesWritten(0),
+ m_pixels(0),
+ m_stopping(false)
+{
+	m_start = std::chrono::steady_clock::now();
+}
+
+/**
+ * Destructor stops the reporter thread, if running
+ */
+ProgressReporter::~ProgressReporter() {
+	stop();
+}
+
+/**
+ * Sets where and how often events are written
+ *
+ * @param[in] fd File descriptor receiving events, negative to disable them
+ * @param[in] interval Minimum seconds between events
+ */
+void ProgressReporter::setOutput(int fd, double interval) {
+	m_fd = fd;
+	m_interval = (interval > 0) ? interval : 1;
+}
+
+/**
+ * Starts a run, and the reporter thread if an output is set
+ *
+ * @param[in] filesTotal Number of files in the run
+ * @param[in] bytesTotal Total size of the source files
+ */
+void ProgressReporter::start(unsigned long filesTotal, unsigned long long bytesTotal) {
+	stop();
+	m_filesTotal = filesTotal;
+	m_bytesTotal = bytesTotal;
+	m_filesDone = 0;
+	m_filesFailed = 0;
+	m_bytesDone = 0;
+	m_bytesWritten = 0;
+	m_pixels = 0;
+	m_start = std::chrono::steady_clock::now();
+	m_stopping = false;
+	if (m_fd >= 0) {
+		#if !defined _WIN32 && !defined _WIN64
+		// A reader going away must not kill the run
+		signal(SIGPIPE,SIG_IGN);
+		#endif
+		m_thread = std::thread(&ProgressReporter::reporterLoop,this);
+	}
+}
+
+/**
+ * Finishes the run: the reporter thread writes the final event and exits
+ */
+void ProgressReporter::stop() {
+	if (!m_thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+		m_wakeUp.notify_all();
+	}
+	m_thread.join();
+}
+
+/**
+ * Counts a processed file
+ *
+ * @param[in] sourceBytes Size of the source file
+ * @param[in] success Whether the file was successfully processed
+ */
+void ProgressReporter::addFile(unsigned long long sourceBytes, bool success) {
+	m_bytesDone += sourceBytes;
+	if (!success) {
+		m_filesFailed++;
+	}
+	m_filesDone++;
+}
+
+/**
+ * Counts the output of a converted image
+ *
+ * @param[in] pixels Pixels of the image
+ * @param[in] bytesWritten Size of the converted image
+ */
+void ProgressReporter::addOutput(unsigned long long pixels, unsigned long long bytesWritten) {
+	m_pixels += pixels;
+	m_bytesWritten += bytesWritten;
+}
+
+/**
+ * Reporter thread main loop: writes an event every interval until stopped
+ */
+void ProgressReporter::reporterLoop() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	std::chrono::duration<double> interval(m_interval);
+	while (!m_stopping) {
+		m_wakeUp.wait_for(lock,interval);
+		if (!m_stopping) {
+			writeEvent("progress");
+		}
+	}
+	writeEvent("done");
+}
+
+/**
+ * Writes an event with a snapshot of the counters
+ *
+ * @param[in] event Event name
+ */
+void ProgressReporter::writeEvent(const char* event) {
+	unsigned long filesDone = m_filesDone;
+	unsigned long filesFailed = m_filesFailed;
+	unsigned long long bytesDone = m_bytesDone;
+	unsigned long long bytesWritten = m_bytesWritten;
+	double megapixels = m_pixels/1e6;
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	double mps = (elapsed > 0) ? megapixels/elapsed : 0;
+	double eta = -1;
+	if ((bytesDone > 0) && (m_bytesTotal >= bytesDone)) {
+		eta = elapsed*(m_bytesTotal - bytesDone)/bytesDone;
+	} else if ((filesDone > 0) && (m_filesTotal >= filesDone)) {
+		eta = elapsed*(m_filesTotal - filesDone)/filesDone;
+	}
+
+	char line[512];
+	int length = snprintf(line,sizeof(line),
+		"{\"event\":\"%s\",\"files_done\":%lu,\"files_failed\":%lu,\"files_total\":%lu,"
+		"\"bytes_done\":%llu,\"bytes_total\":%llu,\"bytes_written\":%llu,\"megapixels\":%.3f,"
+		"\"mp_per_second\":%.3f,\"elapsed_seconds\":%.3f,\"eta_seconds\":%.1f}\n",
+		event,filesDone,filesFailed,m_filesTotal,bytesDone,m_bytesTotal,bytesWritten,megapixels,mps,elapsed,eta);
+	if ((length <= 0) || (length >= (int) sizeof(line))) {
+		return;
+	}
+
+	// Write the whole line, giving up on errors
+	const char* data = line;
+	while (length > 0) {
+		int bytes = write(m_fd,data,length);
+		if (bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		data += bytes;
+		length -= bytes;
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef PROGRESSREPORTER_H
+#define PROGRESSREPORTER_H
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/**
+ * ProgressReporter objects write the progress of a batch run as JSON
+ * lines to a file descriptor, at most once per interval.
+ *
+ * Workers only update atomic counters. A background thread takes snapshots
+ * of the counters and formats the events, so converting images never waits
+ * for text formatting or output.
+ *
+ * Each event is a single line with these fields: event ("progress", or
+ * "done" for the last one), files_done, files_failed, files_total,
+ * bytes_done, bytes_total (source sizes), bytes_written, megapixels,
+ * mp_per_second, elapsed_seconds and eta_seconds (-1 while unknown).
+ */
+class ProgressReporter {
+
+	public:
+		ProgressReporter();
+		~ProgressReporter();
+		void setOutput(int, double);
+		void start(unsigned long, unsigned long long);
+		void stop();
+		void addFile(unsigned long long, bool);
+		void addOutput(unsigned long long, unsigned long long);
+
+	private:
+		int m_fd;										/**< Descriptor receiving events, negative to disable */
+		double m_interval;								/**< Minimum seconds between events */
+		unsigned long m_filesTotal;						/**< Files in the run */
+		unsigned long long m_bytesTotal;				/**< Total size of source files */
+		std::atomic<unsigned long> m_filesDone;			/**< Files processed */
+		std::atomic<unsigned long> m_filesFailed;		/**< Files that failed */
+		std::atomic<unsigned long long> m_bytesDone;	/**< Size of processed source files */
+		std::atomic<unsigned long long> m_bytesWritten;	/**< Bytes of converted images */
+		std::atomic<unsigned long long> m_pixels;		/**< Pixels of converted images */
+		std::chrono::steady_clock::time_point m_start;	/**< Start of the run */
+		std::thread m_thread;							/**< Reporter thread */
+		std::mutex m_mutex;								/**< Protects the stop flag */
+		std::condition_variable m_wakeUp;				/**< Signals the reporter thread to stop */
+		bool m_stopping;								/**< Run finished, reporter thread has to exit */
+
+		void reporterLoop();
+		void writeEvent(const char*);
+
+		ProgressReporter(const ProgressReporter&);
+		ProgressReporter& operator=(const ProgressReporter&);
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include <cstdio>
+#include <algorithm>
+#include <set>
+#include "globals.h"
+#include "publishbatch.h"
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Longest time a written file waits for the barrier of its group
+ */
+const std::chrono::milliseconds PUBLISH_MAX_DELAY(200);
+
+/**
+ * Starts the publisher thread
+ *
+ * @param[in] folders Output folders the files are written to
+ * @param[in] files Files published after every barrier
+ */
+PublishBatch::PublishBatch(const std::vector<std::string>& folders, size_t files)
+:m_folders(folders),
+ m_groupFiles(std::max(files,(size_t) 1)),
+ m_flushing(false),
+ m_publishing(false),
+ m_stopping(false),
+ m_published(0),
+ m_barriers(0),
+ m_barrierSeconds(0) {
+	m_publisher = std::thread(&PublishBatch::publisherLoop,this);
+}
+
+/**
+ * Publishes the files still staged and stops the publisher thread
+ */
+PublishBatch::~PublishBatch() {
+	flush();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_changed.notify_all();
+	m_publisher.join();
+}
+
+/**
+ * Stages a written file, to be moved to its final name after the next
+ * barrier
+ *
+ * @param[in] tempPath Temp name of the file, already written and closed
+ * @param[in] path Final name of the file
+ * @param[in] done Called from the publisher thread when the file has been published, with the error message (empty on success)
+ */
+void PublishBatch::add(const std::string& tempPath, const std::string& path, IoWriteCallback done) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_staged.empty()) {
+		m_oldest = std::chrono::steady_clock::now();
+	}
+	m_staged.push_back(StagedFile());
+	StagedFile& staged = m_staged.back();
+	staged.tempPath = tempPath;
+	staged.path = path;
+	staged.done = done;
+	m_changed.notify_all();
+}
+
+/**
+ * Publishes all staged files now, and waits until their completion
+ * functions have returned
+ */
+void PublishBatch::flush() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_flushing = true;
+	m_changed.notify_all();
+	m_changed.wait(lock,[this]() {
+		return m_staged.empty() && !m_publishing;
+	});
+	m_flushing = false;
+}
+
+/**
+ * Gets the number of files moved to their final names
+ *
+ * @return Files published
+ */
+unsigned long PublishBatch::getPublished() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_published;
+}
+
+/**
+ * Gets the number of barriers run, one per group of files
+ *
+ * @return Barriers run
+ */
+unsigned long PublishBatch::getBarriers() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_barriers;
+}
+
+/**
+ * Gets the time spent waiting for storage in barriers
+ *
+ * @return Seconds
+ */
+double PublishBatch::getBarrierSeconds() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_barrierSeconds;
+}
+
+/**
+ * Publisher thread main loop: waits for a group to be complete, runs its
+ * barrier and publishes its files, until stopped
+ */
+void PublishBatch::publisherLoop() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		if (m_staged.empty()) {
+			if (m_stopping) {
+				break;
+			}
+			m_changed.wait(lock);
+			continue;
+		}
+		std::chrono::steady_clock::time_point deadline = m_oldest + PUBLISH_MAX_DELAY;
+		if (!m_flushing && !m_stopping && (m_staged.size() < m_groupFiles) && (std::chrono::steady_clock::now() < deadline)) {
+			m_changed.wait_until(lock,deadline);
+			continue;
+		}
+		std::vector<StagedFile> group;
+		group.swap(m_staged);
+		m_publishing = true;
+		lock.unlock();
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		bool synced = barrier(group);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		unsigned long published = publish(group,synced ? "" : "Failed to flush output files to storage");
+
+		lock.lock();
+		m_publishing = false;
+		m_published += published;
+		m_barriers++;
+		m_barrierSeconds += seconds;
+		m_changed.notify_all();
+	}
+}
+
+/**
+ * Flushes the files of a group to storage
+ *
+ * @param[in] group The files
+ * @return true if all files were flushed, false otherwise
+ */
+bool PublishBatch::barrier(std::vector<StagedFile>& group) {
+	bool success = true;
+#ifdef __linux__
+	// One flush of every filesystem holding output folders covers all files
+	(void) group;
+	for (size_t i=0; i<m_folders.size(); i++) {
+		int fd = open(m_folders[i].c_str(),O_RDONLY);
+		if ((fd < 0) || (syncfs(fd) != 0)) {
+			success = false;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+#else
+	for (size_t i=0; i<group.size(); i++) {
+		success = syncFile(group[i].tempPath) && success;
+	}
+#endif
+
+	return success;
+}
+
+/**
+ * Moves the files of a group to their final names, or deletes them if the
+ * barrier failed, flushes the folders they were moved in once each, and
+ * calls their completion functions
+ *
+ * @param[in] group The files
+ * @param[in] error Error message of the barrier, empty on success
+ * @return Number of files published
+ */
+unsigned long PublishBatch::publish(std::vector<StagedFile>& group, const std::string& error) {
+	std::vector<std::string> errors(group.size(),error);
+	std::set<std::string> folders;
+	for (size_t i=0; i<group.size(); i++) {
+		StagedFile& staged = group[i];
+		if (errors[i].empty()) {
+			// Delete original file when processing in same folder, silently fail otherwise
+			remove(staged.path.c_str());
+			if (rename(staged.tempPath.c_str(),staged.path.c_str()) != 0) {
+				errors[i] = "Can't rename " + staged.tempPath + " to " + staged.path;
+			} else {
+				folders.insert(getParentFolder(staged.path));
+			}
+		}
+		if (!errors[i].empty()) {
+			remove(staged.tempPath.c_str());
+		}
+	}
+
+	// Renames survive a power loss once their folders are flushed
+	std::set<std::string> failedFolders;
+	for (std::set<std::string>::iterator it = folders.begin(); it != folders.end(); ++it) {
+		if (!syncFolder(*it)) {
+			failedFolders.insert(*it);
+		}
+	}
+
+	unsigned long published = 0;
+	for (size_t i=0; i<group.size(); i++) {
+		StagedFile& staged = group[i];
+		if (errors[i].empty() && (failedFolders.find(getParentFolder(staged.path)) != failedFolders.end())) {
+			errors[i] = "Failed to flush the folder of " + staged.path + " to storage";
+		}
+		if (errors[i].empty()) {
+			published++;
+		}
+		staged.done(errors[i]);
+	}
+
+	return published;
+}
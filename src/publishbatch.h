@@ -0,0 +1,69 @@
+#ifndef PUBLISHBATCH_H
+#define PUBLISHBATCH_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include "ioengine.h"
+
+/**
+ * PublishBatch objects move written temp files to their final names in
+ * groups, after flushing them to storage with a single barrier per group,
+ * so that a file found under its final name after a power loss is always
+ * complete, without waiting for the storage device once per file.
+ *
+ * On Linux the barrier is one syncfs call per output folder; on other
+ * systems the files of the group are flushed one by one before any of
+ * them is published. Once moved, every folder holding files of the group
+ * is flushed once, so that the new names survive a power loss too. A group is published when it has enough files, when
+ * its oldest file has waited for the longest publication delay, or when
+ * the batch is flushed. A publisher thread does the flushing and moving,
+ * and calls the completion functions of the files.
+ */
+class PublishBatch {
+
+	public:
+		PublishBatch(const std::vector<std::string>&, size_t);
+		~PublishBatch();
+		void add(const std::string&, const std::string&, IoWriteCallback);
+		void flush();
+		unsigned long getPublished();
+		unsigned long getBarriers();
+		double getBarrierSeconds();
+
+	private:
+		/**
+		 * Written file waiting to be published
+		 */
+		struct StagedFile {
+			std::string tempPath;	/**< Temp name of the file, already written and closed */
+			std::string path;		/**< Final name of the file */
+			IoWriteCallback done;	/**< Called when the file has been published, with the error message (empty on success) */
+		};
+
+		std::vector<std::string> m_folders;		/**< Output folders flushed by every barrier */
+		size_t m_groupFiles;					/**< Files published after every barrier */
+		std::mutex m_mutex;						/**< Protects all members below */
+		std::condition_variable m_changed;		/**< Signals staged files, flush requests and published groups */
+		std::vector<StagedFile> m_staged;		/**< Files waiting for the next barrier */
+		std::chrono::steady_clock::time_point m_oldest;	/**< When the oldest staged file was added */
+		bool m_flushing;						/**< Staged files must be published now */
+		bool m_publishing;						/**< The publisher thread is publishing a group */
+		bool m_stopping;						/**< The publisher thread must finish */
+		unsigned long m_published;				/**< Files published */
+		unsigned long m_barriers;				/**< Barriers run */
+		double m_barrierSeconds;				/**< Time spent waiting for barriers */
+		std::thread m_publisher;				/**< Publisher thread */
+
+		void publisherLoop();
+		bool barrier(std::vector<StagedFile>&);
+		unsigned long publish(std::vector<StagedFile>&, const std::string&);
+
+		PublishBatch(const PublishBatch&);
+		PublishBatch& operator=(const PublishBatch&);
+};
+
+#endif
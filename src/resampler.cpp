@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <cmath>
+#include "resampler.h"
+
+/**
+ * Creates a resampler. It has to be set up before adding lines.
+ */
+Resampler::Resampler()
+:m_outputWidth(0),
+ m_outputHeight(0),
+ m_components(0),
+ m_scaleY(1),
+ m_sourceLine(0),
+ m_outputLine(0),
+ m_covered(0)
+{
+}
+
+/**
+ * Prepares the resampler for a new image. Output dimensions must not be
+ * greater than source dimensions.
+ *
+ * @param[in] sourceWidth Width of the source image
+ * @param[in] sourceHeight Height of the source image
+ * @param[in] outputWidth Width of the reduced image
+ * @param[in] outputHeight Height of the reduced image
+ * @param[in] components Color components per pixel
+ */
+void Resampler::setup(unsigned int sourceWidth, unsigned int sourceHeight, unsigned int outputWidth, unsigned int outputHeight, int components) {
+	m_outputWidth = outputWidth;
+	m_outputHeight = outputHeight;
+	m_components = components;
+	m_scaleY = (double) sourceHeight/outputHeight;
+	m_sourceLine = 0;
+	m_outputLine = 0;
+	m_covered = 0;
+
+	// Horizontal taps: source pixels covered by every output pixel
+	double scaleX = (double) sourceWidth/outputWidth;
+	m_tapStart.clear();
+	m_taps.clear();
+	for (unsigned int x=0; x<outputWidth; x++) {
+		m_tapStart.push_back(m_taps.size());
+		double start = x*scaleX;
+		double end = std::min((x+1)*scaleX,(double) sourceWidth);
+		for (unsigned int s=(unsigned int) start; (s < sourceWidth) && (s < end); s++) {
+			double overlap = std::min(end,(double) (s+1)) - std::max(start,(double) s);
+			if (overlap > 0) {
+				Tap tap = {s, (float) (overlap/scaleX)};
+				m_taps.push_back(tap);
+			}
+		}
+	}
+	m_tapStart.push_back(m_taps.size());
+
+	m_row.assign(outputWidth*components,0);
+	m_sum.assign(outputWidth*components,0);
+	m_output.assign(outputWidth*components,0);
+}
+
+/**
+ * Adds the next source line.
+ *
+ * @param[in] line Source line, with sourceWidth pixels
+ * @return The next output line if this source line completed it, NULL otherwise.
+ * The line is valid until the next call.
+ */
+const JSAMPLE* Resampler::addLine(const JSAMPLE* line) {
+	// Reduce horizontally
+	for (unsigned int x=0; x<m_outputWidth; x++) {
+		for (int c=0; c<m_components; c++) {
+			float value = 0;
+			for (unsigned int t=m_tapStart[x]; t<m_tapStart[x+1]; t++) {
+				value += m_taps[t].weight*line[m_taps[t].source*m_components+c];
+			}
+			m_row[x*m_components+c] = value;
+		}
+	}
+
+	// Accumulate vertically, splitting the line between output lines when
+	// it crosses a boundary
+	const JSAMPLE* output = NULL;
+	double position = m_sourceLine;
+	double end = m_sourceLine + 1;
+	while ((end - position > 1e-9) && (m_outputLine < m_outputHeight)) {
+		double boundary = (m_outputLine+1)*m_scaleY;
+		double weight = std::min(end,boundary) - position;
+		for (size_t i=0; i<m_sum.size(); i++) {
+			m_sum[i] += (float) weight*m_row[i];
+		}
+		m_covered += weight;
+		position += weight;
+		if (position >= boundary - 1e-9) {
+			output = emitLine();
+		}
+	}
+	m_sourceLine++;
+
+	return output;
+}
+
+/**
+ * Finishes the image, producing the last output line if source lines
+ * were left over because of rounding.
+ *
+ * @return The last output line, or NULL if all output lines were already produced
+ */
+const JSAMPLE* Resampler::finish() {
+	if ((m_outputLine < m_outputHeight) && (m_covered > 0)) {
+		return emitLine();
+	}
+
+	return NULL;
+}
+
+/**
+ * Gets the memory of the filter tables and line buffers
+ *
+ * @return Bytes held
+ */
+unsigned long long Resampler::getMemoryUsed() {
+	return m_tapStart.capacity()*sizeof(unsigned int) + m_taps.capacity()*sizeof(Tap)
+		+ (m_row.capacity() + m_sum.capacity())*sizeof(float) + m_output.capacity();
+}
+
+/**
+ * Turns the accumulated sums into the next output line
+ *
+ * @return The output line
+ */
+const JSAMPLE* Resampler::emitLine() {
+	float scale = (float) (1/m_covered);
+	for (size_t i=0; i<m_sum.size(); i++) {
+		float value = m_sum[i]*scale + 0.5f;
+		m_output[i] = (JSAMPLE) std::max(0.0f,std::min(value,(float) MAXJSAMPLE));
+		m_sum[i] = 0;
+	}
+	m_covered = 0;
+	m_outputLine++;
+
+	return &m_output[0];
+}
@@ -0,0 +1,50 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <vector>
+#include <cstdio>
+#include <jpeglib.h>
+
+/**
+ * Resampler objects reduce images line by line with an area averaging
+ * (box) filter, so they can sit between JPEG decompression and the color
+ * transform without keeping the whole image in memory.
+ *
+ * Only downscaling is supported: every output pixel is the weighted mean of
+ * the source pixels it covers, including fractional coverage at its edges.
+ */
+class Resampler {
+
+	public:
+		Resampler();
+		void setup(unsigned int, unsigned int, unsigned int, unsigned int, int);
+		const JSAMPLE* addLine(const JSAMPLE*);
+		const JSAMPLE* finish();
+		unsigned long long getMemoryUsed();
+
+	private:
+		/**
+		 * Contribution of a source column to an output column
+		 */
+		struct Tap {
+			unsigned int source;	/**< Index of the source pixel in the line */
+			float weight;			/**< Fraction of the output pixel covered by the source pixel */
+		};
+
+		unsigned int m_outputWidth;			/**< Width of the reduced image */
+		unsigned int m_outputHeight;		/**< Height of the reduced image */
+		int m_components;					/**< Color components per pixel */
+		double m_scaleY;					/**< Source lines per output line */
+		unsigned int m_sourceLine;			/**< Source lines received so far */
+		unsigned int m_outputLine;			/**< Output lines produced so far */
+		double m_covered;					/**< Source lines accumulated into the current output line */
+		std::vector<unsigned int> m_tapStart;	/**< First tap of every output column, plus end marker */
+		std::vector<Tap> m_taps;			/**< Horizontal filter taps */
+		std::vector<float> m_row;			/**< Current source line, reduced horizontally */
+		std::vector<float> m_sum;			/**< Weighted sum of the current output line */
+		std::vector<JSAMPLE> m_output;		/**< Last output line produced */
+
+		const JSAMPLE* emitLine();
+};
+
+#endif
@@ -0,0 +1,726 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include "globals.h"
+#include "runstats.h"
+
+/**
+ * Number of buckets of duration histograms: values up to 2^40 microseconds
+ */
+const unsigned int HISTOGRAM_BUCKETS = 8*40;
+
+/**
+ * Number of images kept as memory outliers
+ */
+const size_t MEMORY_OUTLIERS = 5;
+
+/**
+ * Creates an empty histogram
+ */
+Histogram::Histogram()
+:m_buckets(HISTOGRAM_BUCKETS,0),
+ m_count(0),
+ m_total(0),
+ m_max(0)
+{
+}
+
+/**
+ * Adds a sample to the histogram
+ *
+ * @param[in] seconds Duration in seconds
+ */
+void Histogram::add(double seconds) {
+	if (seconds < 0) {
+		seconds = 0;
+	}
+	m_buckets[bucketIndex(seconds)]++;
+	m_count++;
+	m_total += seconds;
+	if (seconds > m_max) {
+		m_max = seconds;
+	}
+}
+
+/**
+ * Adds all samples of another histogram to this one
+ *
+ * @param[in] other The histogram to merge
+ */
+void Histogram::merge(const Histogram& other) {
+	for (unsigned int i=0; i<HISTOGRAM_BUCKETS; i++) {
+		m_buckets[i] += other.m_buckets[i];
+	}
+	m_count += other.m_count;
+	m_total += other.m_total;
+	if (other.m_max > m_max) {
+		m_max = other.m_max;
+	}
+}
+
+/**
+ * Gets the number of samples
+ *
+ * @return Number of samples added
+ */
+unsigned long Histogram::getCount() const {
+	return m_count;
+}
+
+/**
+ * Gets the sum of all samples
+ *
+ * @return Total duration in seconds
+ */
+double Histogram::getTotal() const {
+	return m_total;
+}
+
+/**
+ * Gets the largest sample
+ *
+ * @return Largest duration in seconds
+ */
+double Histogram::getMax() const {
+	return m_max;
+}
+
+/**
+ * Gets a percentile of the samples
+ *
+ * @param[in] percent Percentile to compute (0-100)
+ * @return Approximate duration in seconds below which the given percentage
+ * of samples fall, 0 if the histogram is empty
+ */
+double Histogram::getPercentile(double percent) const {
+	if (m_count == 0) {
+		return 0;
+	}
+	unsigned long rank = (unsigned long) ceil(percent*m_count/100.0);
+	if (rank < 1) {
+		rank = 1;
+	}
+	unsigned long seen = 0;
+	for (unsigned int i=0; i<HISTOGRAM_BUCKETS; i++) {
+		seen += m_buckets[i];
+		if (seen >= rank) {
+			return std::min(bucketValue(i),m_max);
+		}
+	}
+
+	return m_max;
+}
+
+/**
+ * Gets the bucket for a duration. Durations under 8 microseconds get a
+ * bucket each, longer ones get 8 buckets per power of two.
+ *
+ * @param[in] seconds Duration in seconds
+ * @return Index of the bucket
+ */
+unsigned int Histogram::bucketIndex(double seconds) {
+	unsigned long long micros = (unsigned long long) (seconds*1e6);
+	if (micros < 8) {
+		return (unsigned int) micros;
+	}
+	unsigned int exponent = 63 - __builtin_clzll(micros);
+	unsigned int index = 8*(exponent-2) + ((micros >> (exponent-3)) & 7);
+
+	return std::min(index,HISTOGRAM_BUCKETS-1);
+}
+
+/**
+ * Gets the representative duration of a bucket
+ *
+ * @param[in] index Index of the bucket
+ * @return Duration in the middle of the bucket range, in seconds
+ */
+double Histogram::bucketValue(unsigned int index) {
+	if (index < 8) {
+		return index/1e6;
+	}
+	unsigned int exponent = index/8 + 2;
+	double width = (double) (1ULL << (exponent-3));
+	double low = (8 + index%8)*width;
+
+	return (low + width/2)/1e6;
+}
+
+
+/**
+ * Creates empty run statistics
+ */
+RunStats::RunStats()
+:m_wallSeconds(0),
+ m_keepFiles(false),
+ m_shardIndex(0),
+ m_shardCount(1),
+ m_folderFiles(0),
+ m_converted(0),
+ m_failed(0),
+ m_copied(0),
+ m_deduplicated(0),
+ m_deduplicatedBytes(0),
+ m_bytesRead(0),
+ m_bytesWritten(0),
+ m_megapixels(0),
+ m_profileHits(0),
+ m_profileMisses(0),
+ m_transformHits(0),
+ m_transformMisses(0),
+ m_peakRss(0),
+ m_lcmsAllocations(0),
+ m_lcmsPoolHits(0)
+{
+	m_start = std::chrono::steady_clock::now();
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		m_memoryPeak[i] = 0;
+	}
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		m_stageMemory[i] = 0;
+	}
+}
+
+/**
+ * Marks the start of the run
+ */
+void RunStats::start() {
+	m_start = std::chrono::steady_clock::now();
+}
+
+/**
+ * Marks the end of the run and takes the hit counters and memory use of
+ * the cache used, and the peak resident memory of the process
+ *
+ * @param[in] cache Profile and transform cache used in the run
+ */
+void RunStats::finish(IccCache& cache) {
+	LcmsMemoryStats lcms;
+	cache.getLcmsStats(lcms);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+	m_profileHits = cache.getProfileHits();
+	m_profileMisses = cache.getProfileMisses();
+	m_transformHits = cache.getTransformHits();
+	m_transformMisses = cache.getTransformMisses();
+	m_memoryPeak[MEMORY_CACHE] = std::max(m_memoryPeak[MEMORY_CACHE],lcms.peakBytes);
+	m_lcmsAllocations += lcms.allocations;
+	m_lcmsPoolHits += lcms.poolHits;
+	m_peakRss = std::max(m_peakRss,getPeakRss());
+}
+
+/**
+ * Sets whether results of every file are kept for the report.
+ * Only aggregated values are kept otherwise.
+ *
+ * @param[in] keepFiles true to keep per-file results
+ */
+void RunStats::setKeepFiles(bool keepFiles) {
+	m_keepFiles = keepFiles;
+}
+
+/**
+ * Sets the shard of the input folder processed by the run, so that the
+ * reports of all shards can be merged
+ *
+ * @param[in] index Index of the shard, from 0
+ * @param[in] count Number of shards, 1 if the whole folder is processed
+ * @param[in] folderFiles Files in the input folder, in all shards
+ */
+void RunStats::setShard(unsigned int index, unsigned int count, unsigned long folderFiles) {
+	m_shardIndex = index;
+	m_shardCount = count;
+	m_folderFiles = folderFiles;
+}
+
+/**
+ * Adds the result of a conversion. Only successful conversions are
+ * added to time histograms and totals.
+ *
+ * @param[in] file Name of the converted file
+ * @param[in] result Conversion result
+ */
+void RunStats::addConversion(const std::string& file, const ConversionResult& result) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_keepFiles) {
+		FileRecord record;
+		record.file = file;
+		record.result = result;
+		m_files.push_back(record);
+	}
+	if (result.errorCode != CONVERSION_OK) {
+		m_failed++;
+		return;
+	}
+	m_converted++;
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		m_stages[i].add(result.stageSeconds[i]);
+		m_stageMemory[i] = std::max(m_stageMemory[i],result.stageMemory[i]);
+	}
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		m_memoryPeak[i] = std::max(m_memoryPeak[i],result.memoryPeak[i]);
+	}
+	m_peakRss = std::max(m_peakRss,result.peakRss);
+	addOutlier(file,result);
+	m_total.add(result.totalSeconds);
+	m_bytesRead += result.inputBytes;
+	m_bytesWritten += result.outputBytes;
+	m_megapixels += (double) result.width*result.height/1e6;
+}
+
+/**
+ * Adds the time of a run stage outside conversions
+ *
+ * @param[in] stage The stage (see @ref RUN_STAGES)
+ * @param[in] seconds Duration in seconds
+ */
+void RunStats::addRunStage(int stage, double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_runStages[stage].add(seconds);
+}
+
+/**
+ * Adds a copied non-JPEG file
+ *
+ * @param[in] bytes Size of the file
+ * @param[in] seconds Time spent copying
+ */
+void RunStats::addCopy(unsigned long bytes, double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_runStages[RUN_STAGE_COPY].add(seconds);
+	m_copied++;
+	m_bytesRead += bytes;
+	m_bytesWritten += bytes;
+}
+
+/**
+ * Adds a JPEG file with the same content as a file processed earlier,
+ * whose outputs were linked instead of converting it again
+ *
+ * @param[in] bytes Size of the file
+ * @param[in] converted Whether the earlier file was converted and its outputs could be linked (counted as failed otherwise)
+ * @param[in] seconds Time taken to link the outputs
+ */
+void RunStats::addDuplicate(unsigned long bytes, bool converted, double seconds) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_runStages[RUN_STAGE_DEDUP].add(seconds);
+	m_bytesRead += bytes;
+	if (converted) {
+		m_deduplicated++;
+		m_deduplicatedBytes += bytes;
+	} else {
+		m_failed++;
+	}
+}
+
+/**
+ * Adds memory used by a subsystem outside conversions, such as the
+ * buffers of an I/O engine
+ *
+ * @param[in] subsystem The subsystem (see @ref MEMORY_SUBSYSTEMS)
+ * @param[in] bytes Peak bytes used
+ */
+void RunStats::addMemory(int subsystem, unsigned long long bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_memoryPeak[subsystem] = std::max(m_memoryPeak[subsystem],bytes);
+}
+
+/**
+ * Adds the LittleCMS allocation counters of a converter
+ *
+ * @param[in] stats Counters of the converter's context
+ */
+void RunStats::addLcmsStats(const LcmsMemoryStats& stats) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_lcmsAllocations += stats.allocations;
+	m_lcmsPoolHits += stats.poolHits;
+}
+
+/**
+ * Writes a short human readable summary of the run
+ *
+ * @param[in] out Stream to write to
+ * @param[in] showStages Whether to include the per-stage time table
+ */
+void RunStats::writeSummary(std::ostream& out, bool showStages) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	double seconds = (m_wallSeconds > 0) ? m_wallSeconds : 1e-9;
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::fixed << std::setprecision(2);
+	if (m_shardCount > 1) {
+		out << "Shard " << m_shardIndex << "/" << m_shardCount << " of " << m_folderFiles << " files in the input folder" << std::endl;
+	}
+	out << "Converted " << m_converted << " files (" << m_failed << " failed, " << m_copied << " copied) in "
+		<< m_wallSeconds << " s: " << m_megapixels << " MP, " << m_megapixels/seconds << " MP/s, "
+		<< m_converted/seconds << " files/s" << std::endl;
+	if (m_deduplicated > 0) {
+		out << "Deduplicated " << m_deduplicated << " files (" << m_deduplicatedBytes/1048576.0
+			<< " MB) by linking to the outputs of files with the same content" << std::endl;
+	}
+	out << "Read " << m_bytesRead/1048576.0 << " MB, wrote " << m_bytesWritten/1048576.0 << " MB. "
+		<< "Cache hit rate: profiles " << 100*hitRate(m_profileHits,m_profileMisses) << "%, transforms "
+		<< 100*hitRate(m_transformHits,m_transformMisses) << "%" << std::endl;
+	out << "Peak memory: RSS " << m_peakRss/1048576.0 << " MB";
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		out << ", " << getMemoryName(i) << " " << m_memoryPeak[i]/1048576.0 << " MB";
+	}
+	out << std::endl;
+	if (showStages) {
+		out << std::setprecision(3);
+		out << std::left << std::setw(10) << "Stage" << std::right << std::setw(12) << "total s"
+			<< std::setw(10) << "p50 ms" << std::setw(10) << "p95 ms" << std::setw(10) << "p99 ms"
+			<< std::setw(10) << "peak MB" << std::endl;
+		for (int i=0; i<=CONVERSION_STAGE_COUNT; i++) {
+			const Histogram& histogram = (i < CONVERSION_STAGE_COUNT) ? m_stages[i] : m_total;
+			out << std::left << std::setw(10) << ((i < CONVERSION_STAGE_COUNT) ? getStageName(i) : "total")
+				<< std::right << std::setw(12) << histogram.getTotal()
+				<< std::setw(10) << 1000*histogram.getPercentile(50)
+				<< std::setw(10) << 1000*histogram.getPercentile(95)
+				<< std::setw(10) << 1000*histogram.getPercentile(99);
+			if (i < CONVERSION_STAGE_COUNT) {
+				out << std::setw(10) << m_stageMemory[i]/1048576.0;
+			}
+			out << std::endl;
+		}
+		out << std::setprecision(2);
+		out << "LittleCMS allocations: " << m_lcmsAllocations << " (" << 100*hitRate(m_lcmsPoolHits,m_lcmsAllocations-m_lcmsPoolHits)
+			<< "% from pools)" << std::endl;
+		if (!m_outliers.empty()) {
+			out << "Largest images by memory:" << std::endl;
+			for (size_t i=0; i<m_outliers.size(); i++) {
+				const MemoryOutlier& outlier = m_outliers[i];
+				out << "  " << outlier.file << ": " << outlier.width << "x" << outlier.height << " "
+					<< getColorSpaceName(outlier.components) << ", " << outlier.memory/1048576.0 << " MB" << std::endl;
+			}
+		}
+	}
+	out.flags(flags);
+	out.precision(precision);
+}
+
+/**
+ * Writes the run report to a file. Files with .csv extension get one line
+ * per converted file (needs per-file results kept), any other file gets
+ * a JSON document with the aggregated values and per-file results if kept.
+ *
+ * @param[in] fileName Path to the report file
+ * @return true if the report was written, false otherwise
+ */
+bool RunStats::writeReport(const std::string& fileName) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::ofstream out(fileName.c_str());
+	if (!out.is_open()) {
+		return false;
+	}
+	std::string extension = (fileName.size() >= 4) ? fileName.substr(fileName.size()-4) : "";
+	if ((extension == ".csv") || (extension == ".CSV")) {
+		writeCsv(out);
+	} else {
+		writeJson(out);
+	}
+	out.close();
+
+	return !out.fail();
+}
+
+/**
+ * Gets the name of a conversion stage, as used in reports
+ *
+ * @param[in] stage The stage (see @ref CONVERSION_STAGES)
+ * @return Name of the stage
+ */
+const char* RunStats::getStageName(int stage) {
+	static const char* names[CONVERSION_STAGE_COUNT] = {"open","header","profile","transform","decode","resample","color","encode","publish"};
+	return names[stage];
+}
+
+/**
+ * Gets the name of a run stage, as used in reports
+ *
+ * @param[in] stage The stage (see @ref RUN_STAGES)
+ * @return Name of the stage
+ */
+const char* RunStats::getRunStageName(int stage) {
+	static const char* names[RUN_STAGE_COUNT] = {"list","copy","dedup"};
+	return names[stage];
+}
+
+/**
+ * Gets the name of a memory subsystem, as used in reports
+ *
+ * @param[in] subsystem The subsystem (see @ref MEMORY_SUBSYSTEMS)
+ * @return Name of the subsystem
+ */
+const char* RunStats::getMemoryName(int subsystem) {
+	static const char* names[MEMORY_SUBSYSTEM_COUNT] = {"codec","lcms","pixels","cache","io"};
+	return names[subsystem];
+}
+
+/**
+ * Gets the name of the color space of a source image
+ *
+ * @param[in] components Color components of the image
+ * @return Name of the color space
+ */
+const char* RunStats::getColorSpaceName(unsigned int components) {
+	switch (components) {
+		case 1:
+			return "Gray";
+		case 3:
+			return "RGB";
+		case 4:
+			return "CMYK";
+		default:
+			return "unknown";
+	}
+}
+
+/**
+ * Gets the peak memory of a conversion, leaving out the shared cache
+ *
+ * @param[in] result Conversion result
+ * @return Sum of the peaks of the image's subsystems
+ */
+unsigned long long RunStats::getImageMemory(const ConversionResult& result) {
+	unsigned long long memory = 0;
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		if (i != MEMORY_CACHE) {
+			memory += result.memoryPeak[i];
+		}
+	}
+
+	return memory;
+}
+
+/**
+ * Keeps a conversion among the memory outliers if it is one of the
+ * images that needed most memory. Must be called with the mutex locked.
+ *
+ * @param[in] file Name of the converted file
+ * @param[in] result Conversion result
+ */
+void RunStats::addOutlier(const std::string& file, const ConversionResult& result) {
+	MemoryOutlier outlier;
+	outlier.memory = getImageMemory(result);
+	if ((m_outliers.size() >= MEMORY_OUTLIERS) && (outlier.memory <= m_outliers.back().memory)) {
+		return;
+	}
+	outlier.file = file;
+	outlier.width = result.sourceWidth;
+	outlier.height = result.sourceHeight;
+	outlier.components = result.inputComponents;
+	size_t position = 0;
+	while ((position < m_outliers.size()) && (m_outliers[position].memory >= outlier.memory)) {
+		position++;
+	}
+	m_outliers.insert(m_outliers.begin()+position,outlier);
+	if (m_outliers.size() > MEMORY_OUTLIERS) {
+		m_outliers.pop_back();
+	}
+}
+
+/**
+ * Computes a cache hit rate
+ *
+ * @param[in] hits Number of hits
+ * @param[in] misses Number of misses
+ * @return Fraction of requests that were hits, 0 if there were no requests
+ */
+double RunStats::hitRate(unsigned long hits, unsigned long misses) {
+	return ((hits + misses) > 0) ? (double) hits/(hits + misses) : 0;
+}
+
+/**
+ * Writes the report in JSON format
+ *
+ * @param[in] out Stream to write to
+ */
+void RunStats::writeJson(std::ostream& out) {
+	double seconds = (m_wallSeconds > 0) ? m_wallSeconds : 1e-9;
+	out << std::setprecision(6);
+	out << "{" << std::endl;
+	out << "  \"run\": {\"wall_seconds\": " << m_wallSeconds
+		<< ", \"files_converted\": " << m_converted
+		<< ", \"files_failed\": " << m_failed
+		<< ", \"files_copied\": " << m_copied
+		<< ", \"files_deduplicated\": " << m_deduplicated
+		<< ", \"bytes_deduplicated\": " << m_deduplicatedBytes
+		<< ", \"bytes_read\": " << m_bytesRead
+		<< ", \"bytes_written\": " << m_bytesWritten
+		<< ", \"megapixels\": " << m_megapixels
+		<< ", \"megapixels_per_second\": " << m_megapixels/seconds
+		<< ", \"files_per_second\": " << m_converted/seconds
+		<< ", \"shard_index\": " << m_shardIndex
+		<< ", \"shard_count\": " << m_shardCount
+		<< ", \"files_in_folder\": " << m_folderFiles << "}," << std::endl;
+	out << "  \"cache\": {\"profile_hits\": " << m_profileHits
+		<< ", \"profile_misses\": " << m_profileMisses
+		<< ", \"profile_hit_rate\": " << hitRate(m_profileHits,m_profileMisses)
+		<< ", \"transform_hits\": " << m_transformHits
+		<< ", \"transform_misses\": " << m_transformMisses
+		<< ", \"transform_hit_rate\": " << hitRate(m_transformHits,m_transformMisses) << "}," << std::endl;
+	out << "  \"memory\": {\"peak_rss\": " << m_peakRss
+		<< ", \"lcms_allocations\": " << m_lcmsAllocations
+		<< ", \"lcms_pool_hits\": " << m_lcmsPoolHits
+		<< "," << std::endl << "    \"subsystems\": {";
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		out << ((i > 0) ? ", " : "") << "\"" << getMemoryName(i) << "\": " << m_memoryPeak[i];
+	}
+	out << "}," << std::endl << "    \"stages\": {";
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		out << ((i > 0) ? ", " : "") << "\"" << getStageName(i) << "\": " << m_stageMemory[i];
+	}
+	out << "}," << std::endl << "    \"outliers\": [";
+	for (size_t i=0; i<m_outliers.size(); i++) {
+		const MemoryOutlier& outlier = m_outliers[i];
+		out << ((i > 0) ? "," : "") << std::endl;
+		out << "      {\"file\": " << jsonString(outlier.file)
+			<< ", \"width\": " << outlier.width
+			<< ", \"height\": " << outlier.height
+			<< ", \"color_space\": " << jsonString(getColorSpaceName(outlier.components))
+			<< ", \"memory\": " << outlier.memory << "}";
+	}
+	out << std::endl << "    ]" << std::endl << "  }," << std::endl;
+	out << "  \"stages\": {" << std::endl;
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		out << "    \"" << getStageName(i) << "\": ";
+		writeJsonHistogram(out,m_stages[i]);
+		out << "," << std::endl;
+	}
+	out << "    \"total\": ";
+	writeJsonHistogram(out,m_total);
+	out << std::endl << "  }," << std::endl;
+	out << "  \"run_stages\": {" << std::endl;
+	for (int i=0; i<RUN_STAGE_COUNT; i++) {
+		out << "    \"" << getRunStageName(i) << "\": ";
+		writeJsonHistogram(out,m_runStages[i]);
+		out << ((i < RUN_STAGE_COUNT-1) ? "," : "") << std::endl;
+	}
+	out << "  }," << std::endl;
+	out << "  \"files\": [";
+	for (size_t i=0; i<m_files.size(); i++) {
+		const ConversionResult& result = m_files[i].result;
+		out << ((i > 0) ? "," : "") << std::endl;
+		out << "    {\"file\": " << jsonString(m_files[i].file)
+			<< ", \"error_code\": " << result.errorCode
+			<< ", \"error\": " << jsonString(result.errorMessage)
+			<< ", \"profile_source\": " << jsonString(result.profileSource)
+			<< ", \"profile_name\": " << jsonString(result.profileName)
+			<< ", \"width\": " << result.width
+			<< ", \"height\": " << result.height
+			<< ", \"bytes_read\": " << result.inputBytes
+			<< ", \"bytes_written\": " << result.outputBytes
+			<< ", \"total_ms\": " << 1000*result.totalSeconds
+			<< ", \"stages_ms\": {";
+		for (int j=0; j<CONVERSION_STAGE_COUNT; j++) {
+			out << ((j > 0) ? ", " : "") << "\"" << getStageName(j) << "\": " << 1000*result.stageSeconds[j];
+		}
+		out << "}, \"peak_rss\": " << result.peakRss << ", \"memory\": {";
+		for (int j=0; j<MEMORY_SUBSYSTEM_COUNT; j++) {
+			out << ((j > 0) ? ", " : "") << "\"" << getMemoryName(j) << "\": " << result.memoryPeak[j];
+		}
+		out << "}, \"stages_memory\": {";
+		for (int j=0; j<CONVERSION_STAGE_COUNT; j++) {
+			out << ((j > 0) ? ", " : "") << "\"" << getStageName(j) << "\": " << result.stageMemory[j];
+		}
+		out << "}}";
+	}
+	out << std::endl << "  ]" << std::endl;
+	out << "}" << std::endl;
+}
+
+/**
+ * Writes the report in CSV format, one line per file
+ *
+ * @param[in] out Stream to write to
+ */
+void RunStats::writeCsv(std::ostream& out) {
+	out << std::setprecision(6);
+	out << "file,error_code,profile_source,profile_name,width,height,bytes_read,bytes_written,total_ms";
+	for (int i=0; i<CONVERSION_STAGE_COUNT; i++) {
+		out << "," << getStageName(i) << "_ms";
+	}
+	out << ",peak_rss";
+	for (int i=0; i<MEMORY_SUBSYSTEM_COUNT; i++) {
+		out << "," << getMemoryName(i) << "_bytes";
+	}
+	out << std::endl;
+	for (size_t i=0; i<m_files.size(); i++) {
+		const ConversionResult& result = m_files[i].result;
+		out << csvString(m_files[i].file) << "," << result.errorCode << ","
+			<< csvString(result.profileSource) << "," << csvString(result.profileName) << ","
+			<< result.width << "," << result.height << ","
+			<< result.inputBytes << "," << result.outputBytes << "," << 1000*result.totalSeconds;
+		for (int j=0; j<CONVERSION_STAGE_COUNT; j++) {
+			out << "," << 1000*result.stageSeconds[j];
+		}
+		out << "," << result.peakRss;
+		for (int j=0; j<MEMORY_SUBSYSTEM_COUNT; j++) {
+			out << "," << result.memoryPeak[j];
+		}
+		out << std::endl;
+	}
+}
+
+/**
+ * Writes a histogram summary as a JSON object
+ *
+ * @param[in] out Stream to write to
+ * @param[in] histogram The histogram
+ */
+void RunStats::writeJsonHistogram(std::ostream& out, const Histogram& histogram) {
+	double mean = (histogram.getCount() > 0) ? histogram.getTotal()/histogram.getCount() : 0;
+	out << "{\"count\": " << histogram.getCount()
+		<< ", \"total_seconds\": " << histogram.getTotal()
+		<< ", \"mean_ms\": " << 1000*mean
+		<< ", \"p50_ms\": " << 1000*histogram.getPercentile(50)
+		<< ", \"p95_ms\": " << 1000*histogram.getPercentile(95)
+		<< ", \"p99_ms\": " << 1000*histogram.getPercentile(99)
+		<< ", \"max_ms\": " << 1000*histogram.getMax() << "}";
+}
+
+/**
+ * Quotes and escapes a string for JSON output
+ *
+ * @param[in] text The string
+ * @return The JSON string literal
+ */
+std::string RunStats::jsonString(const std::string& text) {
+	std::ostringstream out;
+	out << "\"";
+	for (size_t i=0; i<text.size(); i++) {
+		unsigned char c = text[i];
+		if ((c == '"') || (c == '\\')) {
+			out << '\\' << c;
+		} else if (c < 0x20) {
+			out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c << std::dec;
+		} else {
+			out << c;
+		}
+	}
+	out << "\"";
+
+	return out.str();
+}
+
+/**
+ * Quotes a string for CSV output
+ *
+ * @param[in] text The string
+ * @return The CSV field
+ */
+std::string RunStats::csvString(const std::string& text) {
+	std::string field = "\"";
+	for (size_t i=0; i<text.size(); i++) {
+		if (text[i] == '"') {
+			field += '"';
+		}
+		field += text[i];
+	}
+	field += "\"";
+
+	return field;
+}
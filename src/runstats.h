@@ -0,0 +1,137 @@
+#ifndef RUNSTATS_H
+#define RUNSTATS_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+#include "iccconverter.h"
+#include "icccache.h"
+
+/**
+ * Histogram of durations with logarithmic buckets: each power of two
+ * is split in 8 buckets, so percentiles are accurate to about 6%.
+ * Memory use does not depend on the number of samples.
+ */
+class Histogram {
+
+	public:
+		Histogram();
+		void add(double);
+		void merge(const Histogram&);
+		unsigned long getCount() const;
+		double getTotal() const;
+		double getMax() const;
+		double getPercentile(double) const;
+
+	private:
+		std::vector<unsigned long> m_buckets;	/**< Sample count per bucket */
+		unsigned long m_count;					/**< Number of samples */
+		double m_total;							/**< Sum of all samples, in seconds */
+		double m_max;							/**< Largest sample, in seconds */
+
+		static unsigned int bucketIndex(double);
+		static double bucketValue(unsigned int);
+};
+
+/**
+ * Stages of a batch run outside conversions, timed in run statistics
+ */
+enum RUN_STAGES {
+	RUN_STAGE_LIST = 0,		/**< Listing the input folder */
+	RUN_STAGE_COPY,			/**< Copying non-JPEG files */
+	RUN_STAGE_DEDUP,		/**< Linking files with the same content as a converted file */
+	RUN_STAGE_COUNT			/**< Number of stages */
+};
+
+/**
+ * RunStats objects aggregate the results of all conversions in a run:
+ * per-stage time histograms, bytes, megapixels, profile/transform cache
+ * hit rates and peak memory by subsystem and stage, with the images that
+ * needed most memory. They can write a report in JSON or CSV format.
+ *
+ * Results can be added concurrently from several threads.
+ */
+class RunStats {
+
+	public:
+		RunStats();
+		void start();
+		void finish(IccCache&);
+		void setKeepFiles(bool);
+		void setShard(unsigned int, unsigned int, unsigned long);
+		void addConversion(const std::string&, const ConversionResult&);
+		void addRunStage(int, double);
+		void addCopy(unsigned long, double);
+		void addDuplicate(unsigned long, bool, double);
+		void addMemory(int, unsigned long long);
+		void addLcmsStats(const LcmsMemoryStats&);
+		void writeSummary(std::ostream&, bool);
+		bool writeReport(const std::string&);
+		static const char* getColorSpaceName(unsigned int);
+		static std::string jsonString(const std::string&);
+		static std::string csvString(const std::string&);
+
+	private:
+		/**
+		 * Outcome of a single file conversion, kept for reports
+		 */
+		struct FileRecord {
+			std::string file;			/**< Name of the converted file */
+			ConversionResult result;	/**< Conversion result */
+		};
+
+		/**
+		 * Image among those that needed most memory
+		 */
+		struct MemoryOutlier {
+			std::string file;			/**< Name of the converted file */
+			unsigned int width;			/**< Source image width in pixels */
+			unsigned int height;		/**< Source image height in pixels */
+			unsigned int components;	/**< Color components of the source image */
+			unsigned long long memory;	/**< Peak memory of the image, all subsystems but the cache */
+		};
+
+		std::mutex m_mutex;							/**< Serializes updates from workers */
+		std::chrono::steady_clock::time_point m_start;	/**< Start of the run */
+		double m_wallSeconds;						/**< Duration of the run */
+		bool m_keepFiles;							/**< Keep per-file results for reports */
+		std::vector<FileRecord> m_files;			/**< Per-file results, if kept */
+		unsigned int m_shardIndex;					/**< Shard of the input folder processed, from 0 */
+		unsigned int m_shardCount;					/**< Number of shards, 1 if the whole folder is processed */
+		unsigned long m_folderFiles;				/**< Files in the input folder, in all shards */
+		Histogram m_stages[CONVERSION_STAGE_COUNT];	/**< Time per conversion stage and file */
+		Histogram m_total;							/**< Total conversion time per file */
+		Histogram m_runStages[RUN_STAGE_COUNT];		/**< Time of stages outside conversions */
+		unsigned long m_converted;					/**< Successfully converted files */
+		unsigned long m_failed;						/**< Failed conversions */
+		unsigned long m_copied;						/**< Copied non-JPEG files */
+		unsigned long m_deduplicated;				/**< Files linked to the outputs of a file with the same content */
+		unsigned long long m_deduplicatedBytes;		/**< Size of deduplicated files */
+		unsigned long m_bytesRead;					/**< Bytes read by conversions and copies */
+		unsigned long m_bytesWritten;				/**< Bytes written by conversions and copies */
+		double m_megapixels;						/**< Megapixels of converted images */
+		unsigned long m_profileHits;				/**< Profile cache hits */
+		unsigned long m_profileMisses;				/**< Profile cache misses */
+		unsigned long m_transformHits;				/**< Transform cache hits */
+		unsigned long m_transformMisses;			/**< Transform cache misses */
+		unsigned long long m_memoryPeak[MEMORY_SUBSYSTEM_COUNT];	/**< Peak bytes per subsystem (see @ref MEMORY_SUBSYSTEMS) */
+		unsigned long long m_stageMemory[CONVERSION_STAGE_COUNT];	/**< Peak image bytes per stage */
+		unsigned long long m_peakRss;				/**< Peak resident memory of the process */
+		unsigned long long m_lcmsAllocations;		/**< LittleCMS allocations of converters and cache */
+		unsigned long long m_lcmsPoolHits;			/**< LittleCMS allocations served from context pools */
+		std::vector<MemoryOutlier> m_outliers;		/**< Images that needed most memory, largest first */
+
+		static const char* getStageName(int);
+		static const char* getRunStageName(int);
+		static const char* getMemoryName(int);
+		static unsigned long long getImageMemory(const ConversionResult&);
+		void addOutlier(const std::string&, const ConversionResult&);
+		double hitRate(unsigned long, unsigned long);
+		void writeJson(std::ostream&);
+		void writeCsv(std::ostream&);
+		void writeJsonHistogram(std::ostream&, const Histogram&);
+};
+
+#endif
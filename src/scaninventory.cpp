@@ -0,0 +1,402 @@
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include "runstats.h"
+#include "scaninventory.h"
+
+/**
+ * Profile names listed in the summary, unless verbose
+ */
+const size_t SCAN_SUMMARY_PROFILES = 10;
+
+/**
+ * Creates an empty record
+ */
+ScanRecord::ScanRecord()
+:fileSize(0),
+ jpeg(false),
+ valid(false),
+ width(0),
+ height(0),
+ components(0),
+ progressive(false),
+ exifColorSpace(0),
+ memory(0) {
+}
+
+/**
+ * Creates an empty inventory
+ */
+ScanInventory::ScanInventory()
+:m_wallSeconds(0),
+ m_keepFiles(false),
+ m_shardIndex(0),
+ m_shardCount(1),
+ m_folderFiles(0),
+ m_jpegFiles(0),
+ m_invalid(0),
+ m_other(0),
+ m_progressive(0),
+ m_bytes(0),
+ m_samples(0),
+ m_megapixels(0),
+ m_maxWidth(0),
+ m_maxHeight(0),
+ m_maxMemory(0),
+ m_secondsPerSample(0),
+ m_threads(1)
+{
+	m_start = std::chrono::steady_clock::now();
+	for (int i=0; i<SIZE_CLASSES; i++) {
+		m_sizes[i] = 0;
+	}
+}
+
+/**
+ * Marks the start of the scan
+ */
+void ScanInventory::start() {
+	m_start = std::chrono::steady_clock::now();
+}
+
+/**
+ * Marks the end of the scan
+ */
+void ScanInventory::finish() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_start).count();
+}
+
+/**
+ * Sets whether the record of every file is kept for the report.
+ * Only histograms and totals are kept otherwise.
+ *
+ * @param[in] keepFiles true to keep per-file records
+ */
+void ScanInventory::setKeepFiles(bool keepFiles) {
+	m_keepFiles = keepFiles;
+}
+
+/**
+ * Sets the shard of the input folder scanned, so that the inventories of
+ * all shards can be merged
+ *
+ * @param[in] index Index of the shard, from 0
+ * @param[in] count Number of shards, 1 if the whole folder is scanned
+ * @param[in] folderFiles Files in the input folder, in all shards
+ */
+void ScanInventory::setShard(unsigned int index, unsigned int count, unsigned long folderFiles) {
+	m_shardIndex = index;
+	m_shardCount = count;
+	m_folderFiles = folderFiles;
+}
+
+/**
+ * Adds the record of a scanned file
+ *
+ * @param[in] record The record
+ */
+void ScanInventory::add(const ScanRecord& record) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_keepFiles) {
+		m_files.push_back(record);
+	}
+	m_bytes += record.fileSize;
+	if (!record.jpeg) {
+		m_other++;
+		return;
+	}
+	if (!record.valid) {
+		m_invalid++;
+		return;
+	}
+	m_jpegFiles++;
+	unsigned long long pixels = (unsigned long long) record.width*record.height;
+	m_samples += pixels*record.components;
+	m_megapixels += pixels/1e6;
+	if (pixels > (unsigned long long) m_maxWidth*m_maxHeight) {
+		m_maxWidth = record.width;
+		m_maxHeight = record.height;
+	}
+	m_maxMemory = std::max(m_maxMemory,record.memory);
+	m_sizes[getSizeClass(pixels)]++;
+	if (record.progressive) {
+		m_progressive++;
+	}
+	m_colorSpaces[RunStats::getColorSpaceName(record.components)]++;
+	m_profileSources[record.profileSource.empty() ? "none" : record.profileSource]++;
+	if (!record.profileName.empty()) {
+		m_profileNames[record.profileName]++;
+	}
+	m_exifColorSpaces[getExifColorSpaceName(record.exifColorSpace)]++;
+}
+
+/**
+ * Sets the measured cost of conversions, used to estimate the time of
+ * converting the batch
+ *
+ * @param[in] file File converted to measure the cost
+ * @param[in] secondsPerSample Conversion time per pixel sample
+ * @param[in] threads Worker threads of the estimated run
+ */
+void ScanInventory::setEstimate(const std::string& file, double secondsPerSample, int threads) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_calibrationFile = file;
+	m_secondsPerSample = secondsPerSample;
+	m_threads = std::max(threads,1);
+}
+
+/**
+ * Writes a short human readable summary of the scan
+ *
+ * @param[in] out Stream to write to
+ * @param[in] allProfiles true to list every profile name, false for the most common ones
+ */
+void ScanInventory::writeSummary(std::ostream& out, bool allProfiles) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	double seconds = (m_wallSeconds > 0) ? m_wallSeconds : 1e-9;
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::fixed << std::setprecision(2);
+	if (m_shardCount > 1) {
+		out << "Shard " << m_shardIndex << "/" << m_shardCount << " of " << m_folderFiles << " files in the input folder" << std::endl;
+	}
+	out << "Scanned " << m_jpegFiles+m_invalid+m_other << " files (" << m_jpegFiles << " JPEG, " << m_invalid << " invalid, "
+		<< m_other << " other) in " << m_wallSeconds << " s: " << (m_jpegFiles+m_invalid+m_other)/seconds << " files/s, "
+		<< m_megapixels << " MP, " << m_bytes/1048576.0 << " MB" << std::endl;
+	writeHistogram(out,"Color spaces",m_colorSpaces,0);
+	out << "Encoding: baseline " << m_jpegFiles-m_progressive << ", progressive " << m_progressive << std::endl;
+	writeHistogram(out,"Profiles",m_profileSources,0);
+	writeHistogram(out,"EXIF color spaces",m_exifColorSpaces,0);
+	out << "Sizes:";
+	for (int i=0; i<SIZE_CLASSES; i++) {
+		out << ((i > 0) ? ", " : " ") << getSizeClassName(i) << " " << m_sizes[i];
+	}
+	out << " (largest " << m_maxWidth << "x" << m_maxHeight << ")" << std::endl;
+	writeHistogram(out,"Profile names",m_profileNames,allProfiles ? 0 : SCAN_SUMMARY_PROFILES);
+	out << "Estimated conversion: ";
+	if (m_calibrationFile.empty()) {
+		out << "unknown";
+	} else {
+		out << getEstimatedSeconds() << " s with " << m_threads << " threads ("
+			<< m_secondsPerSample*3e6 << " s per RGB megapixel, measured on " << m_calibrationFile << ")";
+	}
+	out << ", up to " << m_maxMemory/1048576.0 << " MB per image" << std::endl;
+	out.flags(flags);
+	out.precision(precision);
+}
+
+/**
+ * Writes the inventory to a file. Files with .csv extension get one line
+ * per scanned file (needs per-file records kept), any other file gets a
+ * JSON document with the histograms, the estimate and per-file records
+ * if kept.
+ *
+ * @param[in] fileName Path to the report file
+ * @return true if the report was written, false otherwise
+ */
+bool ScanInventory::writeReport(const std::string& fileName) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::ofstream out(fileName.c_str());
+	if (!out.is_open()) {
+		return false;
+	}
+	std::string extension = (fileName.size() >= 4) ? fileName.substr(fileName.size()-4) : "";
+	if ((extension == ".csv") || (extension == ".CSV")) {
+		writeCsv(out);
+	} else {
+		writeJson(out);
+	}
+	out.close();
+
+	return !out.fail();
+}
+
+/**
+ * Gets the name of an EXIF color space, as used in reports
+ *
+ * @param[in] colorSpace EXIF color space: 0=Not found, 1=sRGB, 2=AdobeRGB, 0xFFFF=undefined
+ * @return Name of the color space
+ */
+const char* ScanInventory::getExifColorSpaceName(unsigned int colorSpace) {
+	switch (colorSpace) {
+		case 0:
+			return "none";
+		case 1:
+			return "sRGB";
+		case 2:
+			return "AdobeRGB";
+		case 0xFFFF:
+			return "uncalibrated";
+		default:
+			return "other";
+	}
+}
+
+/**
+ * Gets the name of an image size class, as used in reports
+ *
+ * @param[in] sizeClass The size class
+ * @return Name of the size class
+ */
+const char* ScanInventory::getSizeClassName(int sizeClass) {
+	static const char* names[SIZE_CLASSES] = {"<1MP","1-4MP","4-16MP","16-64MP",">=64MP"};
+	return names[sizeClass];
+}
+
+/**
+ * Gets the size class of an image: below 1 megapixel, then every class
+ * is 4 times larger than the previous one
+ *
+ * @param[in] pixels Pixels of the image
+ * @return The size class
+ */
+int ScanInventory::getSizeClass(unsigned long long pixels) {
+	int sizeClass = 0;
+	unsigned long long limit = 1000000;
+	while ((sizeClass < SIZE_CLASSES-1) && (pixels >= limit)) {
+		sizeClass++;
+		limit *= 4;
+	}
+
+	return sizeClass;
+}
+
+/**
+ * Estimates the time of converting the batch from the measured cost per
+ * sample. Conversions are assumed to scale linearly with worker threads.
+ *
+ * @return Estimated seconds, 0 if no cost was measured
+ */
+double ScanInventory::getEstimatedSeconds() {
+	return m_samples*m_secondsPerSample/m_threads;
+}
+
+/**
+ * Writes a histogram as a single line, most common values first
+ *
+ * @param[in] out Stream to write to
+ * @param[in] title Title of the line
+ * @param[in] histogram Count per value
+ * @param[in] limit Maximum number of values shown, 0 for all
+ */
+void ScanInventory::writeHistogram(std::ostream& out, const char* title, const std::map<std::string,unsigned long>& histogram, size_t limit) {
+	std::vector<std::pair<unsigned long,std::string> > sorted;
+	for (std::map<std::string,unsigned long>::const_iterator it=histogram.begin(); it!=histogram.end(); ++it) {
+		sorted.push_back(std::make_pair(it->second,it->first));
+	}
+	std::stable_sort(sorted.begin(),sorted.end(),[](const std::pair<unsigned long,std::string>& a, const std::pair<unsigned long,std::string>& b) {
+		return a.first > b.first;
+	});
+	size_t shown = ((limit > 0) && (limit < sorted.size())) ? limit : sorted.size();
+	out << title << ":";
+	for (size_t i=0; i<shown; i++) {
+		out << ((i > 0) ? ", " : " ") << sorted[i].second << " " << sorted[i].first;
+	}
+	if (shown < sorted.size()) {
+		out << " and " << sorted.size()-shown << " more";
+	} else if (sorted.empty()) {
+		out << " none";
+	}
+	out << std::endl;
+}
+
+/**
+ * Writes a histogram as a JSON object
+ *
+ * @param[in] out Stream to write to
+ * @param[in] histogram Count per value
+ */
+void ScanInventory::writeJsonMap(std::ostream& out, const std::map<std::string,unsigned long>& histogram) {
+	out << "{";
+	for (std::map<std::string,unsigned long>::const_iterator it=histogram.begin(); it!=histogram.end(); ++it) {
+		out << ((it != histogram.begin()) ? ", " : "") << RunStats::jsonString(it->first) << ": " << it->second;
+	}
+	out << "}";
+}
+
+/**
+ * Writes the inventory as a JSON document
+ *
+ * @param[in] out Stream to write to
+ */
+void ScanInventory::writeJson(std::ostream& out) {
+	double seconds = (m_wallSeconds > 0) ? m_wallSeconds : 1e-9;
+	out << std::setprecision(6);
+	out << "{" << std::endl;
+	out << "  \"scan\": {\"wall_seconds\": " << m_wallSeconds
+		<< ", \"files_jpeg\": " << m_jpegFiles
+		<< ", \"files_invalid\": " << m_invalid
+		<< ", \"files_other\": " << m_other
+		<< ", \"files_per_second\": " << (m_jpegFiles+m_invalid+m_other)/seconds
+		<< ", \"bytes\": " << m_bytes
+		<< ", \"megapixels\": " << m_megapixels
+		<< ", \"samples\": " << m_samples
+		<< ", \"largest_width\": " << m_maxWidth
+		<< ", \"largest_height\": " << m_maxHeight
+		<< ", \"shard_index\": " << m_shardIndex
+		<< ", \"shard_count\": " << m_shardCount
+		<< ", \"files_in_folder\": " << m_folderFiles << "}," << std::endl;
+	out << "  \"color_spaces\": ";
+	writeJsonMap(out,m_colorSpaces);
+	out << "," << std::endl << "  \"encoding\": {\"baseline\": " << m_jpegFiles-m_progressive
+		<< ", \"progressive\": " << m_progressive << "}," << std::endl;
+	out << "  \"profile_sources\": ";
+	writeJsonMap(out,m_profileSources);
+	out << "," << std::endl << "  \"profile_names\": ";
+	writeJsonMap(out,m_profileNames);
+	out << "," << std::endl << "  \"exif_color_spaces\": ";
+	writeJsonMap(out,m_exifColorSpaces);
+	out << "," << std::endl << "  \"sizes\": {";
+	for (int i=0; i<SIZE_CLASSES; i++) {
+		out << ((i > 0) ? ", " : "") << "\"" << getSizeClassName(i) << "\": " << m_sizes[i];
+	}
+	out << "}," << std::endl;
+	out << "  \"estimate\": {\"seconds\": " << getEstimatedSeconds()
+		<< ", \"threads\": " << m_threads
+		<< ", \"seconds_per_sample\": " << m_secondsPerSample
+		<< ", \"calibration_file\": " << RunStats::jsonString(m_calibrationFile)
+		<< ", \"max_memory\": " << m_maxMemory << "}," << std::endl;
+	out << "  \"files\": [";
+	for (size_t i=0; i<m_files.size(); i++) {
+		const ScanRecord& record = m_files[i];
+		out << ((i > 0) ? "," : "") << std::endl;
+		out << "    {\"file\": " << RunStats::jsonString(record.file)
+			<< ", \"size\": " << record.fileSize
+			<< ", \"jpeg\": " << (record.jpeg ? "true" : "false")
+			<< ", \"valid\": " << (record.valid ? "true" : "false");
+		if (record.valid) {
+			out << ", \"width\": " << record.width
+				<< ", \"height\": " << record.height
+				<< ", \"color_space\": " << RunStats::jsonString(RunStats::getColorSpaceName(record.components))
+				<< ", \"progressive\": " << (record.progressive ? "true" : "false")
+				<< ", \"profile_source\": " << RunStats::jsonString(record.profileSource)
+				<< ", \"profile_name\": " << RunStats::jsonString(record.profileName)
+				<< ", \"exif_color_space\": " << RunStats::jsonString(getExifColorSpaceName(record.exifColorSpace))
+				<< ", \"memory\": " << record.memory;
+		}
+		out << "}";
+	}
+	out << std::endl << "  ]" << std::endl;
+	out << "}" << std::endl;
+}
+
+/**
+ * Writes per-file records as CSV
+ *
+ * @param[in] out Stream to write to
+ */
+void ScanInventory::writeCsv(std::ostream& out) {
+	out << "file,size,jpeg,valid,width,height,color_space,progressive,profile_source,profile_name,exif_color_space,memory" << std::endl;
+	for (size_t i=0; i<m_files.size(); i++) {
+		const ScanRecord& record = m_files[i];
+		out << RunStats::csvString(record.file) << "," << record.fileSize << ","
+			<< (record.jpeg ? 1 : 0) << "," << (record.valid ? 1 : 0) << ","
+			<< record.width << "," << record.height << ","
+			<< (record.valid ? RunStats::getColorSpaceName(record.components) : "") << ","
+			<< (record.progressive ? 1 : 0) << ","
+			<< RunStats::csvString(record.profileSource) << "," << RunStats::csvString(record.profileName) << ","
+			<< (record.valid ? getExifColorSpaceName(record.exifColorSpace) : "") << ","
+			<< record.memory << std::endl;
+	}
+}
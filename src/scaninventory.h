@@ -0,0 +1,96 @@
+#ifndef SCANINVENTORY_H
+#define SCANINVENTORY_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <ostream>
+
+/**
+ * Header information of a file found by a scan
+ */
+struct ScanRecord {
+	std::string file;				/**< Name of the file in the input folder */
+	unsigned long long fileSize;	/**< Size of the file */
+	bool jpeg;						/**< Whether the file would be converted (JPEG extension) */
+	bool valid;						/**< Whether the JPEG frame header was found */
+	unsigned int width;				/**< Image width in pixels */
+	unsigned int height;			/**< Image height in pixels */
+	unsigned int components;		/**< Color components of the image */
+	bool progressive;				/**< Whether the image is progressive */
+	std::string profileSource;		/**< Where the input profile would come from (Embedded, EXIF), empty for a default profile */
+	std::string profileName;		/**< Name of the embedded or EXIF profile */
+	unsigned int exifColorSpace;	/**< EXIF color space: 0=Not found, 1=sRGB, 2=AdobeRGB, 0xFFFF=undefined */
+	unsigned long long memory;		/**< Estimated memory to convert the image */
+
+	ScanRecord();
+};
+
+/**
+ * ScanInventory objects aggregate the headers of the files of a batch
+ * found by a scan: histograms of color spaces, embedded profiles, EXIF
+ * color spaces, sizes and progressive vs baseline encoding, with an
+ * estimate of the cost of converting the batch. They can write the
+ * inventory in JSON or CSV format.
+ *
+ * Records can be added concurrently from several threads.
+ */
+class ScanInventory {
+
+	public:
+		ScanInventory();
+		void start();
+		void finish();
+		void setKeepFiles(bool);
+		void setShard(unsigned int, unsigned int, unsigned long);
+		void add(const ScanRecord&);
+		void setEstimate(const std::string&, double, int);
+		void writeSummary(std::ostream&, bool);
+		bool writeReport(const std::string&);
+		static const char* getExifColorSpaceName(unsigned int);
+
+	private:
+		/**
+		 * Number of image size classes in histograms
+		 */
+		static const int SIZE_CLASSES = 5;
+
+		std::mutex m_mutex;							/**< Serializes updates from workers */
+		std::chrono::steady_clock::time_point m_start;	/**< Start of the scan */
+		double m_wallSeconds;						/**< Duration of the scan */
+		bool m_keepFiles;							/**< Keep per-file records for reports */
+		std::vector<ScanRecord> m_files;			/**< Per-file records, if kept */
+		unsigned int m_shardIndex;					/**< Shard of the input folder scanned, from 0 */
+		unsigned int m_shardCount;					/**< Number of shards, 1 if the whole folder is scanned */
+		unsigned long m_folderFiles;				/**< Files in the input folder, in all shards */
+		unsigned long m_jpegFiles;					/**< Files with a JPEG frame header */
+		unsigned long m_invalid;					/**< JPEG files without a frame header */
+		unsigned long m_other;						/**< Files that would be copied */
+		unsigned long m_progressive;				/**< Progressive JPEG files */
+		unsigned long long m_bytes;					/**< Size of all files */
+		unsigned long long m_samples;				/**< Pixel samples (pixels times components) of JPEG files */
+		double m_megapixels;						/**< Megapixels of JPEG files */
+		unsigned int m_maxWidth;					/**< Width of the largest image */
+		unsigned int m_maxHeight;					/**< Height of the largest image */
+		unsigned long long m_maxMemory;				/**< Largest estimated conversion memory */
+		unsigned long m_sizes[SIZE_CLASSES];		/**< Images by size class */
+		std::map<std::string,unsigned long> m_colorSpaces;		/**< Images by color space */
+		std::map<std::string,unsigned long> m_profileSources;	/**< Images by profile source */
+		std::map<std::string,unsigned long> m_profileNames;		/**< Images by embedded or EXIF profile name */
+		std::map<std::string,unsigned long> m_exifColorSpaces;	/**< Images by EXIF color space */
+		std::string m_calibrationFile;				/**< File converted to measure the cost per sample, empty if none */
+		double m_secondsPerSample;					/**< Measured conversion time per pixel sample */
+		int m_threads;								/**< Worker threads of the estimated run */
+
+		static const char* getSizeClassName(int);
+		static int getSizeClass(unsigned long long);
+		double getEstimatedSeconds();
+		void writeHistogram(std::ostream&, const char*, const std::map<std::string,unsigned long>&, size_t);
+		void writeJsonMap(std::ostream&, const std::map<std::string,unsigned long>&);
+		void writeJson(std::ostream&);
+		void writeCsv(std::ostream&);
+};
+
+#endif
@@ -0,0 +1,133 @@
+#include <cstdlib>
+#include <cstdint>
+#include "scratcharena.h"
+
+/**
+ * Size of the first chunk
+ */
+const size_t SCRATCH_MIN_CHUNK = 256*1024;
+
+/**
+ * Creates an empty arena. No memory is allocated until the first block
+ * is requested.
+ */
+ScratchArena::ScratchArena()
+:m_offset(0),
+ m_used(0),
+ m_chunkAllocations(0) {
+}
+
+/**
+ * Destructor frees all chunks
+ */
+ScratchArena::~ScratchArena() {
+	freeChunks();
+}
+
+/**
+ * Gets a block of memory, valid until the next reset
+ *
+ * @param[in] size Size of the block in bytes
+ * @return The block, aligned to @ref SCRATCH_ALIGNMENT bytes, or NULL if
+ * there is not enough memory
+ */
+void* ScratchArena::allocate(size_t size) {
+	size_t rounded = (size + SCRATCH_ALIGNMENT - 1) & ~(SCRATCH_ALIGNMENT - 1);
+	if (rounded < size) {
+		return NULL;
+	}
+	if (m_chunks.empty() || (m_chunks.back().size - m_offset < rounded)) {
+		size_t chunkSize = m_chunks.empty() ? SCRATCH_MIN_CHUNK : m_chunks.back().size*2;
+		if (chunkSize < rounded) {
+			chunkSize = rounded;
+		}
+		if (!addChunk(chunkSize)) {
+			return NULL;
+		}
+	}
+	void* block = m_chunks.back().data + m_offset;
+	m_offset += rounded;
+	m_used += rounded;
+
+	return block;
+}
+
+/**
+ * Takes back all blocks. If the last image needed more than one chunk,
+ * they are replaced by one chunk holding all of it.
+ */
+void ScratchArena::reset() {
+	if (m_chunks.size() > 1) {
+		size_t needed = m_used;
+		freeChunks();
+		addChunk(needed);
+	}
+	m_offset = 0;
+	m_used = 0;
+}
+
+/**
+ * Gets the memory handed out since the last reset
+ *
+ * @return Bytes in use, including alignment padding
+ */
+size_t ScratchArena::getUsed() {
+	return m_used;
+}
+
+/**
+ * Gets the memory held by the arena
+ *
+ * @return Total size of the chunks in bytes
+ */
+size_t ScratchArena::getCapacity() {
+	size_t capacity = 0;
+	for (size_t i=0; i<m_chunks.size(); i++) {
+		capacity += m_chunks[i].size;
+	}
+
+	return capacity;
+}
+
+/**
+ * Gets the number of heap allocations done by the arena, which stops
+ * growing once the arena has reached its steady size
+ *
+ * @return Chunks allocated since the arena was created
+ */
+unsigned long ScratchArena::getChunkAllocations() {
+	return m_chunkAllocations;
+}
+
+/**
+ * Allocates a new chunk and makes it the one being filled
+ *
+ * @param[in] size Usable size of the chunk
+ * @return true on success, false if there is not enough memory
+ */
+bool ScratchArena::addChunk(size_t size) {
+	Chunk chunk;
+	chunk.memory = (char*) malloc(size + SCRATCH_ALIGNMENT);
+	if (chunk.memory == NULL) {
+		return false;
+	}
+	uintptr_t address = (uintptr_t) chunk.memory;
+	chunk.data = chunk.memory + ((SCRATCH_ALIGNMENT - (address % SCRATCH_ALIGNMENT)) % SCRATCH_ALIGNMENT);
+	chunk.size = size;
+	m_chunks.push_back(chunk);
+	m_offset = 0;
+	m_chunkAllocations++;
+
+	return true;
+}
+
+/**
+ * Frees all chunks
+ */
+void ScratchArena::freeChunks() {
+	for (size_t i=0; i<m_chunks.size(); i++) {
+		free(m_chunks[i].memory);
+	}
+	m_chunks.clear();
+	m_offset = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef SCRATCHARENA_H
+#define SCRATCHARENA_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Alignment of memory blocks handed out by a @ref ScratchArena, enough for
+ * the SIMD code of libjpeg-turbo and lcms
+ */
+const size_t SCRATCH_ALIGNMENT = 64;
+
+/**
+ * ScratchArena objects hand out memory for the temporary data of one image
+ * at a time, and take it all back at once when the image is finished.
+ *
+ * Blocks are carved out of large chunks that are kept between images. When
+ * an image needs more than the current chunk, new chunks are added, and the
+ * next reset replaces them with a single chunk big enough for that image,
+ * so that converting images no larger than the biggest one seen so far
+ * allocates nothing from the heap.
+ *
+ * Not thread safe: each converter owns its arenas.
+ */
+class ScratchArena {
+
+	public:
+		ScratchArena();
+		~ScratchArena();
+		void* allocate(size_t);
+		void reset();
+		size_t getUsed();
+		size_t getCapacity();
+		unsigned long getChunkAllocations();
+
+	private:
+		/**
+		 * Block of memory obtained from the heap
+		 */
+		struct Chunk {
+			char* memory;		/**< Start of the allocated memory, to be freed */
+			char* data;			/**< First aligned byte */
+			size_t size;		/**< Usable bytes from data */
+		};
+
+		std::vector<Chunk> m_chunks;		/**< Chunks, the last one is being filled */
+		size_t m_offset;					/**< Bytes used in the last chunk */
+		size_t m_used;						/**< Bytes handed out since the last reset, in all chunks */
+		unsigned long m_chunkAllocations;	/**< Chunks obtained from the heap so far */
+
+		bool addChunk(size_t);
+		void freeChunks();
+
+		ScratchArena(const ScratchArena&);
+		ScratchArena& operator=(const ScratchArena&);
+};
+
+#endif
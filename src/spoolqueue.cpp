@@ -0,0 +1,348 @@
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "globals.h"
+#include "spoolqueue.h"
+
+/**
+ * Shortest time between polls of items leased to other processes, and
+ * between touches of lease files
+ */
+const double SPOOL_MIN_POLL_SECONDS = 0.05;
+
+/**
+ * Longest time between polls of items leased to other processes, reached
+ * by doubling the poll time while none of them is found done
+ */
+const double SPOOL_MAX_POLL_SECONDS = 1;
+
+/**
+ * Creates a closed spool
+ */
+SpoolQueue::SpoolQueue()
+:m_leaseSeconds(60),
+ m_claimed(0),
+ m_takenOver(0),
+ m_alreadyDone(0),
+ m_stopping(false) {
+}
+
+/**
+ * Destructor gives back the leases still held
+ */
+SpoolQueue::~SpoolQueue() {
+	close();
+}
+
+/**
+ * Opens the spool folder, creating it if needed, and starts touching the
+ * leases of claimed items
+ *
+ * @param[in] folder Path of the spool folder, shared by all processes of the job
+ * @param[in] leaseSeconds Seconds after which an untouched lease expires
+ * @param[in] items Names of the items (files of the input folder), the same in all processes
+ * @return true on success, false if the spool folder can't be created or written
+ */
+bool SpoolQueue::open(const std::string& folder, double leaseSeconds, const std::vector<std::string>& items) {
+	close();
+	m_folder = folder;
+	m_leaseSeconds = leaseSeconds;
+	mkdir(m_folder.c_str(),0777);
+	char host[256];
+	if (gethostname(host,sizeof(host)) != 0) {
+		host[0] = 0;
+	}
+	host[sizeof(host)-1] = 0;
+	m_owner = std::string(host) + ":" + std::to_string((long) getpid());
+
+	// Check that lease files can be created
+	std::string probe = m_folder + g_slash + ".probe." + m_owner;
+	int fd = ::open(probe.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+	if (fd < 0) {
+		return false;
+	}
+	::close(fd);
+	unlink(probe.c_str());
+
+	m_items = items;
+	m_names.resize(items.size());
+	for (size_t i=0; i<items.size(); i++) {
+		char name[32];
+		snprintf(name,sizeof(name),"%016llx",hashString(items[i]));
+		m_names[i] = name;
+	}
+	m_states.assign(items.size(),ITEM_UNKNOWN);
+	m_deferred.clear();
+	m_leases.clear();
+	m_claimed = 0;
+	m_takenOver = 0;
+	m_alreadyDone = 0;
+	m_stopping = false;
+	m_heartbeat = std::thread(&SpoolQueue::heartbeatLoop,this);
+
+	return true;
+}
+
+/**
+ * Stops touching leases and deletes the leases of items claimed and not
+ * finished, so that other processes can take them at once
+ */
+void SpoolQueue::close() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wakeUp.notify_all();
+	if (m_heartbeat.joinable()) {
+		m_heartbeat.join();
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::map<size_t,int>::iterator it=m_leases.begin(); it!=m_leases.end(); ++it) {
+		unlink(getLeasePath(it->first,it->second).c_str());
+	}
+	m_leases.clear();
+}
+
+/**
+ * Claims an item. Items leased to other processes are kept to be retried
+ * with @ref SpoolQueue#nextDeferred. Claiming an item again gives the same
+ * outcome without touching the spool.
+ *
+ * @param[in] index Index of the item
+ * @return Outcome of the claim (see @ref SPOOL_CLAIMS)
+ */
+int SpoolQueue::claim(size_t index) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	switch (m_states[index]) {
+		case ITEM_CLAIMED:
+			return SPOOL_CLAIMED;
+		case ITEM_DONE:
+			return SPOOL_DONE;
+		case ITEM_DEFERRED:
+			return SPOOL_BUSY;
+	}
+	int result = tryClaim(index);
+	if (result == SPOOL_BUSY) {
+		m_states[index] = ITEM_DEFERRED;
+		m_deferred.push_back(index);
+	}
+
+	return result;
+}
+
+/**
+ * Marks a claimed item as done, once its outputs have been written
+ *
+ * @param[in] index Index of the item
+ */
+void SpoolQueue::complete(size_t index) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::map<size_t,int>::iterator it = m_leases.find(index);
+	if (it == m_leases.end()) {
+		return;
+	}
+	std::string text = m_owner + " " + m_items[index] + "\n";
+	int fd = ::open(getDonePath(index).c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+	if (fd >= 0) {
+		if (write(fd,text.data(),text.size()) < 0) {
+			// The marker exists, its contents are informative only
+		}
+		::close(fd);
+	}
+	for (int generation=0; generation<=it->second; generation++) {
+		unlink(getLeasePath(index,generation).c_str());
+	}
+	m_leases.erase(it);
+	m_states[index] = ITEM_DONE;
+}
+
+/**
+ * Claims one of the items leased to other processes, waiting until one of
+ * them is done or its lease expires. Done markers are polled often, so
+ * that the end of the job is found soon, backing off while nothing changes.
+ *
+ * @param[out] index Index of the claimed item
+ * @param[in] finished Called (with the spool locked) for every item found done meanwhile
+ * @return true if an item was claimed, false when all items are done
+ */
+bool SpoolQueue::nextDeferred(size_t& index, std::function<void(size_t)> finished) {
+	double poll = SPOOL_MIN_POLL_SECONDS;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_deferred.empty()) {
+		size_t count = m_deferred.size();
+		bool progress = false;
+		for (size_t i=0; i<count; i++) {
+			size_t item = m_deferred.front();
+			m_deferred.pop_front();
+			int result = tryClaim(item);
+			if (result == SPOOL_CLAIMED) {
+				index = item;
+				return true;
+			} else if (result == SPOOL_DONE) {
+				finished(item);
+				progress = true;
+			} else {
+				m_deferred.push_back(item);
+			}
+		}
+		if (m_deferred.empty() || m_stopping) {
+			break;
+		}
+		poll = progress ? SPOOL_MIN_POLL_SECONDS : std::min(poll*2,SPOOL_MAX_POLL_SECONDS);
+		m_wakeUp.wait_for(lock,std::chrono::duration<double>(poll));
+	}
+
+	return false;
+}
+
+/**
+ * Gets the number of items claimed by this process
+ *
+ * @return Items claimed
+ */
+unsigned long SpoolQueue::getClaimed() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_claimed;
+}
+
+/**
+ * Gets the number of items claimed after the lease of another process
+ * expired (the process crashed or hung)
+ *
+ * @return Items taken over
+ */
+unsigned long SpoolQueue::getTakenOver() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_takenOver;
+}
+
+/**
+ * Gets the number of items found done, by other processes or by earlier
+ * runs of the job
+ *
+ * @return Items skipped because they were done
+ */
+unsigned long SpoolQueue::getAlreadyDone() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_alreadyDone;
+}
+
+/**
+ * Tries to lease an item: creates the lease file of generation 0, or of
+ * the generation after an expired lease. Must be called with the mutex
+ * locked.
+ *
+ * @param[in] index Index of the item
+ * @return Outcome of the claim (see @ref SPOOL_CLAIMS)
+ */
+int SpoolQueue::tryClaim(size_t index) {
+	struct stat st;
+	if (stat(getDonePath(index).c_str(),&st) == 0) {
+		m_states[index] = ITEM_DONE;
+		m_alreadyDone++;
+		return SPOOL_DONE;
+	}
+	int generation = 0;
+	while (true) {
+		std::string path = getLeasePath(index,generation);
+		int fd = ::open(path.c_str(),O_WRONLY | O_CREAT | O_EXCL,0644);
+		if (fd >= 0) {
+			std::string text = m_owner + " " + m_items[index] + "\n";
+			if (write(fd,text.data(),text.size()) < 0) {
+				// The lease is the file itself, its contents are informative only
+			}
+			::close(fd);
+			// The item may have been finished since the done marker was checked
+			if (stat(getDonePath(index).c_str(),&st) == 0) {
+				unlink(path.c_str());
+				m_states[index] = ITEM_DONE;
+				m_alreadyDone++;
+				return SPOOL_DONE;
+			}
+			m_states[index] = ITEM_CLAIMED;
+			m_leases[index] = generation;
+			m_claimed++;
+			if (generation > 0) {
+				m_takenOver++;
+			}
+			return SPOOL_CLAIMED;
+		}
+		if (errno != EEXIST) {
+			return SPOOL_BUSY;
+		}
+		double age = 0;
+		if (stat(getLeasePath(index,generation+1).c_str(),&st) == 0) {
+			generation++;
+		} else if (!getLeaseAge(path,age)) {
+			// Lease deleted meanwhile: retry the same generation
+			continue;
+		} else if (age > m_leaseSeconds) {
+			generation++;
+		} else {
+			return SPOOL_BUSY;
+		}
+	}
+}
+
+/**
+ * Gets the path of the lease file of an item
+ *
+ * @param[in] index Index of the item
+ * @param[in] generation Lease generation, increased every time the lease is taken over
+ * @return Path of the lease file
+ */
+std::string SpoolQueue::getLeasePath(size_t index, int generation) {
+	return m_folder + g_slash + m_names[index] + ".lease." + std::to_string(generation);
+}
+
+/**
+ * Gets the path of the done marker of an item
+ *
+ * @param[in] index Index of the item
+ * @return Path of the done marker
+ */
+std::string SpoolQueue::getDonePath(size_t index) {
+	return m_folder + g_slash + m_names[index] + ".done";
+}
+
+/**
+ * Gets the time since a lease file was last touched
+ *
+ * @param[in] path Path of the lease file
+ * @param[out] age Seconds since the file was modified
+ * @return true on success, false if the file doesn't exist
+ */
+bool SpoolQueue::getLeaseAge(const std::string& path, double& age) {
+	struct stat st;
+	if (stat(path.c_str(),&st) != 0) {
+		return false;
+	}
+	age = difftime(time(NULL),st.st_mtime);
+
+	return true;
+}
+
+/**
+ * Heartbeat thread main loop: touches the lease files of claimed items
+ * four times per lease time, so that they don't expire while the items
+ * are being processed
+ */
+void SpoolQueue::heartbeatLoop() {
+	std::chrono::duration<double> interval(std::max(m_leaseSeconds/4,SPOOL_MIN_POLL_SECONDS));
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stopping) {
+		m_wakeUp.wait_for(lock,interval);
+		if (m_stopping) {
+			break;
+		}
+		for (std::map<size_t,int>::iterator it=m_leases.begin(); it!=m_leases.end(); ++it) {
+			utimes(getLeasePath(it->first,it->second).c_str(),NULL);
+		}
+	}
+}
@@ -0,0 +1,89 @@
+#ifndef SPOOLQUEUE_H
+#define SPOOLQUEUE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+
+/**
+ * Outcomes of claiming a spool item
+ */
+enum SPOOL_CLAIMS {
+	SPOOL_CLAIMED = 0,	/**< The item is leased to this process */
+	SPOOL_DONE,			/**< The item has been finished by some process */
+	SPOOL_BUSY			/**< The item is leased to another process, it is retried later */
+};
+
+/**
+ * SpoolQueue objects coordinate the processes converting the same input
+ * folder through a spool folder on a filesystem they share, so that every
+ * file is converted by one process and processes can join a running job.
+ *
+ * A process claims an item by creating its lease file with O_EXCL. Lease
+ * files are touched while the item is being processed, and an item whose
+ * lease has not been touched for the lease time is taken over by creating
+ * the lease file of the next generation, which only one process can do.
+ * A done marker is created when the item is finished, and lease files are
+ * then deleted. Items leased to other processes are retried after the
+ * rest of the work, until every item is done.
+ *
+ * Spool files are named after a hash of the item name: hash.lease.N for
+ * leases (generation N) and hash.done for done markers.
+ */
+class SpoolQueue {
+
+	public:
+		SpoolQueue();
+		~SpoolQueue();
+		bool open(const std::string&, double, const std::vector<std::string>&);
+		void close();
+		int claim(size_t);
+		void complete(size_t);
+		bool nextDeferred(size_t&, std::function<void(size_t)>);
+		unsigned long getClaimed();
+		unsigned long getTakenOver();
+		unsigned long getAlreadyDone();
+
+	private:
+		/**
+		 * States of items in this process
+		 */
+		enum ITEM_STATES {
+			ITEM_UNKNOWN = 0,	/**< Not claimed yet */
+			ITEM_CLAIMED,		/**< Leased to this process */
+			ITEM_DEFERRED,		/**< Leased to another process, to be retried */
+			ITEM_DONE			/**< Finished by this or another process */
+		};
+
+		std::string m_folder;					/**< Spool folder */
+		double m_leaseSeconds;					/**< Seconds after which an untouched lease expires */
+		std::string m_owner;					/**< Host and process id written to lease files */
+		std::vector<std::string> m_names;		/**< Spool file name prefix of every item */
+		std::vector<std::string> m_items;		/**< Item names, written to lease files */
+		std::vector<int> m_states;				/**< State of every item (see @ref ITEM_STATES) */
+		std::deque<size_t> m_deferred;			/**< Items leased to other processes */
+		std::map<size_t,int> m_leases;			/**< Lease generation of items claimed and not done */
+		std::mutex m_mutex;						/**< Protects all members above and the counters */
+		unsigned long m_claimed;				/**< Items claimed by this process */
+		unsigned long m_takenOver;				/**< Items claimed after their lease expired */
+		unsigned long m_alreadyDone;			/**< Items found done by other processes or earlier runs */
+		std::thread m_heartbeat;				/**< Thread touching the lease files of claimed items */
+		std::condition_variable m_wakeUp;		/**< Signals the heartbeat thread and waiting workers to stop */
+		bool m_stopping;						/**< Heartbeat thread has to exit */
+
+		int tryClaim(size_t);
+		std::string getLeasePath(size_t, int);
+		std::string getDonePath(size_t);
+		bool getLeaseAge(const std::string&, double&);
+		void heartbeatLoop();
+
+		SpoolQueue(const SpoolQueue&);
+		SpoolQueue& operator=(const SpoolQueue&);
+};
+
+#endif
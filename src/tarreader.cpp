@@ -0,0 +1,389 @@
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tarreader.h"
+
+/**
+ * Size of tar headers and of the blocks file contents are padded to
+ */
+const size_t TAR_HEADER_SIZE = 512;
+
+/**
+ * Creates a closed reader
+ */
+TarReader::TarReader()
+:m_fd(-1),
+ m_data(NULL),
+ m_size(0),
+ m_skipped(0) {
+}
+
+/**
+ * Destructor unmaps the archive
+ */
+TarReader::~TarReader() {
+	close();
+}
+
+/**
+ * Maps an archive in memory and indexes its files
+ *
+ * @param[in] path Path of the archive
+ * @param[out] error Error message on failure
+ * @return true on success, false if the archive can't be read or is not a valid tar archive
+ */
+bool TarReader::open(const std::string& path, std::string& error) {
+	close();
+	m_fd = ::open(path.c_str(),O_RDONLY);
+	struct stat st;
+	if ((m_fd < 0) || (fstat(m_fd,&st) != 0)) {
+		error = "Failed to open " + path;
+		close();
+		return false;
+	}
+	m_size = (size_t) st.st_size;
+	if (m_size < TAR_HEADER_SIZE) {
+		error = "Not a tar archive: " + path;
+		close();
+		return false;
+	}
+	void* data = mmap(NULL,m_size,PROT_READ,MAP_PRIVATE,m_fd,0);
+	if (data == MAP_FAILED) {
+		error = "Failed to map " + path;
+		close();
+		return false;
+	}
+	m_data = (const char*) data;
+	if (!parse(error)) {
+		error += ": " + path;
+		close();
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Unmaps the archive. Contents found before are no longer valid.
+ */
+void TarReader::close() {
+	if (m_data != NULL) {
+		munmap((void*) m_data,m_size);
+		m_data = NULL;
+	}
+	if (m_fd >= 0) {
+		::close(m_fd);
+		m_fd = -1;
+	}
+	m_size = 0;
+	m_members.clear();
+	m_index.clear();
+	m_skipped = 0;
+}
+
+/**
+ * Gets the files of the archive, in archive order
+ *
+ * @param[out] files Names of the files, without leading "./"
+ * @param[out] sizes Size of every file
+ */
+void TarReader::getFiles(std::vector<std::string>& files, std::vector<unsigned long long>& sizes) {
+	files.clear();
+	sizes.clear();
+	for (size_t i=0; i<m_members.size(); i++) {
+		if (m_index[m_members[i].name] == i) {
+			files.push_back(m_members[i].name);
+			sizes.push_back(m_members[i].size);
+		}
+	}
+}
+
+/**
+ * Gets the number of files skipped because their names are absolute or
+ * have ".." components
+ *
+ * @return Files skipped
+ */
+unsigned long TarReader::getSkipped() {
+	return m_skipped;
+}
+
+/**
+ * Finds the contents of a file
+ *
+ * @param[in] name Name of the file
+ * @param[out] data Contents of the file, valid until the archive is closed
+ * @param[out] size Size of the file
+ * @return true if the file was found, false otherwise
+ */
+bool TarReader::find(const std::string& name, const char*& data, size_t& size) {
+	std::map<std::string,size_t>::const_iterator it = m_index.find(name);
+	if (it == m_index.end()) {
+		return false;
+	}
+	const Member& member = m_members[it->second];
+	data = m_data + member.offset;
+	size = (size_t) member.size;
+
+	return true;
+}
+
+/**
+ * Asks the kernel to read the contents of a file ahead, so that they are
+ * in memory when the file is converted
+ *
+ * @param[in] name Name of the file
+ */
+void TarReader::prefetch(const std::string& name) {
+	const char* data = NULL;
+	size_t size = 0;
+	if (!find(name,data,size) || (size == 0)) {
+		return;
+	}
+	size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = (size_t) (data - m_data) / pageSize * pageSize;
+	size_t end = (size_t) (data - m_data) + size;
+	madvise((void*) (m_data + start),end - start,MADV_WILLNEED);
+}
+
+/**
+ * Indexes the files of the archive, walking its headers
+ *
+ * @param[out] error Error message on failure
+ * @return true on success, false if a header is not valid or the archive is truncated
+ */
+bool TarReader::parse(std::string& error) {
+	std::map<std::string,std::string> extended;
+	std::string longName;
+	std::string longLink;
+	unsigned long long offset = 0;
+	while (offset + TAR_HEADER_SIZE <= m_size) {
+		const char* header = m_data + offset;
+
+		// A zero block ends the archive
+		size_t zeros = 0;
+		while ((zeros < TAR_HEADER_SIZE) && (header[zeros] == 0)) {
+			zeros++;
+		}
+		if (zeros == TAR_HEADER_SIZE) {
+			break;
+		}
+
+		// Checksum of the header, with the checksum field taken as spaces
+		unsigned long long checksum = 0;
+		unsigned int sum = 0;
+		for (size_t i=0; i<TAR_HEADER_SIZE; i++) {
+			sum += ((i >= 148) && (i < 156)) ? ' ' : (unsigned char) header[i];
+		}
+		if (!parseNumber(header+148,8,checksum) || (checksum != sum)) {
+			error = (offset == 0) ? "Not a tar archive" : "Invalid tar header at offset " + std::to_string(offset);
+			return false;
+		}
+		unsigned long long size = 0;
+		if (!parseNumber(header+124,12,size)) {
+			error = "Invalid size in tar header at offset " + std::to_string(offset);
+			return false;
+		}
+		if (extended.count("size") > 0) {
+			size = strtoull(extended["size"].c_str(),NULL,10);
+		}
+		unsigned long long dataOffset = offset + TAR_HEADER_SIZE;
+		if (size > m_size - dataOffset) {
+			error = "Truncated tar archive";
+			return false;
+		}
+		const char* data = m_data + dataOffset;
+		offset = dataOffset + (size + TAR_HEADER_SIZE - 1) / TAR_HEADER_SIZE * TAR_HEADER_SIZE;
+
+		// Extended headers and long names apply to the next entry
+		char type = header[156];
+		if (type == 'x') {
+			if (!parsePax(data,(size_t) size,extended)) {
+				error = "Invalid pax header at offset " + std::to_string(dataOffset - TAR_HEADER_SIZE);
+				return false;
+			}
+			continue;
+		} else if (type == 'g') {
+			continue;
+		} else if (type == 'L') {
+			longName = getField(data,(size_t) size);
+			continue;
+		} else if (type == 'K') {
+			longLink = getField(data,(size_t) size);
+			continue;
+		}
+		std::string name = getField(header,100);
+		std::string prefix = getField(header+345,155);
+		if ((memcmp(header+257,"ustar",5) == 0) && !prefix.empty()) {
+			name = prefix + "/" + name;
+		}
+		if (!longName.empty()) {
+			name = longName;
+		}
+		if (extended.count("path") > 0) {
+			name = extended["path"];
+		}
+		std::string linkName = getField(header+157,100);
+		if (!longLink.empty()) {
+			linkName = longLink;
+		}
+		if (extended.count("linkpath") > 0) {
+			linkName = extended["linkpath"];
+		}
+		extended.clear();
+		longName.clear();
+		longLink.clear();
+
+		// Keep regular files and hard links to them
+		name = normalizeName(name);
+		Member member;
+		member.name = name;
+		member.offset = dataOffset;
+		member.size = size;
+		if ((type == '1') && (m_index.count(normalizeName(linkName)) > 0)) {
+			const Member& target = m_members[m_index[normalizeName(linkName)]];
+			member.offset = target.offset;
+			member.size = target.size;
+		} else if ((type != '0') && (type != 0) && (type != '7')) {
+			continue;
+		}
+		if (name.empty() || (name[name.size()-1] == '/')) {
+			continue;
+		}
+		if (!isSafeName(name)) {
+			m_skipped++;
+			continue;
+		}
+		m_index[name] = m_members.size();
+		m_members.push_back(member);
+	}
+
+	return true;
+}
+
+/**
+ * Parses a numeric header field: octal digits, or base-256 if the high bit
+ * of the first byte is set (GNU extension for large values)
+ *
+ * @param[in] field The field
+ * @param[in] length Length of the field
+ * @param[out] value The value
+ * @return true on success, false if the field is not a number
+ */
+bool TarReader::parseNumber(const char* field, size_t length, unsigned long long& value) {
+	value = 0;
+	if ((unsigned char) field[0] & 0x80) {
+		value = (unsigned char) field[0] & 0x7F;
+		for (size_t i=1; i<length; i++) {
+			value = (value << 8) | (unsigned char) field[i];
+		}
+		return true;
+	}
+	size_t i = 0;
+	while ((i < length) && (field[i] == ' ')) {
+		i++;
+	}
+	for (; (i < length) && (field[i] != 0) && (field[i] != ' '); i++) {
+		if ((field[i] < '0') || (field[i] > '7')) {
+			return false;
+		}
+		value = (value << 3) | (unsigned long long) (field[i] - '0');
+	}
+
+	return true;
+}
+
+/**
+ * Gets a text header field, which ends at the first NUL or at the end of
+ * the field
+ *
+ * @param[in] field The field
+ * @param[in] length Length of the field
+ * @return The text
+ */
+std::string TarReader::getField(const char* field, size_t length) {
+	size_t end = 0;
+	while ((end < length) && (field[end] != 0)) {
+		end++;
+	}
+
+	return std::string(field,end);
+}
+
+/**
+ * Parses the records of a pax extended header ("length keyword=value\n")
+ *
+ * @param[in] data Contents of the extended header
+ * @param[in] size Size of the contents
+ * @param[in,out] records Values by keyword, updated with the records found
+ * @return true on success, false if a record is malformed
+ */
+bool TarReader::parsePax(const char* data, size_t size, std::map<std::string,std::string>& records) {
+	size_t position = 0;
+	while (position < size) {
+		size_t length = 0;
+		size_t i = position;
+		while ((i < size) && (data[i] >= '0') && (data[i] <= '9') && (length <= size)) {
+			length = length*10 + (size_t) (data[i] - '0');
+			i++;
+		}
+		// The length counts the whole record, so it must cover its own digits and space
+		if ((i >= size) || (data[i] != ' ') || (length > size - position) || (length <= i + 1 - position)) {
+			return false;
+		}
+		std::string record(data+i+1,position+length-i-1);
+		if (!record.empty() && (record[record.size()-1] == '\n')) {
+			record.resize(record.size()-1);
+		}
+		size_t equals = record.find('=');
+		if (equals != std::string::npos) {
+			records[record.substr(0,equals)] = record.substr(equals+1);
+		}
+		position += length;
+	}
+
+	return true;
+}
+
+/**
+ * Removes leading "./" from a name
+ *
+ * @param[in] name The name
+ * @return The name without leading "./"
+ */
+std::string TarReader::normalizeName(const std::string& name) {
+	size_t start = 0;
+	while (name.compare(start,2,"./") == 0) {
+		start += 2;
+	}
+
+	return name.substr(start);
+}
+
+/**
+ * Checks that a name stays below the folder it is extracted to
+ *
+ * @param[in] name The name
+ * @return true if the name is relative and has no ".." components
+ */
+bool TarReader::isSafeName(const std::string& name) {
+	if (name.empty() || (name[0] == '/')) {
+		return false;
+	}
+	size_t start = 0;
+	while (start <= name.size()) {
+		size_t end = name.find('/',start);
+		if (end == std::string::npos) {
+			end = name.size();
+		}
+		if (name.compare(start,end-start,"..") == 0) {
+			return false;
+		}
+		start = end + 1;
+	}
+
+	return true;
+}
@@ -0,0 +1,60 @@
+#ifndef TARREADER_H
+#define TARREADER_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+/**
+ * TarReader objects give access to the files of a tar archive without
+ * extracting them. The archive is mapped in memory and its headers are
+ * indexed when it is opened, so the contents of every file can then be
+ * used in place, from any thread.
+ *
+ * POSIX (ustar) archives are supported, with pax and GNU long names.
+ * Regular files and hard links to them are listed; directories, symbolic
+ * links and other entries are ignored. When a name appears several times,
+ * the last file wins, as when extracting. Names that would escape the
+ * output folder (absolute, or with ".." components) are skipped.
+ */
+class TarReader {
+
+	public:
+		TarReader();
+		~TarReader();
+		bool open(const std::string&, std::string&);
+		void close();
+		void getFiles(std::vector<std::string>&, std::vector<unsigned long long>&);
+		unsigned long getSkipped();
+		bool find(const std::string&, const char*&, size_t&);
+		void prefetch(const std::string&);
+
+	private:
+		/**
+		 * File found in the archive
+		 */
+		struct Member {
+			std::string name;			/**< Name of the file, without leading "./" */
+			unsigned long long offset;	/**< Offset of the contents in the archive */
+			unsigned long long size;	/**< Size of the contents */
+		};
+
+		int m_fd;								/**< Archive file descriptor, -1 if closed */
+		const char* m_data;						/**< Archive mapped in memory, NULL if closed */
+		size_t m_size;							/**< Archive size */
+		std::vector<Member> m_members;			/**< Files in archive order */
+		std::map<std::string,size_t> m_index;	/**< Last member of every name */
+		unsigned long m_skipped;				/**< Files skipped because of unsafe names */
+
+		bool parse(std::string&);
+		static bool parseNumber(const char*, size_t, unsigned long long&);
+		static std::string getField(const char*, size_t);
+		static bool parsePax(const char*, size_t, std::map<std::string,std::string>&);
+		static std::string normalizeName(const std::string&);
+		static bool isSafeName(const std::string&);
+
+		TarReader(const TarReader&);
+		TarReader& operator=(const TarReader&);
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <algorithm>
+#include "globals.h"
+#include "threadioengine.h"
+
+/**
+ * Starts the I/O threads
+ *
+ * @param[in] threads Number of I/O threads
+ */
+ThreadIoEngine::ThreadIoEngine(int threads)
+:m_stopping(false) {
+	for (int i=0; i<std::max(threads,1); i++) {
+		m_threads.push_back(std::thread(&ThreadIoEngine::ioLoop,this));
+	}
+}
+
+/**
+ * Finishes queued requests and stops the I/O threads
+ */
+ThreadIoEngine::~ThreadIoEngine() {
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		m_stopping = true;
+	}
+	m_wakeUp.notify_all();
+	for (size_t i=0; i<m_threads.size(); i++) {
+		m_threads[i].join();
+	}
+}
+
+/**
+ * Gets the name of the engine
+ *
+ * @return The name, as given in the command line
+ */
+const char* ThreadIoEngine::getName() {
+	return "threads";
+}
+
+/**
+ * Queues a request for the next free thread
+ *
+ * @param[in] request The request
+ */
+void ThreadIoEngine::submit(IoRequest* request) {
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		m_queue.push_back(request);
+	}
+	m_wakeUp.notify_one();
+}
+
+/**
+ * I/O thread: runs queued requests until stopped
+ */
+void ThreadIoEngine::ioLoop() {
+	while (true) {
+		IoRequest* request = NULL;
+		{
+			std::unique_lock<std::mutex> lock(m_queueMutex);
+			while (m_queue.empty() && !m_stopping) {
+				m_wakeUp.wait(lock);
+			}
+			if (m_queue.empty()) {
+				return;
+			}
+			request = m_queue.front();
+			m_queue.pop_front();
+		}
+		if (request->type == IO_REQUEST_READ) {
+			readFile(request);
+		} else {
+			writeFile(request);
+		}
+		complete(request);
+	}
+}
+
+/**
+ * Reads a whole file into the request data
+ *
+ * @param[in,out] request The request
+ */
+void ThreadIoEngine::readFile(IoRequest* request) {
+	FILE* f = fopen(request->path.c_str(),"rb");
+	if (f == NULL) {
+		request->error = "Failed to open " + request->path;
+		return;
+	}
+	if (fseek(f,0,SEEK_END) == 0) {
+		long size = ftell(f);
+		if (size > 0) {
+			request->data.reserve(size);
+		}
+		rewind(f);
+	}
+	char buffer[65536];
+	size_t length = 0;
+	while ((length = fread(buffer,1,sizeof(buffer),f)) > 0) {
+		request->data.append(buffer,length);
+	}
+	if (ferror(f)) {
+		request->error = "Failed to read " + request->path;
+		request->data.clear();
+	}
+	fclose(f);
+}
+
+/**
+ * Writes the request data to a temp file and moves it to its final name,
+ * unless the request leaves publishing to the caller
+ *
+ * @param[in,out] request The request
+ */
+void ThreadIoEngine::writeFile(IoRequest* request) {
+	FILE* f = fopen(request->tempPath.c_str(),"wb");
+	if (f == NULL) {
+		request->error = "Failed to write " + request->path;
+		return;
+	}
+	bool written = (fwrite(request->data.data(),1,request->data.size(),f) == request->data.size());
+	bool synced = !written || !request->sync || syncFile(f);
+	written = (fclose(f) == 0) && written;
+	if (!written || !synced) {
+		request->error = (written ? "Failed to flush to storage " : "Failed to write ") + request->path;
+		remove(request->tempPath.c_str());
+		return;
+	}
+	if (!request->publish) {
+		return;
+	}
+
+	// Delete original file when processing in same folder, silently fail otherwise
+	remove(request->path.c_str());
+	if (rename(request->tempPath.c_str(),request->path.c_str()) != 0) {
+		request->error = "Can't rename " + request->tempPath + " to " + request->path;
+		remove(request->tempPath.c_str());
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef THREADIOENGINE_H
+#define THREADIOENGINE_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "ioengine.h"
+
+/**
+ * I/O engine running blocking file calls on a pool of threads. Available
+ * everywhere, and used when io_uring is not.
+ */
+class ThreadIoEngine : public IoEngine {
+
+	public:
+		ThreadIoEngine(int);
+		~ThreadIoEngine();
+		const char* getName();
+
+	protected:
+		void submit(IoRequest*);
+
+	private:
+		std::vector<std::thread> m_threads;		/**< I/O threads */
+		std::mutex m_queueMutex;				/**< Protects the queue and the stop flag */
+		std::condition_variable m_wakeUp;		/**< Signals new requests or stop */
+		std::deque<IoRequest*> m_queue;			/**< Requests waiting for a thread */
+		bool m_stopping;						/**< Threads have to exit once the queue is empty */
+
+		void ioLoop();
+		static void readFile(IoRequest*);
+		static void writeFile(IoRequest*);
+};
+
+#endif
@@ -0,0 +1,451 @@
+#ifdef ICCFLOW_TURBOJPEG
+
+#include <cstring>
+#include <algorithm>
+#include "turbojpegcodec.h"
+
+/**
+ * Gets the TurboJPEG pixel format of decoded lines with a number of components
+ *
+ * @param[in] components Color components per pixel
+ * @return The pixel format, or TJPF_UNKNOWN if not supported
+ */
+static int getPixelFormat(int components) {
+	switch (components) {
+		case 1:
+			return TJPF_GRAY;
+		case 3:
+			return TJPF_RGB;
+		case 4:
+			return TJPF_CMYK;
+		default:
+			return TJPF_UNKNOWN;
+	}
+}
+
+
+/**
+ * Creates the TurboJPEG decompression instance
+ */
+TurbojpegDecoder::TurbojpegDecoder()
+:m_file(NULL),
+ m_data(NULL),
+ m_size(0),
+ m_pitch(0),
+ m_height(0),
+ m_nextLine(0)
+{
+	m_handle = tj3Init(TJINIT_DECOMPRESS);
+}
+
+/**
+ * Destructor frees the TurboJPEG decompression instance
+ */
+TurbojpegDecoder::~TurbojpegDecoder() {
+	tj3Destroy(m_handle);
+}
+
+/**
+ * Sets an open file as source. The whole file is read when reading the header.
+ *
+ * @param[in] file Open file with the JPEG data
+ */
+void TurbojpegDecoder::setFileSource(FILE* file) {
+	m_file = file;
+	m_fileData.clear();
+	m_data = NULL;
+	m_size = 0;
+}
+
+/**
+ * Sets a memory block as source
+ *
+ * @param[in] data JPEG data
+ * @param[in] size Size of the JPEG data
+ */
+void TurbojpegDecoder::setMemorySource(const unsigned char* data, size_t size) {
+	m_file = NULL;
+	m_fileData.clear();
+	m_data = data;
+	m_size = size;
+}
+
+/**
+ * Markers are always available, as the whole JPEG data is kept in memory,
+ * so the setting is ignored
+ */
+void TurbojpegDecoder::setSaveMarkers(bool) {
+}
+
+/**
+ * Reads the JPEG header, after reading the whole file for file sources
+ *
+ * @param[out] info Size, components and color space of the stored image
+ * @return true if the header was read, false on error
+ */
+bool TurbojpegDecoder::readHeader(JpegImageInfo& info) {
+	if (m_handle == NULL) {
+		return false;
+	}
+	if (m_file != NULL) {
+		char buffer[65536];
+		size_t bytes = 0;
+		while ((bytes = fread(buffer,1,sizeof(buffer),m_file)) > 0) {
+			m_fileData.append(buffer,bytes);
+		}
+		if (ferror(m_file)) {
+			return false;
+		}
+		m_data = (const unsigned char*) m_fileData.data();
+		m_size = m_fileData.size();
+	}
+	if (tj3DecompressHeader(m_handle,m_data,m_size) != 0) {
+		return false;
+	}
+	m_info.width = tj3Get(m_handle,TJPARAM_JPEGWIDTH);
+	m_info.height = tj3Get(m_handle,TJPARAM_JPEGHEIGHT);
+	switch (tj3Get(m_handle,TJPARAM_COLORSPACE)) {
+		case TJCS_GRAY:
+			m_info.components = 1;
+			m_info.colorSpace = JCS_GRAYSCALE;
+			break;
+		case TJCS_CMYK:
+		case TJCS_YCCK:
+			m_info.components = 4;
+			m_info.colorSpace = JCS_CMYK;
+			break;
+		case TJCS_RGB:
+		case TJCS_YCbCr:
+			m_info.components = 3;
+			m_info.colorSpace = JCS_RGB;
+			break;
+		default:
+			return false;
+	}
+	info = m_info;
+
+	return true;
+}
+
+/**
+ * Gets the JPEG data, which is always held whole in memory
+ *
+ * @param[out] data Start of the data
+ * @param[out] size Size of the data
+ */
+void TurbojpegDecoder::getHeaderData(const char*& data, size_t& size) {
+	data = (const char*) m_data;
+	size = m_size;
+}
+
+/**
+ * Gets the markers of the image, scanning the JPEG data
+ *
+ * @param[out] markers The APPn and COM markers, in file order
+ */
+void TurbojpegDecoder::getMarkers(std::vector<JpegMarker>& markers) {
+	scanJpegMarkers((const char*) m_data,m_size,markers);
+}
+
+/**
+ * Gets the size of the decoded image when scaling it in the IDCT
+ *
+ * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+ * @param[out] width Scaled width
+ * @param[out] height Scaled height
+ * @return true on success, false on error
+ */
+bool TurbojpegDecoder::getScaledSize(int denominator, unsigned int& width, unsigned int& height) {
+	tjscalingfactor factor = {1, denominator};
+	width = TJSCALED(tj3Get(m_handle,TJPARAM_JPEGWIDTH),factor);
+	height = TJSCALED(tj3Get(m_handle,TJPARAM_JPEGHEIGHT),factor);
+
+	return true;
+}
+
+/**
+ * Decodes the whole image
+ *
+ * @param[in] denominator Scaling denominator (1, 2, 4 or 8)
+ * @param[in] codec Decompression parameters
+ * @param[out] output Size, components and color space of decoded lines
+ * @return true on success, false on error
+ */
+bool TurbojpegDecoder::start(int denominator, const CodecSettings& codec, JpegImageInfo& output) {
+	tjscalingfactor factor = {1, denominator};
+	if (tj3SetScalingFactor(m_handle,factor) != 0) {
+		return false;
+	}
+	tj3Set(m_handle,TJPARAM_FASTDCT,(codec.decodeDctMethod == JDCT_IFAST) ? 1 : 0);
+	tj3Set(m_handle,TJPARAM_FASTUPSAMPLE,codec.fancyUpsampling ? 0 : 1);
+	output = m_info;
+	getScaledSize(denominator,output.width,output.height);
+	m_pitch = (size_t) output.width*output.components;
+	m_height = output.height;
+	m_nextLine = 0;
+	m_image.resize(m_pitch*m_height);
+	if (tj3Decompress8(m_handle,m_data,m_size,&m_image[0],(int) m_pitch,getPixelFormat(output.components)) != 0) {
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Hands out the next decoded line
+ *
+ * @return The line, valid until the next image, or NULL if all lines were read
+ */
+const JSAMPLE* TurbojpegDecoder::readLine() {
+	if (m_nextLine >= m_height) {
+		return NULL;
+	}
+
+	return &m_image[(m_nextLine++)*m_pitch];
+}
+
+/**
+ * Finishes decompression, freeing the decoded image
+ *
+ * @return true on success
+ */
+bool TurbojpegDecoder::finish() {
+	abort();
+
+	return true;
+}
+
+/**
+ * Abandons the current image, freeing all data
+ */
+void TurbojpegDecoder::abort() {
+	std::vector<unsigned char>().swap(m_image);
+	m_fileData.clear();
+	m_height = 0;
+	m_nextLine = 0;
+}
+
+/**
+ * Gets the amount of JPEG data consumed
+ *
+ * @return Size of the JPEG data
+ */
+unsigned long TurbojpegDecoder::getBytesRead() {
+	return m_size;
+}
+
+/**
+ * Gets the working memory of the current image
+ *
+ * @return Size of the decoded image and of the JPEG data read from file
+ */
+unsigned long long TurbojpegDecoder::getMemoryUsed() {
+	return m_image.capacity() + m_fileData.capacity();
+}
+
+
+/**
+ * Creates the TurboJPEG compression instance
+ */
+TurbojpegEncoder::TurbojpegEncoder()
+:m_file(NULL),
+ m_output(NULL),
+ m_pixelFormat(TJPF_UNKNOWN),
+ m_nextLine(0),
+ m_bytesWritten(0)
+{
+	m_handle = tj3Init(TJINIT_COMPRESS);
+}
+
+/**
+ * Destructor frees the TurboJPEG compression instance
+ */
+TurbojpegEncoder::~TurbojpegEncoder() {
+	tj3Destroy(m_handle);
+}
+
+/**
+ * Sets an open file as destination
+ *
+ * @param[in] file Open file receiving the JPEG data
+ */
+void TurbojpegEncoder::setFileDestination(FILE* file) {
+	m_file = file;
+	m_output = NULL;
+	m_bytesWritten = 0;
+}
+
+/**
+ * Sets a string as destination
+ *
+ * @param[in] output String receiving the JPEG data
+ */
+void TurbojpegEncoder::setStringDestination(std::string* output) {
+	m_file = NULL;
+	m_output = output;
+	m_bytesWritten = 0;
+}
+
+/**
+ * Sets compression parameters and prepares the image buffer. Chroma
+ * subsampling and color space match libjpeg defaults: 4:2:0 YCbCr for RGB
+ * and no transform for CMYK.
+ *
+ * @param[in] image Size, components and color space of the lines to encode
+ * @param[in] quality JPEG quality (0-100)
+ * @param[in] codec Compression parameters
+ * @param[in] iccProfile ICC profile data to embed, empty for none
+ * @param[in] markers APPn and COM markers to write before the ICC profile
+ * @return true on success, false on error
+ */
+bool TurbojpegEncoder::start(const JpegImageInfo& image, int quality, const CodecSettings& codec, const std::string& iccProfile, const std::vector<JpegMarker>& markers) {
+	if (m_handle == NULL) {
+		return false;
+	}
+	m_pixelFormat = getPixelFormat(image.components);
+	if (m_pixelFormat == TJPF_UNKNOWN) {
+		return false;
+	}
+	tj3Set(m_handle,TJPARAM_QUALITY,quality);
+	switch (image.components) {
+		case 1:
+			tj3Set(m_handle,TJPARAM_SUBSAMP,TJSAMP_GRAY);
+			tj3Set(m_handle,TJPARAM_COLORSPACE,TJCS_GRAY);
+			break;
+		case 3:
+			tj3Set(m_handle,TJPARAM_SUBSAMP,TJSAMP_420);
+			tj3Set(m_handle,TJPARAM_COLORSPACE,TJCS_YCbCr);
+			break;
+		case 4:
+			tj3Set(m_handle,TJPARAM_SUBSAMP,TJSAMP_444);
+			tj3Set(m_handle,TJPARAM_COLORSPACE,TJCS_CMYK);
+			break;
+	}
+	tj3Set(m_handle,TJPARAM_FASTDCT,(codec.encodeDctMethod == JDCT_IFAST) ? 1 : 0);
+	tj3Set(m_handle,TJPARAM_OPTIMIZE,codec.optimizeCoding ? 1 : 0);
+	tj3Set(m_handle,TJPARAM_PROGRESSIVE,codec.progressive ? 1 : 0);
+	tj3Set(m_handle,TJPARAM_RESTARTROWS,codec.restartRows);
+	m_info = image;
+	m_iccProfile = iccProfile;
+	m_markers = markers;
+	m_image.resize((size_t) image.width*image.components*image.height);
+	m_nextLine = 0;
+
+	return true;
+}
+
+/**
+ * Stores the next line
+ *
+ * @param[in] line Pixels of the line
+ * @return true on success, false if the image is already complete
+ */
+bool TurbojpegEncoder::writeLine(const JSAMPLE* line) {
+	if (m_nextLine >= m_info.height) {
+		return false;
+	}
+	size_t pitch = (size_t) m_info.width*m_info.components;
+	memcpy(&m_image[(m_nextLine++)*pitch],line,pitch);
+
+	return true;
+}
+
+/**
+ * Compresses the whole image and writes it with the given markers and the
+ * ICC profile markers inserted after the JFIF marker, where libjpeg writes
+ * them.
+ *
+ * @return true on success, false on error
+ */
+bool TurbojpegEncoder::finish() {
+	unsigned char* jpeg = NULL;
+	size_t jpegSize = 0;
+	int pitch = (int) (m_info.width*m_info.components);
+	bool success = (m_nextLine == m_info.height)
+		&& (tj3Compress8(m_handle,&m_image[0],(int) m_info.width,pitch,(int) m_info.height,m_pixelFormat,&jpeg,&jpegSize) == 0);
+	std::vector<unsigned char>().swap(m_image);
+	if (!success) {
+		tj3Free(jpeg);
+		abort();
+		return false;
+	}
+
+	// Skip SOI and JFIF APP0 markers
+	size_t split = 2;
+	if ((jpegSize >= 6) && (jpeg[2] == 0xFF) && (jpeg[3] == 0xE0)) {
+		split += 2 + ((jpeg[4] << 8) | jpeg[5]);
+	}
+	success = write(jpeg,std::min(split,jpegSize));
+	std::vector<std::string> iccMarkers;
+	if (!m_iccProfile.empty()) {
+		getIccMarkers(m_iccProfile,iccMarkers);
+	}
+	for (size_t i=0; i<iccMarkers.size(); i++) {
+		JpegMarker marker;
+		marker.code = JPEG_APP0+2;
+		marker.data = iccMarkers[i];
+		m_markers.push_back(marker);
+	}
+	for (size_t i=0; success && (i<m_markers.size()); i++) {
+		size_t length = m_markers[i].data.size() + 2;
+		unsigned char header[4] = {0xFF, (unsigned char) m_markers[i].code, (unsigned char) (length >> 8), (unsigned char) (length & 0xFF)};
+		success = write(header,sizeof(header)) && write((const unsigned char*) m_markers[i].data.data(),m_markers[i].data.size());
+	}
+	if (success && (jpegSize > split)) {
+		success = write(jpeg+split,jpegSize-split);
+	}
+	tj3Free(jpeg);
+	abort();
+
+	return success;
+}
+
+/**
+ * Abandons the current image, freeing the collected lines and markers
+ */
+void TurbojpegEncoder::abort() {
+	std::vector<unsigned char>().swap(m_image);
+	m_iccProfile.clear();
+	m_markers.clear();
+	m_nextLine = 0;
+}
+
+/**
+ * Gets the amount of JPEG data produced
+ *
+ * @return Bytes written to the destination
+ */
+unsigned long TurbojpegEncoder::getBytesWritten() {
+	return m_bytesWritten;
+}
+
+/**
+ * Gets the working memory of the current image
+ *
+ * @return Size of the buffer collecting the lines
+ */
+unsigned long long TurbojpegEncoder::getMemoryUsed() {
+	return m_image.capacity();
+}
+
+/**
+ * Writes data to the destination
+ *
+ * @param[in] data Data to write
+ * @param[in] size Size of the data
+ * @return true on success, false on write error
+ */
+bool TurbojpegEncoder::write(const unsigned char* data, size_t size) {
+	if (m_file != NULL) {
+		if (fwrite(data,1,size,m_file) != size) {
+			return false;
+		}
+	} else if (m_output != NULL) {
+		m_output->append((const char*) data,size);
+	}
+	m_bytesWritten += size;
+
+	return true;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef TURBOJPEGCODEC_H
+#define TURBOJPEGCODEC_H
+
+#ifdef ICCFLOW_TURBOJPEG
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <turbojpeg.h>
+#include "jpegcodec.h"
+
+/**
+ * JPEG decompressor using the TurboJPEG 3 API. The whole JPEG data is read
+ * and decoded at once when starting, and lines are then handed out from the
+ * decoded image, so memory use grows with image size.
+ */
+class TurbojpegDecoder : public JpegDecoder {
+
+	public:
+		TurbojpegDecoder();
+		~TurbojpegDecoder();
+		void setFileSource(FILE*);
+		void setMemorySource(const unsigned char*, size_t);
+		void setSaveMarkers(bool);
+		bool readHeader(JpegImageInfo&);
+		void getHeaderData(const char*&, size_t&);
+		void getMarkers(std::vector<JpegMarker>&);
+		bool getScaledSize(int, unsigned int&, unsigned int&);
+		bool start(int, const CodecSettings&, JpegImageInfo&);
+		const JSAMPLE* readLine();
+		bool finish();
+		void abort();
+		unsigned long getBytesRead();
+		unsigned long long getMemoryUsed();
+
+	private:
+		tjhandle m_handle;					/**< TurboJPEG decompression instance */
+		FILE* m_file;						/**< Source file, NULL when reading from memory */
+		std::string m_fileData;				/**< JPEG data read from file sources */
+		const unsigned char* m_data;		/**< JPEG data */
+		size_t m_size;						/**< Size of JPEG data */
+		JpegImageInfo m_info;				/**< Size and layout of the stored image */
+		std::vector<unsigned char> m_image;	/**< Decoded image */
+		size_t m_pitch;						/**< Bytes per decoded line */
+		unsigned int m_height;				/**< Decoded lines */
+		unsigned int m_nextLine;			/**< Next line to hand out */
+
+		TurbojpegDecoder(const TurbojpegDecoder&);
+		TurbojpegDecoder& operator=(const TurbojpegDecoder&);
+};
+
+/**
+ * JPEG compressor using the TurboJPEG 3 API. Lines are collected until the
+ * whole image has been received, and then compressed at once.
+ */
+class TurbojpegEncoder : public JpegEncoder {
+
+	public:
+		TurbojpegEncoder();
+		~TurbojpegEncoder();
+		void setFileDestination(FILE*);
+		void setStringDestination(std::string*);
+		bool start(const JpegImageInfo&, int, const CodecSettings&, const std::string&, const std::vector<JpegMarker>&);
+		bool writeLine(const JSAMPLE*);
+		bool finish();
+		void abort();
+		unsigned long getBytesWritten();
+		unsigned long long getMemoryUsed();
+
+	private:
+		tjhandle m_handle;					/**< TurboJPEG compression instance */
+		FILE* m_file;						/**< Destination file, NULL when writing to memory */
+		std::string* m_output;				/**< Destination string, NULL when writing to file */
+		JpegImageInfo m_info;				/**< Size and layout of the image being compressed */
+		int m_pixelFormat;					/**< TurboJPEG pixel format of the image */
+		std::string m_iccProfile;			/**< ICC profile to embed */
+		std::vector<JpegMarker> m_markers;	/**< APPn and COM markers to write */
+		std::vector<unsigned char> m_image;	/**< Lines received so far */
+		unsigned int m_nextLine;			/**< Next line to receive */
+		unsigned long m_bytesWritten;		/**< Bytes written to the destination */
+
+		bool write(const unsigned char*, size_t);
+
+		TurbojpegEncoder(const TurbojpegEncoder&);
+		TurbojpegEncoder& operator=(const TurbojpegEncoder&);
+};
+
+#endif
+
+#endif
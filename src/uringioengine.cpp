@@ -0,0 +1,454 @@
+#ifdef ICCFLOW_IO_URING
+
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include "uringioengine.h"
+
+/**
+ * Largest read or write submitted at once
+ */
+static const size_t URING_MAX_TRANSFER = 1 << 30;
+
+/**
+ * Sets up the ring and starts the ring thread. Check @ref UringIoEngine#isReady
+ * before using the engine.
+ *
+ * @param[in] depth Maximum number of file operations in flight
+ */
+UringIoEngine::UringIoEngine(int depth)
+:m_ring(-1),
+ m_event(-1),
+ m_eventValue(0),
+ m_depth(std::max(depth,1)),
+ m_sqMap(MAP_FAILED),
+ m_sqMapSize(0),
+ m_cqMap(MAP_FAILED),
+ m_cqMapSize(0),
+ m_sqes((io_uring_sqe*) MAP_FAILED),
+ m_sqesSize(0),
+ m_sqHead(NULL),
+ m_sqTail(NULL),
+ m_sqMask(0),
+ m_sqArray(NULL),
+ m_cqHead(NULL),
+ m_cqTail(NULL),
+ m_cqMask(0),
+ m_cqes(NULL),
+ m_stopping(false) {
+	// One more entry for the eventfd read, rounded up to a power of two
+	unsigned int entries = 8;
+	while (entries < m_depth+1) {
+		entries *= 2;
+	}
+	if (!setupRing(entries) || !isSupported() || ((m_event = eventfd(0,EFD_CLOEXEC)) < 0)) {
+		if (m_ring >= 0) {
+			close(m_ring);
+			m_ring = -1;
+		}
+		return;
+	}
+	m_thread = std::thread(&UringIoEngine::ringLoop,this);
+}
+
+/**
+ * Finishes pending requests, stops the ring thread and releases the ring
+ */
+UringIoEngine::~UringIoEngine() {
+	if (m_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_queueMutex);
+			m_stopping = true;
+		}
+		uint64_t one = 1;
+		if (::write(m_event,&one,sizeof(one)) < 0) {
+			// The ring thread still wakes up with the next completion
+		}
+		m_thread.join();
+	}
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes,m_sqesSize);
+	}
+	if ((m_cqMap != MAP_FAILED) && (m_cqMap != m_sqMap)) {
+		munmap(m_cqMap,m_cqMapSize);
+	}
+	if (m_sqMap != MAP_FAILED) {
+		munmap(m_sqMap,m_sqMapSize);
+	}
+	if (m_ring >= 0) {
+		close(m_ring);
+	}
+	if (m_event >= 0) {
+		close(m_event);
+	}
+}
+
+/**
+ * Checks whether the ring was set up
+ *
+ * @return true if the engine can be used, false if io_uring is not available
+ */
+bool UringIoEngine::isReady() {
+	return m_ring >= 0;
+}
+
+/**
+ * Gets the name of the engine
+ *
+ * @return The name, as given in the command line
+ */
+const char* UringIoEngine::getName() {
+	return "uring";
+}
+
+/**
+ * Queues a request for the ring thread and wakes it up
+ *
+ * @param[in] request The request
+ */
+void UringIoEngine::submit(IoRequest* request) {
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		m_incoming.push_back(request);
+	}
+	uint64_t one = 1;
+	if (::write(m_event,&one,sizeof(one)) < 0) {
+		// Counter overflow only: the ring thread is already awake
+	}
+}
+
+/**
+ * Creates the ring and maps its queues
+ *
+ * @param[in] entries Number of submission queue entries
+ * @return true on success, false if io_uring is not available
+ */
+bool UringIoEngine::setupRing(unsigned int entries) {
+	io_uring_params params;
+	memset(&params,0,sizeof(params));
+	m_ring = syscall(__NR_io_uring_setup,entries,&params);
+	if (m_ring < 0) {
+		m_ring = -1;
+		return false;
+	}
+
+	m_sqMapSize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+	m_cqMapSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMap) {
+		m_sqMapSize = m_cqMapSize = std::max(m_sqMapSize,m_cqMapSize);
+	}
+	m_sqMap = mmap(NULL,m_sqMapSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,m_ring,IORING_OFF_SQ_RING);
+	if (m_sqMap == MAP_FAILED) {
+		return false;
+	}
+	m_cqMap = singleMap ? m_sqMap : mmap(NULL,m_cqMapSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,m_ring,IORING_OFF_CQ_RING);
+	if (m_cqMap == MAP_FAILED) {
+		return false;
+	}
+	m_sqesSize = params.sq_entries*sizeof(io_uring_sqe);
+	m_sqes = (io_uring_sqe*) mmap(NULL,m_sqesSize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,m_ring,IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED) {
+		return false;
+	}
+
+	char* sq = (char*) m_sqMap;
+	m_sqHead = (unsigned int*) (sq + params.sq_off.head);
+	m_sqTail = (unsigned int*) (sq + params.sq_off.tail);
+	m_sqMask = *(unsigned int*) (sq + params.sq_off.ring_mask);
+	m_sqArray = (unsigned int*) (sq + params.sq_off.array);
+	char* cq = (char*) m_cqMap;
+	m_cqHead = (unsigned int*) (cq + params.cq_off.head);
+	m_cqTail = (unsigned int*) (cq + params.cq_off.tail);
+	m_cqMask = *(unsigned int*) (cq + params.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+	m_depth = std::min(m_depth,std::min(params.sq_entries,params.cq_entries)-1);
+
+	return true;
+}
+
+/**
+ * Checks that the kernel supports all operations used by the engine
+ * (renameat and unlinkat need Linux 5.11)
+ *
+ * @return true if all operations are supported, false otherwise
+ */
+bool UringIoEngine::isSupported() {
+	const unsigned int opCount = 256;
+	std::vector<char> buffer(sizeof(io_uring_probe) + opCount*sizeof(io_uring_probe_op),0);
+	io_uring_probe* probe = (io_uring_probe*) &buffer[0];
+	if (syscall(__NR_io_uring_register,m_ring,IORING_REGISTER_PROBE,probe,opCount) < 0) {
+		return false;
+	}
+	const int ops[] = {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+		IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT};
+	for (size_t i=0; i<sizeof(ops)/sizeof(ops[0]); i++) {
+		if ((ops[i] > probe->last_op) || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Ring thread: queues the next step of every pending request, submits
+ * them all at once and handles completions, until stopped
+ */
+void UringIoEngine::ringLoop() {
+	std::deque<Operation*> ready;
+	unsigned int inFlight = 0;
+	bool eventArmed = false;
+	while (true) {
+		// Take new requests
+		{
+			std::lock_guard<std::mutex> lock(m_queueMutex);
+			while (!m_incoming.empty()) {
+				Operation* operation = new Operation();
+				operation->request = m_incoming.front();
+				operation->step = (operation->request->type == IO_REQUEST_READ) ? URING_STEP_STAT : URING_STEP_OPEN;
+				operation->fd = -1;
+				operation->offset = 0;
+				ready.push_back(operation);
+				m_incoming.pop_front();
+			}
+			if (m_stopping && ready.empty() && (inFlight == 0)) {
+				break;
+			}
+		}
+
+		// Queue eventfd read and next steps
+		unsigned int tail = *m_sqTail;
+		unsigned int head = __atomic_load_n(m_sqHead,__ATOMIC_ACQUIRE);
+		if (!eventArmed && (tail - head <= m_sqMask)) {
+			io_uring_sqe* sqe = &m_sqes[tail & m_sqMask];
+			memset(sqe,0,sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = m_event;
+			sqe->addr = (uintptr_t) &m_eventValue;
+			sqe->len = sizeof(m_eventValue);
+			sqe->user_data = 0;
+			m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+			tail++;
+			eventArmed = true;
+		}
+		while (!ready.empty() && (inFlight < m_depth) && (tail - head <= m_sqMask)) {
+			io_uring_sqe* sqe = &m_sqes[tail & m_sqMask];
+			prepare(ready.front(),sqe);
+			m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+			tail++;
+			ready.pop_front();
+			inFlight++;
+		}
+		__atomic_store_n(m_sqTail,tail,__ATOMIC_RELEASE);
+
+		// Submit everything queued and wait for a completion
+		unsigned int toSubmit = tail - __atomic_load_n(m_sqHead,__ATOMIC_ACQUIRE);
+		if (syscall(__NR_io_uring_enter,m_ring,toSubmit,1,IORING_ENTER_GETEVENTS,NULL,0) < 0) {
+			if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+				// Ring unusable: fail requests not submitted yet, and keep reaping the others
+				while (!ready.empty()) {
+					Operation* operation = ready.front();
+					ready.pop_front();
+					if (operation->fd >= 0) {
+						close(operation->fd);
+					}
+					operation->request->error = "I/O error on " + operation->request->path;
+					complete(operation->request);
+					delete operation;
+				}
+			}
+		}
+
+		// Handle completions
+		unsigned int cqHead = *m_cqHead;
+		unsigned int cqTail = __atomic_load_n(m_cqTail,__ATOMIC_ACQUIRE);
+		while (cqHead != cqTail) {
+			io_uring_cqe* cqe = &m_cqes[cqHead & m_cqMask];
+			if (cqe->user_data == 0) {
+				eventArmed = false;
+			} else {
+				Operation* operation = (Operation*) (uintptr_t) cqe->user_data;
+				inFlight--;
+				advance(operation,cqe->res);
+				if (operation->step == URING_STEP_DONE) {
+					complete(operation->request);
+					delete operation;
+				} else {
+					ready.push_back(operation);
+				}
+			}
+			cqHead++;
+		}
+		__atomic_store_n(m_cqHead,cqHead,__ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Fills a submission queue entry with the current step of a request
+ *
+ * @param[in] operation The request state
+ * @param[out] sqe The submission queue entry
+ */
+void UringIoEngine::prepare(Operation* operation, io_uring_sqe* sqe) {
+	IoRequest* request = operation->request;
+	memset(sqe,0,sizeof(*sqe));
+	sqe->user_data = (uintptr_t) operation;
+	switch (operation->step) {
+		case URING_STEP_STAT:
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) request->path.c_str();
+			sqe->len = STATX_SIZE;
+			sqe->off = (uintptr_t) &operation->stat;
+			break;
+		case URING_STEP_OPEN:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			if (request->type == IO_REQUEST_READ) {
+				sqe->addr = (uintptr_t) request->path.c_str();
+				sqe->open_flags = O_RDONLY | O_CLOEXEC;
+			} else {
+				sqe->addr = (uintptr_t) request->tempPath.c_str();
+				sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+				sqe->len = 0666;
+			}
+			break;
+		case URING_STEP_READ:
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = operation->fd;
+			sqe->addr = (uintptr_t) &request->data[operation->offset];
+			sqe->len = std::min(request->data.size() - operation->offset,URING_MAX_TRANSFER);
+			sqe->off = operation->offset;
+			break;
+		case URING_STEP_WRITE:
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = operation->fd;
+			sqe->addr = (uintptr_t) (request->data.data() + operation->offset);
+			sqe->len = std::min(request->data.size() - operation->offset,URING_MAX_TRANSFER);
+			sqe->off = operation->offset;
+			break;
+		case URING_STEP_FSYNC:
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = operation->fd;
+			break;
+		case URING_STEP_CLOSE:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = operation->fd;
+			break;
+		case URING_STEP_RENAME:
+			sqe->opcode = IORING_OP_RENAMEAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) request->tempPath.c_str();
+			sqe->len = AT_FDCWD;
+			sqe->addr2 = (uintptr_t) request->path.c_str();
+			break;
+		case URING_STEP_UNLINK:
+			sqe->opcode = IORING_OP_UNLINKAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t) request->tempPath.c_str();
+			break;
+	}
+}
+
+/**
+ * Moves a request to its next step after a completion
+ *
+ * @param[in,out] operation The request state
+ * @param[in] res Result of the completed step (negative errno on failure)
+ */
+void UringIoEngine::advance(Operation* operation, int res) {
+	IoRequest* request = operation->request;
+	bool reading = (request->type == IO_REQUEST_READ);
+	switch (operation->step) {
+		case URING_STEP_STAT:
+			if (res < 0) {
+				request->error = "Failed to open " + request->path;
+				operation->step = URING_STEP_DONE;
+			} else {
+				request->data.resize(operation->stat.stx_size);
+				operation->step = URING_STEP_OPEN;
+			}
+			break;
+		case URING_STEP_OPEN:
+			if (res < 0) {
+				request->error = (reading ? "Failed to open " : "Failed to write ") + request->path;
+				operation->step = URING_STEP_DONE;
+			} else {
+				operation->fd = res;
+				if (request->data.empty()) {
+					operation->step = (!reading && request->sync) ? URING_STEP_FSYNC : URING_STEP_CLOSE;
+				} else {
+					operation->step = reading ? URING_STEP_READ : URING_STEP_WRITE;
+				}
+			}
+			break;
+		case URING_STEP_READ:
+			if (res < 0) {
+				request->error = "Failed to read " + request->path;
+				request->data.clear();
+				operation->step = URING_STEP_CLOSE;
+			} else if (res == 0) {
+				// File shrank since statx
+				request->data.resize(operation->offset);
+				operation->step = URING_STEP_CLOSE;
+			} else {
+				operation->offset += res;
+				if (operation->offset == request->data.size()) {
+					operation->step = URING_STEP_CLOSE;
+				}
+			}
+			break;
+		case URING_STEP_WRITE:
+			if (res <= 0) {
+				request->error = "Failed to write " + request->path;
+				operation->step = URING_STEP_CLOSE;
+			} else {
+				operation->offset += res;
+				if (operation->offset == request->data.size()) {
+					operation->step = request->sync ? URING_STEP_FSYNC : URING_STEP_CLOSE;
+				}
+			}
+			break;
+		case URING_STEP_FSYNC:
+			if (res < 0) {
+				request->error = "Failed to flush to storage " + request->path;
+			}
+			operation->step = URING_STEP_CLOSE;
+			break;
+		case URING_STEP_CLOSE:
+			operation->fd = -1;
+			if (reading) {
+				operation->step = URING_STEP_DONE;
+			} else if (!request->error.empty()) {
+				operation->step = URING_STEP_UNLINK;
+			} else if (res < 0) {
+				// Delayed write errors (e.g. network filesystems) show up when closing
+				request->error = "Failed to write " + request->path;
+				operation->step = URING_STEP_UNLINK;
+			} else {
+				operation->step = request->publish ? URING_STEP_RENAME : URING_STEP_DONE;
+			}
+			break;
+		case URING_STEP_RENAME:
+			if (res < 0) {
+				request->error = "Can't rename " + request->tempPath + " to " + request->path;
+				operation->step = URING_STEP_UNLINK;
+			} else {
+				operation->step = URING_STEP_DONE;
+			}
+			break;
+		default:
+			operation->step = URING_STEP_DONE;
+			break;
+	}
+}
+
+#endif
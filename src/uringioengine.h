@@ -0,0 +1,99 @@
+#ifndef URINGIOENGINE_H
+#define URINGIOENGINE_H
+
+#ifdef ICCFLOW_IO_URING
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <cstdint>
+#include <sys/stat.h>
+#include "ioengine.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/**
+ * I/O engine using Linux io_uring through raw system calls (no liburing).
+ *
+ * A single thread owns the ring. Every request is a sequence of steps
+ * (statx, open, read or write, fsync, close, rename), and the next step of all
+ * pending requests is submitted with one system call, so opening, reading
+ * and publishing many files costs a few calls per batch instead of several
+ * per file. Other threads wake the ring thread through an eventfd, whose
+ * read is kept in the ring.
+ */
+class UringIoEngine : public IoEngine {
+
+	public:
+		UringIoEngine(int);
+		~UringIoEngine();
+		bool isReady();
+		const char* getName();
+
+	protected:
+		void submit(IoRequest*);
+
+	private:
+		/**
+		 * Steps of a request
+		 */
+		enum URING_STEPS {
+			URING_STEP_STAT = 0,	/**< Get size of file to read */
+			URING_STEP_OPEN,		/**< Open file to read, or temp file to write */
+			URING_STEP_READ,		/**< Read the next part of the file */
+			URING_STEP_WRITE,		/**< Write the next part of the file */
+			URING_STEP_FSYNC,		/**< Flush written file to storage */
+			URING_STEP_CLOSE,		/**< Close the file */
+			URING_STEP_RENAME,		/**< Move temp file to its final name */
+			URING_STEP_UNLINK,		/**< Delete temp file after an error */
+			URING_STEP_DONE			/**< Request finished */
+		};
+
+		/**
+		 * State of a request in the ring
+		 */
+		struct Operation {
+			IoRequest* request;		/**< The request */
+			int step;				/**< Current step (see @ref URING_STEPS) */
+			int fd;					/**< Open file, -1 if none */
+			size_t offset;			/**< Bytes read or written */
+			struct statx stat;		/**< Size of file to read */
+		};
+
+		int m_ring;							/**< io_uring file descriptor, -1 if not available */
+		int m_event;						/**< eventfd waking the ring thread */
+		uint64_t m_eventValue;				/**< Buffer of eventfd reads */
+		unsigned int m_depth;				/**< Maximum operations in flight */
+		void* m_sqMap;						/**< Mapped submission ring */
+		size_t m_sqMapSize;					/**< Size of mapped submission ring */
+		void* m_cqMap;						/**< Mapped completion ring (same as submission ring if single mmap) */
+		size_t m_cqMapSize;					/**< Size of mapped completion ring */
+		io_uring_sqe* m_sqes;				/**< Mapped submission queue entries */
+		size_t m_sqesSize;					/**< Size of mapped submission queue entries */
+		unsigned int* m_sqHead;				/**< Submission ring head (kernel) */
+		unsigned int* m_sqTail;				/**< Submission ring tail (us) */
+		unsigned int m_sqMask;				/**< Submission ring index mask */
+		unsigned int* m_sqArray;			/**< Submission ring index array */
+		unsigned int* m_cqHead;				/**< Completion ring head (us) */
+		unsigned int* m_cqTail;				/**< Completion ring tail (kernel) */
+		unsigned int m_cqMask;				/**< Completion ring index mask */
+		io_uring_cqe* m_cqes;				/**< Completion queue entries */
+		std::thread m_thread;				/**< Ring thread */
+		std::mutex m_queueMutex;			/**< Protects incoming requests and the stop flag */
+		std::deque<IoRequest*> m_incoming;	/**< Requests submitted by other threads */
+		bool m_stopping;					/**< Ring thread has to exit once all requests are done */
+
+		bool setupRing(unsigned int);
+		bool isSupported();
+		void ringLoop();
+		void prepare(Operation*, io_uring_sqe*);
+		void advance(Operation*, int);
+
+		UringIoEngine(const UringIoEngine&);
+		UringIoEngine& operator=(const UringIoEngine&);
+};
+
+#endif
+
+#endif
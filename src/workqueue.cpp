@@ -0,0 +1,112 @@
+#include <algorithm>
+#include "workqueue.h"
+
+/**
+ * Creates an empty deque
+ */
+WorkQueue::WorkerDeque::WorkerDeque()
+:remaining(0) {
+}
+
+/**
+ * Creates an empty queue
+ */
+WorkQueue::WorkQueue()
+:m_costs(NULL) {
+}
+
+/**
+ * Sorts the items by cost and deals them to the workers. Items of equal
+ * cost keep their original order.
+ *
+ * @param[in] costs Estimated cost of every item (must outlive the queue use)
+ * @param[in] workers Number of worker threads
+ */
+void WorkQueue::setup(const std::vector<unsigned long long>& costs, int workers) {
+	m_costs = &costs;
+	std::vector<size_t> order(costs.size());
+	for (size_t i=0; i<order.size(); i++) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(),order.end(),[&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+
+	m_deques.clear();
+	for (int i=0; i<std::max(workers,1); i++) {
+		m_deques.push_back(std::unique_ptr<WorkerDeque>(new WorkerDeque()));
+	}
+	for (size_t i=0; i<order.size(); i++) {
+		WorkerDeque& deque = *m_deques[i % m_deques.size()];
+		deque.items.push_back(order[i]);
+		deque.remaining += costs[order[i]];
+	}
+}
+
+/**
+ * Gets the next item for a worker: the largest one of its own deque, or
+ * else the largest one of the deque with most work left
+ *
+ * @param[in] worker Index of the worker (0 to workers-1)
+ * @param[out] index Index of the item to process
+ * @return true if an item was taken, false if all items have been taken
+ */
+bool WorkQueue::next(int worker, size_t& index) {
+	if (takeFront(*m_deques[worker],index)) {
+		return true;
+	}
+	while (true) {
+		WorkerDeque* victim = NULL;
+		unsigned long long victimRemaining = 0;
+		bool pending = false;
+		for (size_t i=0; i<m_deques.size(); i++) {
+			std::lock_guard<std::mutex> lock(m_deques[i]->mutex);
+			if (m_deques[i]->items.empty()) {
+				continue;
+			}
+			pending = true;
+			if ((victim == NULL) || (m_deques[i]->remaining > victimRemaining)) {
+				victim = m_deques[i].get();
+				victimRemaining = m_deques[i]->remaining;
+			}
+		}
+		if (!pending) {
+			return false;
+		}
+		// The victim may have been emptied meanwhile, look again if so
+		if (takeFront(*victim,index)) {
+			return true;
+		}
+	}
+}
+
+/**
+ * Gets the next items of a worker's own deque, without taking them, so
+ * that their input can be prepared in advance. Items may still be stolen
+ * by other workers.
+ *
+ * @param[in] worker Index of the worker (0 to workers-1)
+ * @param[in] count Maximum number of items
+ * @param[out] indices Indices of the items, in the order the worker will take them
+ */
+void WorkQueue::peek(int worker, size_t count, std::vector<size_t>& indices) {
+	WorkerDeque& deque = *m_deques[worker];
+	std::lock_guard<std::mutex> lock(deque.mutex);
+	indices.assign(deque.items.begin(),deque.items.begin()+std::min(count,deque.items.size()));
+}
+
+/**
+ * Takes the largest item of a deque
+ *
+ * @param[in] deque The deque
+ * @param[out] index Index of the item
+ * @return true if an item was taken, false if the deque is empty
+ */
+bool WorkQueue::takeFront(WorkerDeque& deque, size_t& index) {
+	std::lock_guard<std::mutex> lock(deque.mutex);
+	if (deque.items.empty()) {
+		return false;
+	}
+	index = deque.items.front();
+	deque.items.pop_front();
+	deque.remaining -= (*m_costs)[index];
+	return true;
+}
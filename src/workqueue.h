@@ -0,0 +1,48 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+
+/**
+ * WorkQueue objects hand out the files of a batch run to worker threads,
+ * largest first, so that big images don't start last and keep the run
+ * going after the other workers have finished.
+ *
+ * Items are sorted by estimated cost and dealt round-robin to one deque per
+ * worker. Workers take the largest item of their own deque, and when it is
+ * empty they steal the largest item of the deque with most work left, so
+ * that all workers stay busy until the end of the run.
+ */
+class WorkQueue {
+
+	public:
+		WorkQueue();
+		void setup(const std::vector<unsigned long long>&, int);
+		bool next(int, size_t&);
+		void peek(int, size_t, std::vector<size_t>&);
+
+	private:
+		/**
+		 * Items dealt to a worker
+		 */
+		struct WorkerDeque {
+			std::mutex mutex;				/**< Protects the items and the remaining cost */
+			std::deque<size_t> items;		/**< Indices of the items, largest first */
+			unsigned long long remaining;	/**< Estimated cost of the items */
+
+			WorkerDeque();
+		};
+
+		std::vector<std::unique_ptr<WorkerDeque> > m_deques;	/**< One deque per worker */
+		const std::vector<unsigned long long>* m_costs;			/**< Estimated cost of every item */
+
+		bool takeFront(WorkerDeque&, size_t&);
+
+		WorkQueue(const WorkQueue&);
+		WorkQueue& operator=(const WorkQueue&);
+};
+
+#endif
@@ -0,0 +1,396 @@
+/**
+ * Codec backend equivalence check for iccflow.
+ *
+ * Converts every group folder of a corpus created by gencorpus twice, with
+ * -codec libjpeg and with -codec turbojpeg, in several scenarios (default
+ * settings, the small preset, DCT scaling and resampling), and checks that
+ * both backends produce the same images: same dimensions and components,
+ * the same APPn and COM markers (embedded ICC profile included), and
+ * decoded samples within a tolerance, as the backends may round the DCT
+ * and color conversion differently.
+ *
+ * Usage: codeccheck -iccflow binary -corpus folder -output folder
+ *                   [-tolerance samples] [-mean samples]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <iterator>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+extern "C" {
+#include <jpeglib.h>
+}
+
+/**
+ * Conversion settings both backends are compared with
+ */
+struct CheckScenario {
+	const char* name;		/**< Folder name of the scenario outputs */
+	const char* options[4];	/**< iccflow options, NULL terminated */
+};
+
+const CheckScenario CHECK_SCENARIOS[] = {
+	{"default",		{NULL}},
+	{"small",		{"-preset","small",NULL}},
+	{"scale2",		{"-scale","2",NULL}},
+	{"resample",	{"-max-size","500","-resample",NULL}}
+};
+
+const char* const CHECK_CODECS[] = {"libjpeg","turbojpeg"};
+
+/**
+ * JPEG image decoded with libjpeg, with its markers
+ */
+struct DecodedImage {
+	unsigned int width;			/**< Width in pixels */
+	unsigned int height;		/**< Height in pixels */
+	int components;				/**< Color components per pixel */
+	std::vector<std::pair<int,std::string> > markers;	/**< APPn and COM markers (code and data), in file order */
+	std::vector<JSAMPLE> samples;	/**< Decoded samples, line after line */
+};
+
+/**
+ * libjpeg error manager returning to the caller instead of exiting
+ */
+struct CheckErrorManager {
+	jpeg_error_mgr pub;			/**< libjpeg error fields */
+	jmp_buf setjmpBuffer;		/**< Where to return on errors */
+};
+
+/**
+ * Error handler of the error manager
+ */
+static void checkErrorExit(j_common_ptr cinfo) {
+	CheckErrorManager* manager = (CheckErrorManager*) cinfo->err;
+	longjmp(manager->setjmpBuffer,1);
+}
+
+/**
+ * Creates a folder and its missing parents
+ *
+ * @param[in] dir Path of the folder
+ * @return true if the folder exists or was created, false otherwise
+ */
+static bool createDirectory(const std::string& dir) {
+	struct stat st;
+	if ((stat(dir.c_str(),&st) == 0) && S_ISDIR(st.st_mode)) {
+		return true;
+	}
+	size_t separator = dir.find_last_of('/');
+	if ((separator != std::string::npos) && (separator > 0) && !createDirectory(dir.substr(0,separator))) {
+		return false;
+	}
+	return (mkdir(dir.c_str(),0777) == 0);
+}
+
+/**
+ * Reads the file names of the manifest of a corpus group
+ *
+ * @param[in] folder Path of the group folder
+ * @param[out] names File names of the images
+ * @return true if the manifest was read, false otherwise
+ */
+static bool readManifest(const std::string& folder, std::vector<std::string>& names) {
+	std::ifstream manifest((folder + "/manifest.txt").c_str());
+	if (!manifest.is_open()) {
+		return false;
+	}
+	std::string name;
+	int width = 0;
+	int height = 0;
+	while (manifest >> name >> width >> height) {
+		names.push_back(name);
+	}
+
+	return true;
+}
+
+/**
+ * Runs iccflow and waits for it to finish
+ *
+ * @param[in] arguments Command line, starting with the iccflow binary
+ * @return true if iccflow finished successfully, false otherwise
+ */
+static bool runIccflow(const std::vector<std::string>& arguments) {
+	std::vector<char*> argv;
+	for (size_t i=0; i<arguments.size(); i++) {
+		argv.push_back(const_cast<char*>(arguments[i].c_str()));
+	}
+	argv.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		return false;
+	}
+	if (pid == 0) {
+		// Child: discard console output and run iccflow
+		int devNull = open("/dev/null",O_WRONLY);
+		if (devNull >= 0) {
+			dup2(devNull,STDOUT_FILENO);
+			close(devNull);
+		}
+		execv(argv[0],&argv[0]);
+		_exit(127);
+	}
+
+	int status = 0;
+	if (waitpid(pid,&status,0) != pid) {
+		return false;
+	}
+
+	return WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+}
+
+/**
+ * Decodes a JPEG file, keeping its APPn and COM markers
+ *
+ * @param[in] fileName Path of the file
+ * @param[out] image The decoded image
+ * @return true if the file was decoded, false otherwise
+ */
+static bool decodeImage(const std::string& fileName, DecodedImage& image) {
+	std::ifstream file(fileName.c_str(),std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)),std::istreambuf_iterator<char>());
+	if (data.empty()) {
+		return false;
+	}
+
+	jpeg_decompress_struct cinfo;
+	CheckErrorManager error;
+	cinfo.err = jpeg_std_error(&error.pub);
+	error.pub.error_exit = checkErrorExit;
+	if (setjmp(error.setjmpBuffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo,&data[0],data.size());
+	for (int m=0; m<16; m++) {
+		jpeg_save_markers(&cinfo,JPEG_APP0+m,0xFFFF);
+	}
+	jpeg_save_markers(&cinfo,JPEG_COM,0xFFFF);
+	jpeg_read_header(&cinfo,TRUE);
+	for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker != NULL; marker = marker->next) {
+		image.markers.push_back(std::make_pair((int) marker->marker,std::string((const char*) marker->data,marker->data_length)));
+	}
+
+	jpeg_start_decompress(&cinfo);
+	image.width = cinfo.output_width;
+	image.height = cinfo.output_height;
+	image.components = cinfo.output_components;
+	size_t stride = (size_t) image.width*image.components;
+	image.samples.resize(stride*image.height);
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = &image.samples[stride*cinfo.output_scanline];
+		jpeg_read_scanlines(&cinfo,&row,1);
+	}
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+
+	return true;
+}
+
+/**
+ * Gets the ICC profile embedded in the APP2 markers of an image, joining
+ * its chunks in sequence order
+ *
+ * @param[in] image The image
+ * @return The profile data, empty if there is none
+ */
+static std::string getIccProfile(const DecodedImage& image) {
+	const std::string tag("ICC_PROFILE\0",12);
+	std::vector<std::pair<int,std::string> > chunks;
+	for (size_t i=0; i<image.markers.size(); i++) {
+		const std::string& data = image.markers[i].second;
+		if ((image.markers[i].first == JPEG_APP0+2) && (data.size() > 14) && (data.compare(0,12,tag) == 0)) {
+			chunks.push_back(std::make_pair((int) (unsigned char) data[12],data.substr(14)));
+		}
+	}
+	std::sort(chunks.begin(),chunks.end());
+	std::string profile;
+	for (size_t i=0; i<chunks.size(); i++) {
+		profile += chunks[i].second;
+	}
+
+	return profile;
+}
+
+/**
+ * Compares the outputs of both backends for an image
+ *
+ * @param[in] reference Output of the libjpeg backend
+ * @param[in] other Output of the TurboJPEG backend
+ * @param[in] tolerance Largest difference allowed for any sample
+ * @param[in] meanTolerance Largest mean difference allowed over all samples
+ * @param[out] difference Description of the first difference found
+ * @return true if the outputs are equivalent, false otherwise
+ */
+static bool compareImages(const DecodedImage& reference, const DecodedImage& other, int tolerance, double meanTolerance, std::string& difference) {
+	if ((reference.width != other.width) || (reference.height != other.height) || (reference.components != other.components)) {
+		difference = "dimensions " + std::to_string(reference.width) + "x" + std::to_string(reference.height) + "x" + std::to_string(reference.components)
+					 + " vs " + std::to_string(other.width) + "x" + std::to_string(other.height) + "x" + std::to_string(other.components);
+		return false;
+	}
+	if (getIccProfile(reference) != getIccProfile(other)) {
+		difference = "embedded ICC profile differs";
+		return false;
+	}
+	if (reference.markers.size() != other.markers.size()) {
+		difference = std::to_string(reference.markers.size()) + " vs " + std::to_string(other.markers.size()) + " APPn/COM markers";
+		return false;
+	}
+	for (size_t i=0; i<reference.markers.size(); i++) {
+		if (reference.markers[i] != other.markers[i]) {
+			std::ostringstream text;
+			text << "marker " << i << " (0x" << std::hex << std::uppercase << reference.markers[i].first << ") differs";
+			difference = text.str();
+			return false;
+		}
+	}
+
+	int largest = 0;
+	unsigned long long total = 0;
+	for (size_t i=0; i<reference.samples.size(); i++) {
+		int delta = std::abs((int) reference.samples[i] - (int) other.samples[i]);
+		largest = std::max(largest,delta);
+		total += delta;
+	}
+	double mean = reference.samples.empty() ? 0 : (double) total/reference.samples.size();
+	if ((largest > tolerance) || (mean > meanTolerance)) {
+		std::ostringstream text;
+		text << "samples differ by up to " << largest << ", " << std::fixed << std::setprecision(3) << mean << " on average";
+		difference = text.str();
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Check main function
+ */
+int main(int argc, char** argv) {
+	// Parse arguments
+	std::string iccflow;
+	std::string corpus;
+	std::string output;
+	int tolerance = 4;
+	double meanTolerance = 0.5;
+	for (int i=1; i<argc; i++) {
+		std::string arg = argv[i];
+		if ((arg == "-iccflow") && (i+1 < argc)) {
+			iccflow = argv[++i];
+		} else if ((arg == "-corpus") && (i+1 < argc)) {
+			corpus = argv[++i];
+		} else if ((arg == "-output") && (i+1 < argc)) {
+			output = argv[++i];
+		} else if ((arg == "-tolerance") && (i+1 < argc)) {
+			tolerance = atoi(argv[++i]);
+		} else if ((arg == "-mean") && (i+1 < argc)) {
+			meanTolerance = atof(argv[++i]);
+		} else {
+			std::cerr << "Unknown argument: " << arg << std::endl;
+			return 1;
+		}
+	}
+	if (iccflow.empty() || corpus.empty() || output.empty()) {
+		std::cerr << "Usage: codeccheck -iccflow binary -corpus folder -output folder [-tolerance samples] [-mean samples]" << std::endl;
+		return 1;
+	}
+
+	// Find corpus groups
+	std::vector<std::string> groups;
+	DIR* dir = opendir(corpus.c_str());
+	if (dir == NULL) {
+		std::cerr << "Failed to open corpus folder: " << corpus << std::endl;
+		return 2;
+	}
+	dirent* ent = NULL;
+	while ((ent = readdir(dir))) {
+		struct stat st;
+		std::string name = ent->d_name;
+		if ((name != ".") && (name != "..") && (stat((corpus + "/" + name).c_str(),&st) == 0) && S_ISDIR(st.st_mode)) {
+			groups.push_back(name);
+		}
+	}
+	closedir(dir);
+	std::sort(groups.begin(),groups.end());
+
+	// Convert every group with both backends and compare their outputs
+	unsigned long compared = 0;
+	unsigned long failures = 0;
+	for (size_t s=0; s<sizeof(CHECK_SCENARIOS)/sizeof(CHECK_SCENARIOS[0]); s++) {
+		const CheckScenario& scenario = CHECK_SCENARIOS[s];
+		for (size_t g=0; g<groups.size(); g++) {
+			std::vector<std::string> names;
+			if (!readManifest(corpus + "/" + groups[g],names)) {
+				std::cerr << "Skipping " << groups[g] << ": no manifest" << std::endl;
+				continue;
+			}
+			std::string folders[2];
+			bool converted = true;
+			for (int c=0; c<2; c++) {
+				folders[c] = output + "/" + scenario.name + "/" + CHECK_CODECS[c] + "/" + groups[g];
+				std::vector<std::string> arguments;
+				arguments.push_back(iccflow);
+				arguments.push_back("-i");
+				arguments.push_back(corpus + "/" + groups[g]);
+				arguments.push_back("-o");
+				arguments.push_back(folders[c]);
+				arguments.push_back("-codec");
+				arguments.push_back(CHECK_CODECS[c]);
+				for (int o=0; scenario.options[o] != NULL; o++) {
+					arguments.push_back(scenario.options[o]);
+				}
+				if (!createDirectory(folders[c]) || !runIccflow(arguments)) {
+					std::cerr << "iccflow failed: " << scenario.name << "/" << groups[g] << " with " << CHECK_CODECS[c] << std::endl;
+					converted = false;
+				}
+			}
+			if (!converted) {
+				failures++;
+				continue;
+			}
+
+			for (size_t n=0; n<names.size(); n++) {
+				std::string image = std::string(scenario.name) + "/" + groups[g] + "/" + names[n];
+				DecodedImage decoded[2];
+				bool read = true;
+				for (int c=0; c<2; c++) {
+					if (!decodeImage(folders[c] + "/" + names[n],decoded[c])) {
+						std::cerr << image << ": can't decode output of " << CHECK_CODECS[c] << std::endl;
+						read = false;
+					}
+				}
+				compared++;
+				std::string difference;
+				if (!read) {
+					failures++;
+				} else if (!compareImages(decoded[0],decoded[1],tolerance,meanTolerance,difference)) {
+					std::cerr << image << ": " << difference << std::endl;
+					failures++;
+				}
+			}
+		}
+	}
+
+	std::cout << compared << " images compared, " << failures << " differences or failures" << std::endl;
+
+	return (failures > 0) ? 3 : 0;
+}